@@ -1,6 +1,7 @@
 #ifndef RELU_H
 #define RELU_H
 #include "linalg.h"
+#include "arena.h"
 
 /*
 Activation Parameter Structure
@@ -10,6 +11,8 @@ typedef struct {
     matrix* inputs;
     matrix* dinputs;
     matrix* outputs; // Post activation outputs 
+    int max_batch; // Batch size the workspace was planned for, 0 if buffers are heap allocated
+    bool is_training; // Caches inputs and sizes dinputs in the forward pass (default true)
 } ReluParams;
 
 /*
@@ -22,13 +25,32 @@ Free ReLu struct
 */
 void free_relu(ReluParams* relu);
 
+/*
+Returns the arena bytes needed for the relu buffers at max_batch rows of num_inputs features.
+fused leaves out the inputs cache, a dense layer fused with the activation never writes it.
+*/
+size_t relu_workspace_size(int num_inputs, int max_batch, bool fused);
+
+/*
+Binds the relu buffers to slices of the arena, planned for max_batch rows of num_inputs features.
+Any heap allocated buffers are freed, fused leaves inputs NULL.
+*/
+void bind_relu_workspace(ReluParams* relu, Arena* arena, int num_inputs, int max_batch, bool fused);
+
 /*
 ReLU activation forward pass
 */
 void relu_forwards(ReluParams* relu, matrix* inputs);
 
+/*
+Inference forward pass, max(0, inputs) into outputs (may be inputs) with no buffers of its own.
+outputs must be sized like inputs by the caller.
+*/
+void relu_inference_forwards(matrix* inputs, matrix* outputs);
+
 /*
 ReLU activation backward pass
+Masks on outputs, so it also follows dense_relu_forwards
 Responsible for Freeing inputs after backward pass
 */
 void relu_backwards(ReluParams* relu, matrix* input_gradients);
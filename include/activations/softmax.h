@@ -1,6 +1,8 @@
 #ifndef SOFTMAX_H
 #define SOFTMAX_H
 #include "linalg.h"
+#include "arena.h"
+#include "fastmath.h"
 
 /*
 Activation Parameter Structure
@@ -11,6 +13,9 @@ typedef struct {
     matrix* inputs;
     matrix* dinputs;
     matrix* outputs; // Post activation outputs 
+    int max_batch; // Batch size the workspace was planned for, 0 if buffers are heap allocated
+    bool is_training; // Caches inputs and sizes dinputs in the forward pass (default true)
+    double loss_total; // Loss sum of the last fused catCE batch, shared by the team that computed it
 } SoftMaxParams;
 
 /*
@@ -23,16 +28,47 @@ Free memory for softmax struct
 */
 void free_softmax(SoftMaxParams* softmax);
 
+/*
+Returns the arena bytes needed for the softmax buffers at max_batch rows of num_inputs features.
+fused leaves out the inputs cache, a dense layer fused with the activation never writes it.
+*/
+size_t softmax_workspace_size(int num_inputs, int max_batch, bool fused);
+
+/*
+Binds the softmax buffers to slices of the arena, planned for max_batch rows of num_inputs features.
+Any heap allocated buffers are freed, fused leaves inputs NULL.
+*/
+void bind_softmax_workspace(SoftMaxParams* softmax, Arena* arena, int num_inputs, int max_batch, bool fused);
+
 /*
 SoftMax activation forward pass
 */
 void softmax_forwards(SoftMaxParams* softmax, matrix* inputs);
 
+/*
+Inference forward pass, row wise softmax of inputs into outputs (may be inputs) with no buffers of its own.
+outputs must be sized like inputs by the caller.
+*/
+void softmax_inference_forwards(matrix* inputs, matrix* outputs);
+
+/*
+Softmax of one row of cols values into outputs (may be inputs), serial, vectorized by fast_softmax_row.
+*/
+void softmax_row(const nn_float* inputs, nn_float* outputs, int cols);
+
 /*
 SoftMax activation backward pass
 Responsible for Freeing inputs after backward pass
 */
 void softmax_backwards(SoftMaxParams* softmax, matrix* Y);
 
+/*
+Fused softmax and categorical cross entropy on logits, labels holds the true class of each row.
+One pass per row writes the probabilities to softmax->outputs and the logit gradient (outputs - one hot)
+to softmax->dinputs, the loss comes from the log-sum-exp so no one hot matrix or prediction copy is needed.
+Returns the mean loss of the batch.
+*/
+double softmax_catCE_forwards_backwards(SoftMaxParams* softmax, matrix* logits, const int* labels);
+
 
 #endif
\ No newline at end of file
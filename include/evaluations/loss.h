@@ -1,6 +1,10 @@
 #ifndef LOSS_H
 #define LOSS_H
 #include "linalg.h"
+#include "fastmath.h"
+
+#define LOSS_CHUNK 256 // Predictions passed to fast_log at a time
+#define LOSS_EPSILON 1e-15 // Predictions are clipped to [LOSS_EPSILON, 1 - LOSS_EPSILON] before the log
 
 /*
 Initializes loss struct for loss
@@ -8,9 +12,10 @@ Initializes loss struct for loss
 Loss* init_loss(LossType loss_type);
 
 /*
-Computes loss (calls func)
+Computes loss of predictions X against true labels Y (calls func)
+X is borrowed for the call, not copied
 */
-void compute_loss (Loss* loss_func, matrix* Y);
+void compute_loss (Loss* loss_func, matrix* X, matrix* Y);
 
 /*
 Computes loss for Categorical Cross Entropy
@@ -0,0 +1,37 @@
+#ifndef CONV_PLAN_H
+#define CONV_PLAN_H
+#include "layer_cnn.h"
+
+//////////////////////////////////////////////////// PLAN METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Builds the plan of layer->algorithm (a Winograd variant or CONV_FFT) for the layer's shape.
+Buffers are sized on the first pass, the weights are transformed on the first pass after they change.
+*/
+ConvPlan* init_conv_plan(layer_cnn* layer);
+
+/*
+Frees the plan and its buffers.
+*/
+void free_conv_plan(ConvPlan* plan);
+
+/*
+Points of the half spectrum an FFT plan uses for a shape, fft_h * (fft_w / 2 + 1).
+*/
+int conv_fft_points(const ConvParams* params);
+
+/*
+Winograd forward, inputs (batch x num_inputs) into outputs (batch x num_outputs) with bias and the epilogue's activation.
+Per chunk of samples: input tiles transformed, one GEMM per group and point against the transformed weights,
+products transformed back. Like gemm, inside a parallel region every thread of the team must call it.
+*/
+void winograd_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue);
+
+/*
+FFT forward, same contract as winograd_forwards.
+Per chunk of samples: zero padded input planes to half spectra, per point a complex multiply accumulate
+against the conjugated weight spectra (a correlation), inverse FFT back to the output planes.
+*/
+void fft_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue);
+
+#endif
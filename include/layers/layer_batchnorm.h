@@ -0,0 +1,107 @@
+#ifndef LAYER_BATCHNORM_H
+#define LAYER_BATCHNORM_H
+#include "linalg.h"
+#include "global.h"
+#include "arena.h"
+#include "layer_dense.h"
+#include "layer_cnn.h"
+
+#define BN_BLOCK 32 // Channels per block of the kernels, their per channel terms stay in registers or L1
+#define BN_ROWS 64 // Rows per tile of the normalizing kernels
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+BatchNorm layer data structure.
+A row holds channels x spatial features channel by channel: spatial == 1 normalizes each feature of a dense layer,
+spatial == H * W each channel plane of an NCHW conv output.
+Training normalizes with the batch statistics and folds them into the running ones,
+inference (and is_training false) uses the running statistics.
+*/
+typedef struct {
+    int id; // Integer id of layer
+    bool is_training; // Normalizes with batch statistics and keeps what backward needs (default true)
+
+    int channels; // Normalized channels, each with its own statistics, gamma and beta
+    int spatial; // Features per channel in a row
+    int num_features; // Cols of the inputs and outputs, channels * spatial
+
+    double momentum; // Weight of the old running statistics per step (default 0.9)
+    double epsilon; // Added to the variance (default 1e-5)
+    bool folded; // Scale and shift were folded into the preceding layer's weights, the layer is an identity
+
+    matrix* gamma; // Scale, 1 x channels
+    matrix* beta; // Shift, 1 x channels
+    matrix* dgamma; // Gradients for gamma
+    matrix* dbeta; // Gradients for beta
+    matrix* running_mean; // 1 x channels
+    matrix* running_var; // Unbiased, 1 x channels
+
+    matrix* batch_mean; // Statistics of the last training batch, 1 x channels
+    matrix* batch_inv_std; // 1 / sqrt(var + epsilon) of the last training batch
+    double* channel_sums; // Per channel sums of the reduction passes, 2 x channels
+
+    matrix* normalized; // Normalized inputs of the last training batch, before gamma and beta
+    matrix* outputs; // Outputs used for training
+    matrix* dinputs; // Gradients for inputs
+
+    int max_batch; // Batch size the workspace was planned for, 0 if batch buffers are heap allocated
+} layer_batchnorm;
+
+//////////////////////////////////////////////////// LAYER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Initialize a BatchNorm layer over channels x spatial features, gamma 1, beta 0, running statistics 0 and 1.
+*/
+layer_batchnorm* init_batchnorm_layer(int channels, int spatial);
+
+/*
+Frees all layer batchnorm memory.
+*/
+void free_batchnorm_layer(layer_batchnorm* layer);
+
+/*
+Returns the arena bytes needed for the layer's batch buffers (normalized, outputs, dinputs) at max_batch.
+*/
+size_t batchnorm_workspace_size(layer_batchnorm* layer, int max_batch);
+
+/*
+Binds the layer's batch buffers to slices of the arena, planned for max_batch rows.
+Any heap allocated batch buffers are freed.
+*/
+void bind_batchnorm_workspace(layer_batchnorm* layer, Arena* arena, int max_batch);
+
+/*
+Forward pass, inputs (batch x num_features) into layer->outputs.
+Training: one pass for the mean and variance of every channel (shifted sums and sums of squares together),
+one pass writing the normalized inputs and the outputs, running statistics updated.
+Supports parallel, every thread of an enclosing region must call it.
+*/
+void batchnorm_forwards(matrix* inputs, layer_batchnorm* layer);
+
+/*
+Inference forward pass with the running statistics, one pass of outputs = inputs * scale + shift per channel.
+outputs (may be inputs) must be sized like inputs by the caller.
+*/
+void batchnorm_inference_forwards(matrix* inputs, layer_batchnorm* layer, matrix* outputs);
+
+/*
+Backward pass, input_gradients (batch x num_features) into layer->dinputs, dgamma and dbeta.
+One pass for the per channel sums both gradients need, one pass for dinputs.
+*/
+void batchnorm_backwards(matrix* input_gradients, layer_batchnorm* layer);
+
+/*
+Folds the running statistics, gamma and beta into a dense layer the BatchNorm follows (num_features == num_neurons),
+so inference runs the dense layer alone: column j of the weights scaled by gamma / sqrt(var + epsilon), bias shifted.
+Marks the BatchNorm folded. Repack or requantize the dense layer afterwards if it already was.
+*/
+void batchnorm_fold_dense(layer_batchnorm* bn, layer_dense* layer);
+
+/*
+Folds the BatchNorm into a conv layer it follows (channels == out_channels, spatial == out_height * out_width),
+scaling row oc of the weights and shifting the bias. Marks the BatchNorm folded.
+*/
+void batchnorm_fold_cnn(layer_batchnorm* bn, layer_cnn* layer);
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef LAYER_CNN_H
+#define LAYER_CNN_H
+#include "linalg.h"
+#include "global.h"
+#include "gemm.h"
+
+#define CONV_OCB 8 // Output channels per register block of the direct kernel, the SIMD dimension
+#define CONV_PIX 8 // Output pixels per register block of the direct kernel
+#define CONV_TILE 64 // Output cols per strip of the depthwise direct kernel
+#define CONV_PLAN_ELEMS (1 << 21) // Transformed values (inputs and products) a Winograd or FFT pass holds at most
+#define CONV_FFT_WEIGHT_ELEMS (1 << 23) // Largest weight spectra (2 * points * out_channels * in_channels / groups) FFT runs with
+#define CONV_BENCH_BATCH 8 // Batch of the micro-benchmark behind conv_select_algorithm
+#define CONV_BENCH_REPS 3 // Timed runs per algorithm, the fastest counts
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Convolution algorithm enum
+*/
+typedef enum {
+    CONV_AUTO, // Fastest supported algorithm for the shape, measured at init (conv_select_algorithm)
+    CONV_IM2COL, // Receptive fields of each sample unrolled into columns, one GEMM per sample and group
+    CONV_DIRECT, // Direct kernel, nothing unrolled: output channels blocked in registers (NCHWc style weights),
+                 // or strips of output rows for depthwise and other narrow groups.
+                 // Backward of the channel blocked case shares the im2col GEMMs
+    CONV_WINOGRAD_2X2, // Winograd F(2x2, 3x3), 3x3 stride 1 undilated kernels only, 2.25x fewer multiplies
+    CONV_WINOGRAD_4X4, // Winograd F(4x4, 3x3), same shapes, 4x fewer multiplies at a larger rounding error
+    CONV_FFT // Products of 2D FFTs, stride 1 undilated kernels, for large kernels
+} ConvAlgorithm;
+
+/*
+Convolution shape, see conv_params for the defaults.
+Channels must divide by groups, groups == in_channels is a depthwise convolution.
+*/
+typedef struct {
+    int in_channels;
+    int in_height;
+    int in_width;
+    int out_channels;
+    int kernel_h;
+    int kernel_w;
+    int stride_h;
+    int stride_w;
+    int pad_h; // Zero padding on each side
+    int pad_w;
+    int dilation_h; // Spacing between kernel taps, 1 is a dense kernel
+    int dilation_w;
+    int groups; // Channel groups, each output channel only sees the input channels of its group
+} ConvParams;
+
+/*
+Transform plan of a Winograd or FFT layer, built for the layer's shape the first time the algorithm runs.
+A transformed plane has points: the alpha x alpha entries of a Winograd input tile (alpha = tile + 2),
+or the fft_h x (fft_w / 2 + 1) half spectrum of a zero padded FFT plane.
+Backward passes of these algorithms run through im2col.
+*/
+typedef struct {
+    ConvAlgorithm algorithm; // Algorithm the plan belongs to
+    int tile; // Winograd output tile side (2 or 4)
+    int tiles_h; // Winograd tiles per sample
+    int tiles_w;
+    int fft_h; // FFT plane, powers of two covering the padded input
+    int fft_w;
+    int points; // Points per transformed plane
+    int max_chunk; // Most samples transformed per pass, bounds the transformed buffers by CONV_PLAN_ELEMS
+    bool weights_ready; // Transformed weights match the layer weights
+    matrix* weights; // Transformed weights, Winograd [group][point][oc][c], FFT re then conjugated im [point][oc][c]
+    matrix* inputs; // Transformed inputs of a chunk of samples
+    matrix* products; // Transformed outputs of a chunk, before the inverse transform
+    matrix* scratch; // FFT planes, one row per thread
+    nn_float* twiddles; // FFT cos and sin tables, fft_h then fft_w
+} ConvPlan;
+
+/*
+Conv2D layer data structure.
+A batch is a matrix with one sample per row, each row is a C x H x W image stored channel by channel (NCHW),
+so the outputs of a conv layer feed a dense layer as they are.
+*/
+typedef struct {
+    int id; // Integer id of layer
+    bool is_training; // Caches inputs in the forward pass for backward (default true)
+
+    ConvParams params;
+    int out_height;
+    int out_width;
+    int num_inputs; // Cols of the inputs, in_channels * in_height * in_width
+    int num_outputs; // Cols of the outputs, out_channels * out_height * out_width
+    ConvAlgorithm algorithm; // Kernel in use, may be changed between passes
+
+    matrix* weights; // out_channels x (in_channels / groups * kernel_h * kernel_w), row oc holds [ic][kh][kw]
+    matrix* biases; // 1 x out_channels
+    matrix* inputs; // Inputs used for training
+
+    matrix* dweights; // Gradients for weights
+    matrix* dbiases; // Gradients for biases
+    matrix* dinputs; // Gradients for inputs
+
+    matrix* outputs; // Outputs used for training
+
+    matrix* columns; // Unrolled receptive fields of one sample and group (im2col), NULL until needed
+    matrix* dcolumns; // Gradients of the columns, NULL until needed
+    matrix* packed_weights; // Weights in blocks of CONV_OCB output channels, [block][tap][CONV_OCB], NULL until needed
+    int* tap_lo; // Per kernel col, first output col whose tap lands inside the input row
+    int* tap_hi; // Per kernel col, one past the last such output col
+    ConvPlan* plan; // Winograd or FFT plan, NULL until one of them runs
+
+    bool useRegularization; // Determines if using L1 and L2 regularization
+    double lambda_l1;  // L1 regularization coefficient
+    double lambda_l2;  // L2 regularization coefficient
+} layer_cnn;
+
+//////////////////////////////////////////////////// LAYER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Returns the shape of a square kernel_size convolution with stride 1, no padding, no dilation and one group.
+*/
+ConvParams conv_params(int in_channels, int in_height, int in_width, int out_channels, int kernel_size);
+
+/*
+Initialize a Conv2D layer, checks the shape and resolves CONV_AUTO.
+*/
+layer_cnn* init_cnn_layer(ConvParams params);
+
+/*
+Frees all layer cnn memory.
+*/
+void free_cnn_layer(layer_cnn* layer);
+
+/*
+Picks the fastest supported algorithm for a shape by timing a forward pass of each on CONV_BENCH_BATCH samples.
+The choice is cached per shape, so each distinct shape is measured once per process. Call outside parallel regions.
+*/
+ConvAlgorithm conv_select_algorithm(const ConvParams* params);
+
+/*
+True when the algorithm can run the shape, Winograd needs 3x3 kernels and Winograd and FFT stride 1 without dilation.
+FFT also needs its weight spectra to fit in CONV_FFT_WEIGHT_ELEMS values.
+*/
+bool conv_algorithm_supported(const ConvParams* params, ConvAlgorithm algorithm);
+
+/*
+Returns the algorithm's name ("im2col", "direct", "winograd2x2", "winograd4x4", "fft", "auto").
+*/
+const char* conv_algorithm_name(ConvAlgorithm algorithm);
+
+/*
+Empties the cache of conv_select_algorithm, for instance after switching the gemm kernel.
+*/
+void conv_clear_algorithm_cache();
+
+/*
+Marks the layer weights as changed, the next Winograd or FFT pass transforms them again.
+The backward passes do it themselves, only code writing the weights directly needs to call it.
+*/
+void cnn_weights_changed(layer_cnn* layer);
+
+/*
+Forward pass for a conv layer, inputs (batch x num_inputs) into layer->outputs (batch x num_outputs).
+Supports parallel, like the dense passes every thread of an enclosing region must call it.
+*/
+void cnn_forwards(matrix* inputs, layer_cnn* layer);
+
+/*
+Inference forward pass, conv plus bias with the epilogue's activation (NONE, BIAS or BIAS_RELU) straight into outputs.
+Nothing is cached, outputs must be sized (inputs->rows x num_outputs) by the caller.
+*/
+void cnn_inference_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue);
+
+/*
+Backward pass for conv layer.
+*/
+void cnn_backwards(matrix* input_gradients, layer_cnn* layer);
+
+/*
+Backward pass for weights and biases only, dinputs is not computed.
+For the first layer of a network, where nothing consumes the input gradients.
+*/
+void cnn_param_backwards(matrix* input_gradients, layer_cnn* layer);
+
+#endif
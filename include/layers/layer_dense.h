@@ -2,6 +2,12 @@
 #define LAYER_DENSE_H
 #include "linalg.h"
 #include "global.h"
+#include "arena.h"
+#include "gemm.h"
+#include "quantize.h"
+#include "relu.h"
+#include "softmax.h"
+#include "threadpool.h"
 //////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
 
 /*
@@ -9,7 +15,7 @@ Layer Dense data structure.
 */
 typedef struct {
     int id; // Integer id of layer
-    bool is_training; // flag to differentiate between validate and train pass
+    bool is_training; // Caches inputs and sizes dinputs in the forward pass for backward (default true)
 
     int num_neurons; // Number of Neurons in a layer
     int num_inputs; // Number of Input Features into a layer
@@ -24,6 +30,16 @@ typedef struct {
 
     matrix* outputs; // Outputs used for training (before activation)
 
+    int max_batch; // Batch size the workspace was planned for, 0 if batch buffers are heap allocated
+
+    QuantizedDense* quantized; // Int8 copy of the weights for inference, NULL unless quantized
+
+    bool sparse_inputs; // Takes CSR batches (dense_sparse_*), inputs and dinputs are never sized (default false)
+    sparse_matrix* sparse_batch; // CSR batch of the last training forward pass, borrowed from the caller
+    sparse_matrix* sparse_batch_t; // Transpose of the sparse batch (num_inputs x batch), built by dense_sparse_backwards
+    int* active_rows; // Weight rows the sparse batch has nonzeros in (num_inputs), set by dense_sparse_backwards
+    int num_active_rows;
+
     bool useRegularization; // Determines if using L1 and L2 regularization
     double lambda_l1;  // L1 regularization coefficient
     double lambda_l2;  // L2 regularization coefficient 
@@ -47,16 +63,97 @@ Cleans uneeded memory after training pass
 */
 void clean_memory_forward(layer_dense* layer);
 
+/*
+Returns the arena bytes needed for the layer's batch buffers (inputs, dinputs, outputs) at max_batch.
+outputs false leaves out the outputs, for a fused dense + relu whose epilogue writes the relu's buffers.
+*/
+size_t dense_workspace_size(layer_dense* layer, int max_batch, bool outputs);
+
+/*
+Binds the layer's batch buffers to slices of the arena, planned for max_batch rows.
+Any heap allocated batch buffers are freed, outputs false leaves layer->outputs NULL.
+*/
+void bind_dense_workspace(layer_dense* layer, Arena* arena, int max_batch, bool outputs);
+
 /*
 Forward Pass for a Dense Layer
 */
 void dense_forwards(matrix* inputs, layer_dense* layer);
 
+/*
+Fused forward pass for a dense layer followed by ReLU.
+Bias and ReLU are applied in the GEMM epilogue, straight into relu->outputs.
+layer->outputs and relu->inputs are not written, relu_backwards only needs relu->outputs.
+*/
+void dense_relu_forwards(matrix* inputs, layer_dense* layer, ReluParams* relu);
+
+/*
+Fused forward pass for a dense layer followed by SoftMax.
+Bias is applied in the GEMM epilogue and rows are normalized as soon as they are complete, straight into softmax->outputs.
+layer->outputs and softmax->inputs are not written, softmax_backwards only needs softmax->outputs.
+*/
+void dense_softmax_forwards(matrix* inputs, layer_dense* layer, SoftMaxParams* softmax);
+
+/*
+Inference forward pass, inputs * weights + biases with the epilogue's activation straight into outputs.
+Nothing is cached and no layer buffer is touched, outputs must be sized (inputs->rows x num_neurons) by the caller.
+*/
+void dense_inference_forwards(matrix* inputs, layer_dense* layer, matrix* outputs, GemmEpilogueType epilogue);
+
+/*
+Post training quantization of the weights to int8 per output channel, for inputs calibrated to [input_min, input_max].
+The float weights are kept, quantizing again replaces the int8 copy.
+*/
+void dense_quantize(layer_dense* layer, nn_float input_min, nn_float input_max);
+
+/*
+Int8 inference forward pass, like dense_inference_forwards on the quantized weights.
+Inputs are quantized into scratch (inputs->rows x quantized->k_padded bytes), dequantization, bias and ReLU
+are fused into the epilogue of each int32 tile, softmax normalizes the rows afterwards.
+*/
+void dense_quantized_forwards(matrix* inputs, layer_dense* layer, uint8_t* scratch, matrix* outputs,
+                              GemmEpilogueType epilogue);
+
+/*
+Forward passes on a CSR batch, like dense_forwards, dense_relu_forwards and dense_softmax_forwards.
+Each output row sums the weight rows its nonzeros select, no other weight row is read.
+In training the batch is borrowed for the backward pass, it must stay valid until then.
+*/
+void dense_sparse_forwards(sparse_matrix* inputs, layer_dense* layer);
+void dense_sparse_relu_forwards(sparse_matrix* inputs, layer_dense* layer, ReluParams* relu);
+void dense_sparse_softmax_forwards(sparse_matrix* inputs, layer_dense* layer, SoftMaxParams* softmax);
+
+/*
+Inference forward pass on a CSR batch, like dense_inference_forwards.
+*/
+void dense_sparse_inference_forwards(sparse_matrix* inputs, layer_dense* layer, matrix* outputs, GemmEpilogueType epilogue);
+
+/*
+Backward pass for weights and biases of a layer fed a CSR batch, dinputs is not computed.
+Only the active rows of dweights (the inputs with a nonzero in the batch) are written and regularized,
+the gradient of the other rows is zero and what dweights holds there is stale.
+*/
+void dense_sparse_backwards(matrix* input_gradients, layer_dense* layer);
+
 /*
 Backward pass for dense layer
 */
 void dense_backwards(matrix* input_gradients, layer_dense* layer);
 
+/*
+Backward pass for weights and biases only, dinputs is not computed.
+For the first layer of a network, where nothing consumes the input gradients.
+*/
+void dense_param_backwards(matrix* input_gradients, layer_dense* layer);
+
+/*
+Backward pass for dense layer as thread pool tasks, returns once they are queued.
+Weight, bias and regularization gradients are split by neuron, input gradients by batch row,
+so the dW and dX GEMMs run side by side. input_grads false skips dX (first layer).
+Wait on group before reading any gradient.
+*/
+void dense_backwards_async(ThreadPool* pool, TaskGroup* group, matrix* input_gradients, layer_dense* layer, bool input_grads);
+
 /*
 Calculate Gradients for Backward Pass for Regularization
 */
@@ -0,0 +1,90 @@
+#ifndef LAYER_POOL_H
+#define LAYER_POOL_H
+#include "linalg.h"
+#include "global.h"
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Pooling type enum
+*/
+typedef enum {
+    POOL_MAX, // Largest value of each window, backward routes the gradient to it
+    POOL_AVG // Mean of each window over the pixels inside the input, padding is not counted
+} PoolType;
+
+/*
+Pooling shape, see pool_params for the defaults.
+*/
+typedef struct {
+    PoolType type;
+    int channels;
+    int in_height;
+    int in_width;
+    int pool_h; // Window size
+    int pool_w;
+    int stride_h;
+    int stride_w;
+    int pad_h; // Implicit padding on each side, never selected by max pooling
+    int pad_w;
+} PoolParams;
+
+/*
+Pooling layer data structure.
+Batches are NCHW rows like the conv layer, each channel plane is pooled on its own.
+*/
+typedef struct {
+    int id; // Integer id of layer
+    bool is_training; // Records the argmax of each window in the forward pass for backward (default true)
+
+    PoolParams params;
+    int out_height;
+    int out_width;
+    int num_inputs; // Cols of the inputs, channels * in_height * in_width
+    int num_outputs; // Cols of the outputs, channels * out_height * out_width
+
+    int* tap_lo; // Per window col, first output col whose tap lands inside the input row
+    int* tap_hi; // Per window col, one past the last such output col
+
+    matrix* outputs; // Outputs used for training
+    matrix* dinputs; // Gradients for inputs
+    int* argmax; // Max pooling, per output the offset of its max in the input plane (batch x num_outputs)
+    int argmax_rows; // Rows argmax holds
+    int batch; // Rows of the last forward pass
+} layer_pool;
+
+//////////////////////////////////////////////////// LAYER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Returns the shape of a pool_size x pool_size window with stride pool_size and no padding.
+*/
+PoolParams pool_params(PoolType type, int channels, int in_height, int in_width, int pool_size);
+
+/*
+Initialize a pooling layer, checks the shape.
+*/
+layer_pool* init_pool_layer(PoolParams params);
+
+/*
+Frees all layer pool memory.
+*/
+void free_pool_layer(layer_pool* layer);
+
+/*
+Forward pass for a pooling layer, inputs (batch x num_inputs) into layer->outputs (batch x num_outputs).
+One pass over the inputs, max pooling records the argmax of every window on the way.
+Supports parallel, every thread of an enclosing region must call it.
+*/
+void pool_forwards(matrix* inputs, layer_pool* layer);
+
+/*
+Inference forward pass straight into outputs (inputs->rows x num_outputs), nothing is recorded.
+*/
+void pool_inference_forwards(matrix* inputs, layer_pool* layer, matrix* outputs);
+
+/*
+Backward pass for pooling layer, input_gradients (batch x num_outputs) into layer->dinputs.
+*/
+void pool_backwards(matrix* input_gradients, layer_pool* layer);
+
+#endif
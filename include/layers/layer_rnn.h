@@ -0,0 +1,136 @@
+#ifndef LAYER_RNN_H
+#define LAYER_RNN_H
+#include "linalg.h"
+#include "global.h"
+#include "gemm.h"
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Recurrent cell enum
+*/
+typedef enum {
+    RNN_LSTM, // Gates [input, forget, cell, output], c = f * c_prev + i * g, h = o * tanh(c)
+    RNN_GRU // Gates [reset, update, candidate], n = tanh(x_n + r * (h_prev * W_hn + b_hn)), h = (1 - z) * n + z * h_prev
+} RnnType;
+
+/*
+Packed batch of variable length sequences.
+Sequences are sorted longest first and stored time major: the rows of step t are the batch_sizes[t] sequences
+still running at t, in packed order, starting at row offsets[t]. A sequence's row at step t + 1 is the same
+slot of the next step, so the running sequences of every step are a prefix of those of the step before.
+*/
+typedef struct {
+    int batch; // Sequences
+    int num_steps; // Length of the longest sequence
+    int total_rows; // Packed rows, the sum of the lengths
+    int* lengths; // Length of each packed slot, longest first
+    int* order; // Per packed slot, index of the sequence in the caller's order
+    int* batch_sizes; // Per step, sequences running at it
+    int* offsets; // Per step, first packed row of it, num_steps + 1 entries
+} SequenceBatch;
+
+/*
+Recurrent layer data structure (LSTM or GRU).
+Inputs and outputs are packed sequence batches, inputs (total_rows x num_inputs) and outputs (total_rows x hidden_size),
+one hidden state per packed row. Every sequence starts from a zero state.
+The input and recurrent weights of all gates are one matrix, so each timestep is a single GEMM over every gate,
+and the input projection of the whole batch is a single GEMM ahead of the recurrence.
+*/
+typedef struct {
+    int id; // Integer id of layer
+    bool is_training; // Keeps what the backward pass needs (default true)
+
+    RnnType type;
+    int num_inputs; // Input features per step
+    int hidden_size; // Hidden units
+    int gate_size; // Gate pre activations per step, 4 * hidden_size (LSTM) or 3 * hidden_size (GRU)
+    int bptt_steps; // Truncated BPTT, gradients reach back at most to the start of their window of bptt_steps
+                    // steps (windows start at step 0), 0 backpropagates through whole sequences (default 0)
+
+    matrix* weights; // (num_inputs + hidden_size) x gate_size, input weights W_x then recurrent weights W_h
+    matrix* biases; // 1 x gate_size, a GRU adds hidden_size recurrent candidate biases b_hn after them
+    matrix* dweights; // Gradients for weights
+    matrix* dbiases; // Gradients for biases
+
+    matrix* inputs; // Inputs used for training
+    matrix* gates; // Gate activations per packed row, the input projection before the recurrence
+    matrix* cells; // LSTM cell states per packed row
+    matrix* cell_tanh; // LSTM tanh of the cell states
+    matrix* candidate_recurrent; // GRU h_prev * W_hn + b_hn per packed row
+    matrix* hidden_prev; // State each packed row started from, zero at step 0
+    matrix* outputs; // Hidden states per packed row
+
+    matrix* recurrent; // h_prev * W_h of the running sequences of a step (batch x gate_size)
+    matrix* dgates; // Gradients of the gate pre activations per packed row
+    matrix* drecurrent; // GRU gradients of h_prev * W_h, LSTM NULL (the same as dgates)
+    matrix* carry_h; // Gradients of the state of each sequence flowing to the step before (batch x hidden_size)
+    matrix* carry_c; // LSTM cell state gradients flowing back, GRU the direct h_prev term
+    matrix* dinputs; // Gradients for inputs
+
+    GemmPackedB* packed_recurrent; // W_h packed for the forward recurrence, NULL until needed
+    GemmPackedB* packed_recurrent_t; // W_h^T packed for the backward recurrence, NULL until needed
+    SequenceBatch* seq; // Sequence batch of the last forward pass, borrowed from the caller
+} layer_rnn;
+
+//////////////////////////////////////////////////// SEQUENCE METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Builds the packed layout of batch sequences of the given lengths (all positive), in the caller's order.
+*/
+SequenceBatch* init_sequence_batch(const int* lengths, int batch);
+
+/*
+Frees the sequence batch.
+*/
+void free_sequence_batch(SequenceBatch* seq);
+
+/*
+Packs sequences[i] (lengths[i] x cols, caller's order) into packed (total_rows x cols).
+*/
+void pack_sequences(SequenceBatch* seq, matrix** sequences, matrix* packed);
+
+/*
+Gathers the packed row of the last step of every sequence into last (batch x cols), caller's order.
+*/
+void sequence_last_rows(SequenceBatch* seq, matrix* packed, matrix* last);
+
+/*
+Gradients of sequence_last_rows, last (batch x cols) scattered into packed (total_rows x cols), every other row zero.
+*/
+void sequence_scatter_last(SequenceBatch* seq, matrix* last, matrix* packed);
+
+//////////////////////////////////////////////////// LAYER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Initialize an LSTM or GRU layer, weights uniform in +-1 / sqrt(hidden_size), LSTM forget gate biases 1.
+*/
+layer_rnn* init_rnn_layer(RnnType type, int num_inputs, int hidden_size);
+
+/*
+Frees all layer rnn memory.
+*/
+void free_rnn_layer(layer_rnn* layer);
+
+/*
+Forward pass, packed inputs (seq->total_rows x num_inputs) into layer->outputs (seq->total_rows x hidden_size).
+One GEMM projects the inputs of every step, then each thread runs the recurrence of its own slice of sequences:
+per step one GEMM of the running states against the packed W_h of every gate, and one pass applying the gates.
+The sequence batch is borrowed for the backward pass. Supports parallel, every thread of an enclosing region must call it.
+*/
+void rnn_forwards(matrix* inputs, SequenceBatch* seq, layer_rnn* layer);
+
+/*
+Backward pass, input_gradients (total_rows x hidden_size) into layer->dinputs, dweights and dbiases.
+The recurrence runs backward per thread like the forward pass, cut at the bptt_steps windows,
+the weight and input gradients of every step are then single GEMMs over all packed rows.
+*/
+void rnn_backwards(matrix* input_gradients, layer_rnn* layer);
+
+/*
+Backward pass for weights and biases only, dinputs is not computed.
+For the first layer of a network, where nothing consumes the input gradients.
+*/
+void rnn_param_backwards(matrix* input_gradients, layer_rnn* layer);
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+#include "linalg.h"
+#include "arena.h"
+#include "threadpool.h"
+#include "layer_dense.h"
+#include "layer_batchnorm.h"
+#include "relu.h"
+#include "softmax.h"
+#include "loss.h"
+#include "sgd.h"
+#include "adagrad.h"
+#include "rmsprop.h"
+#include "adam.h"
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Node type enum
+What kind of layer a node of the network holds.
+*/
+typedef enum {
+    NODE_DENSE,
+    NODE_RELU,
+    NODE_SOFTMAX,
+    NODE_BATCHNORM
+} NodeType;
+
+/*
+Network node, one layer in the order it was added.
+Only the pointer matching type is set.
+*/
+typedef struct {
+    NodeType type;
+    layer_dense* dense;
+    ReluParams* relu;
+    SoftMaxParams* softmax;
+    layer_batchnorm* batchnorm;
+} NetworkNode;
+
+/*
+Plan step type enum
+Kernel a compiled step runs, dense layers followed by an activation are fused into one step.
+*/
+typedef enum {
+    STEP_DENSE,
+    STEP_DENSE_RELU, // dense_relu_forwards
+    STEP_DENSE_SOFTMAX, // dense_softmax_forwards
+    STEP_RELU,
+    STEP_SOFTMAX,
+    STEP_BATCHNORM // Training and unfolded inference batchnorms, folded ones have no step
+} StepType;
+
+/*
+Compiled plan step.
+Buffers are arena slices bound at compile time, their pointers never change afterwards.
+*/
+typedef struct {
+    StepType type;
+    layer_dense* dense; // NULL for activation only steps
+    ReluParams* relu;
+    SoftMaxParams* softmax;
+    layer_batchnorm* batchnorm; // BatchNorm steps only
+    OpParams* optimizer; // Optimizer state of the dense or batchnorm layer, NULL otherwise
+    int in_features; // Cols of the step input
+    int out_features; // Cols of the step output
+    matrix* outputs; // Step output (post activation when fused)
+    matrix* dinputs; // Gradient of the loss with respect to the step input
+} PlanStep;
+
+/*
+Network data structure.
+Ordered list of layers with a loss and an optimizer, compiled into a flat execution plan.
+*/
+typedef struct {
+    NetworkNode* nodes; // Layers in the order they were added
+    int num_nodes;
+    int capacity;
+
+    Loss* loss; // Loss of the last step's outputs
+    OpParams* optimizer; // Optimizer type and hyperparameters, copied into one state per dense and batchnorm layer at compile
+
+    bool fuse; // Fuse dense layers with the activation that follows them (default true)
+    bool compiled;
+    bool inference_only; // Compiled with network_compile_inference, no training buffers or optimizer states
+    int max_batch; // Largest batch a step can run, planned at compile
+    PlanStep* plan; // Flat execution plan, forward order
+    int num_steps;
+    Arena* workspace; // Every batch buffer of the network, NULL when inference only
+    Arena* inference_workspace; // Ping-pong activation buffers of network_predict
+    matrix* activations[2]; // Ping-pong buffers (max_batch x widest hidden step), steps alternate between them
+    matrix* predictions; // Output of network_predict, heap owned
+
+    GemmPackedB** packed_weights; // Per step weights packed for network_predict_small, NULL until network_prepack
+    Arena* small_workspace; // Buffers of network_predict_small
+    matrix* small_activations[2]; // Ping-pong buffers (GEMM_SMALL_M x widest hidden step)
+    matrix* small_predictions; // Output of network_predict_small (GEMM_SMALL_M x last out_features)
+
+    bool quantized; // network_predict runs the int8 copies of the dense layers, set by network_quantize
+    uint8_t* quantized_inputs; // Quantized step inputs (max_batch x widest padded dense input)
+    int* labels; // True class of each row of a one hot batch (max_batch), for the fused loss
+
+    ThreadPool* pool; // Backward and optimizer run as tasks on it when set
+} network;
+
+//////////////////////////////////////////////////// NETWORK METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Initializes an empty network.
+*/
+network* init_network();
+
+/*
+Frees the network, its layers, optimizer states and workspace.
+A thread pool set with network_set_threadpool is not freed.
+*/
+void free_network(network* net);
+
+/*
+Appends a dense layer, returns it so regularization can be set before compiling.
+*/
+layer_dense* network_add_dense(network* net, int num_inputs, int num_neurons);
+
+/*
+Appends a dense layer fed CSR batches, it must be the first layer.
+The network then trains with network_train_step_sparse, its workspace holds no dense copy of the inputs
+and only the weight rows a batch selects are read, differentiated and updated (see update_dense_params).
+*/
+layer_dense* network_add_sparse_dense(network* net, int num_inputs, int num_neurons);
+
+/*
+Appends a ReLU activation.
+*/
+void network_add_relu(network* net);
+
+/*
+Appends a SoftMax activation, it must be the last layer.
+*/
+void network_add_softmax(network* net);
+
+/*
+Appends a BatchNorm over num_features features, returns it so momentum and epsilon can be set before compiling.
+Training normalizes with the batch statistics, inference with the running ones.
+*/
+layer_batchnorm* network_add_batchnorm(network* net, int num_features);
+
+/*
+Sets the loss of the network. Training needs CATCROSSENTROPY after a softmax.
+*/
+void network_set_loss(network* net, LossType loss_type);
+
+/*
+Sets the optimizer (init_sgd, init_sgd_momentum, init_adagrad, init_rmsprop, init_adam), the network owns it.
+Returns the template so flags (correctBias, useMasterWeights) can be set before compiling.
+Every dense and batchnorm layer gets its own copy of the hyperparameters and state at compile.
+*/
+OpParams* network_set_optimizer(network* net, OpParams* optimizer);
+
+/*
+Sets Adam as the optimizer, like network_set_optimizer(net, init_adam(...)).
+*/
+OpParams* network_set_adam(network* net, double beta_1, double beta_2, double epsilon, double lr, double decay);
+
+/*
+Runs the backward pass and optimizer updates as tasks on pool (see dense_backwards_async).
+NULL (default) runs them with OpenMP.
+*/
+void network_set_threadpool(network* net, ThreadPool* pool);
+
+/*
+Compiles the layers into the execution plan for batches of up to max_batch rows.
+Checks shapes, decides fusions, plans and binds one workspace arena for every batch buffer, creates optimizer states.
+Layers can not be added afterwards.
+*/
+void network_compile(network* net, int max_batch);
+
+/*
+Compiles the layers for serving only, batches of up to max_batch rows.
+Layers stop caching inputs and sizing gradient buffers, and the only batch memory is the two
+ping-pong buffers of network_predict. Every BatchNorm right after a dense layer is folded into its weights
+and biases (batchnorm_fold_dense), so the dense step runs alone and can fuse the activation after the BatchNorm.
+Weights are prepacked for network_predict_small.
+The network can not be trained afterwards.
+*/
+void network_compile_inference(network* net, int max_batch);
+
+/*
+One training step on a batch (X->rows <= max_batch) with one hot labels Y: forward, loss, backward, optimizer update.
+Runs inside one parallel region (or on the thread pool), returns the loss of the batch.
+The classes are read out of Y, then the step is network_train_step_labels.
+*/
+double network_train_step(network* net, matrix* X, matrix* Y);
+
+/*
+One training step on a batch with the true class of each row in labels (X->rows ints).
+The last layer runs as fused softmax and categorical cross entropy on the logits
+(see softmax_catCE_forwards_backwards), no one hot matrix is read.
+*/
+double network_train_step_labels(network* net, matrix* X, const int* labels);
+
+/*
+One training step on a CSR batch (X->rows <= max_batch) for a network starting with network_add_sparse_dense,
+true class of each row in labels. X must stay valid until the step returns.
+*/
+double network_train_step_sparse(network* net, sparse_matrix* X, const int* labels);
+
+/*
+Returns the network outputs for X, any number of rows, run max_batch rows at a time.
+Inference path: fused kernels between the two ping-pong buffers, the last step writes straight
+into the predictions, training buffers are never touched.
+The returned matrix is owned by the network and overwritten by the next call.
+*/
+matrix* network_predict(network* net, matrix* X);
+
+/*
+network_predict on a CSR batch, the first dense step reads only the weight rows the nonzeros select.
+The first step runs in float on a quantized network.
+*/
+matrix* network_predict_sparse(network* net, sparse_matrix* X);
+
+/*
+Packs the weights of every dense step for network_predict_small and plans its buffers.
+A sparse input first layer is not packed, it only takes CSR batches (network_predict_sparse).
+Packs are a snapshot, call it again after the weights change (training, loading) to repack them in place.
+*/
+void network_prepack(network* net);
+
+/*
+Low latency path for online scoring, X->rows in [1, GEMM_SMALL_M].
+Skinny GEMM against the prepacked weights with every activation fused, on the calling thread only:
+no OpenMP team, no allocation, no max_batch chunking.
+The returned matrix is owned by the network and overwritten by the next call. Dense input networks only.
+*/
+matrix* network_predict_small(network* net, matrix* X);
+
+/*
+Post training int8 quantization of every dense layer.
+Runs the float model over calibration (any number of rows) to find the input range of each dense step,
+then quantizes the weights per output channel. network_predict uses the int8 kernels afterwards,
+set net->quantized to false to go back to the float weights, which are kept.
+network_predict_small stays in float.
+*/
+void network_quantize(network* net, matrix* calibration);
+
+/*
+Prints the accuracy delta of the int8 model against the float one on X (Y one hot labels, may be NULL):
+accuracy of both, top 1 agreement, largest output difference and the weight memory of both.
+*/
+void print_quantization_report(network* net, matrix* X, matrix* Y);
+
+/*
+Prints the compiled plan, one line per step, and the workspace reports.
+*/
+void print_network(network* net);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef ADAGRAD_H
+#define ADAGRAD_H
+#include "optimizer.h"
+
+/*
+Initialize AdaGrad, cache += grads^2, params -= lr * grads / (sqrt(cache) + epsilon).
+*/
+OpParams* init_adagrad(double lr, double epsilon, double decay);
+
+/*
+AdaGrad step over n contiguous parameters, one pass reading each gradient and cache value once.
+When master is not NULL the update is applied to the double copy and rounded into params.
+*/
+void adagrad_step(OpParams* adagrad, nn_float* params, const nn_float* grads, nn_float* cache, double* master, int n);
+
+#endif
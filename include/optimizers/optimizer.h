@@ -0,0 +1,111 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+#include "linalg.h"
+#include "layer_dense.h"
+#include "layer_cnn.h"
+#include "layer_batchnorm.h"
+#include "layer_rnn.h"
+#include "threadpool.h"
+
+#define OPTIMIZER_CHUNK 4096 // Parameters per work shared chunk of the update kernels, whole cache lines per thread
+
+/*
+Optimization Parameter Structure
+Contains optimization parameters and state for a layer, shared by every optimizer.
+Which state tensors exist depends on the optimizer:
+momentums hold the Adam first moments or the SGD_MOMENTUM velocities,
+caches hold the Adam second moments, the AdaGrad sums of squared gradients or the RMSProp running means of them.
+*/
+
+typedef struct {
+    matrix* w_momentums; // Momentums for Weight
+    matrix* w_cache; // Cache for Weight
+    matrix* b_momentums; // Momentums for Bias
+    matrix* b_cache; // Cache for Bias
+    double beta_1; // Beta 1 HyperParam
+    double beta_2; // Beta 2 HyperParam
+    double momentum; // Velocity decay of SGD_MOMENTUM
+    double rho; // Cache decay of RMS_PROP
+    double epsilon; // Epsilon HyperParam
+    double lr; // Learning Rate
+    double decay; // Decay rate of lr
+    int iterations; // Current training epoch
+    bool correctBias; // Flag to determine if using bias correction
+    bool useMasterWeights; // Flag to keep a double precision master copy of the parameters (float32 builds)
+    double* w_master; // Master copy of weights, updated in double and rounded into the layer
+    double* b_master; // Master copy of biases
+    OptimizationType optimizer; // Optimizer to Use
+} OpParams;
+
+//////////////////////////////////////////////////// OPTIMIZER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Initialize an optimizer with the defaults of its type: momentum 0.9, rho 0.9, epsilon 1e-7, betas 0.9 and 0.999.
+See init_sgd, init_sgd_momentum, init_adagrad, init_rmsprop and init_adam for the hyperparameters of each.
+*/
+OpParams* init_optimizer(OptimizationType type, double lr, double decay);
+
+/*
+Returns a new optimizer with the hyperparameters and flags of tmpl and no state.
+*/
+OpParams* clone_optimizer(const OpParams* tmpl);
+
+/*
+Frees the optimizer state, not the struct.
+*/
+void free_optimizer(OpParams* opt);
+
+/*
+Returns the optimizer's name ("sgd", "sgd_momentum", "adagrad", "rmsprop", "adam").
+*/
+const char* optimizer_name(OptimizationType type);
+
+/*
+True when the optimizer keeps momentums (Adam, SGD_MOMENTUM), or caches (Adam, AdaGrad, RMSProp).
+*/
+bool optimizer_uses_momentums(OptimizationType type);
+bool optimizer_uses_cache(OptimizationType type);
+
+/*
+Run once before optimization, decays the learning rate.
+*/
+void pre_update_params(OpParams* opt);
+
+/*
+Run once after optimization
+*/
+void post_update_params(OpParams* opt);
+
+/*
+Update dense layer parameters.
+Every tensor takes one pass of the optimizer's fused step (sgd_step, sgd_momentum_step, adagrad_step, rmsprop_step,
+adam_step), work shared over OPTIMIZER_CHUNK chunks with no barrier, nothing reads the parameters before the next
+forward pass syncs the team.
+A sparse input layer (sparse_inputs) is updated lazily: only the weight rows of its last batch's active rows
+take a step, rows no input selected keep their weights and state until a batch selects them.
+*/
+void update_dense_params(OpParams* opt, layer_dense* layer);
+
+/*
+Queues pre update, dense update and post update as one thread pool task.
+Lets the update of one layer overlap the backward pass of the layers below it.
+Wait on group before the next forward pass.
+*/
+void update_dense_params_async(ThreadPool* pool, TaskGroup* group, OpParams* opt, layer_dense* layer);
+
+/*
+Update cnn layer parameters, like update_dense_params.
+*/
+void update_cnn_params(OpParams* opt, layer_cnn* layer);
+
+/*
+Update batchnorm layer parameters, gamma in the weight state and beta in the bias state.
+*/
+void update_batchnorm_params(OpParams* opt, layer_batchnorm* layer);
+
+/*
+Update rnn layer parameters, the input and recurrent weights of every gate in the weight state.
+*/
+void update_rnn_params(OpParams* opt, layer_rnn* layer);
+
+#endif
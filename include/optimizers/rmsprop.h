@@ -0,0 +1,16 @@
+#ifndef RMSPROP_H
+#define RMSPROP_H
+#include "optimizer.h"
+
+/*
+Initialize RMSProp, cache = rho * cache + (1 - rho) * grads^2, params -= lr * grads / (sqrt(cache) + epsilon).
+*/
+OpParams* init_rmsprop(double lr, double rho, double epsilon, double decay);
+
+/*
+RMSProp step over n contiguous parameters, one pass reading each gradient and cache value once.
+When master is not NULL the update is applied to the double copy and rounded into params.
+*/
+void rmsprop_step(OpParams* rmsprop, nn_float* params, const nn_float* grads, nn_float* cache, double* master, int n);
+
+#endif
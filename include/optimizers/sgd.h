@@ -0,0 +1,26 @@
+#ifndef SGD_H
+#define SGD_H
+#include "optimizer.h"
+
+/*
+Initialize SGD, params -= lr * grads.
+*/
+OpParams* init_sgd(double lr, double decay);
+
+/*
+Initialize SGD with momentum, velocity = momentum * velocity - lr * grads, params += velocity.
+*/
+OpParams* init_sgd_momentum(double lr, double momentum, double decay);
+
+/*
+SGD step over n contiguous parameters, one pass reading each gradient once.
+When master is not NULL the update is applied to the double copy and rounded into params.
+*/
+void sgd_step(OpParams* sgd, nn_float* params, const nn_float* grads, double* master, int n);
+
+/*
+SGD with momentum step over n contiguous parameters, velocities are stored in momentums.
+*/
+void sgd_momentum_step(OpParams* sgd, nn_float* params, const nn_float* grads, nn_float* momentums, double* master, int n);
+
+#endif
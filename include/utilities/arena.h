@@ -0,0 +1,81 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include "linalg.h"
+
+#define ARENA_ALIGNMENT 64 // Cache line, also the widest SIMD load
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Arena data structure.
+One 64 byte aligned block that layer buffers are carved out of.
+Sized once from the workspace plan, nothing is freed until the whole arena is.
+*/
+typedef struct {
+    char* base; // Start of the block
+    size_t capacity; // Size of the block in bytes
+    size_t offset; // Bytes handed out so far
+    size_t high_water; // Largest offset ever reached
+    int num_allocs; // Number of allocations handed out
+} Arena;
+
+//////////////////////////////////////////////////// ARENA METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Allocates an arena of capacity bytes.
+*/
+Arena* init_arena(size_t capacity);
+
+/*
+Frees the arena and every buffer carved out of it.
+*/
+void free_arena(Arena* arena);
+
+/*
+Returns bytes rounded up to the arena alignment.
+*/
+size_t arena_align(size_t bytes);
+
+/*
+Returns a 64 byte aligned, zeroed slice of bytes.
+Exits if the arena is out of space (the workspace plan was too small).
+*/
+void* arena_alloc(Arena* arena, size_t bytes);
+
+/*
+Returns the current offset, pass to arena_release to drop everything allocated after it.
+*/
+size_t arena_mark(Arena* arena);
+
+/*
+Rolls the arena back to a mark from arena_mark. The high water mark is kept.
+*/
+void arena_release(Arena* arena, size_t mark);
+
+/*
+Returns the arena bytes a (rows x cols) matrix takes, struct and data.
+Used to plan workspaces before the arena exists.
+*/
+size_t arena_matrix_bytes(int rows, int cols);
+
+/*
+Returns a zeroed (rows x cols) matrix, struct and data both live in the arena.
+Never pass it to free_matrix.
+*/
+matrix* arena_alloc_matrix(Arena* arena, int rows, int cols);
+
+/*
+Prints capacity, usage and high water mark of the arena.
+*/
+void print_arena_report(Arena* arena);
+
+//////////////////////////////////////////////////// LAYER WORKSPACES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Sizes a layer buffer for the current batch.
+max_batch == 0 means the buffer is heap owned and goes through resize_matrix.
+Otherwise the buffer is an arena slice planned for max_batch rows, only its row count changes.
+*/
+void fit_buffer(matrix** M, int rows, int cols, int max_batch);
+
+#endif
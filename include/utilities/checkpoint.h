@@ -0,0 +1,137 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include "network.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC 0x4B434E4D // "MNCK" in a little endian file
+#define CHECKPOINT_VERSION 2 // Version 1 files (Adam only, 48 byte optimizer record) still load
+#define CHECKPOINT_ALIGNMENT 64 // Every tensor starts on a cache line
+
+// Header flags
+#define CHECKPOINT_HAS_CRC 0x1 // crc32 covers everything after the header
+#define CHECKPOINT_HAS_OPTIMIZER 0x2 // Optimizer template and per layer states are stored
+
+// Node flags
+#define CHECKPOINT_NODE_REGULARIZED 0x1
+#define CHECKPOINT_NODE_MOMENTS 0x2 // w_momentums and b_momentums follow the parameters (version 1: and the caches)
+#define CHECKPOINT_NODE_MASTER 0x4 // Double precision master weights and biases follow the optimizer state
+#define CHECKPOINT_NODE_FOLDED 0x8 // BatchNorm already folded into the dense layer before it, inference only
+#define CHECKPOINT_NODE_CACHE 0x10 // w_cache and b_cache follow the parameters, stored as w_momentums, w_cache,
+                                   // b_momentums, b_cache of the states present
+#define CHECKPOINT_NODE_SPARSE 0x20 // Dense layer fed CSR batches (network_add_sparse_dense), the first node only
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Checkpoint file header, 64 bytes at offset 0.
+Followed by the optimizer template, one record per network node, then the tensors of every dense node
+(weights, biases, optimizer state, master copies) and batchnorm node (gamma, beta, running mean, running variance,
+optimizer state of gamma and beta, master copies) in node order, row major and 64 byte aligned.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dtype; // DataType of parameters and moments, master copies are always double
+    uint32_t flags;
+    uint32_t num_nodes;
+    uint32_t loss_type; // LossType
+    uint32_t max_batch; // Batch size the network was compiled for
+    uint32_t crc32; // Of bytes [sizeof header, file size) when CHECKPOINT_HAS_CRC
+    uint64_t file_size;
+    uint64_t reserved[3];
+} CheckpointHeader;
+
+/*
+Optimizer type and hyperparameters of the network template.
+Version 1 files end the record at momentum and are always Adam.
+*/
+typedef struct {
+    double beta_1;
+    double beta_2;
+    double epsilon;
+    double lr;
+    double decay;
+    uint32_t correct_bias;
+    uint32_t use_master_weights;
+    double momentum;
+    double rho;
+    uint32_t type; // OptimizationType
+    uint32_t reserved;
+} CheckpointOptimizer;
+
+/*
+One network node. Shapes and offsets are zero for activations.
+BatchNorm nodes store their features in num_inputs and num_neurons, momentum and epsilon in lambda_l1 and lambda_l2.
+*/
+typedef struct {
+    uint32_t type; // NodeType
+    uint32_t flags;
+    uint32_t num_inputs;
+    uint32_t num_neurons;
+    double lambda_l1;
+    double lambda_l2;
+    double lr; // Decayed learning rate of the layer's optimizer state
+    uint64_t iterations; // Optimizer steps the layer has taken
+    uint64_t offset; // File offset of the node's first tensor
+} CheckpointNode;
+
+/*
+Background checkpoint writer.
+A snapshot copies every tensor into a staging buffer laid out exactly like the file (a memcpy on the
+training thread), the thread then writes it with one writev, syncs and renames it into place.
+*/
+typedef struct {
+    void* staging; // Snapshot being written, file image after the header
+    size_t staging_size;
+    CheckpointHeader header;
+    char* path; // Destination of the snapshot being written
+
+    bool pending; // A snapshot is waiting for or being written
+    bool stop;
+    long written; // Snapshots completed
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // Signalled when a snapshot is handed to the thread
+    pthread_cond_t done; // Signalled when a snapshot is on disk
+} CheckpointWriter;
+
+//////////////////////////////////////////////////// CHECKPOINT METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Writes the architecture, parameters and optimizer states of a compiled network to path with one writev.
+The file is written next to path and renamed over it, a crash never leaves a torn checkpoint.
+checksum adds a CRC32 of the contents, checked on load.
+*/
+void save_checkpoint(network* net, const char* path, bool checksum);
+
+/*
+Maps a checkpoint and rebuilds the network it holds: layers, loss, optimizer template and states, compiled
+for the stored max_batch so training resumes where it left off.
+inference compiles it with network_compile_inference instead and skips the optimizer states.
+Exits if the file is corrupt or stored in another dtype than the build.
+*/
+network* load_checkpoint(const char* path, bool inference);
+
+/*
+Starts the background writer thread.
+*/
+CheckpointWriter* init_checkpoint_writer();
+
+/*
+Waits for the snapshot in flight, then stops the thread and frees the writer.
+*/
+void free_checkpoint_writer(CheckpointWriter* writer);
+
+/*
+Snapshots the network and returns, the file is written in the background.
+Waits first if the previous snapshot is still being written. Call between training steps.
+*/
+void checkpoint_async(CheckpointWriter* writer, network* net, const char* path, bool checksum);
+
+/*
+Blocks until the snapshot in flight (if any) is on disk.
+*/
+void checkpoint_wait(CheckpointWriter* writer);
+
+#endif
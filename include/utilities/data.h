@@ -0,0 +1,239 @@
+#ifndef DATA_H
+#define DATA_H
+#include "linalg.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define DATASET_MAGIC 0x53444E4D // "MNDS" in a little endian file
+#define DATASET_VERSION 1
+#define DATASET_ALIGNMENT 64 // Sections start on a cache line
+#define STREAM_CHUNK_SIZE (1 << 20) // Bytes read from a CSV file at a time
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Last batch policy enum
+What the loader does with the partial batch left at the end of an epoch.
+*/
+typedef enum {
+    LAST_BATCH_KEEP, // Hand out the short batch as is
+    LAST_BATCH_DROP, // Skip it, every batch is full
+    LAST_BATCH_PAD // Fill it up with samples from the start of the epoch, every batch is full
+} LastBatchPolicy;
+
+/*
+Data loader data structure.
+A background thread shuffles the sample order each epoch and gathers rows into a ring of
+num_buffers contiguous batch buffers (2 double buffers, 3 triple buffers).
+The trainer holds one buffer while the thread fills the others ahead of it.
+*/
+typedef struct {
+    matrix* X; // Samples, borrowed
+    matrix* Y; // Labels, borrowed, may be NULL
+    int batch_size;
+    int num_buffers;
+    bool shuffle;
+    LastBatchPolicy last_batch;
+    int batches_per_epoch;
+
+    int* order; // Sample order of the epoch being gathered, only touched by the thread
+    unsigned int seed; // Shuffle state, only touched by the thread
+    matrix** x_batches; // Ring of batch buffers (batch_size x X->cols)
+    matrix** y_batches;
+
+    long produced; // Batches gathered so far
+    long consumed; // Batches handed to the trainer so far
+    long released; // Batches the trainer is done with
+    int epoch_batch; // Trainer position within the epoch
+    long stalls; // Times the trainer had to wait for a batch
+
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled; // Signalled when a batch is gathered
+    pthread_cond_t freed; // Signalled when the trainer releases a batch
+} DataLoader;
+
+/*
+Label layout enum
+How labels are stored in a dataset file.
+*/
+typedef enum {
+    LABELS_NONE,
+    LABELS_INDEX, // One class index per row (rows x 1), stored in the sample dtype
+    LABELS_ONE_HOT // One hot rows (rows x num_classes), ready for softmax_backwards
+} LabelLayout;
+
+/*
+Dataset file header, 64 bytes at offset 0.
+Samples (rows x cols) and labels (rows x label_cols) follow, row major, each section 64 byte aligned.
+Values are stored little endian in dtype, which must match the build (FLOAT64 / FLOAT32).
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dtype; // DataType of samples and labels
+    uint32_t label_layout; // LabelLayout
+    uint64_t rows;
+    uint64_t cols; // Features per sample
+    uint64_t label_cols; // 0, 1 (index) or num_classes (one hot)
+    uint64_t data_offset; // Byte offset of the samples
+    uint64_t label_offset; // Byte offset of the labels
+    uint64_t reserved;
+} DatasetHeader;
+
+/*
+Memory mapped dataset.
+X and Y are matrix views straight into the mapping, nothing is parsed or copied.
+The mapping is private, writing to a view never reaches the file.
+*/
+typedef struct {
+    void* base; // Start of the mapping
+    size_t size; // Bytes mapped
+    DatasetHeader header;
+    matrix X; // Samples (rows x cols)
+    matrix Y; // Labels (rows x label_cols), data NULL for LABELS_NONE
+} Dataset;
+
+/*
+Stream format enum
+Kind of file a data stream parses.
+*/
+typedef enum {
+    STREAM_CSV,
+    STREAM_IDX
+} StreamFormat;
+
+/*
+Streaming reader data structure.
+Parses a CSV or IDX file front to back in chunks and hands out fixed size batches, the file is never resident.
+Samples pass through a shuffle buffer: each batch row is drawn at random from the buffer and its slot
+is refilled from the file, so order is shuffled within a window of shuffle_size samples.
+Memory is one chunk plus (shuffle_size + batch_size) rows whatever the file size.
+*/
+typedef struct {
+    StreamFormat format;
+    char* path; // For error messages
+    FILE* file; // CSV text or IDX images
+    FILE* label_file; // IDX labels, NULL without
+    long data_start; // IDX offsets of the first image / label, for rewinding
+    long label_start;
+    int idx_rows; // IDX images in the file
+    int idx_read; // IDX images read this epoch
+    unsigned char* pixels; // IDX row of raw bytes
+
+    char* chunk; // CSV read buffer, lines are parsed in place
+    size_t chunk_cap;
+    size_t chunk_len;
+    size_t chunk_pos; // Start of the next unparsed line
+    bool file_done; // Everything up to chunk_len is all that is left
+    long line_num;
+    int label_col; // CSV column holding the class, -1 for none
+    bool skip_header;
+
+    int cols; // Features per sample
+    int num_classes; // Width of the one hot label batches, 0 without labels
+    double scale; // Features are multiplied by it
+
+    int batch_size;
+    int shuffle_size; // Samples in the shuffle buffer, 1 reads in file order
+    matrix* buffer_x; // Shuffle buffer (shuffle_size x cols)
+    int* buffer_labels;
+    int buffered; // Samples in the shuffle buffer
+    bool source_done; // File exhausted this epoch, the buffer drains
+    unsigned int seed;
+    matrix* x_batch;
+    matrix* y_batch; // One hot, NULL without labels
+} DataStream;
+
+//////////////////////////////////////////////////// DATA LOADER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Starts a loader over the rows of X (and Y), batches of batch_size rows.
+num_buffers is clamped to at least 2. The gathering thread starts right away.
+X and Y must outlive the loader.
+*/
+DataLoader* init_data_loader(matrix* X, matrix* Y, int batch_size, int num_buffers, bool shuffle,
+                             LastBatchPolicy last_batch, unsigned int seed);
+
+/*
+Stops the gathering thread and frees the batch buffers.
+*/
+void free_data_loader(DataLoader* loader);
+
+/*
+Points X_batch (and Y_batch if not NULL) at the next gathered batch of the epoch.
+The batch stays valid until the next call. Returns false once the epoch is done,
+the following call starts the next epoch (already shuffled and gathering in the background).
+*/
+bool data_loader_next(DataLoader* loader, matrix** X_batch, matrix** Y_batch);
+
+//////////////////////////////////////////////////// STREAMING READER ///////////////////////////////////////////////////////////////////////////
+
+/*
+Opens a CSV file (one sample per line, comma separated) for streaming batches of batch_size rows.
+label_col is the column holding the integer class (-1 for none), num_classes sizes the one hot labels.
+Features are multiplied by scale. skip_header skips the first line. shuffle_size <= 1 keeps file order.
+*/
+DataStream* open_csv_stream(const char* path, int label_col, int num_classes, bool skip_header, double scale,
+                            int batch_size, int shuffle_size, unsigned int seed);
+
+/*
+Opens IDX files (unsigned byte images and labels, labels_path may be NULL) for streaming batches of batch_size rows.
+*/
+DataStream* open_idx_stream(const char* images_path, const char* labels_path, int num_classes, double scale,
+                            int batch_size, int shuffle_size, unsigned int seed);
+
+/*
+Closes the files and frees the buffers.
+*/
+void free_data_stream(DataStream* stream);
+
+/*
+Points X_batch (and Y_batch if not NULL) at the next batch, valid until the next call.
+The last batch of an epoch may be short. Returns false once the epoch is done,
+the following call rewinds the file and starts the next one.
+*/
+bool data_stream_next(DataStream* stream, matrix** X_batch, matrix** Y_batch);
+
+//////////////////////////////////////////////////// DATASET FILES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Maps a dataset file, checks the header and sets up the X / Y views.
+Exits if the file is missing, corrupt or stored in another dtype than the build.
+*/
+Dataset* open_dataset(const char* path);
+
+/*
+Unmaps the dataset. Views into it (and batches pointing at them) are invalid afterwards.
+*/
+void close_dataset(Dataset* ds);
+
+/*
+Points X_batch (and Y_batch if not NULL) at num_rows rows of the mapping starting at start_row, zero copy.
+*/
+void dataset_batch_view(Dataset* ds, matrix* X_batch, matrix* Y_batch, int start_row, int num_rows);
+
+/*
+Writes X and one hot labels Y (may be NULL) as a dataset file in the build dtype.
+LABELS_INDEX stores the argmax of each Y row.
+*/
+void write_dataset(const char* path, matrix* X, matrix* Y, LabelLayout layout);
+
+/*
+One time conversion of a CSV file (one sample per line, comma separated) to a dataset file.
+label_col is the column holding the integer class (-1 for none), num_classes sizes one hot labels.
+Features are multiplied by scale (1.0 / 255 for pixel data). skip_header skips the first line.
+Returns the number of rows converted.
+*/
+int convert_csv_dataset(const char* csv_path, const char* out_path, int label_col, int num_classes,
+                        bool skip_header, double scale, LabelLayout layout);
+
+/*
+One time conversion of IDX files (MNIST ubyte images and labels) to a dataset file.
+labels_path may be NULL. Pixels are multiplied by scale. Returns the number of rows converted.
+*/
+int convert_idx_dataset(const char* images_path, const char* labels_path, const char* out_path, int num_classes,
+                        double scale, LabelLayout layout);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+#include "global.h"
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Elementwise kernel function, out[i] = f(in[i]) for n values, out may be in.
+*/
+typedef void (*fastmath_kernel)(const nn_float* in, nn_float* out, int n);
+
+/*
+Softmax row kernel function, softmax of cols values into out (may be in).
+Returns the sum of exp(in - max) and stores the row max in *row_max unless it is NULL.
+*/
+typedef nn_float (*fastmath_softmax_kernel)(const nn_float* in, nn_float* out, int cols, nn_float* row_max);
+
+/*
+Vectorized math kernel descriptor.
+Every kernel evaluates the same polynomials, only the vector width and instruction set differ.
+*/
+typedef struct {
+    const char* name; // Kernel name (generic, avx2, avx512)
+    fastmath_kernel exp_row;
+    fastmath_kernel log_row;
+    fastmath_softmax_kernel softmax_row;
+} FastMathKernel;
+
+//////////////////////////////////////////////////// FAST MATH METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Returns the kernel in use, selected on first call from CPUID.
+*/
+const FastMathKernel* fastmath_get_kernel();
+
+/*
+Forces a kernel by name ("generic", "avx2", "avx512").
+Returns false if the kernel is unknown or the cpu does not support it.
+*/
+bool fastmath_set_kernel(const char* name);
+
+/*
+out = exp(in) for n values, out may be in.
+Within 1 ulp of libm exp. Inputs below -708 (-87 for float) return 0,
+inputs above 709 (88 for float) saturate at the largest finite exponential.
+*/
+void fast_exp(const nn_float* in, nn_float* out, int n);
+
+/*
+out = log(in) for n values, out may be in.
+Within 1 ulp of libm log. Inputs must be finite and positive,
+values below the smallest normal number (zero, denormals, negatives) are clamped to it.
+*/
+void fast_log(const nn_float* in, nn_float* out, int n);
+
+/*
+Softmax of one row of cols values into out (may be in), serial, no allocation.
+One vector pass finds the max, one writes exp(x - max) and sums it, one scales by 1 / sum.
+*/
+void fast_softmax_row(const nn_float* in, nn_float* out, int cols);
+
+/*
+fast_softmax_row that also returns sum(exp(in - max)) and stores the row max in *max.
+The log-sum-exp of the row is max + log(sum), and log(softmax(in)[j]) = in[j] - max - log(sum)
+without ever taking the log of a probability that underflowed. Callers batch the logs with fast_log.
+*/
+nn_float fast_softmax_row_sum(const nn_float* in, nn_float* out, int cols, nn_float* max);
+
+#endif
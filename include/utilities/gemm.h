@@ -0,0 +1,161 @@
+#ifndef GEMM_H
+#define GEMM_H
+#include "global.h"
+
+#define GEMM_SMALL_M 16 // Rows gemm_small is tuned for, larger batches belong to gemm
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Micro kernel function.
+Multiplies a packed MR x kc sliver of A with a packed kc x NR sliver of B,
+C = A * B + beta * C for one MR x NR register block of C.
+beta == 0 overwrites C without reading it.
+*/
+typedef void (*gemm_micro_kernel)(int kc, const nn_float* a, const nn_float* b, nn_float* c, int ldc, nn_float beta);
+
+/*
+Skinny kernel function.
+Multiplies MR rows of A, read straight from the row major matrix, with a prepacked K x NR panel of B,
+C = A * B for one MR x NR block of C, accumulate adds to C instead of overwriting it.
+*/
+typedef void (*gemm_small_kernel)(int K, const nn_float* a, int lda, const nn_float* b, nn_float* c, int ldc,
+                                  bool accumulate);
+
+/*
+GEMM kernel descriptor.
+Register block of the micro kernel and the cache blocks used around it.
+mc x kc panels of A live in L2, kc x nr slivers of B live in L1, kc x nc panels of B live in L3.
+*/
+typedef struct {
+    const char* name; // Kernel name (generic, avx2, avx512)
+    int mr; // Rows of C per micro kernel call
+    int nr; // Cols of C per micro kernel call
+    int mc; // Rows of A packed per L2 block
+    int kc; // Depth of each packed panel
+    int nc; // Cols of B packed per L3 block
+    gemm_micro_kernel kernel; // Micro kernel
+    int small_nr; // Cols of C per skinny kernel call, panel width of GemmPackedB
+    gemm_small_kernel small_rows_4; // Skinny kernels of gemm_small, 4 rows and 1 row of C per call
+    gemm_small_kernel small_rows_1;
+} GemmKernel;
+
+/*
+B (K x N) packed once for gemm_small: ceil(N / small_nr) col panels of K x small_nr, stored row by row,
+64 byte aligned and zero padded past the last col. The layout belongs to the kernel active when it was packed.
+*/
+typedef struct {
+    int K;
+    int N;
+    const GemmKernel* kernel; // Kernel the panels were packed for
+    nn_float* panels;
+} GemmPackedB;
+
+/*
+Epilogue applied to C by gemm_fused once the last depth block of a tile is done.
+*/
+typedef enum {
+    GEMM_EPILOGUE_NONE,
+    GEMM_EPILOGUE_BIAS, // C += bias (per col)
+    GEMM_EPILOGUE_BIAS_RELU, // C = max(C + bias, 0)
+    GEMM_EPILOGUE_BIAS_SOFTMAX // C = softmax(C + bias) per row
+} GemmEpilogueType;
+
+typedef struct {
+    GemmEpilogueType type;
+    const nn_float* bias; // N biases, one per col of C
+} GemmEpilogue;
+
+//////////////////////////////////////////////////// GEMM METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Returns the kernel in use.
+Selected on first call from CPUID and the cache sizes of the machine.
+*/
+const GemmKernel* gemm_get_kernel();
+
+/*
+Forces a kernel by name ("generic", "avx2", "avx512").
+Returns false if the kernel is unknown or the cpu does not support it.
+*/
+bool gemm_set_kernel(const char* name);
+
+/*
+Frees the calling thread's packed panel buffers, gemm reserves them again on its next call.
+Threads that call gemm and exit before the process does should call it on their way out.
+*/
+void gemm_free_buffers();
+
+/*
+Row major GEMM, C = alpha * op(A) * op(B) + beta * C.
+op(A) is (M x K) and op(B) is (K x N), C is (M x N) with leading dim ldc.
+trans_a / trans_b read the stored matrix transposed in place, so A is stored (K x M) when trans_a is set.
+lda and ldb are the leading dims of the stored matrices. beta == 0 overwrites C without reading it.
+Packs A and B into cache blocked panels, supports parallel.
+Inside a parallel region every thread of the team must call it, the work is shared instead of forking a new team.
+*/
+void gemm(bool trans_a, bool trans_b, int M, int N, int K, nn_float alpha, const nn_float* A, int lda,
+          const nn_float* B, int ldb, nn_float beta, nn_float* C, int ldc);
+
+/*
+gemm with a fused epilogue, C = epilogue(alpha * op(A) * op(B) + beta * C).
+Bias and ReLU are applied per register tile while it is still in L1.
+Softmax is applied per block of complete rows while they are still in L2.
+ep == NULL behaves as gemm.
+*/
+void gemm_fused(bool trans_a, bool trans_b, int M, int N, int K, nn_float alpha, const nn_float* A, int lda,
+                const nn_float* B, int ldb, nn_float beta, nn_float* C, int ldc, const GemmEpilogue* ep);
+
+/*
+Packs B (K x N, leading dim ldb) into panels for gemm_small with the kernel in use.
+*/
+GemmPackedB* gemm_pack_b(int K, int N, const nn_float* B, int ldb);
+
+/*
+Repacks B into the panels of packed after its values changed, the shape must match.
+Like gemm, inside a parallel region every thread of the team must call it.
+*/
+void gemm_repack_b(GemmPackedB* packed, const nn_float* B, int ldb);
+
+/*
+Allocates the panels of a K x N packed B for the kernel in use without filling them, fill with gemm_repack_b or
+gemm_repack_bt. Unlike gemm_pack_b it has no work shared loop, so one thread of a team may call it (omp single).
+*/
+GemmPackedB* gemm_alloc_packed_b(int K, int N);
+
+/*
+gemm_repack_b of op(B) = B^T, B stored (N x K) with leading dim ldb.
+*/
+void gemm_repack_bt(GemmPackedB* packed, const nn_float* B, int ldb);
+
+/*
+Frees the panels and the struct.
+*/
+void free_gemm_packed_b(GemmPackedB* packed);
+
+/*
+Small M GEMM against a prepacked B, C = epilogue(A * B). A is (M x K) row major, C is (M x N).
+Meant for M <= GEMM_SMALL_M: A is read in place instead of packed, each panel of B streams once for all rows.
+Runs on the calling thread only, never forks or joins a team and never allocates.
+*/
+void gemm_small(int M, const nn_float* A, int lda, const GemmPackedB* B, nn_float* C, int ldc, const GemmEpilogue* ep);
+
+/*
+Sparse times dense, C = epilogue(A * B). A is (M x K) in CSR form (row_ptr offsets are absolute), B is (K x N).
+Each row of C is a sum of the rows of B its nonzeros select, the other rows of B are never read.
+Supports parallel over the rows of C, like gemm inside a parallel region every thread of the team must call it.
+*/
+void gemm_sparse(int M, int N, const int* row_ptr, const int* col_idx, const nn_float* values, const nn_float* B,
+                 int ldb, nn_float* C, int ldc, const GemmEpilogue* ep);
+
+/*
+gemm_sparse restricted to some rows of C, C[r] = (A * B)[r] for the num_rows distinct rows r listed,
+row_ptr covers every row of A. The rows of C not listed are left untouched.
+Each listed row is summed in L1 and stored once, with A = X^T (see sparse_transpose_into) it gives
+the rows of X^T * B that are not zero without reading or writing the others.
+Supports parallel over the listed rows, like gemm inside a parallel region every thread of the team must call it.
+*/
+void gemm_sparse_rows(int N, const int* row_ptr, const int* col_idx, const nn_float* values, const nn_float* B, int ldb,
+                      nn_float* C, int ldc, const int* rows, int num_rows);
+
+#endif
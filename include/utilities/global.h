@@ -5,10 +5,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <tgmath.h> // Type generic math, exp/log/sqrt follow the precision of their argument
 #include <stdbool.h>
 #include <float.h>
 
+/*
+Data type enum structure
+Storage and compute precision of matrix data, set at compile time.
+*/
+typedef enum {
+    FLOAT64,
+    FLOAT32
+} DataType;
+
+/*
+Floating point type of every matrix and kernel.
+Double by default, float when compiled with -fp32 (USE_FLOAT32).
+Float halves the bytes moved and doubles the SIMD lanes of every kernel.
+*/
+#ifdef USE_FLOAT32
+typedef float nn_float;
+#define NN_DTYPE FLOAT32
+#define NN_FLOAT_MAX FLT_MAX
+#else
+typedef double nn_float;
+#define NN_DTYPE FLOAT64
+#define NN_FLOAT_MAX DBL_MAX
+#endif
+
+/*
+Runs a work shared kernel (a function built from orphaned omp for loops).
+Inside a parallel region every thread of the team calls it and the loops split across them.
+Outside one it opens a region just for the call.
+Primitives use it so a training step can run inside a single persistent region,
+callers open one region with #pragma omp parallel and every primitive joins it instead of forking.
+Kernels must not be called from inside an omp single or master block.
+*/
+#ifdef ENABLE_PARALLEL
+#define PARALLEL_CALL(call) do { \
+    if (omp_in_parallel()) { call; } \
+    else { _Pragma("omp parallel") { call; } } \
+} while (0)
+#else
+#define PARALLEL_CALL(call) do { call; } while (0)
+#endif
+
 /*
 Matrix Structure.
 
@@ -16,7 +57,7 @@ Matrix Structure.
 typedef struct {
     int rows;
     int cols;
-    double* data;
+    nn_float* data;
 } matrix;
 
 /*
@@ -2,6 +2,22 @@
 #define LINALG_H
 #include "global.h"
 
+//////////////////////////////////////////////////// DATA STRUCTURES //////////////////////////////////////////////////////////////
+
+/*
+Compressed sparse row matrix.
+Row i holds nonzeros row_ptr[i] .. row_ptr[i + 1] - 1 of col_idx and values, cols ascending within a row.
+Offsets are absolute, so a view of some of the rows shares the arrays of its source.
+*/
+typedef struct {
+    int rows;
+    int cols;
+    int nnz; // Nonzeros of these rows, row_ptr[rows] - row_ptr[0]
+    int capacity; // Nonzeros col_idx and values have room for, 0 for a view
+    int* row_ptr; // rows + 1 offsets into col_idx and values
+    int* col_idx;
+    nn_float* values;
+} sparse_matrix;
 
 //////////////////////////////////////////////////// HELPER FUNCTIONS //////////////////////////////////////////////////////////////
 
@@ -29,10 +45,22 @@ void print_matrix(matrix* M);
 /*
 Fills a Matrix M with a value
 */
-void fill_matrix(matrix* M, double val);
+void fill_matrix(matrix* M, nn_float val);
+
+/*
+Makes *M a (rows x cols) matrix.
+Allocates if *M is NULL, reallocates only if the shape differs, otherwise reuses the buffer.
+*/
+void resize_matrix(matrix** M, int rows, int cols);
 
 //////////////////////////////////////////////////// LIN ALG FUNCTIONS //////////////////////////////////////////////////////////////
 
+/*
+Every operation has an allocating form and an _into form.
+_into forms write to a preallocated dest of the result shape and never allocate.
+Element wise _into forms accept dest == w or dest == v, making them in place.
+*/
+
 /*
 Returns a matrix object. 
 Transposes w, swaps dimension indicators in the matrix object.
@@ -40,6 +68,12 @@ Allocates memory on the heap for the return matrix.
 */
 matrix* transpose_matrix(matrix* w); 
 
+/*
+Writes w^T into dest (w->cols x w->rows).
+Can not be done in place.
+*/
+void transpose_matrix_into(matrix* dest, matrix* w);
+
 /*
 Returns a matrix object. 
 Includes dimensionality checks.
@@ -47,6 +81,40 @@ Allocates memory on the heap for the return matrix.
 */
 matrix* matrix_mult(matrix* w, matrix* v);
 
+/*
+Writes w * v into dest (w->rows x v->cols).
+Includes dimensionality checks.
+*/
+void matrix_mult_into(matrix* dest, matrix* w, matrix* v);
+
+/*
+Returns a matrix object, w^T * v.
+Reads w transposed in place, no transposed copy is made.
+Includes dimensionality checks.
+Allocates memory on the heap for the return matrix.
+*/
+matrix* matrix_mult_tn(matrix* w, matrix* v);
+
+/*
+Writes w^T * v into dest (w->cols x v->cols).
+Includes dimensionality checks.
+*/
+void matrix_mult_tn_into(matrix* dest, matrix* w, matrix* v);
+
+/*
+Returns a matrix object, w * v^T.
+Reads v transposed in place, no transposed copy is made.
+Includes dimensionality checks.
+Allocates memory on the heap for the return matrix.
+*/
+matrix* matrix_mult_nt(matrix* w, matrix* v);
+
+/*
+Writes w * v^T into dest (w->rows x v->rows).
+Includes dimensionality checks.
+*/
+void matrix_mult_nt_into(matrix* dest, matrix* w, matrix* v);
+
 /*
 Returns a matrix object. 
 Includes dimensionality checks.
@@ -54,6 +122,17 @@ Allocates memory on the heap for the return matrix
 */
 matrix* element_matrix_mult(matrix* w, matrix* v);
 
+/*
+Writes w * v (element wise) into dest.
+Includes dimensionality checks.
+*/
+void element_matrix_mult_into(matrix* dest, matrix* w, matrix* v);
+
+/*
+Multiplies every element of w by s, in place.
+*/
+void matrix_scalar_mult(matrix* w, nn_float s);
+
 /*
 Returns matrix object
 Includes dimensionality checks.
@@ -61,16 +140,83 @@ Allocates memory on the heap for the return matrix
 */
 matrix* matrix_sum(matrix* w, matrix* v);
 
+/*
+Writes w + v into dest.
+Includes dimensionality checks.
+*/
+void matrix_sum_into(matrix* dest, matrix* w, matrix* v);
+
 /*
 Returns a matrix object
 Allocates memory on the heap for the return matrix
 */
-matrix* matrix_scalar_sum(matrix* w, double s, bool useAbs);
+matrix* matrix_scalar_sum(matrix* w, nn_float s, bool useAbs);
+
+/*
+Writes w + s into dest, |w + s| if useAbs.
+*/
+void matrix_scalar_sum_into(matrix* dest, matrix* w, nn_float s, bool useAbs);
 
 /*
 Returns average value of the matrix.
+Inside a parallel region one thread sums, use matrix_mean_shared to share the sum across the team.
 */
 double matrix_mean(matrix* w);
 
+/*
+Returns average value of the matrix to every thread of the team, called by the whole team.
+Threads reduce into total, which the team shares and the caller owns, so concurrent teams never share a sum.
+*/
+double matrix_mean_shared(matrix* w, double* total);
+
+//////////////////////////////////////////////////// SPARSE FUNCTIONS //////////////////////////////////////////////////////////////
+
+/*
+Allocates a (rows x cols) CSR matrix with room for nnz nonzeros, row_ptr zeroed.
+*/
+sparse_matrix* allocate_sparse_matrix(int rows, int cols, int nnz);
+
+/*
+Frees the arrays and the struct. Views share their source's arrays and must not be freed.
+*/
+void free_sparse_matrix(sparse_matrix* S);
+
+/*
+Returns the nonzeros of M as a CSR matrix.
+*/
+sparse_matrix* dense_to_sparse(matrix* M);
+
+/*
+Returns S as a dense matrix.
+*/
+matrix* sparse_to_dense(sparse_matrix* S);
+
+/*
+Points dest at num_rows rows of src starting at start_row, no copy (like shallow_cpy_matrix).
+*/
+void sparse_rows_view(sparse_matrix* src, sparse_matrix* dest, int start_row, int num_rows);
+
+/*
+Writes S * W into dest (S->rows x W->cols), only the rows of W selected by the cols of the nonzeros are read.
+Includes dimensionality checks.
+*/
+void sparse_matrix_mult_into(matrix* dest, sparse_matrix* S, matrix* W);
+
+/*
+Writes the listed rows of S * W into dest (S->rows x W->cols), every other row of dest is left untouched.
+Includes dimensionality checks.
+*/
+void sparse_matrix_mult_rows_into(matrix* dest, sparse_matrix* S, matrix* W, const int* rows, int num_rows);
+
+/*
+Writes the transpose of S into *dest, allocated or grown as needed (cols ascending within each row).
+*/
+void sparse_transpose_into(sparse_matrix** dest, sparse_matrix* S);
+
+/*
+Writes the indices of the rows of S holding a nonzero into rows (room for S->rows), returns how many.
+*/
+int sparse_nonempty_rows(sparse_matrix* S, int* rows);
+
 
 #endif
\ No newline at end of file
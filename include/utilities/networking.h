@@ -0,0 +1,163 @@
+#ifndef NETWORKING_H
+#define NETWORKING_H
+#include "network.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SERVE_MAGIC 0x5652534D // "MSRV" on a little endian wire
+#define SERVE_HISTOGRAM_BUCKETS 32 // Power of two buckets
+#define SERVE_MAX_REQUEST_ROWS (1 << 16) // Larger requests are refused
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Message type enum
+*/
+typedef enum {
+    SERVE_PREDICT, // rows x cols inputs follow, the response carries rows x outputs predictions
+    SERVE_STATS // No payload, the response carries a ServerStats
+} ServeMessageType;
+
+/*
+Response status enum
+*/
+typedef enum {
+    SERVE_OK,
+    SERVE_BAD_REQUEST // Unknown type, dtype or shape, the server closes the connection after replying
+} ServeStatus;
+
+/*
+Message header, 24 bytes, in front of every request and response.
+Values follow row major in the build dtype, native byte order (the socket is local).
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t type; // ServeMessageType
+    uint32_t status; // ServeStatus, responses only
+    uint32_t dtype; // DataType of the values that follow
+    uint32_t rows;
+    uint32_t cols;
+} ServeHeader;
+
+/*
+Histogram with power of two buckets, bucket 0 counts zeros and bucket b counts [2^(b-1), 2^b).
+*/
+typedef struct {
+    uint64_t counts[SERVE_HISTOGRAM_BUCKETS];
+    uint64_t total; // Values added
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+/*
+Server counters, sent as is in response to SERVE_STATS.
+*/
+typedef struct {
+    uint64_t requests; // Predict requests answered
+    uint64_t rows; // Rows predicted
+    uint64_t batches; // Forward passes run
+    uint64_t errors; // Bad requests
+    Histogram queue_depth; // Requests waiting when a request is queued, itself included
+    Histogram batch_rows; // Rows per forward pass
+    Histogram latency_us; // Request read to predictions ready, microseconds
+} ServerStats;
+
+/*
+Queued predict request, lives on the stack of its connection thread until done.
+*/
+typedef struct ServeRequest {
+    matrix* inputs; // Owned by the connection
+    matrix* outputs; // Owned by the connection, sized before queueing
+    struct timespec arrival;
+    bool done;
+    struct ServeRequest* next;
+} ServeRequest;
+
+/*
+Open client connection, tracked so a stopping server can shut it down.
+*/
+typedef struct ServeConnection {
+    struct InferenceServer* server;
+    int fd;
+    struct ServeConnection* next;
+} ServeConnection;
+
+/*
+Inference server data structure.
+An accept thread hands every connection its own thread, which reads requests and queues them.
+One batching thread coalesces queued requests into dynamic batches of up to max_batch rows, waiting at
+most max_wait_us after the oldest request arrived, runs the forward pass and scatters the rows back.
+*/
+typedef struct InferenceServer {
+    network* net;
+    bool owns_net; // Loaded from a checkpoint, freed with the server
+    int max_batch; // Rows per dynamic batch, a larger request runs alone
+    long max_wait_us; // Longest a request waits for others to join its batch
+    int listen_fd;
+    char* socket_path; // Unix socket to unlink on stop, NULL for TCP
+
+    ServeRequest* head; // Queue of requests waiting for a batch, oldest first
+    ServeRequest* tail;
+    int queued_requests;
+    int queued_rows;
+    matrix* batch; // Gathered batch (max_batch x inputs)
+    ServerStats stats;
+
+    ServeConnection* connections;
+    int active_connections;
+    bool stop;
+    pthread_t accept_thread;
+    pthread_t batch_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // Signalled when a request is queued
+    pthread_cond_t done; // Broadcast when a batch is scattered
+} InferenceServer;
+
+//////////////////////////////////////////////////// SERVER METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Starts serving a compiled network at address: "unix:/path/to.sock" or "tcp:port" (bound to 127.0.0.1).
+The network must outlive the server and must not be used elsewhere while it serves.
+*/
+InferenceServer* start_server(network* net, const char* address, int max_batch, long max_wait_us);
+
+/*
+Loads a checkpoint for inference (see load_checkpoint) and serves it, the network is freed with the server.
+*/
+InferenceServer* serve_checkpoint(const char* model_path, const char* address, int max_batch, long max_wait_us);
+
+/*
+Stops accepting, closes every connection, lets the batch in flight finish and frees the server.
+*/
+void stop_server(InferenceServer* server);
+
+/*
+Copies the server counters.
+*/
+void server_stats(InferenceServer* server, ServerStats* stats);
+
+/*
+Prints the counters and the non empty buckets of every histogram.
+*/
+void print_server_stats(ServerStats* stats);
+
+//////////////////////////////////////////////////// CLIENT METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Connects to a server address (same format as start_server), returns the socket.
+*/
+int serve_connect(const char* address);
+
+/*
+Sends the rows of X and waits for their predictions, resized into *predictions.
+Returns false if the server refused the request or the connection was lost.
+*/
+bool serve_predict(int fd, matrix* X, matrix** predictions);
+
+/*
+Fetches the server counters, returns false if the connection was lost.
+*/
+bool serve_stats(int fd, ServerStats* stats);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+#include "gemm.h"
+#include <stdint.h>
+
+#define QUANT_PANEL 16 // Output channels per packed weight panel, one int32 lane each
+#define QUANT_GROUP 4 // Input features multiplied and summed into one int32 lane per step
+#define QUANT_INPUT_MAX 127 // Inputs are quantized to 7 bits so maddubs pairs never saturate int16
+#define QUANT_WEIGHT_MAX 127 // Weights are symmetric int8, -128 is never used
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Int8 kernel function.
+Multiplies 4 rows of quantized inputs (groups * QUANT_GROUP bytes each) with one packed weight panel,
+c = a * panel as a (4 x QUANT_PANEL) int32 tile. Rows may repeat, the caller drops the copies.
+*/
+typedef void (*quant_kernel)(int groups, const uint8_t* const* a, const int8_t* panel, int32_t* c);
+
+/*
+Int8 kernel descriptor.
+*/
+typedef struct {
+    const char* name; // Kernel name (generic, avx2, avx512vnni)
+    quant_kernel kernel;
+} QuantKernel;
+
+/*
+Post training quantized weights of a dense layer.
+Weights are int8 per output channel: w = weight_scale[n] * wq. Inputs are unsigned 7 bit per tensor with a
+zero point calibrated from a sample: x = input_scale * (xq - zero_point). The int32 dot product is dequantized as
+(acc - zero_point * sum_k wq[k][n]) * input_scale * weight_scale[n].
+*/
+typedef struct {
+    int K; // Input features
+    int N; // Output channels
+    int k_padded; // K rounded up to QUANT_GROUP, row stride of the quantized inputs
+    int8_t* weights; // ceil(N / QUANT_PANEL) panels of k_padded / QUANT_GROUP groups x QUANT_PANEL x QUANT_GROUP bytes
+    nn_float* scales; // input_scale * weight_scale of each output channel
+    int32_t* offsets; // zero_point * sum_k wq[k][n] of each output channel
+    nn_float input_min; // Calibrated input range
+    nn_float input_max;
+    nn_float input_scale;
+    int zero_point;
+} QuantizedDense;
+
+//////////////////////////////////////////////////// QUANTIZATION METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Returns the int8 kernel in use, selected on first call from CPUID.
+*/
+const QuantKernel* quantize_get_kernel();
+
+/*
+Forces an int8 kernel by name ("generic", "avx2", "avx512vnni").
+Returns false if the kernel is unknown or the cpu does not support it.
+*/
+bool quantize_set_kernel(const char* name);
+
+/*
+Quantizes weights (K x N) per output channel for inputs calibrated to [input_min, input_max].
+The range is widened to include 0 so zero inputs (ReLU outputs, padding) are exact.
+*/
+QuantizedDense* quantize_weights(matrix* weights, nn_float input_min, nn_float input_max);
+
+/*
+Frees the quantized weights and the struct.
+*/
+void free_quantized_dense(QuantizedDense* q);
+
+/*
+Returns the bytes held by the quantized weights, scales and offsets.
+*/
+size_t quantized_dense_bytes(QuantizedDense* q);
+
+/*
+Quantizes inputs (rows x K) into dest (rows x k_padded bytes), values outside the calibrated range are clamped.
+Supports parallel, inside a parallel region every thread of the team must call it.
+*/
+void quantize_inputs(QuantizedDense* q, matrix* inputs, uint8_t* dest);
+
+/*
+C = epilogue(dequantize(A * weights)) for M rows of quantized inputs A.
+Dequantization, bias and ReLU run on each int32 tile as it leaves the kernel, C is written once.
+Softmax is not supported here, use GEMM_EPILOGUE_BIAS and normalize the rows afterwards.
+Supports parallel, inside a parallel region every thread of the team must call it.
+*/
+void quantized_gemm(QuantizedDense* q, int M, const uint8_t* A, const nn_float* bias, nn_float* C, int ldc,
+                    GemmEpilogueType epilogue);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include "global.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TASK_DEQUE_SIZE 1024 // Tasks queued per worker, power of two
+
+//////////////////////////////////////////////////// DATA STRUCTURES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Task function.
+Runs the work for the index range [begin, end) of ctx / data.
+*/
+typedef void (*task_func)(void* ctx, void* data, int begin, int end);
+
+/*
+Task group.
+Counts tasks submitted against it that have not finished, threadpool_wait joins on it.
+Zero initialize (init_task_group) before the first submit.
+*/
+typedef struct {
+    atomic_int pending;
+} TaskGroup;
+
+/*
+Task record, stored by value in the deques so submitting never allocates.
+*/
+typedef struct {
+    task_func func;
+    void* ctx;
+    void* data;
+    int begin;
+    int end;
+    TaskGroup* group;
+} Task;
+
+/*
+Chase-Lev work stealing deque.
+The owning worker pushes and pops at bottom (LIFO, cache warm), other workers steal from top (FIFO) with a CAS.
+top and bottom sit on separate cache lines so thieves do not bounce the owner's line.
+*/
+typedef struct {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Alignas(64) Task tasks[TASK_DEQUE_SIZE];
+} TaskDeque;
+
+typedef struct ThreadPool ThreadPool;
+
+/*
+Worker data structure.
+Worker 0 is the thread that created the pool, it runs tasks while it waits on a group.
+*/
+typedef struct {
+    TaskDeque deque;
+    ThreadPool* pool;
+    pthread_t thread;
+    int id;
+    unsigned int seed; // Victim selection when stealing
+} Worker;
+
+/*
+Thread pool data structure.
+*/
+struct ThreadPool {
+    int num_threads; // Workers, including the creating thread
+    bool pinned; // Worker i is bound to core i
+    Worker* workers;
+    atomic_bool shutdown;
+    atomic_int queued; // Tasks sitting in any deque
+    atomic_int sleeping; // Workers blocked on wake
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+//////////////////////////////////////////////////// THREAD POOL METHODS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Starts a pool of num_threads workers, num_threads <= 0 uses one per online core.
+The calling thread becomes worker 0, num_threads - 1 threads are spawned.
+pin binds worker i to core i (Linux only, ignored elsewhere).
+OpenMP inside tasks runs single threaded, parallelism comes from the pool.
+*/
+ThreadPool* init_threadpool(int num_threads, bool pin);
+
+/*
+Stops and joins the workers, must be called by the creating thread with no tasks pending.
+*/
+void free_threadpool(ThreadPool* pool);
+
+/*
+Resets a task group to no pending tasks.
+*/
+void init_task_group(TaskGroup* group);
+
+/*
+Queues func(ctx, data, begin, end) on the calling worker's deque.
+Idle workers steal it. Runs it inline if the deque is full.
+Only pool threads (the creating thread or tasks) may submit.
+*/
+void threadpool_submit(ThreadPool* pool, TaskGroup* group, task_func func, void* ctx, void* data, int begin, int end);
+
+/*
+Splits [begin, end) into chunks of at least grain indices and submits one task per chunk.
+*/
+void threadpool_submit_range(ThreadPool* pool, TaskGroup* group, task_func func, void* ctx, void* data,
+                             int begin, int end, int grain);
+
+/*
+Returns once every task of group has finished.
+The caller runs queued tasks (its own or stolen) while it waits, so waiting inside a task can not deadlock.
+*/
+void threadpool_wait(ThreadPool* pool, TaskGroup* group);
+
+#endif
@@ -13,20 +13,22 @@ has_param() {
 }
 
 # Variables
-SRC_FILES="src/test/main.c src/activations/*.c src/evaluations/*.c src/optimizers/*.c src/layers/*.c src/utilities/*.c"  # Adjust according to your project structure
+MAIN_FILE="src/test/main.c"
+SRC_FILES="src/activations/*.c src/evaluations/*.c src/optimizers/*.c src/layers/*.c src/utilities/*.c"  # Adjust according to your project structure
 INCLUDE_DIRS="include/"
 BUILD_DIR="build/"
 OUTPUT_FILE="${BUILD_DIR}network"  # Output executable name
-CFLAGS="-O3 -march=native -funroll-loops -ftree-vectorize -g -fopenmp -lm
+CFLAGS="-O3 -march=native -funroll-loops -ftree-vectorize -fno-math-errno -g -fopenmp -pthread -lm
  -I${INCLUDE_DIRS} -I${INCLUDE_DIRS}activations -I${INCLUDE_DIRS}evaluations -I${INCLUDE_DIRS}optimizers -I${INCLUDE_DIRS}layers -I${INCLUDE_DIRS}utilities"
 PARALLEL_FLAG=""
 DIAGNOSTIC_FLAG=""
 SOCKET_FLAG=""
+PRECISION_FLAG=""
 
 # Check for flags
 if has_param "-parallel" "$@"; then
     echo "Compiling with OpenMP parallelization enabled..."
-    PARALLEL_FLAG="-D ENABLE_PARALLEL -D NUM_THREADS=8"  # You can change NUM_THREADS based on your system
+    PARALLEL_FLAG="-D ENABLE_PARALLEL"  # Thread count is set at runtime (OMP_NUM_THREADS, thread pool size)
 fi
 
 if has_param "-diag" "$@"; then
@@ -34,6 +36,23 @@ if has_param "-diag" "$@"; then
     DIAGNOSTIC_FLAG="-fsanitize=address,undefined"
 fi
 
+if has_param "-fp32" "$@"; then
+    echo "Compiling with single precision (float32) matrices..."
+    PRECISION_FLAG="-D USE_FLOAT32"
+fi
+
+if has_param "-bench" "$@"; then
+    echo "Compiling benchmarks..."
+    MAIN_FILE="src/test/benchmark.c"
+    OUTPUT_FILE="${BUILD_DIR}benchmark"
+fi
+
+if has_param "-serve" "$@"; then
+    echo "Compiling the inference server..."
+    MAIN_FILE="src/test/serve.c"
+    OUTPUT_FILE="${BUILD_DIR}serve"
+fi
+
 # Create build directory if it doesn't exist
 if [[ ! -d "$BUILD_DIR" ]]; then
     echo "Creating build directory: $BUILD_DIR"
@@ -42,7 +61,7 @@ fi
 
 # Default Compilation (Executable)
 echo "Compiling the program..."
-clang $CFLAGS $PARALLEL_FLAG $DIAGNOSTIC_FLAG $SRC_FILES -o $OUTPUT_FILE
+clang $CFLAGS $PARALLEL_FLAG $PRECISION_FLAG $DIAGNOSTIC_FLAG $MAIN_FILE $SRC_FILES -o $OUTPUT_FILE
 
 # Check if compilation was successful
 if [[ $? -ne 0 ]]; then
@@ -5,64 +5,110 @@ ReluParams* init_relu() {
     relu->dinputs = NULL;
     relu->outputs = NULL;
     relu->inputs = NULL;
+    relu->max_batch = 0; // default, heap allocated buffers
+    relu->is_training = true; // default
     return relu;
 }
 
 void free_relu(ReluParams* relu) {
+    // Arena bound buffers are freed with the arena
+    if (relu->max_batch > 0) {
+        return;
+    }
     if (relu->dinputs != NULL) {
         free_matrix(relu->dinputs);
+        relu->dinputs = NULL;
     }
     if (relu->outputs != NULL) {
         free_matrix(relu->outputs);
+        relu->outputs = NULL;
     }
     if (relu->inputs != NULL) {
         free_matrix(relu->inputs);
+        relu->inputs = NULL;
+    }
+}
+
+size_t relu_workspace_size(int num_inputs, int max_batch, bool fused) {
+    return (fused ? 2 : 3) * arena_matrix_bytes(max_batch, num_inputs); // inputs unless fused, dinputs, outputs
+}
+
+void bind_relu_workspace(ReluParams* relu, Arena* arena, int num_inputs, int max_batch, bool fused) {
+    // Drop lazily allocated buffers
+    free_relu(relu);
+
+    relu->inputs = fused ? NULL : arena_alloc_matrix(arena, max_batch, num_inputs);
+    relu->dinputs = arena_alloc_matrix(arena, max_batch, num_inputs);
+    relu->outputs = arena_alloc_matrix(arena, max_batch, num_inputs);
+    relu->max_batch = max_batch;
+}
+
+/*
+max(0, inputs) into outputs, copying inputs into cache in the same pass unless it is NULL.
+*/
+static void relu_forwards_kernel(matrix* inputs, matrix* outputs, matrix* cache) {
+    int n = inputs->rows * inputs->cols;
+
+    if (cache != NULL) {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; i++) {
+            cache->data[i] = inputs->data[i];
+            outputs->data[i] = (inputs->data[i] <= 0) ? 0 : inputs->data[i];
+        }
+    }
+    else {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; i++) {
+            outputs->data[i] = (inputs->data[i] <= 0) ? 0 : inputs->data[i];
+        }
     }
 }
 
 void relu_forwards(ReluParams* relu, matrix* inputs) {
-    // Allocate memory for structure variables dynamically
-    if (relu->inputs == NULL) {
-        relu->inputs = allocate_matrix(inputs->rows, inputs->cols);
+    // Size structure variables for this batch (workspace slices, or heap buffers reused while the shape is unchanged)
+    #pragma omp single
+    {
+        fit_buffer(&relu->outputs, inputs->rows, inputs->cols, relu->max_batch);
+        if (relu->is_training) {
+            fit_buffer(&relu->inputs, inputs->rows, inputs->cols, relu->max_batch);
+            fit_buffer(&relu->dinputs, inputs->rows, inputs->cols, relu->max_batch);
+        }
     }
-    if (relu->dinputs == NULL) {
-        relu->dinputs = allocate_matrix(inputs->rows, inputs->cols);
+
+    PARALLEL_CALL(relu_forwards_kernel(inputs, relu->outputs, relu->is_training ? relu->inputs : NULL));
+}
+
+void relu_inference_forwards(matrix* inputs, matrix* outputs) {
+    if (outputs->rows != inputs->rows || outputs->cols != inputs->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch in relu inference forwards.\n");
+        exit(1);
     }
-    if (relu->outputs == NULL) {
-        relu->outputs = allocate_matrix(inputs->rows, inputs->cols);
-    } 
-    // temp
-    memcpy(relu->inputs->data, inputs->data, inputs->rows * inputs->cols * sizeof(double));
-    // Calculate outputs
+    PARALLEL_CALL(relu_forwards_kernel(inputs, outputs, NULL));
+}
 
-    #ifdef ENABLE_PARALLEL
+static void relu_backwards_kernel(ReluParams* relu, matrix* input_gradients) {
+    int n = input_gradients->rows * input_gradients->cols;
+
+    // Iterate through every value in layer post activation output to get relu gradients
+    // outputs > 0 exactly where inputs > 0, so the fused forward never has to keep inputs
     #pragma omp for schedule(static)
-    #endif
-    for (int i = 0; i < relu->inputs->rows * relu->inputs->cols; i++) {
-        relu->outputs->data[i] = (relu->inputs->data[i] <= 0) ? 0 : relu->inputs->data[i];
+    for (int i = 0; i < n; i++) {
+        relu->dinputs->data[i] = 
+        (relu->outputs->data[i] > 0) ? input_gradients->data[i] : 0;
     }
 }
 
 void relu_backwards(ReluParams* relu, matrix* input_gradients) {
     // Check dimensions
-    if (relu->inputs->rows != input_gradients->rows || 
-        relu->inputs->cols != input_gradients->cols ) {
+    if (relu->outputs->rows != input_gradients->rows || 
+        relu->outputs->cols != input_gradients->cols ) {
         fprintf(stderr, "Error, Dimensionality mismatch in backwards relu.\n");
         exit(1);
     }
 
     // Allocate memory for structure variable dynamically
-    if (relu->dinputs == NULL) {
-        relu->dinputs = allocate_matrix(input_gradients->rows, input_gradients->cols);
-    }
-
-    #ifdef ENABLE_PARALLEL 
-        #pragma omp for schedule(static)
-    #endif
+    #pragma omp single
+    fit_buffer(&relu->dinputs, input_gradients->rows, input_gradients->cols, relu->max_batch);
 
-    // Iterate through every value in layer post activation output to get relu gradients
-    for (int i = 0; i < input_gradients->rows * input_gradients->cols; i++) {
-        relu->dinputs->data[i] = 
-        (relu->inputs->data[i] > 0) ? input_gradients->data[i] : 0;
-    }
+    PARALLEL_CALL(relu_backwards_kernel(relu, input_gradients));
 }
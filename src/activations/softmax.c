@@ -1,71 +1,102 @@
 #include "softmax.h"
 
+#define CATCE_CHUNK 16 // Rows of the fused loss per vector log, small enough to split a batch across threads
+
 SoftMaxParams* init_softmax() {
     SoftMaxParams* softmax = malloc(sizeof(SoftMaxParams));
     softmax->inputs = NULL;
     softmax->dinputs = NULL;
     softmax->outputs = NULL;
+    softmax->max_batch = 0; // default, heap allocated buffers
+    softmax->is_training = true; // default
+    softmax->loss_total = 0.0;
     return softmax;
 }
 
 void free_softmax(SoftMaxParams* softmax) {
-    if (softmax->inputs != NULL) {
-        free_matrix(softmax->inputs);
+    // Arena bound buffers are freed with the arena
+    if (softmax->max_batch > 0) {
+        return;
     }
     if (softmax->dinputs != NULL) {
         free_matrix(softmax->dinputs);
-    }   
+        softmax->dinputs = NULL;
+    }
     if (softmax->outputs != NULL) {
         free_matrix(softmax->outputs);
+        softmax->outputs = NULL;
+    }
+    if (softmax->inputs != NULL) {
+        free_matrix(softmax->inputs);
+        softmax->inputs = NULL;
     }
 }
 
-void softmax_forwards(SoftMaxParams* softmax, matrix* inputs) {
-    // Allocate memory for structure variables dynamically
-    if (softmax->inputs == NULL) {
-        softmax->inputs = allocate_matrix(inputs->rows, inputs->cols);
-    }
-    if (softmax->dinputs == NULL) {
-        softmax->dinputs = allocate_matrix(inputs->rows, inputs->cols);
-    }
-    if (softmax->outputs == NULL) {
-        softmax->outputs = allocate_matrix(inputs->rows, inputs->cols);
-    }
-    // temp
-    memcpy(softmax->inputs->data, inputs->data, inputs->rows * inputs->cols * sizeof(double));
+size_t softmax_workspace_size(int num_inputs, int max_batch, bool fused) {
+    return (fused ? 2 : 3) * arena_matrix_bytes(max_batch, num_inputs); // inputs unless fused, dinputs, outputs
+}
 
-    // Calculate softmax for every sample in batch
-    for(int i = 0; i < inputs->rows; i++) {
+void bind_softmax_workspace(SoftMaxParams* softmax, Arena* arena, int num_inputs, int max_batch, bool fused) {
+    // Drop lazily allocated buffers
+    free_softmax(softmax);
 
-        // Subtract maximum value from each value in the input batch for numerical stability
-        double max = -DBL_MAX;
-        for(int j = 0; j < inputs->cols; j++) {
-            if (inputs->data[i * inputs->cols + j] > max) {
-                max = inputs->data[i * inputs->cols + j];
-            }
-        }
+    softmax->inputs = fused ? NULL : arena_alloc_matrix(arena, max_batch, num_inputs);
+    softmax->dinputs = arena_alloc_matrix(arena, max_batch, num_inputs);
+    softmax->outputs = arena_alloc_matrix(arena, max_batch, num_inputs);
+    softmax->max_batch = max_batch;
+}
+
+void softmax_row(const nn_float* inputs, nn_float* outputs, int cols) {
+    // Max, exponentials and normalization run as vector passes over the row, no scratch
+    fast_softmax_row(inputs, outputs, cols);
+}
 
-        // Calculate exponentials and sum them
-        double* exp_values = (double*) calloc(inputs->cols, sizeof(double));
-        double sum = 0.0;
-        #ifdef ENABLE_PARALLEL
-        #pragma omp parallel for reduction(+:sum)
-        #endif
-        for(int j = 0; j < inputs->cols; j++) {
-            exp_values[j] = exp(inputs->data[i * inputs->cols + j] - max);
-            sum += exp_values[j];
+/*
+Row wise softmax of inputs into outputs, copying inputs into cache in the same pass unless it is NULL.
+*/
+static void softmax_forwards_kernel(matrix* inputs, matrix* outputs, matrix* cache) {
+    int cols = inputs->cols;
+
+    // Calculate softmax for every sample in batch, each thread gets its own rows
+    #pragma omp for schedule(static)
+    for(int i = 0; i < inputs->rows; i++) {
+        const nn_float* row = inputs->data + i * cols;
+        if (cache != NULL) {
+            memcpy(cache->data + i * cols, row, cols * sizeof(nn_float));
         }
+        softmax_row(row, outputs->data + i * cols, cols);
+    }
+}
 
-        // Normalize exponentials by dividing by the sum to get probabilities
-        #ifdef ENABLE_PARALLEL
-        #pragma omp parallel for
-        #endif
-        for(int j = 0; j < inputs->cols; j++) {
-            softmax->outputs->data[i * inputs->cols + j] = exp_values[j] / sum;
+void softmax_forwards(SoftMaxParams* softmax, matrix* inputs) {
+    // Size structure variables for this batch (workspace slices, or heap buffers reused while the shape is unchanged)
+    #pragma omp single
+    {
+        fit_buffer(&softmax->outputs, inputs->rows, inputs->cols, softmax->max_batch);
+        if (softmax->is_training) {
+            fit_buffer(&softmax->inputs, inputs->rows, inputs->cols, softmax->max_batch);
+            fit_buffer(&softmax->dinputs, inputs->rows, inputs->cols, softmax->max_batch);
         }
+    }
+
+    PARALLEL_CALL(softmax_forwards_kernel(inputs, softmax->outputs, softmax->is_training ? softmax->inputs : NULL));
+}
+
+void softmax_inference_forwards(matrix* inputs, matrix* outputs) {
+    if (outputs->rows != inputs->rows || outputs->cols != inputs->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch in softmax inference forwards.\n");
+        exit(1);
+    }
+    PARALLEL_CALL(softmax_forwards_kernel(inputs, outputs, NULL));
+}
 
-        // free exp memory
-        free(exp_values);
+static void softmax_backwards_kernel(SoftMaxParams* softmax, matrix* Y) {
+    #pragma omp for schedule(static)
+    for (int i = 0; i < softmax->dinputs->rows; i++) {
+        int row_offset = i * softmax->dinputs->cols;  
+        for (int j = 0; j < softmax->dinputs->cols; j++) {
+            softmax->dinputs->data[row_offset + j] = softmax->outputs->data[row_offset + j] - Y->data[row_offset + j];
+        }
     }
 }
 
@@ -76,15 +107,72 @@ void softmax_backwards(SoftMaxParams* softmax, matrix* Y) {
         exit(1);
     }
 
-    #ifdef ENABLE_PARALLEL
-    #pragma omp parallel for
-    #endif
-    for (int i = 0; i < softmax->dinputs->rows; i++) {
-        int row_offset = i * softmax->dinputs->cols;  
-        for (int j = 0; j < softmax->dinputs->cols; j++) {
-            softmax->dinputs->data[row_offset + j] = softmax->outputs->data[row_offset + j] - Y->data[row_offset + j];
+    PARALLEL_CALL(softmax_backwards_kernel(softmax, Y));
+}
+
+static void softmax_catCE_kernel(SoftMaxParams* softmax, matrix* logits, const int* labels) {
+    int cols = logits->cols;
+    int num_chunks = (logits->rows + CATCE_CHUNK - 1) / CATCE_CHUNK;
+
+    #pragma omp single
+    softmax->loss_total = 0.0;
+
+    // Rows go a chunk at a time so the logs of their exponential sums take one vector pass
+    double total = 0.0;
+    #pragma omp for schedule(static) nowait
+    for (int c = 0; c < num_chunks; c++) {
+        int start = c * CATCE_CHUNK;
+        int count = (logits->rows - start < CATCE_CHUNK) ? logits->rows - start : CATCE_CHUNK;
+        nn_float sums[CATCE_CHUNK];
+
+        for (int r = 0; r < count; r++) {
+            int i = start + r;
+            int label = labels[i];
+            if (label < 0 || label >= cols) {
+                fprintf(stderr, "Error: Label %d of row %d is not a class of the %d logits in softmax catCE.\n", label, i, cols);
+                exit(1);
+            }
+            const nn_float* row = logits->data + i * cols;
+            nn_float* probs = softmax->outputs->data + i * cols;
+            nn_float* grads = softmax->dinputs->data + i * cols;
+
+            // -log(softmax(row)[label]) = max + log(sum) - row[label], exact even when the probability underflows
+            nn_float max;
+            sums[r] = fast_softmax_row_sum(row, probs, cols, &max);
+            total += max - row[label];
+
+            // Gradient of the loss with respect to the logits, the one hot row is only the label
+            memcpy(grads, probs, cols * sizeof(nn_float));
+            grads[label] -= 1.0;
+        }
+
+        fast_log(sums, sums, count);
+        for (int r = 0; r < count; r++) {
+            total += sums[r];
         }
     }
+
+    // Each thread adds its part to the layer's total, the barrier publishes it to the team
+    #pragma omp atomic
+    softmax->loss_total += total;
+    #pragma omp barrier
 }
 
+double softmax_catCE_forwards_backwards(SoftMaxParams* softmax, matrix* logits, const int* labels) {
+    #pragma omp single
+    {
+        fit_buffer(&softmax->outputs, logits->rows, logits->cols, softmax->max_batch);
+        fit_buffer(&softmax->dinputs, logits->rows, logits->cols, softmax->max_batch);
+    }
+
+    PARALLEL_CALL(softmax_catCE_kernel(softmax, logits, labels));
+    double loss = softmax->loss_total / logits->rows;
 
+#ifdef ENABLE_PARALLEL
+    // Every thread has read the total before the next call resets it
+    if (omp_in_parallel()) {
+        #pragma omp barrier
+    }
+#endif
+    return loss;
+}
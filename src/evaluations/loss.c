@@ -2,6 +2,7 @@
 
 Loss* init_loss(LossType loss_type) {
     Loss* loss_func = malloc(sizeof(Loss));
+    loss_func->X = NULL;
     if (loss_type == CATCROSSENTROPY) {
         loss_func->lossType = CATCROSSENTROPY;
         loss_func->loss = 0.0;
@@ -26,28 +27,29 @@ Loss* init_loss(LossType loss_type) {
 }
 
 void compute_loss (Loss* loss_func, matrix* X, matrix* Y) {
-    // Dynamically allocate memory for X
-    if (loss_func->X == NULL) {
-        loss_func->X = allocate_matrix(X->rows, X->cols);
-        memcpy(loss_func->X->data, X->data, X->rows * X->cols * sizeof(double));
-    }
+    // One pass over the batch, run once for the team inside a parallel region
+    #pragma omp single
+    {
+        // Point at the predictions, no copy is made
+        loss_func->X = X;
+
+        // Calculate Loss
+        if (loss_func->lossType == CATCROSSENTROPY) {
+            calculate_catCE_loss(loss_func, Y);
+        }
+        else if (loss_func->lossType == BINCROSSENTROPY) {
+            calculate_binCE_loss(loss_func, Y);
+        }
+        else if (loss_func->lossType == MSE) {
+            calculate_MSE_loss(loss_func, Y);
+        }
+        else if (loss_func->lossType == MAE) {
+            calculate_MAE_loss(loss_func, Y);
+        }
 
-    // Calculate Loss
-    if (loss_func->lossType == CATCROSSENTROPY) {
-        calculate_catCE_loss(loss_func, Y);
+        // Predictions are owned by the caller
+        loss_func->X = NULL;
     }
-    else if (loss_func->lossType == BINCROSSENTROPY) {
-        calculate_binCE_loss(loss_func, Y);
-    }
-    else if (loss_func->lossType == MSE) {
-        calculate_MSE_loss(loss_func, Y);
-    }
-    else if (loss_func->lossType == MAE) {
-        calculate_MAE_loss(loss_func, Y);
-    }
-
-    // Free X
-    free_matrix(loss_func->X);
 }
 
 void calculate_catCE_loss(Loss* loss_func, matrix* Y) {
@@ -61,35 +63,41 @@ void calculate_catCE_loss(Loss* loss_func, matrix* Y) {
         exit(1);
     }
 
+    // Predicted probabilities of the true classes, gathered a chunk of rows at a time for one vector log
+    nn_float predicted[LOSS_CHUNK];
+
     // iterate over every vector in the prediction batch
-    for (int i = 0; i < loss_func->X->rows; i++) {
-
-        // find true class in one hot vector
-        int true_class = -1;
-        for (int j = 0; j < Y->cols; j++) {
-            if (Y->data[i * Y->cols + j] == 1.0) {
-                true_class = j;
-                break;
+    for (int start = 0; start < loss_func->X->rows; start += LOSS_CHUNK) {
+        int count = (loss_func->X->rows - start < LOSS_CHUNK) ? loss_func->X->rows - start : LOSS_CHUNK;
+
+        for (int r = 0; r < count; r++) {
+            int i = start + r;
+
+            // find true class in one hot vector
+            int true_class = -1;
+            for (int j = 0; j < Y->cols; j++) {
+                if (Y->data[i * Y->cols + j] == 1.0) {
+                    true_class = j;
+                    break;
+                }
             }
-        }
 
-        // error handling if no true class is found
-        if(true_class == -1) {
-            fprintf(stderr, "Error: No true class found in one hot vectors in calculate cat CE loss. \n");
-            exit(1);
-        }
+            // error handling if no true class is found
+            if(true_class == -1) {
+                fprintf(stderr, "Error: No true class found in one hot vectors in calculate cat CE loss. \n");
+                exit(1);
+            }
 
-        // get predicted sample in question with relation to true class
-        double predicted_sample = loss_func->X->data[i * loss_func->X->rows + true_class];
+            // get predicted sample in question with relation to true class, clipped so we never calculate log(0)
+            nn_float predicted_sample = loss_func->X->data[i * loss_func->X->cols + true_class];
+            predicted[r] = (predicted_sample < LOSS_EPSILON) ? LOSS_EPSILON : predicted_sample;
+        }
 
-        // clip value so we never calculate log(0)
-        if(predicted_sample < 1e-15) {
-            predicted_sample = 1e-15;
+        // calculate -log loss for the chunk and add it to the total
+        fast_log(predicted, predicted, count);
+        for (int r = 0; r < count; r++) {
+            losses -= predicted[r];
         }
-        
-        // calcuale -log loss for the sample in question and append to loss matrix
-        double loss = -log(predicted_sample);
-        losses += loss;
     }
 
     // Update Loss
@@ -99,28 +107,40 @@ void calculate_catCE_loss(Loss* loss_func, matrix* Y) {
 void calculate_binCE_loss(Loss* loss_func, matrix* Y) {
 
     // Check for dimension compatibility
-    if (loss_func->X->rows != Y->rows || Y->cols != 1) {
+    if (loss_func->X->rows != Y->rows || loss_func->X->cols != Y->cols) {
         fprintf(stderr, "Error: Dimensionality Mismatch between prediction and true label dimensions in calculate binary CE loss.\n");
         exit(1);
     }
 
     double total_loss = 0.0; 
 
-    for (int i = 0; i < loss_func->X->rows; i++) {
-        double sample_loss = 0.0;
-        for (int j = 0; j < loss_func->X->cols; j++) {
-            double y_hat = loss_func->X->data[i * 
-                        loss_func->X->cols + j]; 
+    // log(y_hat) and log(1 - y_hat) of a chunk of predictions, one vector log each
+    nn_float log_hat[LOSS_CHUNK];
+    nn_float log_not_hat[LOSS_CHUNK];
 
-            double y = Y->data[i * Y->cols + j]; 
+    int size = loss_func->X->rows * loss_func->X->cols;
+    for (int start = 0; start < size; start += LOSS_CHUNK) {
+        int count = (size - start < LOSS_CHUNK) ? size - start : LOSS_CHUNK;
+
+        // clip values on both sides so we never calculate log(0)
+        for (int r = 0; r < count; r++) {
+            nn_float y_hat = loss_func->X->data[start + r];
+            if (y_hat < LOSS_EPSILON) {
+                y_hat = LOSS_EPSILON;
+            }
+            if (y_hat > 1.0 - LOSS_EPSILON) {
+                y_hat = 1.0 - LOSS_EPSILON;
+            }
+            log_hat[r] = y_hat;
+            log_not_hat[r] = 1.0 - y_hat;
+        }
+        fast_log(log_hat, log_hat, count);
+        fast_log(log_not_hat, log_not_hat, count);
 
-            // clip value so we never calculate log(0)
-            if(y_hat < 1e-15) {
-                y_hat = 1e-15;
-            } 
-            sample_loss -= y * log(y_hat) + (1.0 - y) * log(1.0 - y_hat);  // Binary CE formula
+        for (int r = 0; r < count; r++) {
+            double y = Y->data[start + r];
+            total_loss -= y * log_hat[r] + (1.0 - y) * log_not_hat[r];  // Binary CE formula
         }
-        total_loss += sample_loss;
     }
     
     // Update loss
@@ -0,0 +1,644 @@
+#include "conv_plan.h"
+
+/*
+Winograd transforms, Y = AT [(G g GT) * (BT d B)] A for an alpha x alpha input tile d and a 3x3 kernel g.
+F(2x2, 3x3) takes 4x4 tiles to 2x2 outputs, F(4x4, 3x3) 6x6 tiles to 4x4 outputs, interpolation points 0, +-1, +-2.
+BT and AT are applied as the explicit sums below, the weight transform G only runs once per weight update.
+*/
+static const nn_float wino2_g[] = {
+    1, 0, 0,
+    0.5, 0.5, 0.5,
+    0.5, -0.5, 0.5,
+    0, 0, 1
+};
+static const nn_float wino4_g[] = {
+    1.0 / 4, 0, 0,
+    -1.0 / 6, -1.0 / 6, -1.0 / 6,
+    -1.0 / 6, 1.0 / 6, -1.0 / 6,
+    1.0 / 24, 1.0 / 12, 1.0 / 6,
+    1.0 / 24, -1.0 / 12, 1.0 / 6,
+    0, 0, 1
+};
+
+/*
+t = BT d for alpha values, d read with stride ds and t written with stride ts.
+*/
+static inline void wino_input_1d(const nn_float* d, int ds, nn_float* t, int ts, int tile) {
+    if (tile == 2) {
+        t[0] = d[0] - d[2 * ds];
+        t[ts] = d[ds] + d[2 * ds];
+        t[2 * ts] = d[2 * ds] - d[ds];
+        t[3 * ts] = d[ds] - d[3 * ds];
+    }
+    else {
+        nn_float d0 = d[0], d1 = d[ds], d2 = d[2 * ds], d3 = d[3 * ds], d4 = d[4 * ds], d5 = d[5 * ds];
+        t[0] = 4 * d0 - 5 * d2 + d4;
+        t[ts] = d3 + d4 - 4 * (d1 + d2);
+        t[2 * ts] = d4 - d3 + 4 * (d1 - d2);
+        t[3 * ts] = d4 - d2 + 2 * (d3 - d1);
+        t[4 * ts] = d4 - d2 + 2 * (d1 - d3);
+        t[5 * ts] = 4 * d1 - 5 * d3 + d5;
+    }
+}
+
+/*
+y = AT m for alpha values, m read with stride ms and the tile values of y written with stride ys.
+*/
+static inline void wino_output_1d(const nn_float* m, int ms, nn_float* y, int ys, int tile) {
+    if (tile == 2) {
+        y[0] = m[0] + m[ms] + m[2 * ms];
+        y[ys] = m[ms] - m[2 * ms] - m[3 * ms];
+    }
+    else {
+        nn_float m0 = m[0], m1 = m[ms], m2 = m[2 * ms], m3 = m[3 * ms], m4 = m[4 * ms], m5 = m[5 * ms];
+        nn_float s12 = m1 + m2, d12 = m1 - m2, s34 = m3 + m4, d34 = m3 - m4;
+        y[0] = m0 + s12 + s34;
+        y[ys] = d12 + 2 * d34;
+        y[2 * ys] = s12 + 4 * s34;
+        y[3 * ys] = d12 + 8 * d34 + m5;
+    }
+}
+
+static int next_pow2(int n) {
+    int p = 2; // Planes are split in row pairs
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/*
+cos and sin of 2 pi k / n for k < n / 2.
+*/
+static void fill_twiddles(nn_float* tw, int n) {
+    for (int k = 0; k < n / 2; k++) {
+        tw[k] = cos(2.0 * M_PI * k / n);
+        tw[n / 2 + k] = sin(2.0 * M_PI * k / n);
+    }
+}
+
+/*
+FFT size along one dim. With the input at offset pad, outputs read up to in + 2 pad - 1, so a plane of in + pad
+wraps those reads onto the leading padding, which is zero like the values they stand for.
+The plane also holds the kernel and the outputs.
+*/
+static int fft_size(int in, int pad, int kernel, int out) {
+    int n = in + pad;
+    n = (kernel > n) ? kernel : n;
+    n = (out > n) ? out : n;
+    return next_pow2(n);
+}
+
+int conv_fft_points(const ConvParams* params) {
+    int out_h = params->in_height + 2 * params->pad_h - params->kernel_h + 1;
+    int out_w = params->in_width + 2 * params->pad_w - params->kernel_w + 1;
+    return fft_size(params->in_height, params->pad_h, params->kernel_h, out_h)
+           * (fft_size(params->in_width, params->pad_w, params->kernel_w, out_w) / 2 + 1);
+}
+
+ConvPlan* init_conv_plan(layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    if (!conv_algorithm_supported(p, layer->algorithm) || layer->algorithm == CONV_IM2COL || layer->algorithm == CONV_DIRECT) {
+        fprintf(stderr, "Error: No %s plan for this shape in init conv plan.\n", conv_algorithm_name(layer->algorithm));
+        exit(1);
+    }
+
+    ConvPlan* plan = malloc(sizeof(ConvPlan));
+    if (plan == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in init conv plan.\n");
+        exit(1);
+    }
+    plan->algorithm = layer->algorithm;
+    plan->tile = 0;
+    plan->tiles_h = 0;
+    plan->tiles_w = 0;
+    plan->fft_h = 0;
+    plan->fft_w = 0;
+    plan->twiddles = NULL;
+    plan->weights_ready = false;
+    plan->inputs = NULL; // sized on the first pass
+    plan->products = NULL;
+    plan->scratch = NULL;
+
+    int channels = p->in_channels + p->out_channels;
+    int in_per_group = p->in_channels / p->groups;
+    if (plan->algorithm == CONV_FFT) {
+        plan->fft_h = fft_size(p->in_height, p->pad_h, p->kernel_h, layer->out_height);
+        plan->fft_w = fft_size(p->in_width, p->pad_w, p->kernel_w, layer->out_width);
+        plan->points = conv_fft_points(p);
+        plan->max_chunk = CONV_PLAN_ELEMS / (2 * plan->points * channels);
+        plan->weights = allocate_matrix(2 * plan->points * p->out_channels, in_per_group);
+        plan->twiddles = malloc((plan->fft_h + plan->fft_w) * sizeof(nn_float));
+        if (plan->twiddles == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure for twiddles in init conv plan.\n");
+            exit(1);
+        }
+        fill_twiddles(plan->twiddles, plan->fft_h);
+        fill_twiddles(plan->twiddles + plan->fft_h, plan->fft_w);
+    }
+    else {
+        plan->tile = (plan->algorithm == CONV_WINOGRAD_2X2) ? 2 : 4;
+        plan->tiles_h = (layer->out_height + plan->tile - 1) / plan->tile;
+        plan->tiles_w = (layer->out_width + plan->tile - 1) / plan->tile;
+        int alpha = plan->tile + 2;
+        plan->points = alpha * alpha;
+        plan->max_chunk = CONV_PLAN_ELEMS / (plan->points * channels * plan->tiles_h * plan->tiles_w);
+        plan->weights = allocate_matrix(plan->points * p->out_channels, in_per_group);
+    }
+    plan->max_chunk = (plan->max_chunk < 1) ? 1 : plan->max_chunk;
+    return plan;
+}
+
+void free_conv_plan(ConvPlan* plan) {
+    matrix* buffers[] = {plan->weights, plan->inputs, plan->products, plan->scratch};
+    for (int i = 0; i < 4; i++) {
+        if (buffers[i] != NULL) {
+            free_matrix(buffers[i]);
+        }
+    }
+    free(plan->twiddles);
+    free(plan);
+}
+
+/*
+Sizes the transformed buffers for chunks of up to chunk samples, one thread sizes, the rest wait at the end of the single.
+*/
+static void fit_plan(ConvPlan* plan, const ConvParams* p, int chunk) {
+    #pragma omp single
+    {
+        if (plan->algorithm == CONV_FFT) {
+            int scratch = 2 * plan->points + 2 * plan->fft_w + 2 * plan->fft_h;
+            resize_matrix(&plan->inputs, 2 * plan->points * p->in_channels, chunk);
+            resize_matrix(&plan->products, 2 * plan->points * p->out_channels, chunk);
+            // Outside a region the kernels run in a team PARALLEL_CALL is about to open
+            int threads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+            resize_matrix(&plan->scratch, threads, scratch);
+        }
+        else {
+            int tiles = chunk * plan->tiles_h * plan->tiles_w;
+            resize_matrix(&plan->inputs, plan->points * p->in_channels, tiles);
+            resize_matrix(&plan->products, plan->points * p->out_channels, tiles);
+        }
+    }
+}
+
+//////////////////////////////////////////////////// WINOGRAD ///////////////////////////////////////////////////////////////////////////
+
+/*
+C (rows x cols) = A (rows x inner) * B (inner x cols), or B^T when trans_b (B stored cols x inner).
+*/
+static inline void small_mult(const nn_float* A, const nn_float* B, nn_float* C, int rows, int inner, int cols, bool trans_b) {
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            nn_float sum = 0.0;
+            for (int k = 0; k < inner; k++) {
+                sum += A[i * inner + k] * (trans_b ? B[j * inner + k] : B[k * cols + j]);
+            }
+            C[i * cols + j] = sum;
+        }
+    }
+}
+
+/*
+U = G g GT for every (oc, c) pair, stored [group][point][oc][c] so each point of a group is one GEMM operand.
+*/
+static void winograd_weights_kernel(ConvPlan* plan, layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int alpha = plan->tile + 2;
+    const nn_float* G = (plan->tile == 2) ? wino2_g : wino4_g;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int oc = 0; oc < p->out_channels; oc++) {
+        for (int c = 0; c < in_per_group; c++) {
+            nn_float t[6 * 3];
+            nn_float u[6 * 6];
+            small_mult(G, layer->weights->data + (size_t) oc * layer->weights->cols + c * 9, t, alpha, 3, 3, false);
+            small_mult(t, G, u, alpha, 3, alpha, true);
+
+            int g = oc / out_per_group;
+            nn_float* dst = plan->weights->data + ((size_t) g * plan->points * out_per_group + oc % out_per_group) * in_per_group + c;
+            for (int xi = 0; xi < plan->points; xi++) {
+                dst[(size_t) xi * out_per_group * in_per_group] = u[xi];
+            }
+        }
+    }
+}
+
+/*
+V = BT d B for every input tile of the chunk, stored [group][point][c][tile] with tiles numbered sample by sample.
+*/
+static void winograd_inputs_kernel(ConvPlan* plan, layer_cnn* layer, matrix* inputs, int n0, int chunk) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int alpha = plan->tile + 2;
+    int tiles = plan->tiles_h * plan->tiles_w;
+    int ld = plan->inputs->cols;
+    #pragma omp for collapse(2) schedule(static)
+    for (int c = 0; c < p->in_channels; c++) {
+        for (int n = 0; n < chunk; n++) {
+            const nn_float* x = inputs->data + (size_t) (n0 + n) * inputs->cols + (size_t) c * p->in_height * p->in_width;
+            int g = c / in_per_group;
+            nn_float* dst = plan->inputs->data + ((size_t) g * plan->points * in_per_group + c % in_per_group) * ld + (size_t) n * tiles;
+
+            for (int th = 0; th < plan->tiles_h; th++) {
+                for (int tw = 0; tw < plan->tiles_w; tw++) {
+                    nn_float d[6 * 6];
+                    nn_float t[6 * 6];
+                    nn_float v[6 * 6];
+                    int ih0 = th * plan->tile - p->pad_h;
+                    int iw0 = tw * plan->tile - p->pad_w;
+                    bool inside = (ih0 >= 0 && iw0 >= 0 && ih0 + alpha <= p->in_height && iw0 + alpha <= p->in_width);
+                    for (int i = 0; i < alpha; i++) {
+                        int ih = ih0 + i;
+                        for (int j = 0; j < alpha; j++) {
+                            int iw = iw0 + j;
+                            bool valid = inside || (ih >= 0 && ih < p->in_height && iw >= 0 && iw < p->in_width);
+                            d[i * alpha + j] = valid ? x[ih * p->in_width + iw] : 0.0;
+                        }
+                    }
+
+                    // BT d by columns, then (BT d) B by rows
+                    for (int j = 0; j < alpha; j++) {
+                        wino_input_1d(d + j, alpha, t + j, alpha, plan->tile);
+                    }
+                    for (int i = 0; i < alpha; i++) {
+                        wino_input_1d(t + i * alpha, 1, v + i * alpha, 1, plan->tile);
+                    }
+
+                    int tile = th * plan->tiles_w + tw;
+                    for (int xi = 0; xi < plan->points; xi++) {
+                        dst[(size_t) xi * in_per_group * ld + tile] = v[xi];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Y = AT M A for every output tile of the chunk plus bias and activation, the tile parts past the output are dropped.
+*/
+static void winograd_outputs_kernel(ConvPlan* plan, layer_cnn* layer, matrix* outputs, int n0, int chunk, GemmEpilogueType epilogue) {
+    const ConvParams* p = &layer->params;
+    int out_per_group = p->out_channels / p->groups;
+    int alpha = plan->tile + 2;
+    int m = plan->tile;
+    int tiles = plan->tiles_h * plan->tiles_w;
+    int ld = plan->products->cols;
+    int out_plane = layer->out_height * layer->out_width;
+    bool relu = (epilogue == GEMM_EPILOGUE_BIAS_RELU);
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int oc = 0; oc < p->out_channels; oc++) {
+        for (int n = 0; n < chunk; n++) {
+            int g = oc / out_per_group;
+            const nn_float* src = plan->products->data + ((size_t) g * plan->points * out_per_group + oc % out_per_group) * ld + (size_t) n * tiles;
+            nn_float* y = outputs->data + (size_t) (n0 + n) * outputs->cols + (size_t) oc * out_plane;
+            nn_float bias = (epilogue != GEMM_EPILOGUE_NONE) ? layer->biases->data[oc] : 0.0;
+
+            for (int th = 0; th < plan->tiles_h; th++) {
+                for (int tw = 0; tw < plan->tiles_w; tw++) {
+                    nn_float mt[6 * 6];
+                    nn_float t[4 * 6];
+                    nn_float out[4 * 4];
+                    int tile = th * plan->tiles_w + tw;
+                    for (int xi = 0; xi < plan->points; xi++) {
+                        mt[xi] = src[(size_t) xi * out_per_group * ld + tile];
+                    }
+                    // AT M by columns, then (AT M) A by rows
+                    for (int j = 0; j < alpha; j++) {
+                        wino_output_1d(mt + j, alpha, t + j, alpha, m);
+                    }
+                    for (int i = 0; i < m; i++) {
+                        wino_output_1d(t + i * alpha, 1, out + i * m, 1, m);
+                    }
+
+                    for (int i = 0; i < m && th * m + i < layer->out_height; i++) {
+                        for (int j = 0; j < m && tw * m + j < layer->out_width; j++) {
+                            nn_float z = out[i * m + j] + bias;
+                            y[(th * m + i) * layer->out_width + tw * m + j] = (relu && z < 0.0) ? 0.0 : z;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void winograd_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    ConvPlan* plan = layer->plan;
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int chunk = (inputs->rows < plan->max_chunk) ? inputs->rows : plan->max_chunk;
+
+    fit_plan(plan, p, chunk);
+
+    // Weights only change with an optimizer step, inference reuses the transform
+    if (!plan->weights_ready) {
+        PARALLEL_CALL(winograd_weights_kernel(plan, layer));
+        #pragma omp single
+        plan->weights_ready = true;
+    }
+
+    int ld = plan->inputs->cols;
+    for (int n0 = 0; n0 < inputs->rows; n0 += chunk) {
+        int count = (inputs->rows - n0 < chunk) ? inputs->rows - n0 : chunk;
+        int tiles = count * plan->tiles_h * plan->tiles_w;
+        PARALLEL_CALL(winograd_inputs_kernel(plan, layer, inputs, n0, count));
+
+        // Every point of every group is an independent (out x in) * (in x tiles) product
+        for (int g = 0; g < p->groups; g++) {
+            for (int xi = 0; xi < plan->points; xi++) {
+                size_t block = (size_t) g * plan->points + xi;
+                gemm(false, false, out_per_group, tiles, in_per_group, 1.0,
+                     plan->weights->data + block * out_per_group * in_per_group, in_per_group,
+                     plan->inputs->data + block * in_per_group * ld, ld, 0.0,
+                     plan->products->data + block * out_per_group * ld, ld);
+            }
+        }
+
+        PARALLEL_CALL(winograd_outputs_kernel(plan, layer, outputs, n0, count, epilogue));
+    }
+}
+
+//////////////////////////////////////////////////// FFT ///////////////////////////////////////////////////////////////////////////
+
+/*
+In place radix 2 FFT of n (a power of two) complex values, split in re and im.
+tw holds cos then sin of 2 pi k / n, the inverse is unscaled.
+*/
+static void fft(nn_float* re, nn_float* im, int n, const nn_float* tw, bool inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            nn_float tr = re[i];
+            nn_float ti = im[i];
+            re[i] = re[j];
+            im[i] = im[j];
+            re[j] = tr;
+            im[j] = ti;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                nn_float wr = tw[k * step];
+                nn_float wi = inverse ? tw[n / 2 + k * step] : -tw[n / 2 + k * step];
+                int a = i + k;
+                int b = a + half;
+                nn_float tr = re[b] * wr - im[b] * wi;
+                nn_float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+/*
+Half spectrum of a rows x cols image placed at (row_off, col_off) of a zero fft_h x fft_w plane.
+Rows are transformed two at a time as one complex row and split by symmetry, then the fft_w / 2 + 1 kept cols.
+Point u * (fft_w / 2 + 1) + v lands in re[point * stride] and im[point * stride].
+*/
+static void plane_forward(const ConvPlan* plan, const nn_float* src, int rows, int cols, int row_off, int col_off,
+                          nn_float* scratch, nn_float* re, nn_float* im, size_t stride) {
+    int fh = plan->fft_h;
+    int fw = plan->fft_w;
+    int half = fw / 2 + 1;
+    nn_float* pr = scratch;
+    nn_float* pi = pr + plan->points;
+    nn_float* zr = pi + plan->points;
+    nn_float* zi = zr + fw;
+    nn_float* cr = zi + fw;
+    nn_float* ci = cr + fh;
+
+    for (int r = 0; r < fh; r += 2) {
+        int s0 = r - row_off;
+        int s1 = s0 + 1;
+        bool row0 = (s0 >= 0 && s0 < rows);
+        bool row1 = (s1 >= 0 && s1 < rows);
+        if (!row0 && !row1) {
+            memset(pr + r * half, 0, 2 * half * sizeof(nn_float));
+            memset(pi + r * half, 0, 2 * half * sizeof(nn_float));
+            continue;
+        }
+        memset(zr, 0, fw * sizeof(nn_float));
+        memset(zi, 0, fw * sizeof(nn_float));
+        for (int j = 0; j < cols; j++) {
+            zr[col_off + j] = row0 ? src[s0 * cols + j] : 0.0;
+            zi[col_off + j] = row1 ? src[s1 * cols + j] : 0.0;
+        }
+        fft(zr, zi, fw, plan->twiddles + fh, false);
+
+        // Z = A + iB for real rows a and b: A = (Z[k] + conj Z[-k]) / 2, B = (Z[k] - conj Z[-k]) / 2i
+        for (int k = 0; k < half; k++) {
+            int kc = (fw - k) & (fw - 1);
+            pr[r * half + k] = 0.5 * (zr[k] + zr[kc]);
+            pi[r * half + k] = 0.5 * (zi[k] - zi[kc]);
+            pr[(r + 1) * half + k] = 0.5 * (zi[k] + zi[kc]);
+            pi[(r + 1) * half + k] = -0.5 * (zr[k] - zr[kc]);
+        }
+    }
+
+    for (int v = 0; v < half; v++) {
+        for (int u = 0; u < fh; u++) {
+            cr[u] = pr[u * half + v];
+            ci[u] = pi[u * half + v];
+        }
+        fft(cr, ci, fh, plan->twiddles, false);
+        for (int u = 0; u < fh; u++) {
+            re[(size_t) (u * half + v) * stride] = cr[u];
+            im[(size_t) (u * half + v) * stride] = ci[u];
+        }
+    }
+}
+
+/*
+Inverse of plane_forward for a half spectrum read with stride, the top left rows x cols of the plane
+are scaled, biased and activated into dst (leading dim cols). Row pairs are rebuilt as A + iB, one complex inverse each.
+*/
+static void plane_inverse(const ConvPlan* plan, const nn_float* re, const nn_float* im, size_t stride, nn_float* scratch,
+                          int rows, int cols, nn_float* dst, nn_float bias, bool relu) {
+    int fh = plan->fft_h;
+    int fw = plan->fft_w;
+    int half = fw / 2 + 1;
+    nn_float* pr = scratch;
+    nn_float* pi = pr + plan->points;
+    nn_float* zr = pi + plan->points;
+    nn_float* zi = zr + fw;
+    nn_float* cr = zi + fw;
+    nn_float* ci = cr + fh;
+    nn_float scale = 1.0 / ((nn_float) fh * fw);
+
+    for (int v = 0; v < half; v++) {
+        for (int u = 0; u < fh; u++) {
+            cr[u] = re[(size_t) (u * half + v) * stride];
+            ci[u] = im[(size_t) (u * half + v) * stride];
+        }
+        fft(cr, ci, fh, plan->twiddles, true);
+        for (int u = 0; u < fh; u++) {
+            pr[u * half + v] = cr[u];
+            pi[u * half + v] = ci[u];
+        }
+    }
+
+    for (int r = 0; r < rows; r += 2) {
+        const nn_float* ar = pr + r * half;
+        const nn_float* ai = pi + r * half;
+        const nn_float* br = ar + half;
+        const nn_float* bi = ai + half;
+        for (int k = 0; k < fw; k++) {
+            // Rows of real planes are conjugate symmetric, the dropped half mirrors the kept one
+            int kk = (k < half) ? k : fw - k;
+            nn_float sign = (k < half) ? 1.0 : -1.0;
+            zr[k] = ar[kk] - sign * bi[kk];
+            zi[k] = sign * ai[kk] + br[kk];
+        }
+        fft(zr, zi, fw, plan->twiddles + fh, true);
+
+        for (int j = 0; j < cols; j++) {
+            nn_float z = zr[j] * scale + bias;
+            dst[r * cols + j] = (relu && z < 0.0) ? 0.0 : z;
+        }
+        if (r + 1 < rows) {
+            for (int j = 0; j < cols; j++) {
+                nn_float z = zi[j] * scale + bias;
+                dst[(r + 1) * cols + j] = (relu && z < 0.0) ? 0.0 : z;
+            }
+        }
+    }
+}
+
+/*
+Conjugated spectra of every kernel, stored re then im [point][oc][c], the product then computes a correlation.
+*/
+static void fft_weights_kernel(ConvPlan* plan, layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    size_t stride = (size_t) p->out_channels * in_per_group;
+    nn_float* scratch = plan->scratch->data + (size_t) omp_get_thread_num() * plan->scratch->cols;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int oc = 0; oc < p->out_channels; oc++) {
+        for (int c = 0; c < in_per_group; c++) {
+            const nn_float* w = layer->weights->data + (size_t) oc * layer->weights->cols + c * p->kernel_h * p->kernel_w;
+            nn_float* re = plan->weights->data + (size_t) oc * in_per_group + c;
+            nn_float* im = re + plan->points * stride;
+            plane_forward(plan, w, p->kernel_h, p->kernel_w, 0, 0, scratch, re, im, stride);
+            for (int f = 0; f < plan->points; f++) {
+                im[f * stride] = -im[f * stride];
+            }
+        }
+    }
+}
+
+/*
+Spectra of the zero padded input planes of the chunk, stored re then im [point][c][sample].
+*/
+static void fft_inputs_kernel(ConvPlan* plan, layer_cnn* layer, matrix* inputs, int n0, int chunk) {
+    const ConvParams* p = &layer->params;
+    int ld = plan->inputs->cols;
+    size_t stride = (size_t) p->in_channels * ld;
+    nn_float* scratch = plan->scratch->data + (size_t) omp_get_thread_num() * plan->scratch->cols;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int c = 0; c < p->in_channels; c++) {
+        for (int n = 0; n < chunk; n++) {
+            const nn_float* x = inputs->data + (size_t) (n0 + n) * inputs->cols + (size_t) c * p->in_height * p->in_width;
+            nn_float* re = plan->inputs->data + (size_t) c * ld + n;
+            nn_float* im = re + plan->points * stride;
+            plane_forward(plan, x, p->in_height, p->in_width, p->pad_h, p->pad_w, scratch, re, im, stride);
+        }
+    }
+}
+
+/*
+Per point and output channel, Y[n] = sum over the group's channels of conj(W) * X[n], vectorized over the samples.
+*/
+static void fft_products_kernel(ConvPlan* plan, layer_cnn* layer, int chunk) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int ld = plan->inputs->cols;
+    size_t x_im = (size_t) plan->points * p->in_channels * ld;
+    size_t y_im = (size_t) plan->points * p->out_channels * ld;
+    size_t w_im = (size_t) plan->points * p->out_channels * in_per_group;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int f = 0; f < plan->points; f++) {
+        for (int oc = 0; oc < p->out_channels; oc++) {
+            int g = oc / out_per_group;
+            nn_float* yr = plan->products->data + ((size_t) f * p->out_channels + oc) * ld;
+            nn_float* yi = yr + y_im;
+            const nn_float* wr = plan->weights->data + ((size_t) f * p->out_channels + oc) * in_per_group;
+            const nn_float* wi = wr + w_im;
+            for (int n = 0; n < chunk; n++) {
+                yr[n] = 0.0;
+                yi[n] = 0.0;
+            }
+            for (int c = 0; c < in_per_group; c++) {
+                const nn_float* xr = plan->inputs->data + ((size_t) f * p->in_channels + g * in_per_group + c) * ld;
+                const nn_float* xi = xr + x_im;
+                for (int n = 0; n < chunk; n++) {
+                    yr[n] += wr[c] * xr[n] - wi[c] * xi[n];
+                    yi[n] += wr[c] * xi[n] + wi[c] * xr[n];
+                }
+            }
+        }
+    }
+}
+
+/*
+Inverse transforms of the chunk's products into the output planes, with bias and activation.
+*/
+static void fft_outputs_kernel(ConvPlan* plan, layer_cnn* layer, matrix* outputs, int n0, int chunk, GemmEpilogueType epilogue) {
+    const ConvParams* p = &layer->params;
+    int ld = plan->products->cols;
+    size_t stride = (size_t) p->out_channels * ld;
+    int out_plane = layer->out_height * layer->out_width;
+    bool relu = (epilogue == GEMM_EPILOGUE_BIAS_RELU);
+    nn_float* scratch = plan->scratch->data + (size_t) omp_get_thread_num() * plan->scratch->cols;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int oc = 0; oc < p->out_channels; oc++) {
+        for (int n = 0; n < chunk; n++) {
+            const nn_float* re = plan->products->data + (size_t) oc * ld + n;
+            const nn_float* im = re + plan->points * stride;
+            nn_float* y = outputs->data + (size_t) (n0 + n) * outputs->cols + (size_t) oc * out_plane;
+            nn_float bias = (epilogue != GEMM_EPILOGUE_NONE) ? layer->biases->data[oc] : 0.0;
+            plane_inverse(plan, re, im, stride, scratch, layer->out_height, layer->out_width, y, bias, relu);
+        }
+    }
+}
+
+void fft_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    ConvPlan* plan = layer->plan;
+    int chunk = (inputs->rows < plan->max_chunk) ? inputs->rows : plan->max_chunk;
+
+    fit_plan(plan, &layer->params, chunk);
+
+    if (!plan->weights_ready) {
+        PARALLEL_CALL(fft_weights_kernel(plan, layer));
+        #pragma omp single
+        plan->weights_ready = true;
+    }
+
+    for (int n0 = 0; n0 < inputs->rows; n0 += chunk) {
+        int count = (inputs->rows - n0 < chunk) ? inputs->rows - n0 : chunk;
+        PARALLEL_CALL(fft_inputs_kernel(plan, layer, inputs, n0, count));
+        PARALLEL_CALL(fft_products_kernel(plan, layer, count));
+        PARALLEL_CALL(fft_outputs_kernel(plan, layer, outputs, n0, count, epilogue));
+    }
+}
@@ -0,0 +1,462 @@
+#include "layer_batchnorm.h"
+
+layer_batchnorm* init_batchnorm_layer(int channels, int spatial) {
+    if (channels <= 0 || spatial <= 0) {
+        fprintf(stderr, "Error: Channels (%d) and spatial size (%d) must be positive in init batchnorm layer.\n",
+                channels, spatial);
+        exit(1);
+    }
+
+    layer_batchnorm* layer = malloc(sizeof(layer_batchnorm));
+    if (layer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for batchnorm layer struct.\n");
+        exit(1);
+    }
+    layer->channels = channels;
+    layer->spatial = spatial;
+    layer->num_features = channels * spatial;
+    layer->momentum = 0.9; // default
+    layer->epsilon = 1e-5; // default
+    layer->folded = false;
+
+    layer->gamma = allocate_matrix(1, channels);
+    layer->beta = allocate_matrix(1, channels);
+    layer->dgamma = allocate_matrix(1, channels);
+    layer->dbeta = allocate_matrix(1, channels);
+    layer->running_mean = allocate_matrix(1, channels);
+    layer->running_var = allocate_matrix(1, channels);
+    layer->batch_mean = allocate_matrix(1, channels);
+    layer->batch_inv_std = allocate_matrix(1, channels);
+    layer->channel_sums = malloc(2 * channels * sizeof(double));
+    if (layer->channel_sums == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for channel sums in init batchnorm layer.\n");
+        exit(1);
+    }
+    for (int c = 0; c < channels; c++) {
+        layer->gamma->data[c] = 1.0;
+        layer->running_var->data[c] = 1.0;
+    }
+
+    layer->normalized = NULL; // default
+    layer->outputs = NULL; // default
+    layer->dinputs = NULL; // default
+    layer->max_batch = 0; // default, heap allocated buffers
+    layer->is_training = true; // default
+    layer->id = -1; // default
+    return layer;
+}
+
+/*
+Frees the batch buffers unless they are arena slices.
+*/
+static void free_batch_buffers(layer_batchnorm* layer) {
+    if (layer->max_batch > 0) {
+        return;
+    }
+    matrix** buffers[] = {&layer->normalized, &layer->outputs, &layer->dinputs};
+    for (int i = 0; i < 3; i++) {
+        if (*buffers[i] != NULL) {
+            free_matrix(*buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+}
+
+void free_batchnorm_layer(layer_batchnorm* layer) {
+    matrix** params[] = {&layer->gamma, &layer->beta, &layer->dgamma, &layer->dbeta, &layer->running_mean,
+                         &layer->running_var, &layer->batch_mean, &layer->batch_inv_std};
+    for (int i = 0; i < 8; i++) {
+        if (*params[i] != NULL) {
+            free_matrix(*params[i]);
+            *params[i] = NULL;
+        }
+    }
+    free(layer->channel_sums);
+    layer->channel_sums = NULL;
+
+    // Arena bound buffers are freed with the arena
+    free_batch_buffers(layer);
+}
+
+size_t batchnorm_workspace_size(layer_batchnorm* layer, int max_batch) {
+    return 3 * arena_matrix_bytes(max_batch, layer->num_features); // normalized, outputs, dinputs
+}
+
+void bind_batchnorm_workspace(layer_batchnorm* layer, Arena* arena, int max_batch) {
+    // Drop lazily allocated buffers
+    free_batch_buffers(layer);
+
+    layer->normalized = arena_alloc_matrix(arena, max_batch, layer->num_features);
+    layer->outputs = arena_alloc_matrix(arena, max_batch, layer->num_features);
+    layer->dinputs = arena_alloc_matrix(arena, max_batch, layer->num_features);
+    layer->max_batch = max_batch;
+}
+
+//////////////////////////////////////////////////// KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Per channel sums of a and of a * b over the batch, a - shift and b - shift when b is NULL (sum and sum of squares).
+Blocks of BN_BLOCK channels per task stream every row once: contiguous columns for dense features,
+contiguous planes for conv channels. Sums are kept in double, shifting by a sample of the channel keeps
+the sum of squares from cancelling when the mean is large against the spread.
+*/
+static void channel_sums_kernel(layer_batchnorm* layer, const matrix* a, const matrix* b, const nn_float* shift,
+                                double* sums, double* products) {
+    int spatial = layer->spatial;
+    int features = layer->num_features;
+
+    #pragma omp for schedule(static)
+    for (int cb = 0; cb < layer->channels; cb += BN_BLOCK) {
+        int ce = (cb + BN_BLOCK < layer->channels) ? cb + BN_BLOCK : layer->channels;
+        double s[BN_BLOCK] = {0};
+        double p[BN_BLOCK] = {0};
+
+        for (int n = 0; n < a->rows; n++) {
+            const nn_float* a_row = a->data + (size_t) n * features;
+            const nn_float* b_row = (b != NULL) ? b->data + (size_t) n * features : NULL;
+            if (spatial == 1 && b_row != NULL) {
+                for (int c = cb; c < ce; c++) {
+                    s[c - cb] += a_row[c];
+                    p[c - cb] += (double) a_row[c] * b_row[c];
+                }
+                continue;
+            }
+            if (spatial == 1) {
+                for (int c = cb; c < ce; c++) {
+                    double v = a_row[c] - shift[c];
+                    s[c - cb] += v;
+                    p[c - cb] += v * v;
+                }
+                continue;
+            }
+            for (int c = cb; c < ce; c++) {
+                const nn_float* a_seg = a_row + (size_t) c * spatial;
+                double ss = 0;
+                double pp = 0;
+                if (b_row != NULL) {
+                    const nn_float* b_seg = b_row + (size_t) c * spatial;
+                    for (int i = 0; i < spatial; i++) {
+                        ss += a_seg[i];
+                        pp += (double) a_seg[i] * b_seg[i];
+                    }
+                }
+                else {
+                    double k = shift[c];
+                    for (int i = 0; i < spatial; i++) {
+                        double v = a_seg[i] - k;
+                        ss += v;
+                        pp += v * v;
+                    }
+                }
+                s[c - cb] += ss;
+                p[c - cb] += pp;
+            }
+        }
+        for (int c = cb; c < ce; c++) {
+            sums[c] = s[c - cb];
+            products[c] = p[c - cb];
+        }
+    }
+}
+
+/*
+Fills the scale, shift, mean and inv_std of channel c, from the running or the batch statistics.
+*/
+typedef void (*ChannelTerms)(layer_batchnorm* layer, int c, nn_float* scale, nn_float* shift, nn_float* mean,
+                             nn_float* inv_std);
+
+/*
+out = x * scale[c] + shift[c] per channel, and norm = (x - mean[c]) * inv_std[c] when norm is not NULL.
+Tiles of BN_ROWS rows by BN_BLOCK channels, the per channel terms of a tile are computed once into the stack.
+*/
+static void normalize_kernel(layer_batchnorm* layer, const matrix* x, matrix* out, matrix* norm, ChannelTerms terms) {
+    int spatial = layer->spatial;
+    int features = layer->num_features;
+    int row_tiles = (x->rows + BN_ROWS - 1) / BN_ROWS;
+    int channel_tiles = (layer->channels + BN_BLOCK - 1) / BN_BLOCK;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int rt = 0; rt < row_tiles; rt++) {
+        for (int ct = 0; ct < channel_tiles; ct++) {
+            int cb = ct * BN_BLOCK;
+            int ce = (cb + BN_BLOCK < layer->channels) ? cb + BN_BLOCK : layer->channels;
+            int re = (rt * BN_ROWS + BN_ROWS < x->rows) ? rt * BN_ROWS + BN_ROWS : x->rows;
+            nn_float scale[BN_BLOCK];
+            nn_float shift[BN_BLOCK];
+            nn_float mean[BN_BLOCK];
+            nn_float inv_std[BN_BLOCK];
+            for (int c = cb; c < ce; c++) {
+                terms(layer, c, &scale[c - cb], &shift[c - cb], &mean[c - cb], &inv_std[c - cb]);
+            }
+
+            for (int n = rt * BN_ROWS; n < re; n++) {
+                size_t row = (size_t) n * features;
+                if (spatial == 1) {
+                    const nn_float* x_row = x->data + row;
+                    nn_float* out_row = out->data + row;
+                    if (norm != NULL) {
+                        nn_float* norm_row = norm->data + row;
+                        for (int c = cb; c < ce; c++) {
+                            norm_row[c] = (x_row[c] - mean[c - cb]) * inv_std[c - cb];
+                        }
+                    }
+                    for (int c = cb; c < ce; c++) {
+                        out_row[c] = x_row[c] * scale[c - cb] + shift[c - cb];
+                    }
+                    continue;
+                }
+                for (int c = cb; c < ce; c++) {
+                    const nn_float* x_seg = x->data + row + (size_t) c * spatial;
+                    nn_float* out_seg = out->data + row + (size_t) c * spatial;
+                    nn_float sc = scale[c - cb];
+                    nn_float sh = shift[c - cb];
+                    if (norm != NULL) {
+                        nn_float* norm_seg = norm->data + row + (size_t) c * spatial;
+                        nn_float mu = mean[c - cb];
+                        nn_float is = inv_std[c - cb];
+                        for (int i = 0; i < spatial; i++) {
+                            norm_seg[i] = (x_seg[i] - mu) * is;
+                            out_seg[i] = x_seg[i] * sc + sh;
+                        }
+                    }
+                    else {
+                        for (int i = 0; i < spatial; i++) {
+                            out_seg[i] = x_seg[i] * sc + sh;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Scale and shift of the running statistics, an identity once folded.
+*/
+static void running_terms(layer_batchnorm* layer, int c, nn_float* scale, nn_float* shift, nn_float* mean,
+                          nn_float* inv_std) {
+    if (layer->folded) {
+        *scale = 1;
+        *shift = 0;
+        *mean = 0;
+        *inv_std = 1;
+        return;
+    }
+    *mean = layer->running_mean->data[c];
+    *inv_std = 1.0 / sqrt((double) layer->running_var->data[c] + layer->epsilon);
+    *scale = layer->gamma->data[c] * *inv_std;
+    *shift = layer->beta->data[c] - *mean * *scale;
+}
+
+/*
+Scale and shift of the last batch's statistics.
+*/
+static void batch_terms(layer_batchnorm* layer, int c, nn_float* scale, nn_float* shift, nn_float* mean,
+                        nn_float* inv_std) {
+    *mean = layer->batch_mean->data[c];
+    *inv_std = layer->batch_inv_std->data[c];
+    *scale = layer->gamma->data[c] * *inv_std;
+    *shift = layer->beta->data[c] - *mean * *scale;
+}
+
+/*
+Batch statistics from the sums shifted by batch_mean, running statistics updated. One thread, channels are few.
+*/
+static void finish_statistics(layer_batchnorm* layer, const double* sums, const double* squares, int rows) {
+    double count = (double) rows * layer->spatial;
+    for (int c = 0; c < layer->channels; c++) {
+        double d = sums[c] / count;
+        double var = squares[c] / count - d * d;
+        var = (var > 0) ? var : 0;
+        double mean = layer->batch_mean->data[c] + d;
+        layer->batch_mean->data[c] = mean;
+        layer->batch_inv_std->data[c] = 1.0 / sqrt(var + layer->epsilon);
+
+        // Running variance is unbiased, a batch of one count leaves it as is
+        double unbiased = (count > 1) ? var * count / (count - 1) : layer->running_var->data[c];
+        layer->running_mean->data[c] = layer->momentum * layer->running_mean->data[c] + (1 - layer->momentum) * mean;
+        layer->running_var->data[c] = layer->momentum * layer->running_var->data[c] + (1 - layer->momentum) * unbiased;
+    }
+}
+
+/*
+dinputs = gamma * inv_std / m * (m * dy - dbeta - normalized * dgamma) per channel, m values per channel,
+in the same tiles as normalize_kernel.
+*/
+static void input_gradients_kernel(layer_batchnorm* layer, const matrix* dy) {
+    int spatial = layer->spatial;
+    int features = layer->num_features;
+    int row_tiles = (dy->rows + BN_ROWS - 1) / BN_ROWS;
+    int channel_tiles = (layer->channels + BN_BLOCK - 1) / BN_BLOCK;
+    double count = (double) dy->rows * spatial;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int rt = 0; rt < row_tiles; rt++) {
+        for (int ct = 0; ct < channel_tiles; ct++) {
+            int cb = ct * BN_BLOCK;
+            int ce = (cb + BN_BLOCK < layer->channels) ? cb + BN_BLOCK : layer->channels;
+            int re = (rt * BN_ROWS + BN_ROWS < dy->rows) ? rt * BN_ROWS + BN_ROWS : dy->rows;
+
+            // dx = k_dy * dy + k_norm * normalized + k_0
+            nn_float k_dy[BN_BLOCK];
+            nn_float k_norm[BN_BLOCK];
+            nn_float k_0[BN_BLOCK];
+            for (int c = cb; c < ce; c++) {
+                double g = (double) layer->gamma->data[c] * layer->batch_inv_std->data[c];
+                k_dy[c - cb] = g;
+                k_norm[c - cb] = -g * layer->dgamma->data[c] / count;
+                k_0[c - cb] = -g * layer->dbeta->data[c] / count;
+            }
+
+            for (int n = rt * BN_ROWS; n < re; n++) {
+                size_t row = (size_t) n * features;
+                const nn_float* dy_row = dy->data + row;
+                const nn_float* norm_row = layer->normalized->data + row;
+                nn_float* dx_row = layer->dinputs->data + row;
+                if (spatial == 1) {
+                    for (int c = cb; c < ce; c++) {
+                        dx_row[c] = k_dy[c - cb] * dy_row[c] + k_norm[c - cb] * norm_row[c] + k_0[c - cb];
+                    }
+                    continue;
+                }
+                for (int c = cb; c < ce; c++) {
+                    size_t seg = (size_t) c * spatial;
+                    nn_float a = k_dy[c - cb];
+                    nn_float b = k_norm[c - cb];
+                    nn_float z = k_0[c - cb];
+                    for (int i = 0; i < spatial; i++) {
+                        dx_row[seg + i] = a * dy_row[seg + i] + b * norm_row[seg + i] + z;
+                    }
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////// PASSES ///////////////////////////////////////////////////////////////////////////
+
+void batchnorm_inference_forwards(matrix* inputs, layer_batchnorm* layer, matrix* outputs) {
+    if (inputs->cols != layer->num_features || outputs->rows != inputs->rows || outputs->cols != inputs->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch in batchnorm inference forwards.\n");
+        exit(1);
+    }
+    PARALLEL_CALL(normalize_kernel(layer, inputs, outputs, NULL, running_terms));
+}
+
+void batchnorm_forwards(matrix* inputs, layer_batchnorm* layer) {
+    // Check dimensions
+    if (inputs->cols != layer->num_features) {
+        fprintf(stderr, "Error: Dimensionality mismatch in batchnorm forwards, expected %d cols got %d.\n",
+                layer->num_features, inputs->cols);
+        exit(1);
+    }
+
+    if (layer->is_training && layer->folded) {
+        fprintf(stderr, "Error: BatchNorm folded into the preceding layer can not be trained.\n");
+        exit(1);
+    }
+
+    // Size buffers for this batch (workspace slices, or heap buffers reused while the shape is unchanged)
+    // Statistics are shifted by the first sample of each channel, batch_mean holds the shift until they are done
+    #pragma omp single
+    {
+        fit_buffer(&layer->outputs, inputs->rows, inputs->cols, layer->max_batch);
+        if (layer->is_training) {
+            fit_buffer(&layer->normalized, inputs->rows, inputs->cols, layer->max_batch);
+            for (int c = 0; c < layer->channels; c++) {
+                layer->batch_mean->data[c] = inputs->data[(size_t) c * layer->spatial];
+            }
+        }
+    }
+
+    if (!layer->is_training) {
+        PARALLEL_CALL(normalize_kernel(layer, inputs, layer->outputs, NULL, running_terms));
+        return;
+    }
+
+    double* sums = layer->channel_sums;
+    PARALLEL_CALL(channel_sums_kernel(layer, inputs, NULL, layer->batch_mean->data, sums, sums + layer->channels));
+    #pragma omp single
+    finish_statistics(layer, sums, sums + layer->channels, inputs->rows);
+
+    PARALLEL_CALL(normalize_kernel(layer, inputs, layer->outputs, layer->normalized, batch_terms));
+}
+
+void batchnorm_backwards(matrix* input_gradients, layer_batchnorm* layer) {
+    // Check dimensions
+    if (layer->normalized == NULL || layer->normalized->rows != input_gradients->rows ||
+        input_gradients->cols != layer->num_features) {
+        fprintf(stderr, "Error: Dimensionality mismatch in backwards batchnorm.\n");
+        exit(1);
+    }
+
+    #pragma omp single
+    fit_buffer(&layer->dinputs, input_gradients->rows, input_gradients->cols, layer->max_batch);
+
+    // dbeta = sum of dy, dgamma = sum of dy * normalized, both in one pass
+    double* sums = layer->channel_sums;
+    PARALLEL_CALL(channel_sums_kernel(layer, input_gradients, layer->normalized, NULL, sums, sums + layer->channels));
+    #pragma omp single
+    for (int c = 0; c < layer->channels; c++) {
+        layer->dbeta->data[c] = sums[c];
+        layer->dgamma->data[c] = sums[layer->channels + c];
+    }
+
+    PARALLEL_CALL(input_gradients_kernel(layer, input_gradients));
+}
+
+//////////////////////////////////////////////////// FOLDING ///////////////////////////////////////////////////////////////////////////
+
+/*
+Per channel scale gamma / sqrt(var + epsilon) and shift beta - mean * scale of the running statistics.
+*/
+static void fold_terms(layer_batchnorm* bn, int c, double* scale, double* shift) {
+    *scale = bn->gamma->data[c] / sqrt((double) bn->running_var->data[c] + bn->epsilon);
+    *shift = bn->beta->data[c] - bn->running_mean->data[c] * *scale;
+}
+
+void batchnorm_fold_dense(layer_batchnorm* bn, layer_dense* layer) {
+    if (bn->num_features != layer->num_neurons) {
+        fprintf(stderr, "Error: BatchNorm of %d features can not fold into a dense layer of %d neurons.\n",
+                bn->num_features, layer->num_neurons);
+        exit(1);
+    }
+    if (bn->folded) {
+        return;
+    }
+
+    // BN(x W + b) = x (W diag(scale)) + (b * scale + shift), dense features are channels of spatial 1
+    int cols = layer->num_neurons;
+    for (int j = 0; j < cols; j++) {
+        double scale, shift;
+        fold_terms(bn, j, &scale, &shift);
+        layer->biases->data[j] = layer->biases->data[j] * scale + shift;
+        for (int i = 0; i < layer->num_inputs; i++) {
+            layer->weights->data[(size_t) i * cols + j] *= scale;
+        }
+    }
+    bn->folded = true;
+}
+
+void batchnorm_fold_cnn(layer_batchnorm* bn, layer_cnn* layer) {
+    if (bn->channels != layer->params.out_channels || bn->spatial != layer->out_height * layer->out_width) {
+        fprintf(stderr, "Error: BatchNorm of %d x %d features can not fold into a conv layer of %d x %d outputs.\n",
+                bn->channels, bn->spatial, layer->params.out_channels, layer->out_height * layer->out_width);
+        exit(1);
+    }
+    if (bn->folded) {
+        return;
+    }
+
+    int fan_in = layer->weights->cols;
+    for (int oc = 0; oc < bn->channels; oc++) {
+        double scale, shift;
+        fold_terms(bn, oc, &scale, &shift);
+        layer->biases->data[oc] = layer->biases->data[oc] * scale + shift;
+        for (int k = 0; k < fan_in; k++) {
+            layer->weights->data[(size_t) oc * fan_in + k] *= scale;
+        }
+    }
+    cnn_weights_changed(layer);
+    bn->folded = true;
+}
@@ -0,0 +1,990 @@
+#include "layer_cnn.h"
+#include "conv_plan.h"
+
+ConvParams conv_params(int in_channels, int in_height, int in_width, int out_channels, int kernel_size) {
+    ConvParams params;
+    params.in_channels = in_channels;
+    params.in_height = in_height;
+    params.in_width = in_width;
+    params.out_channels = out_channels;
+    params.kernel_h = kernel_size;
+    params.kernel_w = kernel_size;
+    params.stride_h = 1; // default
+    params.stride_w = 1;
+    params.pad_h = 0; // default
+    params.pad_w = 0;
+    params.dilation_h = 1; // default
+    params.dilation_w = 1;
+    params.groups = 1; // default
+    return params;
+}
+
+/*
+Range [*lo, *hi) of the output positions o in [0, out) whose input position offset + o * stride lies in [0, in).
+Lets the kernels drop the padding checks from their inner loops.
+*/
+static inline void valid_range(int offset, int stride, int in, int out, int* lo, int* hi) {
+    int l = (offset >= 0) ? 0 : (-offset + stride - 1) / stride;
+    int h = (in - 1 - offset < 0) ? 0 : (in - 1 - offset) / stride + 1;
+    *lo = (l < out) ? l : out;
+    *hi = (h < out) ? h : out;
+    *hi = (*hi < *lo) ? *lo : *hi;
+}
+
+/*
+Initialize a Conv2D layer running algorithm, init_cnn_layer without the selection.
+*/
+static layer_cnn* create_cnn_layer(ConvParams params, ConvAlgorithm algorithm) {
+    if (params.groups <= 0 || params.in_channels % params.groups != 0 || params.out_channels % params.groups != 0) {
+        fprintf(stderr, "Error: Channels (%d in, %d out) must divide by groups (%d) in init cnn layer.\n",
+                params.in_channels, params.out_channels, params.groups);
+        exit(1);
+    }
+    if (params.stride_h <= 0 || params.stride_w <= 0 || params.dilation_h <= 0 || params.dilation_w <= 0 ||
+        params.pad_h < 0 || params.pad_w < 0) {
+        fprintf(stderr, "Error: Stride and dilation must be positive and padding non negative in init cnn layer.\n");
+        exit(1);
+    }
+
+    // Output size, a kernel spans dilation * (kernel - 1) + 1 input pixels
+    int span_h = params.dilation_h * (params.kernel_h - 1) + 1;
+    int span_w = params.dilation_w * (params.kernel_w - 1) + 1;
+    int out_height = (params.in_height + 2 * params.pad_h - span_h) / params.stride_h + 1;
+    int out_width = (params.in_width + 2 * params.pad_w - span_w) / params.stride_w + 1;
+    if (params.kernel_h <= 0 || params.kernel_w <= 0 || out_height <= 0 || out_width <= 0) {
+        fprintf(stderr, "Error: Kernel (%d x %d) does not fit the padded (%d x %d) input in init cnn layer.\n",
+                params.kernel_h, params.kernel_w, params.in_height, params.in_width);
+        exit(1);
+    }
+
+    layer_cnn* layer = malloc(sizeof(layer_cnn));
+    layer->params = params;
+    layer->out_height = out_height;
+    layer->out_width = out_width;
+    layer->num_inputs = params.in_channels * params.in_height * params.in_width;
+    layer->num_outputs = params.out_channels * out_height * out_width;
+    layer->algorithm = algorithm;
+
+    int fan_in = params.in_channels / params.groups * params.kernel_h * params.kernel_w;
+    layer->weights = allocate_matrix(params.out_channels, fan_in);
+    layer->dweights = allocate_matrix(params.out_channels, fan_in);
+    layer->biases = allocate_matrix(1, params.out_channels);
+    layer->dbiases = allocate_matrix(1, params.out_channels);
+
+    layer->inputs = NULL; // default
+    layer->dinputs = NULL; // default
+    layer->outputs = NULL; // default
+    layer->columns = NULL; // default
+    layer->dcolumns = NULL; // default
+    layer->packed_weights = NULL; // default
+    layer->plan = NULL; // default
+
+    // Output cols each kernel col can reach, so no kernel checks the padding per pixel
+    layer->tap_lo = malloc(params.kernel_w * sizeof(int));
+    layer->tap_hi = malloc(params.kernel_w * sizeof(int));
+    if (layer->tap_lo == NULL || layer->tap_hi == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for tap ranges in init cnn layer.\n");
+        exit(1);
+    }
+    for (int kj = 0; kj < params.kernel_w; kj++) {
+        valid_range(kj * params.dilation_w - params.pad_w, params.stride_w, params.in_width, out_width,
+                    &layer->tap_lo[kj], &layer->tap_hi[kj]);
+    }
+
+    layer->is_training = true; // default
+    layer->useRegularization = false; // default
+    layer->lambda_l1 = 5e-4; // default
+    layer->lambda_l2 = 5e-4; // default
+    layer->id = -1; // default
+
+    // Initialize Weights, same scheme as the dense layers over the receptive field
+    srand(42);
+    for (int i = 0; i < params.out_channels * fan_in; i++) {
+        layer->weights->data[i] = sqrt(1.0 / fan_in) * ((double)rand() / RAND_MAX * 2.0 - 1.0);
+    }
+    return layer;
+}
+
+//////////////////////////////////////////////////// ALGORITHM SELECTION ///////////////////////////////////////////////////////////////////////////
+
+/*
+Algorithm measured for a shape.
+*/
+typedef struct {
+    ConvParams params;
+    ConvAlgorithm algorithm;
+} ConvChoice;
+
+static ConvChoice* choices = NULL;
+static int num_choices = 0;
+static int choices_capacity = 0;
+
+bool conv_algorithm_supported(const ConvParams* params, ConvAlgorithm algorithm) {
+    bool unit = params->stride_h == 1 && params->stride_w == 1 && params->dilation_h == 1 && params->dilation_w == 1;
+    switch (algorithm) {
+        case CONV_IM2COL:
+        case CONV_DIRECT:
+            return true;
+        case CONV_WINOGRAD_2X2:
+        case CONV_WINOGRAD_4X4:
+            return unit && params->kernel_h == 3 && params->kernel_w == 3;
+        case CONV_FFT:
+            // Weight spectra take a padded plane per kernel, bounded so large images fall back to the others
+            return unit && (size_t) 2 * conv_fft_points(params) * params->out_channels * (params->in_channels / params->groups)
+                           <= (size_t) CONV_FFT_WEIGHT_ELEMS;
+        default:
+            return false;
+    }
+}
+
+const char* conv_algorithm_name(ConvAlgorithm algorithm) {
+    switch (algorithm) {
+        case CONV_IM2COL:
+            return "im2col";
+        case CONV_DIRECT:
+            return "direct";
+        case CONV_WINOGRAD_2X2:
+            return "winograd2x2";
+        case CONV_WINOGRAD_4X4:
+            return "winograd4x4";
+        case CONV_FFT:
+            return "fft";
+        default:
+            return "auto";
+    }
+}
+
+void conv_clear_algorithm_cache() {
+    #pragma omp critical(conv_choices)
+    {
+        free(choices);
+        choices = NULL;
+        num_choices = 0;
+        choices_capacity = 0;
+    }
+}
+
+/*
+Fastest of CONV_BENCH_REPS forward passes over CONV_BENCH_BATCH samples, in seconds.
+The first pass is a warm up that builds the plan, the buffers and the transformed weights. The weight transform
+is left out of the timing, it runs once per optimizer step for a whole batch, more samples than the benchmark has.
+An algorithm whose warm up already takes several times the best time so far is not timed further.
+*/
+static double time_algorithm(layer_cnn* layer, matrix* inputs, matrix* outputs, double best_so_far) {
+    double best = DBL_MAX;
+    for (int r = 0; r <= CONV_BENCH_REPS; r++) {
+        double start = omp_get_wtime();
+        cnn_inference_forwards(inputs, layer, outputs, GEMM_EPILOGUE_BIAS);
+        double elapsed = omp_get_wtime() - start;
+        if (r == 0 && elapsed > 4.0 * best_so_far) {
+            return elapsed;
+        }
+        if (r > 0 && elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+ConvAlgorithm conv_select_algorithm(const ConvParams* params) {
+    ConvAlgorithm chosen = CONV_AUTO;
+
+    #pragma omp critical(conv_choices)
+    {
+        for (int i = 0; i < num_choices; i++) {
+            if (memcmp(&choices[i].params, params, sizeof(ConvParams)) == 0) {
+                chosen = choices[i].algorithm;
+                break;
+            }
+        }
+
+        if (chosen == CONV_AUTO) {
+            // Same inputs on every run, the timing only depends on the shape
+            layer_cnn* layer = create_cnn_layer(*params, CONV_IM2COL);
+            matrix* inputs = allocate_matrix(CONV_BENCH_BATCH, layer->num_inputs);
+            matrix* outputs = allocate_matrix(CONV_BENCH_BATCH, layer->num_outputs);
+            for (int i = 0; i < inputs->rows * inputs->cols; i++) {
+                inputs->data[i] = (nn_float) (i % 17) / 8.0 - 1.0;
+            }
+
+            double best = DBL_MAX;
+            ConvAlgorithm candidates[] = {CONV_IM2COL, CONV_DIRECT, CONV_WINOGRAD_2X2, CONV_WINOGRAD_4X4, CONV_FFT};
+            for (int a = 0; a < 5; a++) {
+                if (!conv_algorithm_supported(params, candidates[a])) {
+                    continue;
+                }
+                layer->algorithm = candidates[a];
+                double elapsed = time_algorithm(layer, inputs, outputs, best);
+                if (elapsed < best) {
+                    best = elapsed;
+                    chosen = candidates[a];
+                }
+            }
+            free_cnn_layer(layer);
+            free(layer);
+            free_matrix(inputs);
+            free_matrix(outputs);
+
+            if (num_choices == choices_capacity) {
+                choices_capacity = (choices_capacity == 0) ? 8 : 2 * choices_capacity;
+                choices = realloc(choices, choices_capacity * sizeof(ConvChoice));
+                if (choices == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failure in conv select algorithm.\n");
+                    exit(1);
+                }
+            }
+            choices[num_choices].params = *params;
+            choices[num_choices].algorithm = chosen;
+            num_choices++;
+        }
+    }
+    return chosen;
+}
+
+layer_cnn* init_cnn_layer(ConvParams params) {
+    // Selected first, the benchmark layer reseeds rand and the weights below start from the same seed regardless
+    ConvAlgorithm algorithm = conv_select_algorithm(&params);
+    return create_cnn_layer(params, algorithm);
+}
+
+void free_cnn_layer(layer_cnn* layer) {
+    free_matrix(layer->weights);
+    free_matrix(layer->biases);
+    free_matrix(layer->dweights);
+    free_matrix(layer->dbiases);
+    layer->weights = NULL;
+    layer->biases = NULL;
+    layer->dweights = NULL;
+    layer->dbiases = NULL;
+
+    matrix** buffers[] = {&layer->inputs, &layer->dinputs, &layer->outputs, &layer->columns, &layer->dcolumns,
+                          &layer->packed_weights};
+    for (int i = 0; i < 6; i++) {
+        if (*buffers[i] != NULL) {
+            free_matrix(*buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+    free(layer->tap_lo);
+    free(layer->tap_hi);
+    layer->tap_lo = NULL;
+    layer->tap_hi = NULL;
+
+    if (layer->plan != NULL) {
+        free_conv_plan(layer->plan);
+        layer->plan = NULL;
+    }
+}
+
+void cnn_weights_changed(layer_cnn* layer) {
+    if (layer->plan != NULL) {
+        layer->plan->weights_ready = false;
+    }
+}
+
+//////////////////////////////////////////////////// SHARED KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+True when the direct kernel blocks output channels in registers, false for depthwise and other narrow groups
+where a block would be more than half padding.
+*/
+static bool is_channel_blocked(const ConvParams* p) {
+    return p->out_channels / p->groups >= CONV_OCB / 2;
+}
+
+/*
+True when the unrolled columns of a sample are the sample itself (1x1 kernel, stride 1, no padding).
+*/
+static bool is_pointwise(const ConvParams* p) {
+    return p->kernel_h == 1 && p->kernel_w == 1 && p->stride_h == 1 && p->stride_w == 1 && p->pad_h == 0 && p->pad_w == 0;
+}
+
+/*
+Adds the bias of every output channel plane and applies the epilogue's activation, in place.
+*/
+static void bias_activation_kernel(layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    int plane = layer->out_height * layer->out_width;
+    int channels = layer->params.out_channels;
+    bool bias = (epilogue != GEMM_EPILOGUE_NONE);
+    bool relu = (epilogue == GEMM_EPILOGUE_BIAS_RELU);
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int n = 0; n < outputs->rows; n++) {
+        for (int oc = 0; oc < channels; oc++) {
+            nn_float* y = outputs->data + (size_t) n * outputs->cols + (size_t) oc * plane;
+            nn_float b = bias ? layer->biases->data[oc] : 0.0;
+            for (int i = 0; i < plane; i++) {
+                nn_float z = y[i] + b;
+                y[i] = (relu && z < 0.0) ? 0.0 : z;
+            }
+        }
+    }
+}
+
+/*
+Bias gradients, each thread sums its own channels across the batch, overwriting last step.
+nowait, only the regularization (same schedule) and the optimizer read them.
+*/
+static void bias_gradients_kernel(layer_cnn* layer, matrix* input_gradients) {
+    int plane = layer->out_height * layer->out_width;
+
+    #pragma omp for schedule(static) nowait
+    for (int oc = 0; oc < layer->params.out_channels; oc++) {
+        nn_float sum = 0.0;
+        for (int n = 0; n < input_gradients->rows; n++) {
+            const nn_float* dy = input_gradients->data + (size_t) n * input_gradients->cols + (size_t) oc * plane;
+            for (int i = 0; i < plane; i++) {
+                sum += dy[i];
+            }
+        }
+        layer->dbiases->data[oc] = sum;
+    }
+}
+
+/*
+L2 plus L1 gradient of one parameter (L1 sign is 1 if >= 0, -1 otherwise).
+*/
+static inline nn_float reg_gradient(layer_cnn* layer, nn_float w) {
+    return 2 * layer->lambda_l2 * w + layer->lambda_l1 * (w >= 0.0 ? 1.0 : -1.0);
+}
+
+static void reg_gradients_kernel(layer_cnn* layer) {
+    // dweights are complete (the weight gradient kernels end on a barrier)
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < layer->dweights->rows * layer->dweights->cols; i++) {
+        layer->dweights->data[i] += reg_gradient(layer, layer->weights->data[i]);
+    }
+    // Same static schedule as the bias gradients, each thread only reads the dbiases it summed itself
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < layer->dbiases->cols; i++) {
+        layer->dbiases->data[i] += reg_gradient(layer, layer->biases->data[i]);
+    }
+}
+
+//////////////////////////////////////////////////// IM2COL ///////////////////////////////////////////////////////////////////////////
+
+/*
+Unrolls the receptive fields of one group of one sample, x holds its in_channels / groups planes.
+cols is (in_channels / groups * kernel_h * kernel_w) x (out_height * out_width), row (c, ki, kj) holds
+the input pixel under tap (ki, kj) of channel c for every output pixel, zero in the padding.
+*/
+static void im2col_kernel(layer_cnn* layer, const nn_float* x, nn_float* cols) {
+    const ConvParams* p = &layer->params;
+    int oh_size = layer->out_height;
+    int ow_size = layer->out_width;
+    int taps = p->kernel_h * p->kernel_w;
+    int rows = p->in_channels / p->groups * taps;
+
+    #pragma omp for schedule(static)
+    for (int r = 0; r < rows; r++) {
+        int c = r / taps;
+        int ki = (r % taps) / p->kernel_w;
+        int kj = r % p->kernel_w;
+        const nn_float* plane = x + (size_t) c * p->in_height * p->in_width;
+        nn_float* dst = cols + (size_t) r * oh_size * ow_size;
+
+        int off_w = kj * p->dilation_w - p->pad_w;
+        int lo = layer->tap_lo[kj];
+        int hi = layer->tap_hi[kj];
+
+        for (int oh = 0; oh < oh_size; oh++) {
+            nn_float* out = dst + oh * ow_size;
+            int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+            if (ih < 0 || ih >= p->in_height) {
+                memset(out, 0, ow_size * sizeof(nn_float));
+                continue;
+            }
+            const nn_float* row = plane + (size_t) ih * p->in_width;
+            for (int t = 0; t < lo; t++) {
+                out[t] = 0.0;
+            }
+            if (p->stride_w == 1) {
+                memcpy(out + lo, row + off_w + lo, (hi - lo) * sizeof(nn_float));
+            }
+            else {
+                for (int t = lo; t < hi; t++) {
+                    out[t] = row[off_w + t * p->stride_w];
+                }
+            }
+            for (int t = hi; t < ow_size; t++) {
+                out[t] = 0.0;
+            }
+        }
+    }
+}
+
+/*
+Adds the unrolled column gradients of one group of one sample back onto its input pixels, overwriting dx.
+Threads split the input channels, each owns the planes it writes.
+*/
+static void col2im_kernel(layer_cnn* layer, const nn_float* dcols, nn_float* dx) {
+    const ConvParams* p = &layer->params;
+    int oh_size = layer->out_height;
+    int ow_size = layer->out_width;
+    int plane_size = p->in_height * p->in_width;
+
+    #pragma omp for schedule(static)
+    for (int c = 0; c < p->in_channels / p->groups; c++) {
+        nn_float* plane = dx + (size_t) c * plane_size;
+        memset(plane, 0, plane_size * sizeof(nn_float));
+
+        for (int ki = 0; ki < p->kernel_h; ki++) {
+            for (int kj = 0; kj < p->kernel_w; kj++) {
+                const nn_float* src = dcols + ((size_t) (c * p->kernel_h + ki) * p->kernel_w + kj) * oh_size * ow_size;
+                int off_w = kj * p->dilation_w - p->pad_w;
+                int lo = layer->tap_lo[kj];
+                int hi = layer->tap_hi[kj];
+
+                for (int oh = 0; oh < oh_size; oh++) {
+                    int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                    if (ih < 0 || ih >= p->in_height) {
+                        continue;
+                    }
+                    nn_float* row = plane + (size_t) ih * p->in_width;
+                    const nn_float* g = src + oh * ow_size;
+                    for (int t = lo; t < hi; t++) {
+                        row[off_w + t * p->stride_w] += g[t];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Sizes the shared column buffers, one thread sizes and the team waits at the end of the single.
+*/
+static void fit_columns(layer_cnn* layer, bool gradients) {
+    const ConvParams* p = &layer->params;
+    if (is_pointwise(p)) {
+        return;
+    }
+    int rows = p->in_channels / p->groups * p->kernel_h * p->kernel_w;
+    int cols = layer->out_height * layer->out_width;
+
+    #pragma omp single
+    {
+        resize_matrix(&layer->columns, rows, cols);
+        if (gradients) {
+            resize_matrix(&layer->dcolumns, rows, cols);
+        }
+    }
+}
+
+/*
+Convolution as one GEMM per sample and group, weights of the group (out x depth) times its columns (depth x pixels).
+Pointwise convolutions multiply the sample in place.
+*/
+static void im2col_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int depth = layer->weights->cols;
+    int pixels = layer->out_height * layer->out_width;
+    bool pointwise = is_pointwise(p);
+
+    fit_columns(layer, false);
+
+    for (int n = 0; n < inputs->rows; n++) {
+        for (int g = 0; g < p->groups; g++) {
+            const nn_float* x = inputs->data + (size_t) n * inputs->cols + (size_t) g * in_per_group * p->in_height * p->in_width;
+            const nn_float* cols = x;
+            if (!pointwise) {
+                PARALLEL_CALL(im2col_kernel(layer, x, layer->columns->data));
+                cols = layer->columns->data;
+            }
+            gemm(false, false, out_per_group, pixels, depth, 1.0, layer->weights->data + (size_t) g * out_per_group * depth, depth,
+                 cols, pixels, 0.0, outputs->data + (size_t) n * outputs->cols + (size_t) g * out_per_group * pixels, pixels);
+        }
+    }
+}
+
+/*
+Backward of im2col_forwards. Per sample and group, dW += dY * columns^T and, when input_grads is set,
+dcolumns = W^T * dY folded back onto dX.
+*/
+static void im2col_backwards(matrix* input_gradients, layer_cnn* layer, bool input_grads) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int depth = layer->weights->cols;
+    int pixels = layer->out_height * layer->out_width;
+    int in_plane = p->in_height * p->in_width;
+    bool pointwise = is_pointwise(p);
+
+    fit_columns(layer, input_grads);
+
+    for (int n = 0; n < input_gradients->rows; n++) {
+        for (int g = 0; g < p->groups; g++) {
+            size_t in_offset = (size_t) n * layer->num_inputs + (size_t) g * in_per_group * in_plane;
+            const nn_float* x = layer->inputs->data + in_offset;
+            const nn_float* dy = input_gradients->data + (size_t) n * input_gradients->cols + (size_t) g * out_per_group * pixels;
+            const nn_float* w = layer->weights->data + (size_t) g * out_per_group * depth;
+            nn_float* dw = layer->dweights->data + (size_t) g * out_per_group * depth;
+
+            const nn_float* cols = x;
+            if (!pointwise) {
+                PARALLEL_CALL(im2col_kernel(layer, x, layer->columns->data));
+                cols = layer->columns->data;
+            }
+
+            // The first sample overwrites last step's weight gradients, the rest accumulate
+            gemm(false, true, out_per_group, depth, pixels, 1.0, dy, pixels, cols, pixels, (n == 0) ? 0.0 : 1.0, dw, depth);
+
+            if (input_grads) {
+                nn_float* dx = layer->dinputs->data + in_offset;
+                if (pointwise) {
+                    gemm(true, false, depth, pixels, out_per_group, 1.0, w, depth, dy, pixels, 0.0, dx, pixels);
+                }
+                else {
+                    gemm(true, false, depth, pixels, out_per_group, 1.0, w, depth, dy, pixels, 0.0, layer->dcolumns->data, pixels);
+                    PARALLEL_CALL(col2im_kernel(layer, layer->dcolumns->data, dx));
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////// DIRECT ///////////////////////////////////////////////////////////////////////////
+
+/*
+Packs the weights into blocks of CONV_OCB output channels of one group, [block][tap][CONV_OCB],
+so the direct kernel loads the weights of a whole block for a tap as one vector. Channels past the end
+of a group are zero.
+*/
+static void pack_weights_kernel(layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    int out_per_group = p->out_channels / p->groups;
+    int blocks_per_group = (out_per_group + CONV_OCB - 1) / CONV_OCB;
+    int depth = layer->weights->cols;
+
+    #pragma omp for schedule(static)
+    for (int blk = 0; blk < p->groups * blocks_per_group; blk++) {
+        int g = blk / blocks_per_group;
+        int oc0 = g * out_per_group + (blk % blocks_per_group) * CONV_OCB;
+        int nb = ((g + 1) * out_per_group - oc0 < CONV_OCB) ? (g + 1) * out_per_group - oc0 : CONV_OCB;
+        nn_float* dst = layer->packed_weights->data + (size_t) blk * depth * CONV_OCB;
+        for (int tap = 0; tap < depth; tap++) {
+            for (int b = 0; b < CONV_OCB; b++) {
+                dst[tap * CONV_OCB + b] = (b < nb) ? layer->weights->data[(size_t) (oc0 + b) * depth + tap] : 0.0;
+            }
+        }
+    }
+}
+
+// One register block row, the CONV_OCB output channels of a pixel
+typedef nn_float conv_vec __attribute__((vector_size(CONV_OCB * sizeof(nn_float))));
+
+/*
+Direct convolution with bias and activation, output channels blocked in registers.
+Each task is one output row of one sample for a block of CONV_OCB output channels. The row is computed
+CONV_PIX pixels at a time into a CONV_PIX x CONV_OCB register block: for every tap one vector of packed
+weights is multiplied by each pixel's input, broadcast. Pixels whose taps all land inside the input skip the
+padding checks.
+*/
+static void direct_blocked_kernel(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int blocks_per_group = (out_per_group + CONV_OCB - 1) / CONV_OCB;
+    int depth = layer->weights->cols;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int ow_size = layer->out_width;
+    int stride = p->stride_w;
+    bool relu = (epilogue == GEMM_EPILOGUE_BIAS_RELU);
+
+    // Output cols where every kernel col lands inside the input row
+    int interior_lo = 0;
+    int interior_hi = ow_size;
+    for (int kj = 0; kj < p->kernel_w; kj++) {
+        interior_lo = (layer->tap_lo[kj] > interior_lo) ? layer->tap_lo[kj] : interior_lo;
+        interior_hi = (layer->tap_hi[kj] < interior_hi) ? layer->tap_hi[kj] : interior_hi;
+    }
+
+    #pragma omp for collapse(3) schedule(static)
+    for (int n = 0; n < inputs->rows; n++) {
+        for (int blk = 0; blk < p->groups * blocks_per_group; blk++) {
+            for (int oh = 0; oh < layer->out_height; oh++) {
+                int g = blk / blocks_per_group;
+                int oc0 = g * out_per_group + (blk % blocks_per_group) * CONV_OCB;
+                int nb = ((g + 1) * out_per_group - oc0 < CONV_OCB) ? (g + 1) * out_per_group - oc0 : CONV_OCB;
+                const nn_float* x = inputs->data + (size_t) n * inputs->cols + (size_t) g * in_per_group * in_plane;
+                const nn_float* wp = layer->packed_weights->data + (size_t) blk * depth * CONV_OCB;
+                nn_float* y = outputs->data + (size_t) n * outputs->cols + (size_t) oc0 * out_plane + oh * ow_size;
+
+                conv_vec bias = {0};
+                for (int b = 0; b < nb && epilogue != GEMM_EPILOGUE_NONE; b++) {
+                    bias[b] = layer->biases->data[oc0 + b];
+                }
+
+                for (int ow0 = 0; ow0 < ow_size; ow0 += CONV_PIX) {
+                    bool interior = (ow0 >= interior_lo && ow0 + CONV_PIX <= interior_hi);
+                    conv_vec acc[CONV_PIX];
+                    for (int q = 0; q < CONV_PIX; q++) {
+                        acc[q] = bias;
+                    }
+
+                    for (int c = 0; c < in_per_group; c++) {
+                        for (int ki = 0; ki < p->kernel_h; ki++) {
+                            int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                            if (ih < 0 || ih >= p->in_height) {
+                                continue;
+                            }
+                            const nn_float* row = x + (size_t) c * in_plane + (size_t) ih * p->in_width;
+                            const nn_float* wt = wp + (size_t) (c * p->kernel_h + ki) * p->kernel_w * CONV_OCB;
+
+                            for (int kj = 0; kj < p->kernel_w; kj++) {
+                                conv_vec wv;
+                                memcpy(&wv, wt + kj * CONV_OCB, sizeof(conv_vec)); // packed rows are not aligned
+                                const nn_float* xr = row + ow0 * stride - p->pad_w + kj * p->dilation_w;
+                                nn_float xv[CONV_PIX];
+                                if (interior) {
+                                    for (int q = 0; q < CONV_PIX; q++) {
+                                        xv[q] = xr[q * stride];
+                                    }
+                                }
+                                else {
+                                    for (int q = 0; q < CONV_PIX; q++) {
+                                        int ow = ow0 + q;
+                                        xv[q] = (ow >= layer->tap_lo[kj] && ow < layer->tap_hi[kj]) ? xr[q * stride] : 0.0;
+                                    }
+                                }
+                                for (int q = 0; q < CONV_PIX; q++) {
+                                    acc[q] += wv * xv[q];
+                                }
+                            }
+                        }
+                    }
+
+                    int np = (ow_size - ow0 < CONV_PIX) ? ow_size - ow0 : CONV_PIX;
+                    for (int b = 0; b < nb; b++) {
+                        for (int q = 0; q < np; q++) {
+                            nn_float z = acc[q][b];
+                            y[(size_t) b * out_plane + ow0 + q] = (relu && z < 0.0) ? 0.0 : z;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Direct convolution with bias and activation for depthwise and other narrow groups, where a block of output
+channels would be mostly padding. Each task is one output channel of one sample, computed in CONV_TILE wide
+strips of an output row: every tap adds its weight times a contiguous input segment (stride 1), which vectorizes.
+*/
+static void direct_depthwise_kernel(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int depth = layer->weights->cols;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int ow_size = layer->out_width;
+    bool relu = (epilogue == GEMM_EPILOGUE_BIAS_RELU);
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int n = 0; n < inputs->rows; n++) {
+        for (int oc = 0; oc < p->out_channels; oc++) {
+            int g = oc / out_per_group;
+            const nn_float* x = inputs->data + (size_t) n * inputs->cols + (size_t) g * in_per_group * in_plane;
+            const nn_float* w = layer->weights->data + (size_t) oc * depth;
+            nn_float* y = outputs->data + (size_t) n * outputs->cols + (size_t) oc * out_plane;
+            nn_float bias = (epilogue != GEMM_EPILOGUE_NONE) ? layer->biases->data[oc] : 0.0;
+            nn_float acc[CONV_TILE];
+
+            for (int oh = 0; oh < layer->out_height; oh++) {
+                for (int ow0 = 0; ow0 < ow_size; ow0 += CONV_TILE) {
+                    int tile = (ow_size - ow0 < CONV_TILE) ? ow_size - ow0 : CONV_TILE;
+                    for (int t = 0; t < tile; t++) {
+                        acc[t] = bias;
+                    }
+
+                    for (int c = 0; c < in_per_group; c++) {
+                        for (int ki = 0; ki < p->kernel_h; ki++) {
+                            int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                            if (ih < 0 || ih >= p->in_height) {
+                                continue;
+                            }
+                            const nn_float* row = x + (size_t) c * in_plane + (size_t) ih * p->in_width;
+                            for (int kj = 0; kj < p->kernel_w; kj++) {
+                                nn_float wv = w[(c * p->kernel_h + ki) * p->kernel_w + kj];
+                                int off = ow0 * p->stride_w - p->pad_w + kj * p->dilation_w;
+                                int lo = layer->tap_lo[kj] - ow0;
+                                int hi = layer->tap_hi[kj] - ow0;
+                                lo = (lo < 0) ? 0 : lo;
+                                hi = (hi > tile) ? tile : hi;
+                                if (p->stride_w == 1) {
+                                    for (int t = lo; t < hi; t++) {
+                                        acc[t] += wv * row[off + t];
+                                    }
+                                }
+                                else {
+                                    for (int t = lo; t < hi; t++) {
+                                        acc[t] += wv * row[off + t * p->stride_w];
+                                    }
+                                }
+                            }
+                        }
+                    }
+
+                    nn_float* out = y + oh * ow_size + ow0;
+                    for (int t = 0; t < tile; t++) {
+                        out[t] = (relu && acc[t] < 0.0) ? 0.0 : acc[t];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Direct forward, channel blocked or per channel.
+*/
+static void direct_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    const ConvParams* p = &layer->params;
+    if (!is_channel_blocked(p)) {
+        PARALLEL_CALL(direct_depthwise_kernel(inputs, layer, outputs, epilogue));
+        return;
+    }
+
+    int blocks = p->groups * ((p->out_channels / p->groups + CONV_OCB - 1) / CONV_OCB);
+    #pragma omp single
+    resize_matrix(&layer->packed_weights, blocks * layer->weights->cols, CONV_OCB);
+
+    PARALLEL_CALL(pack_weights_kernel(layer));
+    PARALLEL_CALL(direct_blocked_kernel(inputs, layer, outputs, epilogue));
+}
+
+/*
+Direct weight gradients, dW[oc][c][ki][kj] = sum over the batch of dY[oc] . (X[c] shifted by the tap).
+Each task owns the kernel of one (output channel, input channel) pair.
+*/
+static void direct_weight_grads_kernel(matrix* input_gradients, layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int depth = layer->weights->cols;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int ow_size = layer->out_width;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int oc = 0; oc < p->out_channels; oc++) {
+        for (int c = 0; c < in_per_group; c++) {
+            int g = oc / out_per_group;
+            nn_float* dw = layer->dweights->data + (size_t) oc * depth + (size_t) c * p->kernel_h * p->kernel_w;
+
+            for (int ki = 0; ki < p->kernel_h; ki++) {
+                for (int kj = 0; kj < p->kernel_w; kj++) {
+                    int off = kj * p->dilation_w - p->pad_w;
+                    int lo = layer->tap_lo[kj];
+                    int hi = layer->tap_hi[kj];
+                    nn_float sum = 0.0;
+
+                    for (int n = 0; n < input_gradients->rows; n++) {
+                        const nn_float* x = layer->inputs->data + (size_t) n * layer->num_inputs + (size_t) (g * in_per_group + c) * in_plane;
+                        const nn_float* dy = input_gradients->data + (size_t) n * input_gradients->cols + (size_t) oc * out_plane;
+                        for (int oh = 0; oh < layer->out_height; oh++) {
+                            int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                            if (ih < 0 || ih >= p->in_height) {
+                                continue;
+                            }
+                            const nn_float* row = x + (size_t) ih * p->in_width;
+                            const nn_float* g_row = dy + oh * ow_size;
+                            for (int t = lo; t < hi; t++) {
+                                sum += g_row[t] * row[off + t * p->stride_w];
+                            }
+                        }
+                    }
+                    dw[ki * p->kernel_w + kj] = sum;
+                }
+            }
+        }
+    }
+}
+
+/*
+Direct input gradients, every tap of every output channel of the group scatters dY back onto dX.
+Each task owns one input channel plane of one sample.
+*/
+static void direct_input_grads_kernel(matrix* input_gradients, layer_cnn* layer) {
+    const ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    int depth = layer->weights->cols;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int ow_size = layer->out_width;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int n = 0; n < input_gradients->rows; n++) {
+        for (int ci = 0; ci < p->in_channels; ci++) {
+            int g = ci / in_per_group;
+            int c = ci % in_per_group;
+            nn_float* dx = layer->dinputs->data + (size_t) n * layer->num_inputs + (size_t) ci * in_plane;
+            memset(dx, 0, in_plane * sizeof(nn_float));
+
+            for (int oc = g * out_per_group; oc < (g + 1) * out_per_group; oc++) {
+                const nn_float* dy = input_gradients->data + (size_t) n * input_gradients->cols + (size_t) oc * out_plane;
+                const nn_float* w = layer->weights->data + (size_t) oc * depth + (size_t) c * p->kernel_h * p->kernel_w;
+
+                for (int ki = 0; ki < p->kernel_h; ki++) {
+                    for (int kj = 0; kj < p->kernel_w; kj++) {
+                        nn_float wv = w[ki * p->kernel_w + kj];
+                        int off = kj * p->dilation_w - p->pad_w;
+                        int lo = layer->tap_lo[kj];
+                        int hi = layer->tap_hi[kj];
+
+                        for (int oh = 0; oh < layer->out_height; oh++) {
+                            int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                            if (ih < 0 || ih >= p->in_height) {
+                                continue;
+                            }
+                            nn_float* row = dx + (size_t) ih * p->in_width;
+                            const nn_float* g_row = dy + oh * ow_size;
+                            if (p->stride_w == 1) {
+                                for (int t = lo; t < hi; t++) {
+                                    row[off + t] += wv * g_row[t];
+                                }
+                            }
+                            else {
+                                for (int t = lo; t < hi; t++) {
+                                    row[off + t * p->stride_w] += wv * g_row[t];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////// PASSES ///////////////////////////////////////////////////////////////////////////
+
+/*
+Copies the batch into the cached layer inputs.
+nowait, nothing reads the cache before the backward pass.
+*/
+static void cache_inputs_kernel(matrix* cache, matrix* inputs) {
+    int n = inputs->rows * inputs->cols;
+
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; i++) {
+        cache->data[i] = inputs->data[i];
+    }
+}
+
+void cnn_inference_forwards(matrix* inputs, layer_cnn* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    if (inputs->cols != layer->num_inputs || outputs->rows != inputs->rows || outputs->cols != layer->num_outputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in cnn inference forwards.\n");
+        exit(1);
+    }
+
+    if (!conv_algorithm_supported(&layer->params, layer->algorithm)) {
+        fprintf(stderr, "Error: Algorithm %s does not support this shape in cnn inference forwards.\n",
+                conv_algorithm_name(layer->algorithm));
+        exit(1);
+    }
+
+    if (layer->algorithm == CONV_WINOGRAD_2X2 || layer->algorithm == CONV_WINOGRAD_4X4 || layer->algorithm == CONV_FFT) {
+        // Plans are built for the algorithm they serve, switching algorithms rebuilds it
+        #pragma omp single
+        if (layer->plan == NULL || layer->plan->algorithm != layer->algorithm) {
+            if (layer->plan != NULL) {
+                free_conv_plan(layer->plan);
+            }
+            layer->plan = init_conv_plan(layer);
+        }
+
+        if (layer->algorithm == CONV_FFT) {
+            fft_forwards(inputs, layer, outputs, epilogue);
+        }
+        else {
+            winograd_forwards(inputs, layer, outputs, epilogue);
+        }
+    }
+    else if (layer->algorithm == CONV_DIRECT) {
+        // Bias and activation applied per register block
+        direct_forwards(inputs, layer, outputs, epilogue);
+    }
+    else {
+        im2col_forwards(inputs, layer, outputs);
+        PARALLEL_CALL(bias_activation_kernel(layer, outputs, epilogue));
+    }
+}
+
+void cnn_forwards(matrix* inputs, layer_cnn* layer) {
+    // Check dimensions
+    if (inputs->cols != layer->num_inputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in cnn forwards, expected %d cols got %d.\n",
+                layer->num_inputs, inputs->cols);
+        exit(1);
+    }
+
+    // Size buffers for this batch, one thread sizes, the rest of the team waits at the end of the single
+    #pragma omp single
+    {
+        resize_matrix(&layer->outputs, inputs->rows, layer->num_outputs);
+        if (layer->is_training) {
+            resize_matrix(&layer->inputs, inputs->rows, inputs->cols);
+        }
+    }
+
+    // Cache layer inputs for the backward pass
+    if (layer->is_training) {
+        PARALLEL_CALL(cache_inputs_kernel(layer->inputs, inputs));
+    }
+
+    cnn_inference_forwards(inputs, layer, layer->outputs, GEMM_EPILOGUE_BIAS);
+}
+
+/*
+Shared body of the backward passes, input_grads false skips the input gradients.
+*/
+static void cnn_backwards_impl(matrix* input_gradients, layer_cnn* layer, bool input_grads) {
+    // Check dimensions
+    if (layer->inputs == NULL || layer->inputs->rows != input_gradients->rows || input_gradients->cols != layer->num_outputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in backwards cnn.\n");
+        exit(1);
+    }
+
+    // Size input gradients for this batch, the weights change after a backward pass
+    #pragma omp single
+    {
+        if (input_grads) {
+            resize_matrix(&layer->dinputs, input_gradients->rows, layer->num_inputs);
+        }
+        cnn_weights_changed(layer);
+    }
+
+    // Weight (and input) gradients, the direct kernels only pay off where the forward is not channel blocked
+    if (layer->algorithm == CONV_DIRECT && !is_channel_blocked(&layer->params)) {
+        PARALLEL_CALL(direct_weight_grads_kernel(input_gradients, layer));
+        if (input_grads) {
+            PARALLEL_CALL(direct_input_grads_kernel(input_gradients, layer));
+        }
+    }
+    else {
+        im2col_backwards(input_gradients, layer, input_grads);
+    }
+
+    // Bias gradients, no barrier, only the regularization and the optimizer read them
+    PARALLEL_CALL(bias_gradients_kernel(layer, input_gradients));
+
+    // Regularization gradients if using
+    if (layer->useRegularization) {
+        PARALLEL_CALL(reg_gradients_kernel(layer));
+    }
+}
+
+void cnn_backwards(matrix* input_gradients, layer_cnn* layer) {
+    cnn_backwards_impl(input_gradients, layer, true);
+}
+
+void cnn_param_backwards(matrix* input_gradients, layer_cnn* layer) {
+    cnn_backwards_impl(input_gradients, layer, false);
+}
@@ -1,4 +1,5 @@
 #include "layer_dense.h"
+#include "gemm.h"
 
 layer_dense* init_layer(int num_inputs, int num_neurons) {
     layer_dense* layer = malloc(sizeof(layer_dense));
@@ -8,6 +9,13 @@ layer_dense* init_layer(int num_inputs, int num_neurons) {
     layer->inputs = NULL; // default
     layer->dinputs = NULL; // default
     layer->outputs = NULL; // default
+    layer->max_batch = 0; // default, heap allocated batch buffers
+    layer->quantized = NULL; // default
+    layer->sparse_inputs = false; // default
+    layer->sparse_batch = NULL;
+    layer->sparse_batch_t = NULL;
+    layer->active_rows = NULL;
+    layer->num_active_rows = 0;
 
     layer->weights = allocate_matrix(num_inputs, num_neurons);
     layer->dweights = allocate_matrix(num_inputs, num_neurons);
@@ -15,6 +23,7 @@ layer_dense* init_layer(int num_inputs, int num_neurons) {
     layer->biases = allocate_matrix(1, num_neurons);
     layer->dbiases = allocate_matrix(1, num_neurons);
 
+    layer->is_training = true; // default
     layer->useRegularization = false; // default
     layer->lambda_l1 = 5e-4; // default
     layer->lambda_l2 = 5e-4; // default
@@ -45,6 +54,17 @@ void free_layer(layer_dense* layer) {
     free(layer->biases);
     layer->biases = NULL;
 
+    if (layer->quantized != NULL) {
+        free_quantized_dense(layer->quantized);
+        layer->quantized = NULL;
+    }
+    if (layer->sparse_batch_t != NULL) {
+        free_sparse_matrix(layer->sparse_batch_t);
+        layer->sparse_batch_t = NULL;
+    }
+    free(layer->active_rows);
+    layer->active_rows = NULL;
+
     // Free dweights
     if (layer->dweights != NULL) {
         free(layer->dweights->data);
@@ -59,6 +79,47 @@ void free_layer(layer_dense* layer) {
         layer->dbiases = NULL;
     }
 
+    // Free batch buffers, arena bound buffers are freed with the arena
+    if (layer->max_batch == 0) {
+        if (layer->inputs != NULL) {
+            free_matrix(layer->inputs);
+        }
+        if (layer->dinputs != NULL) {
+            free_matrix(layer->dinputs);
+        }
+        if (layer->outputs != NULL) {
+            free_matrix(layer->outputs);
+        }
+    }
+    layer->inputs = NULL;
+    layer->dinputs = NULL;
+    layer->outputs = NULL;
+}
+
+size_t dense_workspace_size(layer_dense* layer, int max_batch, bool outputs) {
+    size_t input_bytes = layer->sparse_inputs ? 0 : 2 * arena_matrix_bytes(max_batch, layer->num_inputs); // inputs, dinputs
+    return input_bytes + (outputs ? arena_matrix_bytes(max_batch, layer->num_neurons) : 0);
+}
+
+void bind_dense_workspace(layer_dense* layer, Arena* arena, int max_batch, bool outputs) {
+    // Drop lazily allocated buffers
+    if (layer->max_batch == 0) {
+        if (layer->inputs != NULL) {
+            free_matrix(layer->inputs);
+        }
+        if (layer->dinputs != NULL) {
+            free_matrix(layer->dinputs);
+        }
+        if (layer->outputs != NULL) {
+            free_matrix(layer->outputs);
+        }
+    }
+
+    // A sparse input layer never caches dense inputs nor computes their gradients
+    layer->inputs = layer->sparse_inputs ? NULL : arena_alloc_matrix(arena, max_batch, layer->num_inputs);
+    layer->dinputs = layer->sparse_inputs ? NULL : arena_alloc_matrix(arena, max_batch, layer->num_inputs);
+    layer->outputs = outputs ? arena_alloc_matrix(arena, max_batch, layer->num_neurons) : NULL;
+    layer->max_batch = max_batch;
 }
 
 void clean_memory_forward(layer_dense* layer) {
@@ -77,121 +138,192 @@ void clean_memory_forward(layer_dense* layer) {
     }
 }
 
-void dense_forwards(matrix* inputs, layer_dense* layer) {
-    // Allocate memory for layer input 
-    if (layer->inputs == NULL) {
-        layer->inputs = allocate_matrix(inputs->rows, inputs->cols);
-    } 
+/*
+Copies the batch into the cached layer inputs.
+nowait, nothing reads the cache before the backward pass.
+*/
+static void cache_inputs_kernel(matrix* cache, matrix* inputs) {
+    int n = inputs->rows * inputs->cols;
 
-    // Allocate memory for derivative of inputs
-    if (layer->dinputs == NULL) {
-        layer->dinputs = allocate_matrix(inputs->rows, inputs->cols);
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; i++) {
+        cache->data[i] = inputs->data[i];
     }
+}
 
-    // Copy inputs into layer structure
-    memcpy(layer->inputs->data, inputs->data, layer->inputs->rows * layer->inputs->cols * sizeof(double));
-
-    // Allocate memory for pre activation outputs
-    if (layer->outputs == NULL) {
-        layer->outputs = allocate_matrix(inputs->rows, layer->num_neurons);
+/*
+Shared body of the forwards, caches inputs and runs the GEMM with an epilogue into *outputs.
+*outputs (and *out_dinputs when not NULL) are sized for the batch with out_max_batch.
+Out of training, inputs are not cached and no gradient buffer is sized.
+*/
+static void dense_fused_forwards(matrix* inputs, layer_dense* layer, matrix** outputs, matrix** out_dinputs,
+                                 int out_max_batch, GemmEpilogueType epilogue) {
+    // Check dimensions
+    if (inputs->cols != layer->num_inputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in dense forwards.\n");
+        exit(1);
     }
-    
-    // Calculate Z
-    matrix* mult_matrix = matrix_mult(inputs, layer->weights); // supports parallel
-
-    // Add biases for the layer to the batch output data
-    #pragma omp for collapse(2) schedule(static)
-    for (int i = 0; i < layer->outputs->rows; i++) {
-        // output dim2-> num neurons
-        for (int j = 0; j < layer->outputs->cols; j++) {
-            layer->outputs->data[i * layer->outputs->cols + j] = 
-            mult_matrix->data[i * layer->outputs->cols + j] + layer->biases->data[j];
+
+    // Size buffers for this batch (workspace slices, or heap buffers reused while the shape is unchanged).
+    // One thread sizes, the rest of the team waits at the end of the single.
+    #pragma omp single
+    {
+        fit_buffer(outputs, inputs->rows, layer->num_neurons, out_max_batch);
+        if (layer->is_training) {
+            fit_buffer(&layer->inputs, inputs->rows, inputs->cols, layer->max_batch);
+            fit_buffer(&layer->dinputs, inputs->rows, inputs->cols, layer->max_batch);
+            if (out_dinputs != NULL) {
+                fit_buffer(out_dinputs, inputs->rows, layer->num_neurons, out_max_batch);
+            }
         }
     }
 
-    // Free uneeded memory
-    free_matrix(mult_matrix);}
+    // Cache layer inputs for the backward pass
+    if (layer->is_training) {
+        PARALLEL_CALL(cache_inputs_kernel(layer->inputs, inputs));
+    }
 
-void dense_backwards(matrix* input_gradients, layer_dense* layer) {
-    
-    // Calculate weight gradients
-    matrix* inputs_transposed = transpose_matrix(layer->inputs);
+    dense_inference_forwards(inputs, layer, *outputs, epilogue);
+}
+
+void dense_inference_forwards(matrix* inputs, layer_dense* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    if (inputs->cols != layer->num_inputs || outputs->rows != inputs->rows || outputs->cols != layer->num_neurons) {
+        fprintf(stderr, "Error: Dimensionality mismatch in dense inference forwards.\n");
+        exit(1);
+    }
+
+    // Z = inputs * weights, bias and activation applied per tile
+    GemmEpilogue ep = {epilogue, layer->biases->data};
+    gemm_fused(false, false, inputs->rows, layer->num_neurons, layer->num_inputs, 1.0, inputs->data, inputs->cols,
+               layer->weights->data, layer->weights->cols, 0.0, outputs->data, outputs->cols, &ep);
+}
+
+void dense_quantize(layer_dense* layer, nn_float input_min, nn_float input_max) {
+    if (layer->quantized != NULL) {
+        free_quantized_dense(layer->quantized);
+    }
+    layer->quantized = quantize_weights(layer->weights, input_min, input_max);
+}
 
+void dense_quantized_forwards(matrix* inputs, layer_dense* layer, uint8_t* scratch, matrix* outputs,
+                              GemmEpilogueType epilogue) {
+    if (layer->quantized == NULL) {
+        fprintf(stderr, "Error: Dense layer must be quantized before quantized forwards.\n");
+        exit(1);
+    }
+    if (inputs->cols != layer->num_inputs || outputs->rows != inputs->rows || outputs->cols != layer->num_neurons) {
+        fprintf(stderr, "Error: Dimensionality mismatch in dense quantized forwards.\n");
+        exit(1);
+    }
+
+    bool softmax = (epilogue == GEMM_EPILOGUE_BIAS_SOFTMAX);
+    quantize_inputs(layer->quantized, inputs, scratch);
+    quantized_gemm(layer->quantized, inputs->rows, scratch, layer->biases->data, outputs->data, outputs->cols,
+                   softmax ? GEMM_EPILOGUE_BIAS : epilogue);
+    if (softmax) {
+        softmax_inference_forwards(outputs, outputs);
+    }
+}
+
+void dense_forwards(matrix* inputs, layer_dense* layer) {
+    // Pre activation outputs, biases added per tile
+    dense_fused_forwards(inputs, layer, &layer->outputs, NULL, layer->max_batch, GEMM_EPILOGUE_BIAS);
+}
+
+void dense_relu_forwards(matrix* inputs, layer_dense* layer, ReluParams* relu) {
+    // Only the activation outputs and dinputs are used
+    dense_fused_forwards(inputs, layer, &relu->outputs, &relu->dinputs, relu->max_batch, GEMM_EPILOGUE_BIAS_RELU);
+}
+
+void dense_softmax_forwards(matrix* inputs, layer_dense* layer, SoftMaxParams* softmax) {
+    // Only the activation outputs and dinputs are used
+    dense_fused_forwards(inputs, layer, &softmax->outputs, &softmax->dinputs, softmax->max_batch, GEMM_EPILOGUE_BIAS_SOFTMAX);
+}
+
+/*
+Shared body of the backward passes, input_grads false skips the dinputs GEMM.
+*/
+static void dense_backwards_impl(matrix* input_gradients, layer_dense* layer, bool input_grads) {
+    
     // Check dimensions
-    if(inputs_transposed->cols != input_gradients-> rows) {
+    if(layer->inputs->rows != input_gradients-> rows) {
         fprintf(stderr, "Error: Dimensionality mismatch (inputs transposed backward dense).\n");
         exit(1);
     }
-    layer->dweights = matrix_mult(inputs_transposed, input_gradients); 
-
-    // Calculate bias gradients
-    for (int j = 0; j < layer->dbiases->cols; j++) {
-        for(int i = 0; i < input_gradients->rows; i++) {
-            // sum across rows
-            layer->dbiases->data[j] += input_gradients->data[i * input_gradients->cols + j];
-        }
+    if (input_gradients->cols != layer->weights->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch (weights transposed) in backwards dense.\n");
+        exit(1);
     }
 
+    // Size input gradients for this batch
+    #pragma omp single
+    fit_buffer(&layer->dinputs, input_gradients->rows, layer->num_inputs, layer->max_batch);
+
+    // Calculate weight gradients, inputs^T * input_gradients (inputs read transposed in place)
+    matrix_mult_tn_into(layer->dweights, layer->inputs, input_gradients); 
+
+    // Calculate bias gradients, no barrier, only the regularization and the optimizer read them
+    calculate_bias_gradients(layer, input_gradients);
+
     // Calculate regularization gradients if using
     if (layer->useRegularization) {
         calculate_reg_gradients(layer);
     }
 
-    // Calculate input gradients
-    matrix* weights_transposed = transpose_matrix(layer->weights);
- 
-     // Check dimensions
-    if (input_gradients->cols != weights_transposed->rows) {
-        fprintf(stderr, "Error: Dimensionality mismatch (weights transposed) in backwards dense.\n");
-        exit(1);
+    // Calculate input gradients, input_gradients * weights^T (weights read transposed in place)
+    if (input_grads) {
+        matrix_mult_nt_into(layer->dinputs, input_gradients, layer->weights); // supports parallel
     }
-    layer->dinputs = matrix_mult(input_gradients, weights_transposed); // supports parallel
-    
-    free_matrix(inputs_transposed);
-    free_matrix(weights_transposed);
 }
 
-void calculate_reg_gradients(layer_dense* layer) {
-#ifdef ENABLE_PARALLEL
+void dense_backwards(matrix* input_gradients, layer_dense* layer) {
+    dense_backwards_impl(input_gradients, layer, true);
+}
 
-    // weights
-    #pragma omp for schedule(static)
-    for (int i = 0; i < layer->dweights->rows * layer->dweights->cols; i++) {
-        // L2 gradients
-        layer->dweights->data[i] += 2 * layer->lambda_l2 * layer->weights->data[i];
+void dense_param_backwards(matrix* input_gradients, layer_dense* layer) {
+    dense_backwards_impl(input_gradients, layer, false);
+}
 
-        // L1 gradients (1 if > 0, -1 if < 0)
-        layer->dweights->data[i] += layer->lambda_l1 * (layer->weights->data[i] >= 0.0 ? 1.0 : -1.0);
-    }
-    // biases
-    #pragma omp for schedule(static)
-    for (int i = 0; i < layer->dbiases->rows * layer->dbiases->cols; i++) {
-        // L2 gradients
-        layer->dbiases->data[i] += 2 * layer->lambda_l2 * (layer->biases->data[i]);
+/*
+L2 plus L1 gradient of one parameter (L1 sign is 1 if >= 0, -1 otherwise).
+*/
+static inline nn_float reg_gradient(layer_dense* layer, nn_float w) {
+    return 2 * layer->lambda_l2 * w + layer->lambda_l1 * (w >= 0.0 ? 1.0 : -1.0);
+}
 
-        // L1 gradients (1 if > 0, -1 if < 0)
-        layer->dbiases->data[i] += layer->lambda_l1 * (layer->biases->data[i] >= 0 ? 1.0: -1.0);
-    }
+static void reg_gradients_kernel(layer_dense* layer) {
 
-#else
-    // weights
+    // weights, dweights are complete (the GEMM ends on a barrier)
+    #pragma omp for schedule(static) nowait
     for (int i = 0; i < layer->dweights->rows * layer->dweights->cols; i++) {
-        // L2 gradients
-        layer->dweights->data[i] += 2 * layer->lambda_l2 * layer->weights->data[i];
-
-        // L1 gradients (1 if > 0, -1 if < 0)
-        layer->dweights->data[i] += layer->lambda_l1 * (layer->weights->data[i] >= 0.0 ? 1.0 : -1.0);
+        layer->dweights->data[i] += reg_gradient(layer, layer->weights->data[i]);
     }
-    // biases
-    for (int i = 0; i < layer->dbiases->rows * layer->dbiases->cols; i++) {
-        // L2 gradients
-        layer->dbiases->data[i] += 2 * layer->lambda_l2 * (layer->biases->data[i]);
-
-        // L1 gradients (1 if > 0, -1 if < 0)
-        layer->dbiases->data[i] += layer->lambda_l1 * (layer->biases->data[i] >= 0 ? 1.0: -1.0);
+    // biases, same static schedule over the same cols as the bias gradients,
+    // so each thread only reads the dbiases it summed itself and no barrier is needed
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < layer->dbiases->cols; i++) {
+        layer->dbiases->data[i] += reg_gradient(layer, layer->biases->data[i]);
     }
+}
 
-#endif
+void calculate_reg_gradients(layer_dense* layer) {
+    PARALLEL_CALL(reg_gradients_kernel(layer));
+}
+
+static void bias_gradients_kernel(layer_dense* layer, matrix* input_gradients) {
+    int num_biases = layer->dbiases->cols;
+    int row_gradients = input_gradients->rows;
+    int col_gradients = input_gradients->cols;
+
+    // Each thread sums its own biases across rows, overwriting last step
+    #pragma omp for schedule(static) nowait
+    for (int j = 0; j < num_biases; j++) {
+        nn_float sum = 0.0;
+        for (int i = 0; i < row_gradients; i++) {
+            sum += input_gradients->data[i * col_gradients + j];
+        }
+        layer->dbiases->data[j] = sum;
+    }
 }
 
 void calculate_bias_gradients(layer_dense* layer, matrix* input_gradients) {
@@ -202,40 +334,183 @@ void calculate_bias_gradients(layer_dense* layer, matrix* input_gradients) {
         exit(1);
     }
 
-#ifdef ENABLE_PARALLEL
-    int num_biases = layer->dbiases->cols;
-    int row_gradients = input_gradients->rows;
-    int col_gradients = input_gradients->cols;
+    PARALLEL_CALL(bias_gradients_kernel(layer, input_gradients));
+}
+
+//////////////////////////////////////////////////// SPARSE INPUTS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Shared body of the sparse forwards, like dense_fused_forwards with the CSR batch borrowed instead of copied.
+*/
+static void dense_sparse_fused_forwards(sparse_matrix* inputs, layer_dense* layer, matrix** outputs, matrix** out_dinputs,
+                                        int out_max_batch, GemmEpilogueType epilogue) {
+    // Check dimensions
+    if (inputs->cols != layer->num_inputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in dense sparse forwards.\n");
+        exit(1);
+    }
+
+    #pragma omp single
+    {
+        fit_buffer(outputs, inputs->rows, layer->num_neurons, out_max_batch);
+        if (layer->is_training) {
+            layer->sparse_batch = inputs;
+            if (out_dinputs != NULL) {
+                fit_buffer(out_dinputs, inputs->rows, layer->num_neurons, out_max_batch);
+            }
+        }
+    }
+
+    dense_sparse_inference_forwards(inputs, layer, *outputs, epilogue);
+}
+
+void dense_sparse_inference_forwards(sparse_matrix* inputs, layer_dense* layer, matrix* outputs, GemmEpilogueType epilogue) {
+    if (inputs->cols != layer->num_inputs || outputs->rows != inputs->rows || outputs->cols != layer->num_neurons) {
+        fprintf(stderr, "Error: Dimensionality mismatch in dense sparse inference forwards.\n");
+        exit(1);
+    }
+
+    // Z = inputs * weights, bias and activation applied per row
+    GemmEpilogue ep = {epilogue, layer->biases->data};
+    gemm_sparse(inputs->rows, layer->num_neurons, inputs->row_ptr, inputs->col_idx, inputs->values,
+                layer->weights->data, layer->weights->cols, outputs->data, outputs->cols, &ep);
+}
+
+void dense_sparse_forwards(sparse_matrix* inputs, layer_dense* layer) {
+    dense_sparse_fused_forwards(inputs, layer, &layer->outputs, NULL, layer->max_batch, GEMM_EPILOGUE_BIAS);
+}
+
+void dense_sparse_relu_forwards(sparse_matrix* inputs, layer_dense* layer, ReluParams* relu) {
+    dense_sparse_fused_forwards(inputs, layer, &relu->outputs, &relu->dinputs, relu->max_batch, GEMM_EPILOGUE_BIAS_RELU);
+}
 
-#pragma omp parallel 
-{
-    int thread_id = omp_get_thread_num(); // Get current thread id
-    int total_threads = omp_get_num_threads(); // Get total num threads
-    int rows_per_thread = (num_biases + total_threads - 1) / total_threads; // Get num rows to calc per each thread
-    int start_row = rows_per_thread * thread_id; // Get start row for unique thread
-    int end_row = rows_per_thread * thread_id + rows_per_thread; // Get end row for unique thread
+void dense_sparse_softmax_forwards(sparse_matrix* inputs, layer_dense* layer, SoftMaxParams* softmax) {
+    dense_sparse_fused_forwards(inputs, layer, &softmax->outputs, &softmax->dinputs, softmax->max_batch,
+                                GEMM_EPILOGUE_BIAS_SOFTMAX);
+}
 
-    if (end_row > num_biases) {
-        end_row = num_biases;
+/*
+Regularization gradients of the active weight rows and of every bias.
+*/
+static void sparse_reg_gradients_kernel(layer_dense* layer) {
+    int cols = layer->num_neurons;
+
+    // dweights rows are complete (the GEMM ends on a barrier)
+    #pragma omp for schedule(static) nowait
+    for (int r = 0; r < layer->num_active_rows; r++) {
+        size_t row = (size_t) layer->active_rows[r] * cols;
+        for (int j = 0; j < cols; j++) {
+            layer->dweights->data[row + j] += reg_gradient(layer, layer->weights->data[row + j]);
+        }
     }
+    // Same schedule as the bias gradients, see reg_gradients_kernel
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < layer->dbiases->cols; i++) {
+        layer->dbiases->data[i] += reg_gradient(layer, layer->biases->data[i]);
+    }
+}
 
-    // Calculate bias gradients
-    for (int j = start_row; j < end_row; j++) {
-        for(int i = 0; i < row_gradients; i++) {
-            // sum across rows
-            layer->dbiases->data[j] += input_gradients->data[i * col_gradients + j];
+void dense_sparse_backwards(matrix* input_gradients, layer_dense* layer) {
+    sparse_matrix* inputs = layer->sparse_batch;
+
+    // Check dimensions
+    if (inputs == NULL || inputs->rows != input_gradients->rows || input_gradients->cols != layer->num_neurons) {
+        fprintf(stderr, "Error: Dimensionality mismatch (or no sparse batch) in dense sparse backwards.\n");
+        exit(1);
+    }
+
+    // Transposed batch, its non empty rows are the weight rows the batch selects,
+    // the gradient of every other row is zero
+    #pragma omp single
+    {
+        if (layer->active_rows == NULL) {
+            layer->active_rows = malloc(layer->num_inputs * sizeof(int));
+            if (layer->active_rows == NULL) {
+                fprintf(stderr, "Error: Memory allocation failure for active rows in dense sparse backwards.\n");
+                exit(1);
+            }
         }
+        sparse_transpose_into(&layer->sparse_batch_t, inputs);
+        layer->num_active_rows = sparse_nonempty_rows(layer->sparse_batch_t, layer->active_rows);
+    }
+
+    // Calculate weight gradients of the active rows, inputs^T * input_gradients,
+    // each row summed once from its own nonzeros
+    sparse_matrix_mult_rows_into(layer->dweights, layer->sparse_batch_t, input_gradients, layer->active_rows,
+                                 layer->num_active_rows);
+
+    // Calculate bias gradients, no barrier, only the regularization and the optimizer read them
+    calculate_bias_gradients(layer, input_gradients);
+
+    if (layer->useRegularization) {
+        PARALLEL_CALL(sparse_reg_gradients_kernel(layer));
     }
 }
-#else
 
-    // Calculate bias gradients
-    for (int j = 0; j < layer->dbiases->cols; j++) {
-        for(int i = 0; i < input_gradients->rows; i++) {
-            // sum across rows
-            layer->dbiases->data[j] += input_gradients->data[i * input_gradients->cols + j];
+//////////////////////////////////////////////////// ASYNC BACKWARD ///////////////////////////////////////////////////////////////////////////
+
+#define DENSE_TASK_GRAIN 16 // Fewest neurons / batch rows per task
+
+/*
+Weight, bias and regularization gradients for neurons [begin, end).
+*/
+static void dense_param_grads_task(void* ctx, void* data, int begin, int end) {
+    layer_dense* layer = (layer_dense*) ctx;
+    matrix* input_gradients = (matrix*) data;
+    int cols = input_gradients->cols;
+    nn_float* dweights = layer->dweights->data;
+
+    // dweights[:, begin:end] = inputs^T * input_gradients[:, begin:end]
+    gemm(true, false, layer->num_inputs, end - begin, input_gradients->rows, 1.0, layer->inputs->data, layer->inputs->cols,
+         input_gradients->data + begin, cols, 0.0, dweights + begin, layer->dweights->cols);
+
+    // Bias gradients, sum across rows
+    for (int j = begin; j < end; j++) {
+        nn_float sum = 0.0;
+        for (int i = 0; i < input_gradients->rows; i++) {
+            sum += input_gradients->data[i * cols + j];
         }
+        layer->dbiases->data[j] = sum;
     }
 
-#endif
+    if (layer->useRegularization) {
+        for (int i = 0; i < layer->num_inputs; i++) {
+            for (int j = begin; j < end; j++) {
+                dweights[i * layer->num_neurons + j] += reg_gradient(layer, layer->weights->data[i * layer->num_neurons + j]);
+            }
+        }
+        for (int j = begin; j < end; j++) {
+            layer->dbiases->data[j] += reg_gradient(layer, layer->biases->data[j]);
+        }
+    }
+}
+
+/*
+Input gradients for batch rows [begin, end).
+*/
+static void dense_input_grads_task(void* ctx, void* data, int begin, int end) {
+    layer_dense* layer = (layer_dense*) ctx;
+    matrix* input_gradients = (matrix*) data;
+
+    // dinputs[begin:end, :] = input_gradients[begin:end, :] * weights^T
+    gemm(false, true, end - begin, layer->num_inputs, layer->num_neurons, 1.0,
+         input_gradients->data + (size_t) begin * input_gradients->cols, input_gradients->cols,
+         layer->weights->data, layer->weights->cols, 0.0, layer->dinputs->data + (size_t) begin * layer->num_inputs, layer->num_inputs);
+}
+
+void dense_backwards_async(ThreadPool* pool, TaskGroup* group, matrix* input_gradients, layer_dense* layer, bool input_grads) {
+
+    // Check dimensions
+    if (layer->inputs->rows != input_gradients->rows || input_gradients->cols != layer->num_neurons) {
+        fprintf(stderr, "Error: Dimensionality mismatch in async backwards dense.\n");
+        exit(1);
+    }
+
+    // Size input gradients for this batch before any task touches them
+    fit_buffer(&layer->dinputs, input_gradients->rows, layer->num_inputs, layer->max_batch);
+
+    threadpool_submit_range(pool, group, dense_param_grads_task, layer, input_gradients, 0, layer->num_neurons, DENSE_TASK_GRAIN);
+    if (input_grads) {
+        threadpool_submit_range(pool, group, dense_input_grads_task, layer, input_gradients, 0, input_gradients->rows, DENSE_TASK_GRAIN);
+    }
 }
@@ -0,0 +1,300 @@
+#include "layer_pool.h"
+
+PoolParams pool_params(PoolType type, int channels, int in_height, int in_width, int pool_size) {
+    PoolParams params;
+    params.type = type;
+    params.channels = channels;
+    params.in_height = in_height;
+    params.in_width = in_width;
+    params.pool_h = pool_size;
+    params.pool_w = pool_size;
+    params.stride_h = pool_size; // default, windows tile the input
+    params.stride_w = pool_size;
+    params.pad_h = 0; // default
+    params.pad_w = 0;
+    return params;
+}
+
+layer_pool* init_pool_layer(PoolParams params) {
+    if (params.channels <= 0 || params.pool_h <= 0 || params.pool_w <= 0 || params.stride_h <= 0 || params.stride_w <= 0) {
+        fprintf(stderr, "Error: Channels, window and stride must be positive in init pool layer.\n");
+        exit(1);
+    }
+    // A window always overlaps the input as long as the padding is narrower than it
+    if (params.pad_h < 0 || params.pad_w < 0 || params.pad_h >= params.pool_h || params.pad_w >= params.pool_w) {
+        fprintf(stderr, "Error: Padding (%d x %d) must be non negative and smaller than the window (%d x %d) in init pool layer.\n",
+                params.pad_h, params.pad_w, params.pool_h, params.pool_w);
+        exit(1);
+    }
+
+    int out_height = (params.in_height + 2 * params.pad_h - params.pool_h) / params.stride_h + 1;
+    int out_width = (params.in_width + 2 * params.pad_w - params.pool_w) / params.stride_w + 1;
+    if (params.in_height + 2 * params.pad_h < params.pool_h || params.in_width + 2 * params.pad_w < params.pool_w) {
+        fprintf(stderr, "Error: Window (%d x %d) does not fit the padded (%d x %d) input in init pool layer.\n",
+                params.pool_h, params.pool_w, params.in_height, params.in_width);
+        exit(1);
+    }
+
+    layer_pool* layer = malloc(sizeof(layer_pool));
+    if (layer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for pool layer struct.\n");
+        exit(1);
+    }
+    layer->params = params;
+    layer->out_height = out_height;
+    layer->out_width = out_width;
+    layer->num_inputs = params.channels * params.in_height * params.in_width;
+    layer->num_outputs = params.channels * out_height * out_width;
+
+    // Output cols each window col can reach, so the kernels never check the padding per pixel
+    layer->tap_lo = malloc(params.pool_w * sizeof(int));
+    layer->tap_hi = malloc(params.pool_w * sizeof(int));
+    if (layer->tap_lo == NULL || layer->tap_hi == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for tap ranges in init pool layer.\n");
+        exit(1);
+    }
+    for (int kj = 0; kj < params.pool_w; kj++) {
+        int offset = kj - params.pad_w;
+        int lo = (offset >= 0) ? 0 : (-offset + params.stride_w - 1) / params.stride_w;
+        int hi = (params.in_width - 1 - offset < 0) ? 0 : (params.in_width - 1 - offset) / params.stride_w + 1;
+        layer->tap_lo[kj] = (lo < out_width) ? lo : out_width;
+        layer->tap_hi[kj] = (hi < out_width) ? hi : out_width;
+    }
+
+    layer->outputs = NULL; // default
+    layer->dinputs = NULL; // default
+    layer->argmax = NULL; // default
+    layer->argmax_rows = 0;
+    layer->batch = 0;
+    layer->is_training = true; // default
+    layer->id = -1; // default
+    return layer;
+}
+
+void free_pool_layer(layer_pool* layer) {
+    if (layer->outputs != NULL) {
+        free_matrix(layer->outputs);
+        layer->outputs = NULL;
+    }
+    if (layer->dinputs != NULL) {
+        free_matrix(layer->dinputs);
+        layer->dinputs = NULL;
+    }
+    free(layer->argmax);
+    free(layer->tap_lo);
+    free(layer->tap_hi);
+    layer->argmax = NULL;
+    layer->tap_lo = NULL;
+    layer->tap_hi = NULL;
+    layer->argmax_rows = 0;
+}
+
+//////////////////////////////////////////////////// KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Clips window o of a dimension to the input, [*lo, *hi) are the input positions it covers.
+*/
+static inline void window_range(int o, int stride, int pad, int size, int in, int* lo, int* hi) {
+    int start = o * stride - pad;
+    *lo = (start < 0) ? 0 : start;
+    *hi = (start + size > in) ? in : start + size;
+}
+
+/*
+Pools every plane of the batch into outputs, one plane per iteration.
+Output rows are built in place while the window's input rows stream through in order: per input row and
+window col, one pass over the output cols reachable from it (tap_lo to tap_hi), a strided read the compiler
+vectorizes, so no pixel checks the padding and the output row being built stays in L1.
+argmax (NULL for average pooling and inference) receives the plane offset of each max.
+*/
+static void pool_forwards_kernel(matrix* inputs, layer_pool* layer, matrix* outputs, int* argmax) {
+    PoolParams* p = &layer->params;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int out_w = layer->out_width;
+    int sw = p->stride_w;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int n = 0; n < inputs->rows; n++) {
+        for (int c = 0; c < p->channels; c++) {
+            const nn_float* x = inputs->data + (size_t) n * layer->num_inputs + (size_t) c * in_plane;
+            nn_float* y = outputs->data + (size_t) n * layer->num_outputs + (size_t) c * out_plane;
+            int* idx = (argmax != NULL) ? argmax + (size_t) n * layer->num_outputs + (size_t) c * out_plane : NULL;
+
+            for (int oh = 0; oh < layer->out_height; oh++) {
+                int ih_lo, ih_hi;
+                window_range(oh, p->stride_h, p->pad_h, p->pool_h, p->in_height, &ih_lo, &ih_hi);
+                nn_float* y_row = y + oh * out_w;
+
+                if (p->type == POOL_MAX && idx != NULL) {
+                    // First max wins, windows of NaN or -max values fall back to their first pixel
+                    nn_float* restrict best = y_row;
+                    int* restrict idx_row = idx + oh * out_w;
+                    for (int ow = 0; ow < out_w; ow++) {
+                        int iw_lo, iw_hi;
+                        window_range(ow, sw, p->pad_w, p->pool_w, p->in_width, &iw_lo, &iw_hi);
+                        best[ow] = -NN_FLOAT_MAX;
+                        idx_row[ow] = ih_lo * p->in_width + iw_lo;
+                    }
+                    for (int ih = ih_lo; ih < ih_hi; ih++) {
+                        const nn_float* restrict x_row = x + ih * p->in_width;
+                        for (int kj = 0; kj < p->pool_w; kj++) {
+                            int base = kj - p->pad_w;
+                            int offset = ih * p->in_width + base;
+                            int lo = layer->tap_lo[kj];
+                            int hi = layer->tap_hi[kj];
+                            for (int ow = lo; ow < hi; ow++) {
+                                nn_float v = x_row[ow * sw + base];
+                                bool larger = v > best[ow];
+                                best[ow] = larger ? v : best[ow];
+                                idx_row[ow] = larger ? offset + ow * sw : idx_row[ow];
+                            }
+                        }
+                    }
+                }
+                else if (p->type == POOL_MAX) {
+                    for (int ow = 0; ow < out_w; ow++) {
+                        y_row[ow] = -NN_FLOAT_MAX;
+                    }
+                    for (int ih = ih_lo; ih < ih_hi; ih++) {
+                        const nn_float* x_row = x + ih * p->in_width;
+                        for (int kj = 0; kj < p->pool_w; kj++) {
+                            int base = kj - p->pad_w;
+                            for (int ow = layer->tap_lo[kj]; ow < layer->tap_hi[kj]; ow++) {
+                                nn_float v = x_row[ow * sw + base];
+                                y_row[ow] = (v > y_row[ow]) ? v : y_row[ow];
+                            }
+                        }
+                    }
+                }
+                else {
+                    for (int ow = 0; ow < out_w; ow++) {
+                        y_row[ow] = 0;
+                    }
+                    for (int ih = ih_lo; ih < ih_hi; ih++) {
+                        const nn_float* x_row = x + ih * p->in_width;
+                        for (int kj = 0; kj < p->pool_w; kj++) {
+                            int base = kj - p->pad_w;
+                            for (int ow = layer->tap_lo[kj]; ow < layer->tap_hi[kj]; ow++) {
+                                y_row[ow] += x_row[ow * sw + base];
+                            }
+                        }
+                    }
+                    for (int ow = 0; ow < out_w; ow++) {
+                        int iw_lo, iw_hi;
+                        window_range(ow, sw, p->pad_w, p->pool_w, p->in_width, &iw_lo, &iw_hi);
+                        y_row[ow] /= (nn_float) ((ih_hi - ih_lo) * (iw_hi - iw_lo));
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Input gradients of every plane, zeroed and filled while the plane is in cache.
+Max pooling routes each output gradient to its recorded argmax, average pooling spreads it over the window.
+*/
+static void pool_backwards_kernel(matrix* input_gradients, layer_pool* layer) {
+    PoolParams* p = &layer->params;
+    int in_plane = p->in_height * p->in_width;
+    int out_plane = layer->out_height * layer->out_width;
+    int out_w = layer->out_width;
+    nn_float* grad_row = malloc(out_w * sizeof(nn_float)); // Window averages of one output row, per thread
+    if (grad_row == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in backwards pool.\n");
+        exit(1);
+    }
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int n = 0; n < input_gradients->rows; n++) {
+        for (int c = 0; c < p->channels; c++) {
+            nn_float* dx = layer->dinputs->data + (size_t) n * layer->num_inputs + (size_t) c * in_plane;
+            const nn_float* dy = input_gradients->data + (size_t) n * layer->num_outputs + (size_t) c * out_plane;
+            for (int i = 0; i < in_plane; i++) {
+                dx[i] = 0;
+            }
+
+            if (p->type == POOL_MAX) {
+                const int* idx = layer->argmax + (size_t) n * layer->num_outputs + (size_t) c * out_plane;
+                for (int o = 0; o < out_plane; o++) {
+                    dx[idx[o]] += dy[o];
+                }
+                continue;
+            }
+
+            // Per output row the window averages, then scattered per input row and window col like the forward
+            for (int oh = 0; oh < layer->out_height; oh++) {
+                int ih_lo, ih_hi;
+                window_range(oh, p->stride_h, p->pad_h, p->pool_h, p->in_height, &ih_lo, &ih_hi);
+                nn_float* g = grad_row;
+                for (int ow = 0; ow < out_w; ow++) {
+                    int iw_lo, iw_hi;
+                    window_range(ow, p->stride_w, p->pad_w, p->pool_w, p->in_width, &iw_lo, &iw_hi);
+                    g[ow] = dy[oh * out_w + ow] / (nn_float) ((ih_hi - ih_lo) * (iw_hi - iw_lo));
+                }
+                for (int ih = ih_lo; ih < ih_hi; ih++) {
+                    nn_float* dx_row = dx + ih * p->in_width;
+                    for (int kj = 0; kj < p->pool_w; kj++) {
+                        int base = kj - p->pad_w;
+                        for (int ow = layer->tap_lo[kj]; ow < layer->tap_hi[kj]; ow++) {
+                            dx_row[ow * p->stride_w + base] += g[ow];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(grad_row);
+}
+
+//////////////////////////////////////////////////// PASSES ///////////////////////////////////////////////////////////////////////////
+
+void pool_inference_forwards(matrix* inputs, layer_pool* layer, matrix* outputs) {
+    if (inputs->cols != layer->num_inputs || outputs->rows != inputs->rows || outputs->cols != layer->num_outputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in pool inference forwards.\n");
+        exit(1);
+    }
+    PARALLEL_CALL(pool_forwards_kernel(inputs, layer, outputs, NULL));
+}
+
+void pool_forwards(matrix* inputs, layer_pool* layer) {
+    // Check dimensions
+    if (inputs->cols != layer->num_inputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in pool forwards, expected %d cols got %d.\n",
+                layer->num_inputs, inputs->cols);
+        exit(1);
+    }
+
+    // Size buffers for this batch, the argmax table only grows
+    bool record = layer->is_training && layer->params.type == POOL_MAX;
+    #pragma omp single
+    {
+        resize_matrix(&layer->outputs, inputs->rows, layer->num_outputs);
+        if (record && inputs->rows > layer->argmax_rows) {
+            free(layer->argmax);
+            layer->argmax = malloc((size_t) inputs->rows * layer->num_outputs * sizeof(int));
+            if (layer->argmax == NULL) {
+                fprintf(stderr, "Error: Memory allocation failure for argmax in pool forwards.\n");
+                exit(1);
+            }
+            layer->argmax_rows = inputs->rows;
+        }
+        layer->batch = inputs->rows;
+    }
+
+    PARALLEL_CALL(pool_forwards_kernel(inputs, layer, layer->outputs, record ? layer->argmax : NULL));
+}
+
+void pool_backwards(matrix* input_gradients, layer_pool* layer) {
+    // Check dimensions
+    if (!layer->is_training || input_gradients->rows != layer->batch || input_gradients->cols != layer->num_outputs) {
+        fprintf(stderr, "Error: Dimensionality mismatch in backwards pool.\n");
+        exit(1);
+    }
+
+    #pragma omp single
+    resize_matrix(&layer->dinputs, input_gradients->rows, layer->num_inputs);
+
+    PARALLEL_CALL(pool_backwards_kernel(input_gradients, layer));
+}
@@ -0,0 +1,665 @@
+#include "layer_rnn.h"
+#include "fastmath.h"
+
+//////////////////////////////////////////////////// SEQUENCE BATCHES ///////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    int length;
+    int index;
+} SequenceSlot;
+
+/*
+Longest first, ties keep the caller's order.
+*/
+static int compare_slots(const void* a, const void* b) {
+    const SequenceSlot* x = (const SequenceSlot*) a;
+    const SequenceSlot* y = (const SequenceSlot*) b;
+    if (x->length != y->length) {
+        return (x->length > y->length) ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+SequenceBatch* init_sequence_batch(const int* lengths, int batch) {
+    if (batch <= 0) {
+        fprintf(stderr, "Error: Sequence batch must hold at least one sequence.\n");
+        exit(1);
+    }
+    SequenceSlot* slots = malloc(batch * sizeof(SequenceSlot));
+    SequenceBatch* seq = malloc(sizeof(SequenceBatch));
+    if (slots == NULL || seq == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in init sequence batch.\n");
+        exit(1);
+    }
+    for (int i = 0; i < batch; i++) {
+        if (lengths[i] <= 0) {
+            fprintf(stderr, "Error: Sequence %d has length %d in init sequence batch.\n", i, lengths[i]);
+            exit(1);
+        }
+        slots[i].length = lengths[i];
+        slots[i].index = i;
+    }
+    qsort(slots, batch, sizeof(SequenceSlot), compare_slots);
+
+    seq->batch = batch;
+    seq->num_steps = slots[0].length;
+    seq->lengths = malloc(batch * sizeof(int));
+    seq->order = malloc(batch * sizeof(int));
+    seq->batch_sizes = malloc(seq->num_steps * sizeof(int));
+    seq->offsets = malloc((seq->num_steps + 1) * sizeof(int));
+    if (seq->lengths == NULL || seq->order == NULL || seq->batch_sizes == NULL || seq->offsets == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in init sequence batch.\n");
+        exit(1);
+    }
+    for (int s = 0; s < batch; s++) {
+        seq->lengths[s] = slots[s].length;
+        seq->order[s] = slots[s].index;
+    }
+    free(slots);
+
+    // Slots run longest first, so the sequences running at step t are the first batch_sizes[t]
+    int running = batch;
+    seq->offsets[0] = 0;
+    for (int t = 0; t < seq->num_steps; t++) {
+        while (seq->lengths[running - 1] <= t) {
+            running--;
+        }
+        seq->batch_sizes[t] = running;
+        seq->offsets[t + 1] = seq->offsets[t] + running;
+    }
+    seq->total_rows = seq->offsets[seq->num_steps];
+    return seq;
+}
+
+void free_sequence_batch(SequenceBatch* seq) {
+    free(seq->lengths);
+    free(seq->order);
+    free(seq->batch_sizes);
+    free(seq->offsets);
+    free(seq);
+}
+
+void pack_sequences(SequenceBatch* seq, matrix** sequences, matrix* packed) {
+    int cols = packed->cols;
+    if (packed->rows != seq->total_rows) {
+        fprintf(stderr, "Error: Packed matrix has %d rows for %d packed rows in pack sequences.\n", packed->rows,
+                seq->total_rows);
+        exit(1);
+    }
+    for (int s = 0; s < seq->batch; s++) {
+        matrix* src = sequences[seq->order[s]];
+        if (src->rows != seq->lengths[s] || src->cols != cols) {
+            fprintf(stderr, "Error: Dimensionality mismatch of sequence %d in pack sequences.\n", seq->order[s]);
+            exit(1);
+        }
+        for (int t = 0; t < seq->lengths[s]; t++) {
+            memcpy(packed->data + (size_t) (seq->offsets[t] + s) * cols, src->data + (size_t) t * cols,
+                   cols * sizeof(nn_float));
+        }
+    }
+}
+
+void sequence_last_rows(SequenceBatch* seq, matrix* packed, matrix* last) {
+    if (packed->rows != seq->total_rows || last->rows != seq->batch || last->cols != packed->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch in sequence last rows.\n");
+        exit(1);
+    }
+    int cols = packed->cols;
+    for (int s = 0; s < seq->batch; s++) {
+        int row = seq->offsets[seq->lengths[s] - 1] + s;
+        memcpy(last->data + (size_t) seq->order[s] * cols, packed->data + (size_t) row * cols, cols * sizeof(nn_float));
+    }
+}
+
+void sequence_scatter_last(SequenceBatch* seq, matrix* last, matrix* packed) {
+    if (packed->rows != seq->total_rows || last->rows != seq->batch || last->cols != packed->cols) {
+        fprintf(stderr, "Error: Dimensionality mismatch in sequence scatter last.\n");
+        exit(1);
+    }
+    int cols = packed->cols;
+    memset(packed->data, 0, (size_t) packed->rows * cols * sizeof(nn_float));
+    for (int s = 0; s < seq->batch; s++) {
+        int row = seq->offsets[seq->lengths[s] - 1] + s;
+        memcpy(packed->data + (size_t) row * cols, last->data + (size_t) seq->order[s] * cols, cols * sizeof(nn_float));
+    }
+}
+
+//////////////////////////////////////////////////// LAYER ///////////////////////////////////////////////////////////////////////////
+
+layer_rnn* init_rnn_layer(RnnType type, int num_inputs, int hidden_size) {
+    if (num_inputs <= 0 || hidden_size <= 0) {
+        fprintf(stderr, "Error: Inputs (%d) and hidden size (%d) must be positive in init rnn layer.\n", num_inputs,
+                hidden_size);
+        exit(1);
+    }
+
+    layer_rnn* layer = malloc(sizeof(layer_rnn));
+    if (layer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for rnn layer struct.\n");
+        exit(1);
+    }
+    layer->type = type;
+    layer->num_inputs = num_inputs;
+    layer->hidden_size = hidden_size;
+    layer->gate_size = (type == RNN_LSTM ? 4 : 3) * hidden_size;
+    layer->bptt_steps = 0; // default, whole sequences
+    int num_biases = layer->gate_size + (type == RNN_GRU ? hidden_size : 0);
+
+    layer->weights = allocate_matrix(num_inputs + hidden_size, layer->gate_size);
+    layer->dweights = allocate_matrix(num_inputs + hidden_size, layer->gate_size);
+    layer->biases = allocate_matrix(1, num_biases);
+    layer->dbiases = allocate_matrix(1, num_biases);
+
+    matrix** buffers[] = {&layer->inputs, &layer->gates, &layer->cells, &layer->cell_tanh, &layer->candidate_recurrent,
+                          &layer->hidden_prev, &layer->outputs, &layer->recurrent, &layer->dgates, &layer->drecurrent,
+                          &layer->carry_h, &layer->carry_c, &layer->dinputs};
+    for (int i = 0; i < 13; i++) {
+        *buffers[i] = NULL; // default
+    }
+    layer->packed_recurrent = NULL;
+    layer->packed_recurrent_t = NULL;
+    layer->seq = NULL;
+    layer->is_training = true; // default
+    layer->id = -1; // default
+
+    // Initialize Weights, uniform in +-1 / sqrt(hidden_size) for the input and recurrent weights alike
+    srand(42);
+    double bound = sqrt(1.0 / hidden_size);
+    for (int i = 0; i < layer->weights->rows * layer->weights->cols; i++) {
+        layer->weights->data[i] = bound * ((double)rand() / RAND_MAX * 2.0 - 1.0);
+    }
+    for (int i = 0; i < num_biases; i++) {
+        layer->biases->data[i] = 0.0;
+    }
+
+    // A forget gate open at init lets the cell state and its gradients carry over long sequences
+    if (type == RNN_LSTM) {
+        for (int k = 0; k < hidden_size; k++) {
+            layer->biases->data[hidden_size + k] = 1.0;
+        }
+    }
+    return layer;
+}
+
+void free_rnn_layer(layer_rnn* layer) {
+    matrix** buffers[] = {&layer->weights, &layer->dweights, &layer->biases, &layer->dbiases, &layer->inputs,
+                          &layer->gates, &layer->cells, &layer->cell_tanh, &layer->candidate_recurrent,
+                          &layer->hidden_prev, &layer->outputs, &layer->recurrent, &layer->dgates, &layer->drecurrent,
+                          &layer->carry_h, &layer->carry_c, &layer->dinputs};
+    for (int i = 0; i < 17; i++) {
+        if (*buffers[i] != NULL) {
+            free_matrix(*buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+    if (layer->packed_recurrent != NULL) {
+        free_gemm_packed_b(layer->packed_recurrent);
+        layer->packed_recurrent = NULL;
+    }
+    if (layer->packed_recurrent_t != NULL) {
+        free_gemm_packed_b(layer->packed_recurrent_t);
+        layer->packed_recurrent_t = NULL;
+    }
+    layer->seq = NULL;
+}
+
+//////////////////////////////////////////////////// KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Packed slots [lo, hi) of the calling thread. The same at every step of a pass,
+so each thread runs the whole recurrence of its sequences without waiting on the others.
+*/
+static void thread_slots(int batch, int* lo, int* hi) {
+    int threads = omp_get_num_threads();
+    int id = omp_get_thread_num();
+    *lo = (int) ((long) batch * id / threads);
+    *hi = (int) ((long) batch * (id + 1) / threads);
+}
+
+/*
+Running sequences of the calling thread's slots at step t.
+*/
+static inline int slot_rows(const SequenceBatch* seq, int t, int lo, int hi) {
+    int end = (seq->batch_sizes[t] < hi) ? seq->batch_sizes[t] : hi;
+    return end - lo;
+}
+
+/*
+tanh from the exponential the caller computed, u = exp(-2x).
+*/
+static inline nn_float tanh_from_exp(nn_float u) {
+    return 2.0 / (1.0 + u) - 1.0;
+}
+
+/*
+Copies the batch into the cached layer inputs.
+nowait, nothing reads the cache before the backward pass.
+*/
+static void cache_inputs_kernel(matrix* cache, matrix* inputs) {
+    int n = inputs->rows * inputs->cols;
+
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; i++) {
+        cache->data[i] = inputs->data[i];
+    }
+}
+
+/*
+LSTM gates of rows running sequences from their pre activations z (input projection, plus recurrent the h_prev * W_h
+of the rows unless it is NULL at step 0), and the new cell and hidden states.
+c_prev is NULL at step 0. Every sigmoid and tanh is one exponential, taken for all rows by a single fast_exp call.
+*/
+static void lstm_cells(layer_rnn* layer, int rows, nn_float* z, const nn_float* recurrent, const nn_float* c_prev,
+                       nn_float* cells, nn_float* cell_tanh, nn_float* h) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+
+    // exp(-z) for the sigmoid gates, exp(-2z) for the tanh gate
+    for (int r = 0; r < rows; r++) {
+        nn_float* row = z + (size_t) r * G;
+        const nn_float* rec = (recurrent != NULL) ? recurrent + (size_t) r * G : NULL;
+        for (int k = 0; k < G; k++) {
+            nn_float scale = (k >= 2 * H && k < 3 * H) ? -2.0 : -1.0;
+            row[k] = scale * (rec != NULL ? row[k] + rec[k] : row[k]);
+        }
+    }
+    fast_exp(z, z, rows * G);
+
+    for (int r = 0; r < rows; r++) {
+        nn_float* gi = z + (size_t) r * G;
+        nn_float* gf = gi + H;
+        nn_float* gg = gi + 2 * H;
+        nn_float* go = gi + 3 * H;
+        nn_float* c = cells + (size_t) r * H;
+        nn_float* tc = cell_tanh + (size_t) r * H;
+        const nn_float* cp = (c_prev != NULL) ? c_prev + (size_t) r * H : NULL;
+        for (int k = 0; k < H; k++) {
+            gi[k] = 1.0 / (1.0 + gi[k]);
+            gf[k] = 1.0 / (1.0 + gf[k]);
+            gg[k] = tanh_from_exp(gg[k]);
+            go[k] = 1.0 / (1.0 + go[k]);
+            c[k] = gi[k] * gg[k] + (cp != NULL ? gf[k] * cp[k] : 0.0);
+            tc[k] = -2.0 * c[k];
+        }
+    }
+    fast_exp(cell_tanh, cell_tanh, rows * H);
+
+    for (int r = 0; r < rows; r++) {
+        const nn_float* go = z + (size_t) r * G + 3 * H;
+        nn_float* tc = cell_tanh + (size_t) r * H;
+        nn_float* hr = h + (size_t) r * H;
+        for (int k = 0; k < H; k++) {
+            tc[k] = tanh_from_exp(tc[k]);
+            hr[k] = go[k] * tc[k];
+        }
+    }
+}
+
+/*
+GRU gates and new hidden states of rows running sequences, like lstm_cells.
+h_prev and recurrent are NULL at step 0, candidate receives h_prev * W_hn + b_hn.
+*/
+static void gru_cells(layer_rnn* layer, int rows, nn_float* z, const nn_float* recurrent, const nn_float* h_prev,
+                      nn_float* candidate, nn_float* h) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+    const nn_float* b_hn = layer->biases->data + G;
+
+    for (int r = 0; r < rows; r++) {
+        nn_float* gr = z + (size_t) r * G;
+        nn_float* gz = gr + H;
+        nn_float* gn = gr + 2 * H;
+        const nn_float* rec = (recurrent != NULL) ? recurrent + (size_t) r * G : NULL;
+        nn_float* hn = candidate + (size_t) r * H;
+        nn_float* hr = h + (size_t) r * H;
+        const nn_float* hp = (h_prev != NULL) ? h_prev + (size_t) r * H : NULL;
+
+        // Reset and update gates, exp(-z) of both in one call
+        for (int k = 0; k < 2 * H; k++) {
+            gr[k] = -(rec != NULL ? gr[k] + rec[k] : gr[k]);
+        }
+        fast_exp(gr, gr, 2 * H);
+        for (int k = 0; k < 2 * H; k++) {
+            gr[k] = 1.0 / (1.0 + gr[k]);
+        }
+
+        // Candidate, the reset gate scales its recurrent part only
+        for (int k = 0; k < H; k++) {
+            hn[k] = (rec != NULL ? rec[2 * H + k] : 0.0) + b_hn[k];
+            gn[k] = -2.0 * (gn[k] + gr[k] * hn[k]);
+        }
+        fast_exp(gn, gn, H);
+        for (int k = 0; k < H; k++) {
+            gn[k] = tanh_from_exp(gn[k]);
+            hr[k] = (1.0 - gz[k]) * gn[k] + (hp != NULL ? gz[k] * hp[k] : 0.0);
+        }
+    }
+}
+
+/*
+Forward recurrence over every step, each thread on its own slots.
+Starts with the team packing W_h, ends on a barrier so the outputs are complete on return.
+*/
+static void forward_recurrence_kernel(layer_rnn* layer, const SequenceBatch* seq) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+    const nn_float* w_h = layer->weights->data + (size_t) layer->num_inputs * G;
+    gemm_repack_b(layer->packed_recurrent, w_h, G); // ends on a barrier
+
+    int lo, hi;
+    thread_slots(seq->batch, &lo, &hi);
+    for (int t = 0; t < seq->num_steps; t++) {
+        int rows = slot_rows(seq, t, lo, hi);
+        if (rows <= 0) {
+            break; // Running sequences only shrink
+        }
+        size_t row = seq->offsets[t] + lo;
+        size_t prev = (t > 0) ? seq->offsets[t - 1] + lo : 0;
+        nn_float* z = layer->gates->data + row * G;
+        nn_float* h = layer->outputs->data + row * H;
+        const nn_float* h_prev = (t > 0) ? layer->outputs->data + prev * H : NULL;
+        nn_float* recurrent = NULL;
+
+        // One GEMM for the recurrent part of every gate
+        if (t > 0) {
+            recurrent = layer->recurrent->data + (size_t) lo * G;
+            gemm_small(rows, h_prev, H, layer->packed_recurrent, recurrent, G, NULL);
+        }
+
+        if (layer->type == RNN_LSTM) {
+            const nn_float* c_prev = (t > 0) ? layer->cells->data + prev * H : NULL;
+            lstm_cells(layer, rows, z, recurrent, c_prev, layer->cells->data + row * H, layer->cell_tanh->data + row * H, h);
+        }
+        else {
+            gru_cells(layer, rows, z, recurrent, h_prev, layer->candidate_recurrent->data + row * H, h);
+        }
+
+        // The state each row started from, for the recurrent weight gradients
+        if (layer->is_training) {
+            nn_float* dest = layer->hidden_prev->data + row * H;
+            if (t > 0) {
+                memcpy(dest, h_prev, (size_t) rows * H * sizeof(nn_float));
+            }
+            else {
+                memset(dest, 0, (size_t) rows * H * sizeof(nn_float));
+            }
+        }
+    }
+
+    #pragma omp barrier
+}
+
+/*
+LSTM gate gradients of rows running sequences at step t, dgates receives the pre activation gradients.
+carry_h and carry_c hold the state gradients from step t + 1 (zero where none flows) and receive
+dc * f for step t - 1. c_prev is NULL at step 0.
+*/
+static void lstm_cell_grads(layer_rnn* layer, int rows, const nn_float* dy, const nn_float* gates, const nn_float* c_prev,
+                            const nn_float* cell_tanh, nn_float* carry_h, nn_float* carry_c, nn_float* dgates) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+
+    for (int r = 0; r < rows; r++) {
+        const nn_float* gi = gates + (size_t) r * G;
+        const nn_float* gf = gi + H;
+        const nn_float* gg = gi + 2 * H;
+        const nn_float* go = gi + 3 * H;
+        const nn_float* tc = cell_tanh + (size_t) r * H;
+        const nn_float* cp = (c_prev != NULL) ? c_prev + (size_t) r * H : NULL;
+        const nn_float* dyr = dy + (size_t) r * H;
+        nn_float* dh_next = carry_h + (size_t) r * H;
+        nn_float* dc_next = carry_c + (size_t) r * H;
+        nn_float* di = dgates + (size_t) r * G;
+        nn_float* df = di + H;
+        nn_float* dg = di + 2 * H;
+        nn_float* dout = di + 3 * H;
+
+        for (int k = 0; k < H; k++) {
+            nn_float dh = dyr[k] + dh_next[k];
+            nn_float dc = dh * go[k] * (1.0 - tc[k] * tc[k]) + dc_next[k];
+            di[k] = dc * gg[k] * gi[k] * (1.0 - gi[k]);
+            df[k] = (cp != NULL ? dc * cp[k] : 0.0) * gf[k] * (1.0 - gf[k]);
+            dg[k] = dc * gi[k] * (1.0 - gg[k] * gg[k]);
+            dout[k] = dh * tc[k] * go[k] * (1.0 - go[k]);
+            dc_next[k] = dc * gf[k];
+        }
+    }
+}
+
+/*
+GRU gate gradients, like lstm_cell_grads. dgates receives the input side pre activation gradients,
+drecurrent those of h_prev * W_h (the candidate's scaled by the reset gate).
+carry_c receives the direct h_prev gradient dh * z, h_prev is NULL at step 0.
+*/
+static void gru_cell_grads(layer_rnn* layer, int rows, const nn_float* dy, const nn_float* gates, const nn_float* h_prev,
+                           const nn_float* candidate, nn_float* carry_h, nn_float* carry_c, nn_float* dgates,
+                           nn_float* drecurrent) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+
+    for (int r = 0; r < rows; r++) {
+        const nn_float* gr = gates + (size_t) r * G;
+        const nn_float* gz = gr + H;
+        const nn_float* gn = gr + 2 * H;
+        const nn_float* hn = candidate + (size_t) r * H;
+        const nn_float* hp = (h_prev != NULL) ? h_prev + (size_t) r * H : NULL;
+        const nn_float* dyr = dy + (size_t) r * H;
+        nn_float* dh_next = carry_h + (size_t) r * H;
+        nn_float* direct = carry_c + (size_t) r * H;
+        nn_float* dx = dgates + (size_t) r * G;
+        nn_float* drec = drecurrent + (size_t) r * G;
+
+        for (int k = 0; k < H; k++) {
+            nn_float dh = dyr[k] + dh_next[k];
+            nn_float dn = dh * (1.0 - gz[k]) * (1.0 - gn[k] * gn[k]);
+            nn_float dr = dn * hn[k] * gr[k] * (1.0 - gr[k]);
+            nn_float dz = dh * ((hp != NULL ? hp[k] : 0.0) - gn[k]) * gz[k] * (1.0 - gz[k]);
+            dx[k] = dr;
+            dx[H + k] = dz;
+            dx[2 * H + k] = dn;
+            drec[k] = dr;
+            drec[H + k] = dz;
+            drec[2 * H + k] = dn * gr[k];
+            direct[k] = dh * gz[k];
+        }
+    }
+}
+
+/*
+Backward recurrence from the last step to the first, each thread on its own slots like the forward pass.
+Starts with the team packing W_h^T, ends on a barrier so the gate gradients are complete on return.
+*/
+static void backward_recurrence_kernel(layer_rnn* layer, const SequenceBatch* seq, const matrix* input_gradients) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+    const nn_float* w_h = layer->weights->data + (size_t) layer->num_inputs * G;
+    gemm_repack_bt(layer->packed_recurrent_t, w_h, G); // ends on a barrier
+
+    int lo, hi;
+    thread_slots(seq->batch, &lo, &hi);
+    if (hi > lo) {
+        // No gradient flows into the last step of a sequence
+        memset(layer->carry_h->data + (size_t) lo * H, 0, (size_t) (hi - lo) * H * sizeof(nn_float));
+        memset(layer->carry_c->data + (size_t) lo * H, 0, (size_t) (hi - lo) * H * sizeof(nn_float));
+    }
+
+    for (int t = seq->num_steps - 1; t >= 0; t--) {
+        int rows = slot_rows(seq, t, lo, hi);
+        if (rows <= 0) {
+            continue;
+        }
+        size_t row = seq->offsets[t] + lo;
+        size_t prev = (t > 0) ? seq->offsets[t - 1] + lo : 0;
+        const nn_float* dy = input_gradients->data + row * H;
+        nn_float* carry_h = layer->carry_h->data + (size_t) lo * H;
+        nn_float* carry_c = layer->carry_c->data + (size_t) lo * H;
+        nn_float* dgates = layer->dgates->data + row * G;
+        nn_float* drecurrent = dgates;
+
+        if (layer->type == RNN_LSTM) {
+            const nn_float* c_prev = (t > 0) ? layer->cells->data + prev * H : NULL;
+            lstm_cell_grads(layer, rows, dy, layer->gates->data + row * G, c_prev, layer->cell_tanh->data + row * H,
+                            carry_h, carry_c, dgates);
+        }
+        else {
+            drecurrent = layer->drecurrent->data + row * G;
+            const nn_float* h_prev = (t > 0) ? layer->outputs->data + prev * H : NULL;
+            gru_cell_grads(layer, rows, dy, layer->gates->data + row * G, h_prev,
+                           layer->candidate_recurrent->data + row * H, carry_h, carry_c, dgates, drecurrent);
+        }
+
+        // Truncated at the start of a window, the step before starts with no gradient from this one
+        bool cut = (t == 0) || (layer->bptt_steps > 0 && t % layer->bptt_steps == 0);
+        if (cut) {
+            memset(carry_h, 0, (size_t) rows * H * sizeof(nn_float));
+            memset(carry_c, 0, (size_t) rows * H * sizeof(nn_float));
+            continue;
+        }
+
+        // Gradients of h_prev through every gate in one GEMM
+        gemm_small(rows, drecurrent, G, layer->packed_recurrent_t, carry_h, H, NULL);
+        if (layer->type == RNN_GRU) {
+            for (int i = 0; i < rows * H; i++) {
+                carry_h[i] += carry_c[i];
+            }
+        }
+    }
+
+    #pragma omp barrier
+}
+
+/*
+Bias gradients, the column sums of the gate gradients, plus the GRU candidate's recurrent biases.
+No barrier, only the optimizer reads them.
+*/
+static void bias_gradients_kernel(layer_rnn* layer) {
+    int G = layer->gate_size;
+    int H = layer->hidden_size;
+    int rows = layer->dgates->rows;
+    int num_biases = layer->dbiases->cols;
+
+    #pragma omp for schedule(static) nowait
+    for (int j = 0; j < num_biases; j++) {
+        const matrix* grads = (j < G) ? layer->dgates : layer->drecurrent;
+        int col = (j < G) ? j : 2 * H + j - G;
+        nn_float sum = 0.0;
+        for (int i = 0; i < rows; i++) {
+            sum += grads->data[(size_t) i * G + col];
+        }
+        layer->dbiases->data[j] = sum;
+    }
+}
+
+//////////////////////////////////////////////////// PASSES ///////////////////////////////////////////////////////////////////////////
+
+void rnn_forwards(matrix* inputs, SequenceBatch* seq, layer_rnn* layer) {
+    // Check dimensions
+    if (inputs->cols != layer->num_inputs || inputs->rows != seq->total_rows) {
+        fprintf(stderr, "Error: Dimensionality mismatch in rnn forwards, expected (%d x %d) got (%d x %d).\n",
+                seq->total_rows, layer->num_inputs, inputs->rows, inputs->cols);
+        exit(1);
+    }
+    int R = seq->total_rows;
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+
+    // Size buffers for this batch, one thread sizes, the rest of the team waits at the end of the single
+    #pragma omp single
+    {
+        resize_matrix(&layer->gates, R, G);
+        resize_matrix(&layer->outputs, R, H);
+        resize_matrix(&layer->recurrent, seq->batch, G);
+        if (layer->type == RNN_LSTM) {
+            resize_matrix(&layer->cells, R, H);
+            resize_matrix(&layer->cell_tanh, R, H);
+        }
+        else {
+            resize_matrix(&layer->candidate_recurrent, R, H);
+        }
+        if (layer->is_training) {
+            resize_matrix(&layer->inputs, R, layer->num_inputs);
+            resize_matrix(&layer->hidden_prev, R, H);
+        }
+        // Panels belong to the kernel they were packed for
+        if (layer->packed_recurrent != NULL && layer->packed_recurrent->kernel != gemm_get_kernel()) {
+            free_gemm_packed_b(layer->packed_recurrent);
+            layer->packed_recurrent = NULL;
+        }
+        if (layer->packed_recurrent == NULL) {
+            layer->packed_recurrent = gemm_alloc_packed_b(H, G); // Packed by the recurrence
+        }
+        layer->seq = seq;
+    }
+
+    // Cache layer inputs for the backward pass
+    if (layer->is_training) {
+        PARALLEL_CALL(cache_inputs_kernel(layer->inputs, inputs));
+    }
+
+    // Input projection of every step in one GEMM, biases added per tile
+    GemmEpilogue ep = {GEMM_EPILOGUE_BIAS, layer->biases->data};
+    gemm_fused(false, false, R, G, layer->num_inputs, 1.0, inputs->data, inputs->cols, layer->weights->data, G, 0.0,
+               layer->gates->data, G, &ep);
+
+    PARALLEL_CALL(forward_recurrence_kernel(layer, seq));
+}
+
+/*
+Shared body of the backward passes, input_grads false skips the input gradients.
+*/
+static void rnn_backwards_impl(matrix* input_gradients, layer_rnn* layer, bool input_grads) {
+    // Check dimensions
+    SequenceBatch* seq = layer->seq;
+    if (seq == NULL || layer->inputs == NULL || layer->inputs->rows != input_gradients->rows ||
+        input_gradients->cols != layer->hidden_size) {
+        fprintf(stderr, "Error: Dimensionality mismatch in backwards rnn.\n");
+        exit(1);
+    }
+    int R = seq->total_rows;
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+    int num_inputs = layer->num_inputs;
+
+    #pragma omp single
+    {
+        resize_matrix(&layer->dgates, R, G);
+        resize_matrix(&layer->carry_h, seq->batch, H);
+        resize_matrix(&layer->carry_c, seq->batch, H);
+        if (layer->type == RNN_GRU) {
+            resize_matrix(&layer->drecurrent, R, G);
+        }
+        if (input_grads) {
+            resize_matrix(&layer->dinputs, R, num_inputs);
+        }
+        if (layer->packed_recurrent_t != NULL && layer->packed_recurrent_t->kernel != gemm_get_kernel()) {
+            free_gemm_packed_b(layer->packed_recurrent_t);
+            layer->packed_recurrent_t = NULL;
+        }
+        if (layer->packed_recurrent_t == NULL) {
+            layer->packed_recurrent_t = gemm_alloc_packed_b(G, H);
+        }
+    }
+
+    PARALLEL_CALL(backward_recurrence_kernel(layer, seq, input_gradients));
+
+    // Weight gradients of every step at once, inputs^T * dgates and hidden_prev^T * drecurrent
+    matrix* drecurrent = (layer->type == RNN_GRU) ? layer->drecurrent : layer->dgates;
+    gemm(true, false, num_inputs, G, R, 1.0, layer->inputs->data, num_inputs, layer->dgates->data, G, 0.0, layer->dweights->data, G);
+    gemm(true, false, H, G, R, 1.0, layer->hidden_prev->data, H, drecurrent->data, G, 0.0,
+         layer->dweights->data + (size_t) num_inputs * G, G);
+
+    PARALLEL_CALL(bias_gradients_kernel(layer));
+
+    // Input gradients of every step at once, dgates * W_x^T
+    if (input_grads) {
+        gemm(false, true, R, num_inputs, G, 1.0, layer->dgates->data, G, layer->weights->data, G, 0.0, layer->dinputs->data, num_inputs);
+    }
+}
+
+void rnn_backwards(matrix* input_gradients, layer_rnn* layer) {
+    rnn_backwards_impl(input_gradients, layer, true);
+}
+
+void rnn_param_backwards(matrix* input_gradients, layer_rnn* layer) {
+    rnn_backwards_impl(input_gradients, layer, false);
+}
@@ -0,0 +1,1036 @@
+#include "network.h"
+
+//////////////////////////////////////////////////// NETWORK METHODS ///////////////////////////////////////////////////////////////////////////
+
+network* init_network() {
+    network* net = malloc(sizeof(network));
+    if (net == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for network struct.\n");
+        exit(1);
+    }
+    net->nodes = NULL;
+    net->num_nodes = 0;
+    net->capacity = 0;
+    net->loss = NULL;
+    net->optimizer = NULL;
+    net->fuse = true;
+    net->compiled = false;
+    net->inference_only = false;
+    net->max_batch = 0;
+    net->plan = NULL;
+    net->num_steps = 0;
+    net->workspace = NULL;
+    net->inference_workspace = NULL;
+    net->activations[0] = NULL;
+    net->activations[1] = NULL;
+    net->predictions = NULL;
+    net->packed_weights = NULL;
+    net->small_workspace = NULL;
+    net->small_activations[0] = NULL;
+    net->small_activations[1] = NULL;
+    net->small_predictions = NULL;
+    net->quantized = false;
+    net->quantized_inputs = NULL;
+    net->labels = NULL;
+    net->pool = NULL;
+    return net;
+}
+
+void free_network(network* net) {
+    // Optimizer states and packed weights
+    for (int s = 0; s < net->num_steps; s++) {
+        if (net->plan[s].optimizer != NULL) {
+            free_optimizer(net->plan[s].optimizer);
+            free(net->plan[s].optimizer);
+        }
+        if (net->packed_weights != NULL && net->packed_weights[s] != NULL) {
+            free_gemm_packed_b(net->packed_weights[s]);
+        }
+    }
+    free(net->plan);
+    free(net->packed_weights);
+    free(net->quantized_inputs);
+    free(net->labels);
+
+    // Layers, arena bound buffers go with the workspace
+    for (int i = 0; i < net->num_nodes; i++) {
+        NetworkNode* node = &net->nodes[i];
+        if (node->type == NODE_DENSE) {
+            free_layer(node->dense);
+            free(node->dense);
+        }
+        else if (node->type == NODE_RELU) {
+            free_relu(node->relu);
+            free(node->relu);
+        }
+        else if (node->type == NODE_BATCHNORM) {
+            free_batchnorm_layer(node->batchnorm);
+            free(node->batchnorm);
+        }
+        else {
+            free_softmax(node->softmax);
+            free(node->softmax);
+        }
+    }
+    free(net->nodes);
+
+    if (net->workspace != NULL) {
+        free_arena(net->workspace);
+    }
+    if (net->inference_workspace != NULL) {
+        free_arena(net->inference_workspace);
+    }
+    if (net->small_workspace != NULL) {
+        free_arena(net->small_workspace);
+    }
+    if (net->predictions != NULL) {
+        free_matrix(net->predictions);
+    }
+    if (net->optimizer != NULL) {
+        free_optimizer(net->optimizer);
+        free(net->optimizer);
+    }
+    free(net->loss);
+    free(net);
+}
+
+/*
+Appends an empty node of type, growing the node list as needed.
+*/
+static NetworkNode* add_node(network* net, NodeType type) {
+    if (net->compiled) {
+        fprintf(stderr, "Error: Layers can not be added to a compiled network.\n");
+        exit(1);
+    }
+    if (net->num_nodes == net->capacity) {
+        net->capacity = (net->capacity == 0) ? 8 : 2 * net->capacity;
+        net->nodes = realloc(net->nodes, net->capacity * sizeof(NetworkNode));
+        if (net->nodes == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure for network nodes.\n");
+            exit(1);
+        }
+    }
+    NetworkNode* node = &net->nodes[net->num_nodes++];
+    node->type = type;
+    node->dense = NULL;
+    node->relu = NULL;
+    node->softmax = NULL;
+    node->batchnorm = NULL;
+    return node;
+}
+
+layer_dense* network_add_dense(network* net, int num_inputs, int num_neurons) {
+    NetworkNode* node = add_node(net, NODE_DENSE);
+    node->dense = init_layer(num_inputs, num_neurons);
+    node->dense->id = net->num_nodes - 1;
+    return node->dense;
+}
+
+layer_dense* network_add_sparse_dense(network* net, int num_inputs, int num_neurons) {
+    if (net->num_nodes != 0) {
+        fprintf(stderr, "Error: A sparse dense layer must be the first layer of the network.\n");
+        exit(1);
+    }
+    layer_dense* layer = network_add_dense(net, num_inputs, num_neurons);
+    layer->sparse_inputs = true;
+    return layer;
+}
+
+void network_add_relu(network* net) {
+    add_node(net, NODE_RELU)->relu = init_relu();
+}
+
+void network_add_softmax(network* net) {
+    add_node(net, NODE_SOFTMAX)->softmax = init_softmax();
+}
+
+layer_batchnorm* network_add_batchnorm(network* net, int num_features) {
+    NetworkNode* node = add_node(net, NODE_BATCHNORM);
+    node->batchnorm = init_batchnorm_layer(num_features, 1);
+    node->batchnorm->id = net->num_nodes - 1;
+    return node->batchnorm;
+}
+
+void network_set_loss(network* net, LossType loss_type) {
+    free(net->loss);
+    net->loss = init_loss(loss_type);
+}
+
+OpParams* network_set_optimizer(network* net, OpParams* optimizer) {
+    if (net->compiled) {
+        fprintf(stderr, "Error: Optimizer must be set before the network is compiled.\n");
+        exit(1);
+    }
+    if (net->optimizer != NULL) {
+        free_optimizer(net->optimizer);
+        free(net->optimizer);
+    }
+    net->optimizer = optimizer;
+    return net->optimizer;
+}
+
+OpParams* network_set_adam(network* net, double beta_1, double beta_2, double epsilon, double lr, double decay) {
+    return network_set_optimizer(net, init_adam(beta_1, beta_2, epsilon, lr, decay));
+}
+
+void network_set_threadpool(network* net, ThreadPool* pool) {
+    net->pool = pool;
+}
+
+//////////////////////////////////////////////////// COMPILE ///////////////////////////////////////////////////////////////////////////
+
+/*
+Builds the plan steps from the node list, fusing each dense layer with the activation after it.
+fold folds the BatchNorms right after a dense layer into it first, they get no step of their own.
+*/
+static void build_plan(network* net, bool fold) {
+    net->plan = calloc(net->num_nodes, sizeof(PlanStep));
+    if (net->plan == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for network plan.\n");
+        exit(1);
+    }
+
+    int features = -1; // Width flowing between steps, unknown before the first dense layer
+    for (int i = 0; i < net->num_nodes; i++) {
+        NetworkNode* node = &net->nodes[i];
+        PlanStep* step = &net->plan[net->num_steps++];
+
+        if (node->type == NODE_DENSE) {
+            if (features != -1 && features != node->dense->num_inputs) {
+                fprintf(stderr, "Error: Dimensionality mismatch in network compile, layer %d takes %d inputs but receives %d.\n",
+                        i, node->dense->num_inputs, features);
+                exit(1);
+            }
+            step->type = STEP_DENSE;
+            step->dense = node->dense;
+            step->in_features = node->dense->num_inputs;
+            step->out_features = node->dense->num_neurons;
+
+            // Fold BatchNorms into the weights and biases, the activation after them then fuses with the GEMM
+            while (fold && i + 1 < net->num_nodes && net->nodes[i + 1].type == NODE_BATCHNORM) {
+                i++;
+                batchnorm_fold_dense(net->nodes[i].batchnorm, node->dense);
+            }
+
+            // Fuse the activation into the GEMM epilogue
+            if (net->fuse && i + 1 < net->num_nodes &&
+                (net->nodes[i + 1].type == NODE_RELU || net->nodes[i + 1].type == NODE_SOFTMAX)) {
+                i++;
+                node = &net->nodes[i];
+                step->type = (node->type == NODE_RELU) ? STEP_DENSE_RELU : STEP_DENSE_SOFTMAX;
+            }
+        }
+        else {
+            if (features == -1) {
+                fprintf(stderr, "Error: Network must start with a dense layer in network compile.\n");
+                exit(1);
+            }
+            step->type = (node->type == NODE_RELU) ? STEP_RELU : (node->type == NODE_SOFTMAX) ? STEP_SOFTMAX : STEP_BATCHNORM;
+            step->in_features = features;
+            step->out_features = features;
+        }
+
+        if (node->type == NODE_BATCHNORM) {
+            step->batchnorm = node->batchnorm;
+            if (node->batchnorm->num_features != features) {
+                fprintf(stderr, "Error: Dimensionality mismatch in network compile, batchnorm %d takes %d features but receives %d.\n",
+                        i, node->batchnorm->num_features, features);
+                exit(1);
+            }
+            if (!fold && node->batchnorm->folded) {
+                fprintf(stderr, "Error: BatchNorm %d was folded into the layer before it and can not be trained.\n", i);
+                exit(1);
+            }
+        }
+
+        if (node->type == NODE_RELU) {
+            step->relu = node->relu;
+        }
+        else if (node->type == NODE_SOFTMAX) {
+            step->softmax = node->softmax;
+            if (i != net->num_nodes - 1) {
+                fprintf(stderr, "Error: Softmax must be the last layer in network compile.\n");
+                exit(1);
+            }
+        }
+        features = step->out_features;
+    }
+}
+
+/*
+Plans one arena for every batch buffer, binds the layers to it and records each step's buffers.
+Fused steps skip the buffers their epilogue never touches: the activation inputs, and the dense outputs of
+a dense + relu (a dense + softmax keeps them, they are the logits of the fused loss).
+*/
+static void bind_plan(network* net, int max_batch) {
+    size_t bytes = 0;
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        bool fused = (step->type == STEP_DENSE_RELU || step->type == STEP_DENSE_SOFTMAX);
+        if (step->dense != NULL) {
+            bytes += dense_workspace_size(step->dense, max_batch, step->type != STEP_DENSE_RELU);
+        }
+        if (step->relu != NULL) {
+            bytes += relu_workspace_size(step->out_features, max_batch, fused);
+        }
+        if (step->softmax != NULL) {
+            bytes += softmax_workspace_size(step->out_features, max_batch, fused);
+        }
+        if (step->batchnorm != NULL) {
+            bytes += batchnorm_workspace_size(step->batchnorm, max_batch);
+        }
+    }
+    net->workspace = init_arena(bytes);
+
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        bool fused = (step->type == STEP_DENSE_RELU || step->type == STEP_DENSE_SOFTMAX);
+        if (step->dense != NULL) {
+            bind_dense_workspace(step->dense, net->workspace, max_batch, step->type != STEP_DENSE_RELU);
+            step->outputs = step->dense->outputs;
+            step->dinputs = step->dense->dinputs;
+        }
+        if (step->relu != NULL) {
+            bind_relu_workspace(step->relu, net->workspace, step->out_features, max_batch, fused);
+            step->outputs = step->relu->outputs;
+            if (step->dense == NULL) {
+                step->dinputs = step->relu->dinputs;
+            }
+        }
+        if (step->softmax != NULL) {
+            bind_softmax_workspace(step->softmax, net->workspace, step->out_features, max_batch, fused);
+            step->outputs = step->softmax->outputs;
+            if (step->dense == NULL) {
+                step->dinputs = step->softmax->dinputs;
+            }
+        }
+        if (step->batchnorm != NULL) {
+            bind_batchnorm_workspace(step->batchnorm, net->workspace, max_batch);
+            step->outputs = step->batchnorm->outputs;
+            step->dinputs = step->batchnorm->dinputs;
+        }
+    }
+}
+
+/*
+Plans the two ping-pong buffers of the inference path, wide enough for every step but the last
+(which writes into the predictions).
+*/
+static void bind_inference(network* net, int max_batch) {
+    int widest = 0;
+    for (int s = 0; s < net->num_steps - 1; s++) {
+        widest = (net->plan[s].out_features > widest) ? net->plan[s].out_features : widest;
+    }
+    if (widest == 0) {
+        return;
+    }
+    net->inference_workspace = init_arena(2 * arena_matrix_bytes(max_batch, widest));
+    net->activations[0] = arena_alloc_matrix(net->inference_workspace, max_batch, widest);
+    net->activations[1] = arena_alloc_matrix(net->inference_workspace, max_batch, widest);
+}
+
+static void check_compile(network* net, int max_batch) {
+    if (net->compiled) {
+        fprintf(stderr, "Error: Network is already compiled.\n");
+        exit(1);
+    }
+    if (net->num_nodes == 0 || max_batch <= 0) {
+        fprintf(stderr, "Error: Network compile needs at least one layer and max_batch > 0.\n");
+        exit(1);
+    }
+}
+
+void network_compile(network* net, int max_batch) {
+    check_compile(net, max_batch);
+    build_plan(net, false);
+    bind_plan(net, max_batch);
+    bind_inference(net, max_batch);
+
+    // Classes of a one hot batch, for the fused loss
+    net->labels = malloc(max_batch * sizeof(int));
+    if (net->labels == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for network labels.\n");
+        exit(1);
+    }
+
+    // One optimizer state per dense and batchnorm layer, hyperparameters and flags from the template
+    if (net->optimizer != NULL) {
+        for (int s = 0; s < net->num_steps; s++) {
+            PlanStep* step = &net->plan[s];
+            if (step->dense == NULL && step->batchnorm == NULL) {
+                continue;
+            }
+            step->optimizer = clone_optimizer(net->optimizer);
+        }
+    }
+
+    net->max_batch = max_batch;
+    net->compiled = true;
+}
+
+void network_compile_inference(network* net, int max_batch) {
+    check_compile(net, max_batch);
+    build_plan(net, true);
+    bind_inference(net, max_batch);
+
+    // Direct forward calls skip the training bookkeeping too, parameter gradients are never needed
+    for (int i = 0; i < net->num_nodes; i++) {
+        NetworkNode* node = &net->nodes[i];
+        if (node->type == NODE_DENSE) {
+            node->dense->is_training = false;
+            free_matrix(node->dense->dweights);
+            free_matrix(node->dense->dbiases);
+            node->dense->dweights = NULL;
+            node->dense->dbiases = NULL;
+        }
+        else if (node->type == NODE_RELU) {
+            node->relu->is_training = false;
+        }
+        else if (node->type == NODE_BATCHNORM) {
+            node->batchnorm->is_training = false;
+        }
+        else {
+            node->softmax->is_training = false;
+        }
+    }
+
+    net->max_batch = max_batch;
+    net->inference_only = true;
+    net->compiled = true;
+    network_prepack(net);
+}
+
+void network_prepack(network* net) {
+    if (!net->compiled) {
+        fprintf(stderr, "Error: Network must be compiled before prepack.\n");
+        exit(1);
+    }
+
+    // Packed already, refill the same panels
+    if (net->packed_weights != NULL) {
+        for (int s = 0; s < net->num_steps; s++) {
+            if (net->packed_weights[s] != NULL) {
+                layer_dense* layer = net->plan[s].dense;
+                gemm_repack_b(net->packed_weights[s], layer->weights->data, layer->weights->cols);
+            }
+        }
+        return;
+    }
+
+    net->packed_weights = calloc(net->num_steps, sizeof(GemmPackedB*));
+    if (net->packed_weights == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for packed weights.\n");
+        exit(1);
+    }
+    int widest = 0;
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        // A sparse input layer is only ever fed CSR batches, which never read a packed copy
+        if (step->dense != NULL && !step->dense->sparse_inputs) {
+            net->packed_weights[s] = gemm_pack_b(step->in_features, step->out_features, step->dense->weights->data,
+                                                 step->dense->weights->cols);
+        }
+        if (s < net->num_steps - 1 && step->out_features > widest) {
+            widest = step->out_features;
+        }
+    }
+
+    int outputs = net->plan[net->num_steps - 1].out_features;
+    net->small_workspace = init_arena(2 * arena_matrix_bytes(GEMM_SMALL_M, widest) +
+                                      arena_matrix_bytes(GEMM_SMALL_M, outputs));
+    if (widest > 0) {
+        net->small_activations[0] = arena_alloc_matrix(net->small_workspace, GEMM_SMALL_M, widest);
+        net->small_activations[1] = arena_alloc_matrix(net->small_workspace, GEMM_SMALL_M, widest);
+    }
+    net->small_predictions = arena_alloc_matrix(net->small_workspace, GEMM_SMALL_M, outputs);
+}
+
+//////////////////////////////////////////////////// EXECUTION ///////////////////////////////////////////////////////////////////////////
+
+/*
+First step of the plan on a CSR batch, returns the logits if the step ends the forward pass, NULL otherwise.
+*/
+static matrix* sparse_forward_step(PlanStep* step, sparse_matrix* X) {
+    switch (step->type) {
+        case STEP_DENSE_RELU:
+            dense_sparse_relu_forwards(X, step->dense, step->relu);
+            return NULL;
+        case STEP_DENSE_SOFTMAX:
+            dense_sparse_forwards(X, step->dense);
+            return step->dense->outputs;
+        default:
+            dense_sparse_forwards(X, step->dense);
+            return NULL;
+    }
+}
+
+/*
+Forward pass of the plan up to the logits, the softmax of the last step is left to the fused loss.
+sparse_X replaces X as the input of a sparse first layer.
+Every primitive joins the enclosing parallel region if there is one. Returns the logits.
+*/
+static matrix* forward_plan(network* net, matrix* X, sparse_matrix* sparse_X) {
+    matrix* inputs = X;
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        if (s == 0 && sparse_X != NULL) {
+            matrix* logits = sparse_forward_step(step, sparse_X);
+            if (logits != NULL) {
+                return logits;
+            }
+            inputs = step->outputs;
+            continue;
+        }
+        switch (step->type) {
+            case STEP_DENSE:
+                dense_forwards(inputs, step->dense);
+                break;
+            case STEP_DENSE_RELU:
+                dense_relu_forwards(inputs, step->dense, step->relu);
+                break;
+            case STEP_DENSE_SOFTMAX:
+                // Bias epilogue only, the dense outputs are the logits
+                dense_forwards(inputs, step->dense);
+                return step->dense->outputs;
+            case STEP_RELU:
+                relu_forwards(step->relu, inputs);
+                break;
+            case STEP_BATCHNORM:
+                batchnorm_forwards(inputs, step->batchnorm);
+                break;
+            case STEP_SOFTMAX:
+                return inputs;
+        }
+        inputs = step->outputs;
+    }
+    return inputs;
+}
+
+/*
+Softmax, loss and logit gradient of the last step in one pass over the logits.
+*/
+static void loss_plan(network* net, matrix* logits, const int* labels) {
+    double loss = softmax_catCE_forwards_backwards(net->plan[net->num_steps - 1].softmax, logits, labels);
+    #pragma omp single
+    net->loss->loss = loss;
+}
+
+/*
+Backward pass through the activation of a step, returns the gradient for its dense layer
+(or for the step input when there is none).
+*/
+static matrix* activation_backwards(PlanStep* step, matrix* grads) {
+    if (step->relu != NULL) {
+        relu_backwards(step->relu, grads);
+        return step->relu->dinputs;
+    }
+    if (step->softmax != NULL) {
+        // Logit gradient already written by the fused loss
+        return step->softmax->dinputs;
+    }
+    return grads;
+}
+
+/*
+Full training step inside the (optional) enclosing parallel region.
+*/
+static void train_step_region(network* net, matrix* X, sparse_matrix* sparse_X, const int* labels) {
+    loss_plan(net, forward_plan(net, X, sparse_X), labels);
+
+    // Backward, the first step's input gradients are never consumed
+    matrix* grads = NULL;
+    for (int s = net->num_steps - 1; s >= 0; s--) {
+        PlanStep* step = &net->plan[s];
+        grads = activation_backwards(step, grads);
+        if (step->dense != NULL) {
+            if (s > 0) {
+                dense_backwards(grads, step->dense);
+            }
+            else if (step->dense->sparse_inputs) {
+                dense_sparse_backwards(grads, step->dense);
+            }
+            else {
+                dense_param_backwards(grads, step->dense);
+            }
+        }
+        else if (step->batchnorm != NULL) {
+            batchnorm_backwards(grads, step->batchnorm);
+        }
+        grads = step->dinputs;
+    }
+
+    // Optimize Params
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        if (step->optimizer != NULL) {
+            pre_update_params(step->optimizer);
+            if (step->batchnorm != NULL) {
+                update_batchnorm_params(step->optimizer, step->batchnorm);
+            }
+            else {
+                update_dense_params(step->optimizer, step->dense);
+            }
+            post_update_params(step->optimizer);
+        }
+    }
+}
+
+/*
+Training step with the backward pass and updates on the thread pool.
+Each layer's update is queued as soon as its gradients are done and runs while the layers below it go backward.
+*/
+static void train_step_pool(network* net, matrix* X, sparse_matrix* sparse_X, const int* labels) {
+    TaskGroup grads_done;
+    TaskGroup updates_done;
+    init_task_group(&grads_done);
+    init_task_group(&updates_done);
+
+    loss_plan(net, forward_plan(net, X, sparse_X), labels);
+
+    matrix* grads = NULL;
+    for (int s = net->num_steps - 1; s >= 0; s--) {
+        PlanStep* step = &net->plan[s];
+        grads = activation_backwards(step, grads);
+        if (step->dense != NULL && step->dense->sparse_inputs) {
+            // Sparse first layer, its gradients are cheap enough to run on the calling thread
+            dense_sparse_backwards(grads, step->dense);
+            update_dense_params_async(net->pool, &updates_done, step->optimizer, step->dense);
+        }
+        else if (step->dense != NULL) {
+            dense_backwards_async(net->pool, &grads_done, grads, step->dense, s > 0);
+            threadpool_wait(net->pool, &grads_done);
+            update_dense_params_async(net->pool, &updates_done, step->optimizer, step->dense);
+        }
+        else if (step->batchnorm != NULL) {
+            // A handful of parameters per channel, backward and update run on the calling thread
+            batchnorm_backwards(grads, step->batchnorm);
+            pre_update_params(step->optimizer);
+            update_batchnorm_params(step->optimizer, step->batchnorm);
+            post_update_params(step->optimizer);
+        }
+        grads = step->dinputs;
+    }
+    threadpool_wait(net->pool, &updates_done);
+}
+
+/*
+Checks the network can train on a batch of rows x cols, sparse or not, returns the last step.
+*/
+static PlanStep* check_train_step(network* net, int rows, int cols, bool sparse) {
+    if (!net->compiled || net->loss == NULL || net->optimizer == NULL) {
+        fprintf(stderr, "Error: Network must be compiled with a loss and an optimizer before training.\n");
+        exit(1);
+    }
+    if (net->inference_only) {
+        fprintf(stderr, "Error: Network was compiled for inference only and can not be trained.\n");
+        exit(1);
+    }
+    PlanStep* last = &net->plan[net->num_steps - 1];
+    if (last->softmax == NULL || net->loss->lossType != CATCROSSENTROPY) {
+        fprintf(stderr, "Error: Training needs a softmax last layer with categorical cross entropy loss.\n");
+        exit(1);
+    }
+    if (rows > net->max_batch || cols != net->plan[0].in_features) {
+        fprintf(stderr, "Error: Batch of (%d x %d) does not fit the compiled network (max batch %d, %d inputs).\n",
+                rows, cols, net->max_batch, net->plan[0].in_features);
+        exit(1);
+    }
+    if (sparse != net->plan[0].dense->sparse_inputs) {
+        fprintf(stderr, "Error: Network takes %s batches, use network_train_step%s.\n",
+                sparse ? "dense" : "sparse", sparse ? "_labels" : "_sparse");
+        exit(1);
+    }
+    return last;
+}
+
+double network_train_step(network* net, matrix* X, matrix* Y) {
+    PlanStep* last = check_train_step(net, X->rows, X->cols, false);
+    if (Y->rows != X->rows || Y->cols != last->out_features) {
+        fprintf(stderr, "Error: Labels (%d x %d) do not fit a batch of %d rows with %d classes.\n",
+                Y->rows, Y->cols, X->rows, last->out_features);
+        exit(1);
+    }
+
+    // Find the true class of every one hot row
+    for (int i = 0; i < Y->rows; i++) {
+        net->labels[i] = -1;
+        for (int j = 0; j < Y->cols; j++) {
+            if (Y->data[i * Y->cols + j] == 1.0) {
+                net->labels[i] = j;
+                break;
+            }
+        }
+        if (net->labels[i] == -1) {
+            fprintf(stderr, "Error: No true class found in one hot row %d in network train step.\n", i);
+            exit(1);
+        }
+    }
+    return network_train_step_labels(net, X, net->labels);
+}
+
+/*
+Body of the training steps, exactly one of X and sparse_X is set.
+*/
+static double train_step(network* net, matrix* X, sparse_matrix* sparse_X, const int* labels) {
+    if (net->pool != NULL) {
+        train_step_pool(net, X, sparse_X, labels);
+    }
+    else {
+        // One region spans forward, loss, backward and the updates
+        #ifdef ENABLE_PARALLEL
+        #pragma omp parallel
+        #endif
+        train_step_region(net, X, sparse_X, labels);
+    }
+    return net->loss->loss;
+}
+
+double network_train_step_labels(network* net, matrix* X, const int* labels) {
+    check_train_step(net, X->rows, X->cols, false);
+    return train_step(net, X, NULL, labels);
+}
+
+double network_train_step_sparse(network* net, sparse_matrix* X, const int* labels) {
+    check_train_step(net, X->rows, X->cols, true);
+    return train_step(net, NULL, X, labels);
+}
+
+/*
+Dense step of the inference path, on the int8 weights once the network is quantized.
+*/
+static void inference_dense(network* net, PlanStep* step, matrix* inputs, matrix* outputs, GemmEpilogueType epilogue) {
+    if (net->quantized) {
+        dense_quantized_forwards(inputs, step->dense, net->quantized_inputs, outputs, epilogue);
+    }
+    else {
+        dense_inference_forwards(inputs, step->dense, outputs, epilogue);
+    }
+}
+
+/*
+Inference forward pass of a chunk into predictions (X->rows x last out_features).
+Steps alternate between the ping-pong buffers, views are local so every thread of the region builds its own.
+ranges (min, max per step, may be NULL) is widened to cover the inputs of every dense step, for calibration.
+sparse_X replaces X as the input of the first step, which always runs in float.
+*/
+static void forward_inference(network* net, matrix* X, sparse_matrix* sparse_X, matrix* predictions, nn_float* ranges) {
+    matrix views[2];
+    matrix* inputs = X;
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        matrix* outputs = predictions;
+        if (s < net->num_steps - 1) {
+            views[s % 2] = (matrix) {predictions->rows, step->out_features, net->activations[s % 2]->data};
+            outputs = &views[s % 2];
+        }
+        if (s == 0 && sparse_X != NULL) {
+            GemmEpilogueType epilogue = (step->type == STEP_DENSE_RELU) ? GEMM_EPILOGUE_BIAS_RELU
+                                      : (step->type == STEP_DENSE_SOFTMAX) ? GEMM_EPILOGUE_BIAS_SOFTMAX : GEMM_EPILOGUE_BIAS;
+            dense_sparse_inference_forwards(sparse_X, step->dense, outputs, epilogue);
+            inputs = outputs;
+            continue;
+        }
+        if (ranges != NULL && step->dense != NULL) {
+            #pragma omp single
+            for (int i = 0; i < inputs->rows * inputs->cols; i++) {
+                nn_float v = inputs->data[i];
+                ranges[2 * s] = (v < ranges[2 * s]) ? v : ranges[2 * s];
+                ranges[2 * s + 1] = (v > ranges[2 * s + 1]) ? v : ranges[2 * s + 1];
+            }
+        }
+        switch (step->type) {
+            case STEP_DENSE:
+                inference_dense(net, step, inputs, outputs, GEMM_EPILOGUE_BIAS);
+                break;
+            case STEP_DENSE_RELU:
+                inference_dense(net, step, inputs, outputs, GEMM_EPILOGUE_BIAS_RELU);
+                break;
+            case STEP_DENSE_SOFTMAX:
+                inference_dense(net, step, inputs, outputs, GEMM_EPILOGUE_BIAS_SOFTMAX);
+                break;
+            case STEP_RELU:
+                relu_inference_forwards(inputs, outputs);
+                break;
+            case STEP_BATCHNORM:
+                batchnorm_inference_forwards(inputs, step->batchnorm, outputs);
+                break;
+            case STEP_SOFTMAX:
+                softmax_inference_forwards(inputs, outputs);
+                break;
+        }
+        inputs = outputs;
+    }
+}
+
+/*
+Body of network_predict and network_predict_sparse, exactly one of X and sparse_X is set.
+ranges is passed through to forward_inference.
+*/
+static matrix* predict(network* net, matrix* X, sparse_matrix* sparse_X, nn_float* ranges) {
+    if (!net->compiled) {
+        fprintf(stderr, "Error: Network must be compiled before predict.\n");
+        exit(1);
+    }
+    int rows = (X != NULL) ? X->rows : sparse_X->rows;
+    int cols = (X != NULL) ? X->cols : sparse_X->cols;
+    if (cols != net->plan[0].in_features) {
+        fprintf(stderr, "Error: Dimensionality mismatch in network predict, expected %d features got %d.\n",
+                net->plan[0].in_features, cols);
+        exit(1);
+    }
+    if (sparse_X != NULL && net->plan[0].dense == NULL) {
+        fprintf(stderr, "Error: Sparse predict needs a network starting with a dense layer.\n");
+        exit(1);
+    }
+
+    PlanStep* last = &net->plan[net->num_steps - 1];
+    resize_matrix(&net->predictions, rows, last->out_features);
+
+    // max_batch rows at a time through the workspace
+    for (int start = 0; start < rows; start += net->max_batch) {
+        int chunk_rows = (rows - start < net->max_batch) ? rows - start : net->max_batch;
+        matrix chunk;
+        sparse_matrix sparse_chunk;
+        matrix chunk_predictions;
+        if (X != NULL) {
+            shallow_cpy_matrix(X, &chunk, start, chunk_rows);
+        }
+        else {
+            sparse_rows_view(sparse_X, &sparse_chunk, start, chunk_rows);
+        }
+        shallow_cpy_matrix(net->predictions, &chunk_predictions, start, chunk_rows);
+
+        #ifdef ENABLE_PARALLEL
+        #pragma omp parallel
+        #endif
+        forward_inference(net, (X != NULL) ? &chunk : NULL, (X != NULL) ? NULL : &sparse_chunk, &chunk_predictions, ranges);
+    }
+    return net->predictions;
+}
+
+matrix* network_predict(network* net, matrix* X) {
+    return predict(net, X, NULL, NULL);
+}
+
+matrix* network_predict_sparse(network* net, sparse_matrix* X) {
+    return predict(net, NULL, X, NULL);
+}
+
+matrix* network_predict_small(network* net, matrix* X) {
+    if (net->packed_weights == NULL) {
+        fprintf(stderr, "Error: Network must be prepacked (network_prepack) before predict small.\n");
+        exit(1);
+    }
+    if (net->plan[0].dense->sparse_inputs) {
+        fprintf(stderr, "Error: Predict small takes dense inputs, use network_predict_sparse for a sparse input network.\n");
+        exit(1);
+    }
+    if (X->rows < 1 || X->rows > GEMM_SMALL_M) {
+        fprintf(stderr, "Error: Predict small takes 1 to %d rows, got %d.\n", GEMM_SMALL_M, X->rows);
+        exit(1);
+    }
+    if (X->cols != net->plan[0].in_features) {
+        fprintf(stderr, "Error: Dimensionality mismatch in network predict small, expected %d features got %d.\n",
+                net->plan[0].in_features, X->cols);
+        exit(1);
+    }
+
+    int rows = X->rows;
+    const nn_float* inputs = X->data;
+    int buf = 0;
+    for (int s = 0; s < net->num_steps;) {
+        PlanStep* step = &net->plan[s];
+
+        // Activations left unfused by the plan are fused here anyway, there is no training cache to keep apart
+        GemmEpilogueType ep_type = GEMM_EPILOGUE_BIAS;
+        int next = s + 1;
+        if (step->type == STEP_DENSE_RELU || (step->type == STEP_DENSE && next < net->num_steps &&
+                                              net->plan[next].type == STEP_RELU)) {
+            ep_type = GEMM_EPILOGUE_BIAS_RELU;
+            next = s + ((step->type == STEP_DENSE) ? 2 : 1);
+        }
+        else if (step->type == STEP_DENSE_SOFTMAX || (step->type == STEP_DENSE && next < net->num_steps &&
+                                                      net->plan[next].type == STEP_SOFTMAX)) {
+            ep_type = GEMM_EPILOGUE_BIAS_SOFTMAX;
+            next = s + ((step->type == STEP_DENSE) ? 2 : 1);
+        }
+
+        nn_float* outputs = (next == net->num_steps) ? net->small_predictions->data : net->small_activations[buf]->data;
+        int cols = step->out_features;
+        if (step->dense != NULL) {
+            GemmEpilogue ep = {ep_type, step->dense->biases->data};
+            gemm_small(rows, inputs, step->in_features, net->packed_weights[s], outputs, cols, &ep);
+        }
+        else if (step->type == STEP_RELU) {
+            for (int i = 0; i < rows * cols; i++) {
+                outputs[i] = (inputs[i] <= 0) ? 0 : inputs[i];
+            }
+        }
+        else if (step->type == STEP_BATCHNORM) {
+            // Running statistics, network batchnorms have one feature per channel
+            layer_batchnorm* bn = step->batchnorm;
+            for (int j = 0; j < cols; j++) {
+                nn_float scale = 1;
+                nn_float shift = 0;
+                if (!bn->folded) {
+                    scale = bn->gamma->data[j] / sqrt((double) bn->running_var->data[j] + bn->epsilon);
+                    shift = bn->beta->data[j] - bn->running_mean->data[j] * scale;
+                }
+                for (int i = 0; i < rows; i++) {
+                    outputs[i * cols + j] = inputs[i * cols + j] * scale + shift;
+                }
+            }
+        }
+        else {
+            for (int i = 0; i < rows; i++) {
+                softmax_row(inputs + i * cols, outputs + i * cols, cols);
+            }
+        }
+
+        inputs = outputs;
+        buf ^= 1;
+        s = next;
+    }
+
+    net->small_predictions->rows = rows;
+    return net->small_predictions;
+}
+
+//////////////////////////////////////////////////// QUANTIZATION ///////////////////////////////////////////////////////////////////////////
+
+void network_quantize(network* net, matrix* calibration) {
+    if (calibration->rows == 0) {
+        fprintf(stderr, "Error: Network quantize needs at least one calibration row.\n");
+        exit(1);
+    }
+    nn_float* ranges = malloc(2 * net->num_steps * sizeof(nn_float));
+    if (ranges == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for calibration ranges.\n");
+        exit(1);
+    }
+    for (int s = 0; s < net->num_steps; s++) {
+        ranges[2 * s] = NN_FLOAT_MAX;
+        ranges[2 * s + 1] = -NN_FLOAT_MAX;
+    }
+
+    // Calibrate on the float model, even when requantizing
+    net->quantized = false;
+    predict(net, calibration, NULL, ranges);
+
+    int widest = 0;
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        if (step->dense != NULL) {
+            dense_quantize(step->dense, ranges[2 * s], ranges[2 * s + 1]);
+            widest = (step->dense->quantized->k_padded > widest) ? step->dense->quantized->k_padded : widest;
+        }
+    }
+    free(ranges);
+
+    free(net->quantized_inputs);
+    net->quantized_inputs = malloc((size_t) net->max_batch * widest);
+    if (net->quantized_inputs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for quantized inputs.\n");
+        exit(1);
+    }
+    net->quantized = true;
+}
+
+static int argmax_row(const nn_float* row, int cols) {
+    int best = 0;
+    for (int j = 1; j < cols; j++) {
+        if (row[j] > row[best]) {
+            best = j;
+        }
+    }
+    return best;
+}
+
+void print_quantization_report(network* net, matrix* X, matrix* Y) {
+    if (!net->quantized) {
+        fprintf(stderr, "Error: Network must be quantized before the quantization report.\n");
+        exit(1);
+    }
+
+    // Float predictions are copied out, the int8 run overwrites them
+    net->quantized = false;
+    matrix* reference = network_predict(net, X);
+    matrix* float_predictions = allocate_matrix(reference->rows, reference->cols);
+    memcpy(float_predictions->data, reference->data, (size_t) reference->rows * reference->cols * sizeof(nn_float));
+    net->quantized = true;
+    matrix* int8_predictions = network_predict(net, X);
+
+    int cols = float_predictions->cols;
+    int float_correct = 0;
+    int int8_correct = 0;
+    int agree = 0;
+    double max_diff = 0.0;
+    for (int i = 0; i < X->rows; i++) {
+        const nn_float* f = float_predictions->data + (size_t) i * cols;
+        const nn_float* q = int8_predictions->data + (size_t) i * cols;
+        int f_class = argmax_row(f, cols);
+        int q_class = argmax_row(q, cols);
+        agree += (f_class == q_class);
+        if (Y != NULL) {
+            int label = argmax_row(Y->data + (size_t) i * Y->cols, Y->cols);
+            float_correct += (f_class == label);
+            int8_correct += (q_class == label);
+        }
+        for (int j = 0; j < cols; j++) {
+            double d = fabs(f[j] - q[j]);
+            max_diff = (d > max_diff) ? d : max_diff;
+        }
+    }
+
+    size_t float_bytes = 0;
+    size_t int8_bytes = 0;
+    for (int s = 0; s < net->num_steps; s++) {
+        layer_dense* layer = net->plan[s].dense;
+        if (layer != NULL) {
+            float_bytes += (size_t) layer->num_inputs * layer->num_neurons * sizeof(nn_float);
+            int8_bytes += quantized_dense_bytes(layer->quantized);
+        }
+    }
+
+    printf("Quantization report (%s kernel), %d rows\n", quantize_get_kernel()->name, X->rows);
+    for (int s = 0; s < net->num_steps; s++) {
+        QuantizedDense* q = (net->plan[s].dense != NULL) ? net->plan[s].dense->quantized : NULL;
+        if (q != NULL) {
+            printf("  step %d: input range [%.4g, %.4g], scale %.4g, zero point %d\n", s, q->input_min, q->input_max,
+                   q->input_scale, q->zero_point);
+        }
+    }
+    if (Y != NULL) {
+        printf("  accuracy: float %.4f, int8 %.4f (delta %+.4f)\n", (double) float_correct / X->rows,
+               (double) int8_correct / X->rows, (double) (int8_correct - float_correct) / X->rows);
+    }
+    printf("  top 1 agreement %.4f, max output difference %.3e\n", (double) agree / X->rows, max_diff);
+    printf("  weights: float %.1f KB, int8 %.1f KB (%.1fx smaller)\n", float_bytes / 1024.0, int8_bytes / 1024.0,
+           (int8_bytes > 0) ? (double) float_bytes / int8_bytes : 0.0);
+
+    free_matrix(float_predictions);
+}
+
+void print_network(network* net) {
+    const char* step_names[] = {"dense", "dense + relu (fused)", "dense + softmax (fused)", "relu", "softmax",
+                                "batchnorm"};
+    printf("Network: %d layers in %d steps, max batch %d%s\n", net->num_nodes, net->num_steps, net->max_batch,
+           net->inference_only ? ", inference only" : "");
+    for (int s = 0; s < net->num_steps; s++) {
+        PlanStep* step = &net->plan[s];
+        bool sparse = (step->dense != NULL && step->dense->sparse_inputs);
+        printf("  step %d: %-24s %d -> %d%s%s%s%s\n", s, step_names[step->type], step->in_features, step->out_features,
+               sparse ? ", sparse inputs" : "", (step->optimizer != NULL) ? ", " : "",
+               (step->optimizer != NULL) ? optimizer_name(step->optimizer->optimizer) : "",
+               (net->quantized && step->dense != NULL) ? ", int8" : "");
+    }
+    if (net->workspace != NULL) {
+        print_arena_report(net->workspace);
+    }
+    if (net->inference_workspace != NULL) {
+        print_arena_report(net->inference_workspace);
+    }
+    if (net->small_workspace != NULL) {
+        print_arena_report(net->small_workspace);
+    }
+}
@@ -0,0 +1,31 @@
+#include "adagrad.h"
+
+
+OpParams* init_adagrad(double lr, double epsilon, double decay) {
+    OpParams* adagrad = init_optimizer(ADA_GRAD, lr, decay);
+    adagrad->epsilon = epsilon;
+    return adagrad;
+}
+
+void adagrad_step(OpParams* adagrad, nn_float* restrict params, const nn_float* restrict grads,
+                  nn_float* restrict cache, double* restrict master, int n) {
+    nn_float lr = adagrad->lr;
+    nn_float epsilon = adagrad->epsilon;
+
+    if (master != NULL) {
+        for (int i = 0; i < n; i++) {
+            nn_float grad = grads[i];
+            nn_float c = cache[i] + grad * grad;
+            cache[i] = c;
+            master[i] -= lr * grad / (sqrt(c) + epsilon);
+            params[i] = (nn_float) master[i];
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        nn_float grad = grads[i];
+        nn_float c = cache[i] + grad * grad;
+        cache[i] = c;
+        params[i] -= lr * grad / (sqrt(c) + epsilon);
+    }
+}
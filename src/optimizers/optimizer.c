@@ -0,0 +1,281 @@
+#include "optimizer.h"
+#include "sgd.h"
+#include "adagrad.h"
+#include "rmsprop.h"
+#include "adam.h"
+
+
+OpParams* init_optimizer(OptimizationType type, double lr, double decay) {
+    OpParams* opt = malloc(sizeof(OpParams));
+    if (opt == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for optimizer.\n");
+        exit(1);
+    }
+    opt->w_momentums = NULL;
+    opt->w_cache = NULL;
+    opt->b_momentums = NULL;
+    opt->b_cache = NULL;
+    opt->beta_1 = 0.9; // default
+    opt->beta_2 = 0.999; // default
+    opt->momentum = 0.9; // default
+    opt->rho = 0.9; // default
+    opt->epsilon = 1e-7; // default
+    opt->lr = lr;
+    opt->decay = decay;
+    opt->iterations = 0;
+    opt->correctBias = true;
+    opt->useMasterWeights = false;
+    opt->w_master = NULL;
+    opt->b_master = NULL;
+    opt->optimizer = type;
+    return opt;
+}
+
+OpParams* clone_optimizer(const OpParams* tmpl) {
+    OpParams* opt = init_optimizer(tmpl->optimizer, tmpl->lr, tmpl->decay);
+    opt->beta_1 = tmpl->beta_1;
+    opt->beta_2 = tmpl->beta_2;
+    opt->momentum = tmpl->momentum;
+    opt->rho = tmpl->rho;
+    opt->epsilon = tmpl->epsilon;
+    opt->correctBias = tmpl->correctBias;
+    opt->useMasterWeights = tmpl->useMasterWeights;
+    return opt;
+}
+
+void free_optimizer(OpParams* opt) {
+    if (opt->w_momentums != NULL) {
+        free_matrix(opt->w_momentums);
+    }
+    if (opt->w_cache != NULL) {
+        free_matrix(opt->w_cache);
+    }
+    if (opt->b_momentums != NULL) {
+        free_matrix(opt->b_momentums);
+    }
+    if (opt->b_cache != NULL) {
+        free_matrix(opt->b_cache);
+    }
+    opt->w_momentums = NULL;
+    opt->w_cache = NULL;
+    opt->b_momentums = NULL;
+    opt->b_cache = NULL;
+    free(opt->w_master);
+    free(opt->b_master);
+    opt->w_master = NULL;
+    opt->b_master = NULL;
+}
+
+const char* optimizer_name(OptimizationType type) {
+    switch (type) {
+        case SGD: return "sgd";
+        case SGD_MOMENTUM: return "sgd_momentum";
+        case ADA_GRAD: return "adagrad";
+        case RMS_PROP: return "rmsprop";
+        case ADAM: return "adam";
+    }
+    return "unknown";
+}
+
+bool optimizer_uses_momentums(OptimizationType type) {
+    return type == SGD_MOMENTUM || type == ADAM;
+}
+
+bool optimizer_uses_cache(OptimizationType type) {
+    return type == ADA_GRAD || type == RMS_PROP || type == ADAM;
+}
+
+void pre_update_params(OpParams* opt) {
+    // Once per team, the update reads lr after the barrier
+    #pragma omp single
+    if (opt->decay > 0.0) {
+        opt->lr = opt->lr * (1.0 / (1 + opt->decay * opt->iterations));
+    }
+}
+
+void post_update_params(OpParams* opt) {
+    // The update already has its corrections, no need to wait
+    #pragma omp single nowait
+    opt->iterations += 1;
+}
+
+/*
+Allocates a double precision copy of n parameters.
+*/
+static double* init_master_copy(matrix* params) {
+    int n = params->rows * params->cols;
+    double* master = malloc(n * sizeof(double));
+    if (master == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for master weights in optimizer.\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        master[i] = params->data[i];
+    }
+    return master;
+}
+
+/*
+Allocates the state the optimizer uses on first use and returns the Adam bias corrections of this step.
+Called by one thread, copyprivate hands the corrections to the team.
+*/
+static void prepare_optimizer(OpParams* opt, matrix* weights, matrix* biases, double* momentum_correction,
+                              double* cache_correction) {
+    if (optimizer_uses_momentums(opt->optimizer) && opt->w_momentums == NULL) {
+        opt->w_momentums = allocate_matrix(weights->rows, weights->cols);
+        opt->b_momentums = allocate_matrix(biases->rows, biases->cols);
+    }
+    if (optimizer_uses_cache(opt->optimizer) && opt->w_cache == NULL) {
+        opt->w_cache = allocate_matrix(weights->rows, weights->cols);
+        opt->b_cache = allocate_matrix(biases->rows, biases->cols);
+    }
+    if (opt->useMasterWeights && opt->w_master == NULL) {
+        opt->w_master = init_master_copy(weights);
+        opt->b_master = init_master_copy(biases);
+    }
+
+    // Bias correction terms, once per step rather than per element
+    *momentum_correction = 1.0;
+    *cache_correction = 1.0;
+    if (opt->optimizer == ADAM && opt->correctBias) {
+        *momentum_correction = 1.0 - pow(opt->beta_1, opt->iterations + 1);
+        *cache_correction = 1.0 - pow(opt->beta_2, opt->iterations + 1);
+    }
+}
+
+/*
+Steps n parameters of a tensor from begin with the optimizer's fused kernel.
+*/
+static void step_span(OpParams* opt, matrix* params, matrix* grads, matrix* momentums, matrix* cache, double* master,
+                      size_t begin, int n, double momentum_correction, double cache_correction) {
+    nn_float* p = params->data + begin;
+    const nn_float* g = grads->data + begin;
+    nn_float* m = (momentums != NULL) ? momentums->data + begin : NULL;
+    nn_float* c = (cache != NULL) ? cache->data + begin : NULL;
+    double* w = (master != NULL) ? master + begin : NULL;
+
+    switch (opt->optimizer) {
+        case SGD:
+            sgd_step(opt, p, g, w, n);
+            break;
+        case SGD_MOMENTUM:
+            sgd_momentum_step(opt, p, g, m, w, n);
+            break;
+        case ADA_GRAD:
+            adagrad_step(opt, p, g, c, w, n);
+            break;
+        case RMS_PROP:
+            rmsprop_step(opt, p, g, c, w, n);
+            break;
+        case ADAM:
+            adam_step(opt, p, g, m, c, w, n, momentum_correction, cache_correction);
+            break;
+    }
+}
+
+/*
+Optimizer step for one parameter tensor, chunks of OPTIMIZER_CHUNK parameters per work shared iteration.
+Work shared with no barrier, nothing reads params before the next forward pass syncs the team.
+*/
+static void update_tensor(OpParams* opt, matrix* params, matrix* grads, matrix* momentums, matrix* cache,
+                          double* master, double momentum_correction, double cache_correction) {
+    int n = params->rows * params->cols;
+    int num_chunks = (n + OPTIMIZER_CHUNK - 1) / OPTIMIZER_CHUNK;
+
+    #pragma omp for schedule(static) nowait
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        int begin = chunk * OPTIMIZER_CHUNK;
+        int len = (n - begin < OPTIMIZER_CHUNK) ? n - begin : OPTIMIZER_CHUNK;
+        step_span(opt, params, grads, momentums, cache, master, begin, len, momentum_correction, cache_correction);
+    }
+}
+
+/*
+Optimizer step for the listed rows of a parameter tensor only, the others keep their parameters and state.
+Work shared like update_tensor.
+*/
+static void update_rows(OpParams* opt, matrix* params, matrix* grads, matrix* momentums, matrix* cache,
+                        double* master, const int* rows, int num_rows, double momentum_correction,
+                        double cache_correction) {
+    int cols = params->cols;
+
+    #pragma omp for schedule(static) nowait
+    for (int r = 0; r < num_rows; r++) {
+        step_span(opt, params, grads, momentums, cache, master, (size_t) rows[r] * cols, cols,
+                  momentum_correction, cache_correction);
+    }
+}
+
+static void update_dense_kernel(OpParams* opt, layer_dense* layer, double momentum_correction, double cache_correction) {
+    // Weights, a sparse input layer only steps the rows its last batch selected
+    if (layer->sparse_inputs) {
+        update_rows(opt, layer->weights, layer->dweights, opt->w_momentums, opt->w_cache, opt->w_master,
+                    layer->active_rows, layer->num_active_rows, momentum_correction, cache_correction);
+    }
+    else {
+        update_tensor(opt, layer->weights, layer->dweights, opt->w_momentums, opt->w_cache, opt->w_master,
+                      momentum_correction, cache_correction);
+    }
+
+    // Biases
+    update_tensor(opt, layer->biases, layer->dbiases, opt->b_momentums, opt->b_cache, opt->b_master,
+                  momentum_correction, cache_correction);
+}
+
+void update_dense_params(OpParams* opt, layer_dense* layer) {
+    double momentum_correction = 1.0;
+    double cache_correction = 1.0;
+
+    // One thread allocates and computes the corrections, copyprivate hands them to the team
+    #pragma omp single copyprivate(momentum_correction, cache_correction)
+    prepare_optimizer(opt, layer->weights, layer->biases, &momentum_correction, &cache_correction);
+
+    PARALLEL_CALL(update_dense_kernel(opt, layer, momentum_correction, cache_correction));
+}
+
+static void dense_update_task(void* ctx, void* data, int begin, int end) {
+    (void) begin; // One task per layer, no range
+    (void) end;
+    OpParams* opt = (OpParams*) ctx;
+    layer_dense* layer = (layer_dense*) data;
+    pre_update_params(opt);
+    update_dense_params(opt, layer);
+    post_update_params(opt);
+}
+
+void update_dense_params_async(ThreadPool* pool, TaskGroup* group, OpParams* opt, layer_dense* layer) {
+    threadpool_submit(pool, group, dense_update_task, opt, layer, 0, 1);
+}
+
+static void update_pair_kernel(OpParams* opt, matrix* weights, matrix* dweights, matrix* biases, matrix* dbiases,
+                               double momentum_correction, double cache_correction) {
+    update_tensor(opt, weights, dweights, opt->w_momentums, opt->w_cache, opt->w_master,
+                  momentum_correction, cache_correction);
+    update_tensor(opt, biases, dbiases, opt->b_momentums, opt->b_cache, opt->b_master,
+                  momentum_correction, cache_correction);
+}
+
+/*
+Steps a weight and a bias tensor, like update_dense_params without sparse rows.
+*/
+static void update_pair(OpParams* opt, matrix* weights, matrix* dweights, matrix* biases, matrix* dbiases) {
+    double momentum_correction = 1.0;
+    double cache_correction = 1.0;
+
+    #pragma omp single copyprivate(momentum_correction, cache_correction)
+    prepare_optimizer(opt, weights, biases, &momentum_correction, &cache_correction);
+
+    PARALLEL_CALL(update_pair_kernel(opt, weights, dweights, biases, dbiases, momentum_correction, cache_correction));
+}
+
+void update_cnn_params(OpParams* opt, layer_cnn* layer) {
+    update_pair(opt, layer->weights, layer->dweights, layer->biases, layer->dbiases);
+}
+
+void update_batchnorm_params(OpParams* opt, layer_batchnorm* layer) {
+    update_pair(opt, layer->gamma, layer->dgamma, layer->beta, layer->dbeta);
+}
+
+void update_rnn_params(OpParams* opt, layer_rnn* layer) {
+    update_pair(opt, layer->weights, layer->dweights, layer->biases, layer->dbiases);
+}
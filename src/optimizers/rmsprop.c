@@ -0,0 +1,33 @@
+#include "rmsprop.h"
+
+
+OpParams* init_rmsprop(double lr, double rho, double epsilon, double decay) {
+    OpParams* rmsprop = init_optimizer(RMS_PROP, lr, decay);
+    rmsprop->rho = rho;
+    rmsprop->epsilon = epsilon;
+    return rmsprop;
+}
+
+void rmsprop_step(OpParams* rmsprop, nn_float* restrict params, const nn_float* restrict grads,
+                  nn_float* restrict cache, double* restrict master, int n) {
+    nn_float lr = rmsprop->lr;
+    nn_float rho = rmsprop->rho;
+    nn_float epsilon = rmsprop->epsilon;
+
+    if (master != NULL) {
+        for (int i = 0; i < n; i++) {
+            nn_float grad = grads[i];
+            nn_float c = rho * cache[i] + (1 - rho) * grad * grad;
+            cache[i] = c;
+            master[i] -= lr * grad / (sqrt(c) + epsilon);
+            params[i] = (nn_float) master[i];
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        nn_float grad = grads[i];
+        nn_float c = rho * cache[i] + (1 - rho) * grad * grad;
+        cache[i] = c;
+        params[i] -= lr * grad / (sqrt(c) + epsilon);
+    }
+}
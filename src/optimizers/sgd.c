@@ -0,0 +1,48 @@
+#include "sgd.h"
+
+
+OpParams* init_sgd(double lr, double decay) {
+    return init_optimizer(SGD, lr, decay);
+}
+
+OpParams* init_sgd_momentum(double lr, double momentum, double decay) {
+    OpParams* sgd = init_optimizer(SGD_MOMENTUM, lr, decay);
+    sgd->momentum = momentum;
+    return sgd;
+}
+
+void sgd_step(OpParams* sgd, nn_float* restrict params, const nn_float* restrict grads, double* restrict master, int n) {
+    nn_float lr = sgd->lr;
+
+    if (master != NULL) {
+        for (int i = 0; i < n; i++) {
+            master[i] -= lr * grads[i];
+            params[i] = (nn_float) master[i];
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        params[i] -= lr * grads[i];
+    }
+}
+
+void sgd_momentum_step(OpParams* sgd, nn_float* restrict params, const nn_float* restrict grads,
+                       nn_float* restrict momentums, double* restrict master, int n) {
+    nn_float lr = sgd->lr;
+    nn_float momentum = sgd->momentum;
+
+    if (master != NULL) {
+        for (int i = 0; i < n; i++) {
+            nn_float velocity = momentum * momentums[i] - lr * grads[i];
+            momentums[i] = velocity;
+            master[i] += velocity;
+            params[i] = (nn_float) master[i];
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        nn_float velocity = momentum * momentums[i] - lr * grads[i];
+        momentums[i] = velocity;
+        params[i] += velocity;
+    }
+}
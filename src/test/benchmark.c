@@ -0,0 +1,1875 @@
+#include "linalg.h"
+#include "gemm.h"
+#include "layer_dense.h"
+#include "layer_cnn.h"
+#include "layer_pool.h"
+#include "layer_batchnorm.h"
+#include "layer_rnn.h"
+#include "loss.h"
+#include "network.h"
+#include "data.h"
+#include "checkpoint.h"
+#include "networking.h"
+#include "fastmath.h"
+#include <unistd.h>
+
+/*
+Benchmarks for the linalg kernels.
+Build with ./makefile.sh -bench (add -parallel for the threaded kernels, -fp32 for single precision).
+Run with -threads N to size the thread pool (default one per core) and -pin to bind its workers to cores.
+*/
+
+//////////////////////////////////////////////////// REFERENCE KERNELS ///////////////////////////////////////////////////////////////////////////
+
+// Previous serial matrix_mult, triple loop into a zeroed result
+static void reference_naive(matrix* w, matrix* v, matrix* result) {
+    int rows_w = w->rows;
+    int cols_w = w->cols;
+    int cols_v = v->cols;
+    memset(result->data, 0, rows_w * cols_v * sizeof(nn_float));
+    for (int i = 0; i < rows_w; i++) {
+        for (int j = 0; j < cols_v; j++) {
+            for (int k = 0; k < cols_w; k++) {
+                result->data[i * cols_v + j] += w->data[i * cols_w + k] * v->data[k * cols_v + j];
+            }
+        }
+    }
+}
+
+// Previous parallel matrix_mult, 32 x 32 tiles into a zeroed result
+static void reference_tiled(matrix* w, matrix* v, matrix* result) {
+    int rows_w = w->rows;
+    int cols_w = w->cols;
+    int cols_v = v->cols;
+    int block_size = 32;
+    memset(result->data, 0, rows_w * cols_v * sizeof(nn_float));
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int i = 0; i < rows_w; i += block_size) {
+        for (int j = 0; j < cols_v; j += block_size) {
+            for (int k = 0; k < cols_w; k += block_size) {
+                for (int ii = i; ii < i + block_size && ii < rows_w; ++ii) {
+                    for (int jj = j; jj < j + block_size && jj < cols_v; ++jj) {
+                        nn_float sum = 0.0;
+                        for (int kk = k; kk < k + block_size && kk < cols_w; ++kk) {
+                            sum += w->data[ii * cols_w + kk] * v->data[kk * cols_v + jj];
+                        }
+                        result->data[ii * cols_v + jj] += sum;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Previous softmax row, libm exp per element
+static void reference_softmax(matrix* inputs, matrix* outputs) {
+    int cols = inputs->cols;
+    for (int i = 0; i < inputs->rows; i++) {
+        const nn_float* in = inputs->data + i * cols;
+        nn_float* out = outputs->data + i * cols;
+        nn_float max = -NN_FLOAT_MAX;
+        for (int j = 0; j < cols; j++) {
+            if (in[j] > max) {
+                max = in[j];
+            }
+        }
+        nn_float sum = 0.0;
+        for (int j = 0; j < cols; j++) {
+            out[j] = exp(in[j] - max);
+            sum += out[j];
+        }
+        for (int j = 0; j < cols; j++) {
+            out[j] /= sum;
+        }
+    }
+}
+
+// Previous categorical cross entropy, libm log per sample
+static double reference_catCE(matrix* X, matrix* Y) {
+    double losses = 0.0;
+    for (int i = 0; i < X->rows; i++) {
+        for (int j = 0; j < Y->cols; j++) {
+            if (Y->data[i * Y->cols + j] == 1.0) {
+                double p = X->data[i * X->cols + j];
+                losses -= log(p < 1e-15 ? 1e-15 : p);
+                break;
+            }
+        }
+    }
+    return losses / X->rows;
+}
+
+// Previous Adam update, one parameter at a time through the matrices with the master branch inside the loop
+static void reference_adam(OpParams* adam, matrix* params, matrix* grads, matrix* momentums, matrix* cache) {
+    nn_float beta_1 = adam->beta_1;
+    nn_float beta_2 = adam->beta_2;
+    nn_float epsilon = adam->epsilon;
+    nn_float lr = adam->lr;
+    nn_float m_scale = 1.0 / (1.0 - pow(adam->beta_1, adam->iterations + 1));
+    nn_float c_scale = 1.0 / (1.0 - pow(adam->beta_2, adam->iterations + 1));
+    double* master = adam->w_master;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < params->rows * params->cols; i++) {
+        nn_float grad = grads->data[i];
+        momentums->data[i] = beta_1 * momentums->data[i] + (1 - beta_1) * grad;
+        cache->data[i] = beta_2 * cache->data[i] + (1 - beta_2) * grad * grad;
+        nn_float step = lr * (momentums->data[i] * m_scale) / (sqrt(cache->data[i] * c_scale) + epsilon);
+        if (master != NULL) {
+            master[i] -= step;
+            params->data[i] = (nn_float) master[i];
+        }
+        else {
+            params->data[i] -= step;
+        }
+    }
+}
+
+//////////////////////////////////////////////////// HELPERS ///////////////////////////////////////////////////////////////////////////
+
+static void fill_random(matrix* M) {
+    for (int i = 0; i < M->rows * M->cols; i++) {
+        M->data[i] = (double) rand() / RAND_MAX * 2.0 - 1.0;
+    }
+}
+
+static double max_abs_diff(matrix* a, matrix* b) {
+    double diff = 0.0;
+    for (int i = 0; i < a->rows * a->cols; i++) {
+        double d = fabs(a->data[i] - b->data[i]);
+        if (d > diff) {
+            diff = d;
+        }
+    }
+    return diff;
+}
+
+// Returns GFLOP/s, repeats until at least min_time seconds have passed
+static double time_gflops(void (*fn)(matrix*, matrix*, matrix*), matrix* w, matrix* v, matrix* result, double min_time) {
+    double flops = 2.0 * w->rows * w->cols * v->cols;
+    int reps = 0;
+    fn(w, v, result); // warm up
+    double start = omp_get_wtime();
+    double elapsed = 0.0;
+    do {
+        fn(w, v, result);
+        reps++;
+        elapsed = omp_get_wtime() - start;
+    } while (elapsed < min_time);
+    return flops * reps / elapsed * 1e-9;
+}
+
+static void run_gemm(matrix* w, matrix* v, matrix* result) {
+    gemm(false, false, w->rows, v->cols, w->cols, 1.0, w->data, w->cols, v->data, v->cols, 0.0, result->data, result->cols);
+}
+
+#ifdef USE_FLOAT32
+#define GRAD_CHECK_STEP 1e-2 // Central difference step, float32 needs a wide one to rise above its rounding
+#else
+#define GRAD_CHECK_STEP 1e-6
+#endif
+#define GRAD_CHECK_PROBES 6 // Random entries checked per tensor of a costly layer
+
+/*
+Layer under a gradient check, the loss is sum(outputs * dY) so the output gradients of the backward pass are dY.
+*/
+typedef struct {
+    void* layer;
+    matrix* X;
+    matrix* dY;
+    SequenceBatch* seq; // Recurrent layers only
+} GradCheck;
+
+static double weighted_sum(matrix* outputs, matrix* dY) {
+    double sum = 0.0;
+    for (int i = 0; i < dY->rows * dY->cols; i++) {
+        sum += (double) outputs->data[i] * dY->data[i];
+    }
+    return sum;
+}
+
+/*
+Worst relative error of the analytic gradients grad of param against central differences of loss,
+at probes random entries, or every entry when probes covers the tensor.
+The backward pass must have filled grad before the call.
+*/
+static double gradient_check(double (*loss)(GradCheck*), GradCheck* check, matrix* param, matrix* grad, int probes) {
+    int n = param->rows * param->cols;
+    bool every = probes >= n;
+    double worst = 0.0;
+    for (int k = 0; k < (every ? n : probes); k++) {
+        int i = every ? k : rand() % n;
+        nn_float saved = param->data[i];
+        nn_float plus = saved + GRAD_CHECK_STEP;
+        nn_float minus = saved - GRAD_CHECK_STEP;
+        param->data[i] = plus;
+        double loss_plus = loss(check);
+        param->data[i] = minus;
+        double loss_minus = loss(check);
+        param->data[i] = saved;
+
+        // The step the rounded entries actually took
+        double numeric = (loss_plus - loss_minus) / ((double) plus - minus);
+        double analytic = grad->data[i];
+        double err = fabs(numeric - analytic) / fmax(fabs(numeric) + fabs(analytic), 1e-3);
+        worst = (err > worst) ? err : worst;
+    }
+    return worst;
+}
+
+static double conv_check_loss(GradCheck* check) {
+    layer_cnn* layer = (layer_cnn*) check->layer;
+    cnn_weights_changed(layer);
+    cnn_forwards(check->X, layer);
+    return weighted_sum(layer->outputs, check->dY);
+}
+
+/*
+Worst gradient check error of a conv layer's inputs, weights and biases with its current algorithm.
+*/
+static double conv_gradient_error(layer_cnn* layer, matrix* X, matrix* dY) {
+    GradCheck check = {layer, X, dY, NULL};
+    cnn_forwards(X, layer);
+    cnn_backwards(dY, layer);
+    double err = gradient_check(conv_check_loss, &check, X, layer->dinputs, GRAD_CHECK_PROBES);
+    err = fmax(err, gradient_check(conv_check_loss, &check, layer->weights, layer->dweights, GRAD_CHECK_PROBES));
+    return fmax(err, gradient_check(conv_check_loss, &check, layer->biases, layer->dbiases, GRAD_CHECK_PROBES));
+}
+
+static double pool_check_loss(GradCheck* check) {
+    layer_pool* layer = (layer_pool*) check->layer;
+    pool_forwards(check->X, layer);
+    return weighted_sum(layer->outputs, check->dY);
+}
+
+/*
+Worst gradient check error of a pooling layer's inputs, every input is probed since most take no max pooling gradient.
+Inputs are a shuffled ramp around zero, no two closer than the step, so a probe never moves the max of a window.
+*/
+static double pool_gradient_error(layer_pool* layer, int batch) {
+    matrix* X = allocate_matrix(batch, layer->num_inputs);
+    matrix* dY = allocate_matrix(batch, layer->num_outputs);
+    int n = X->rows * X->cols;
+    for (int i = 0; i < n; i++) {
+        X->data[i] = (i - n / 2) * 3 * GRAD_CHECK_STEP;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int k = rand() % (i + 1);
+        nn_float t = X->data[i];
+        X->data[i] = X->data[k];
+        X->data[k] = t;
+    }
+    fill_random(dY);
+
+    GradCheck check = {layer, X, dY, NULL};
+    pool_forwards(X, layer);
+    pool_backwards(dY, layer);
+    double err = gradient_check(pool_check_loss, &check, X, layer->dinputs, n);
+    free_matrix(X);
+    free_matrix(dY);
+    return err;
+}
+
+static double batchnorm_check_loss(GradCheck* check) {
+    layer_batchnorm* layer = (layer_batchnorm*) check->layer;
+    batchnorm_forwards(check->X, layer);
+    return weighted_sum(layer->outputs, check->dY);
+}
+
+/*
+Worst gradient check error of a training BatchNorm's inputs, gamma and beta, every entry probed.
+*/
+static double batchnorm_gradient_error(layer_batchnorm* layer, int batch) {
+    matrix* X = allocate_matrix(batch, layer->num_features);
+    matrix* dY = allocate_matrix(batch, layer->num_features);
+    fill_random(X);
+    fill_random(dY);
+
+    GradCheck check = {layer, X, dY, NULL};
+    batchnorm_forwards(X, layer);
+    batchnorm_backwards(dY, layer);
+    double err = gradient_check(batchnorm_check_loss, &check, X, layer->dinputs, X->rows * X->cols);
+    err = fmax(err, gradient_check(batchnorm_check_loss, &check, layer->gamma, layer->dgamma, layer->channels));
+    err = fmax(err, gradient_check(batchnorm_check_loss, &check, layer->beta, layer->dbeta, layer->channels));
+    free_matrix(X);
+    free_matrix(dY);
+    return err;
+}
+
+static double rnn_check_loss(GradCheck* check) {
+    layer_rnn* layer = (layer_rnn*) check->layer;
+    rnn_forwards(check->X, check->seq, layer);
+    return weighted_sum(layer->outputs, check->dY);
+}
+
+/*
+Worst gradient check error of a recurrent layer's inputs, weights and biases through whole sequences,
+over a packed batch of sequences of different lengths so the running batch shrinks along the steps.
+*/
+static double rnn_gradient_error(layer_rnn* layer) {
+    int lengths[] = {5, 2, 7, 7, 1, 4};
+    SequenceBatch* seq = init_sequence_batch(lengths, 6);
+    matrix* X = allocate_matrix(seq->total_rows, layer->num_inputs);
+    matrix* dY = allocate_matrix(seq->total_rows, layer->hidden_size);
+    fill_random(X);
+    fill_random(dY);
+
+    GradCheck check = {layer, X, dY, seq};
+    layer->is_training = true;
+    layer->bptt_steps = 0;
+    rnn_forwards(X, seq, layer);
+    rnn_backwards(dY, layer);
+    double err = gradient_check(rnn_check_loss, &check, X, layer->dinputs, GRAD_CHECK_PROBES);
+    err = fmax(err, gradient_check(rnn_check_loss, &check, layer->weights, layer->dweights, GRAD_CHECK_PROBES));
+    err = fmax(err, gradient_check(rnn_check_loss, &check, layer->biases, layer->dbiases, GRAD_CHECK_PROBES));
+    free_matrix(X);
+    free_matrix(dY);
+    free_sequence_batch(seq);
+    return err;
+}
+
+//////////////////////////////////////////////////// BENCHMARKS ///////////////////////////////////////////////////////////////////////////
+
+static void bench_gemm() {
+    // MNIST shaped products, forward and backward of a 784-128-10 network with a batch of 1000
+    int shapes[][3] = {
+        {1000, 784, 128}, // X * W1
+        {1000, 128, 10},  // H * W2
+        {784, 1000, 128}, // X^T * dY (dW1)
+        {1000, 128, 784}, // dY * W1^T (dX)
+        {512, 512, 512}
+    };
+    const char* kernel_names[] = {"generic", "avx2", "avx512"};
+
+    printf("GEMM GFLOP/s (%d threads)\n", omp_get_max_threads());
+    printf("%-18s %10s %10s", "shape", "naive", "tiled32");
+    for (int k = 0; k < 3; k++) {
+        printf(" %10s", kernel_names[k]);
+    }
+    printf(" %10s\n", "max err");
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        int m = shapes[s][0];
+        int k = shapes[s][1];
+        int n = shapes[s][2];
+        matrix* w = allocate_matrix(m, k);
+        matrix* v = allocate_matrix(k, n);
+        matrix* expected = allocate_matrix(m, n);
+        matrix* result = allocate_matrix(m, n);
+        fill_random(w);
+        fill_random(v);
+
+        char label[32];
+        snprintf(label, sizeof(label), "%dx%d*%dx%d", m, k, k, n);
+        printf("%-18s", label);
+        printf(" %10.2f", time_gflops(reference_naive, w, v, expected, 0.5));
+        printf(" %10.2f", time_gflops(reference_tiled, w, v, result, 0.5));
+
+        double err = 0.0;
+        for (int kn = 0; kn < 3; kn++) {
+            if (!gemm_set_kernel(kernel_names[kn])) {
+                printf(" %10s", "n/a");
+                continue;
+            }
+            printf(" %10.2f", time_gflops(run_gemm, w, v, result, 0.5));
+            double diff = max_abs_diff(result, expected);
+            if (diff > err) {
+                err = diff;
+            }
+        }
+        printf(" %10.2e\n", err);
+
+        free_matrix(w);
+        free_matrix(v);
+        free_matrix(expected);
+        free_matrix(result);
+    }
+    printf("\n");
+}
+
+// Returns average milliseconds per call of a backward step product
+static double time_backward(void (*fn)(matrix*, matrix*, matrix*), matrix* x, matrix* dy, matrix* w, double min_time) {
+    int reps = 0;
+    double start = omp_get_wtime();
+    double elapsed = 0.0;
+    do {
+        fn(x, dy, w);
+        reps++;
+        elapsed = omp_get_wtime() - start;
+    } while (elapsed < min_time);
+    return elapsed / reps * 1e3;
+}
+
+// dW and dX the old way, materialized transposes
+static void backward_transpose_copy(matrix* x, matrix* dy, matrix* w) {
+    matrix* x_t = transpose_matrix(x);
+    matrix* w_t = transpose_matrix(w);
+    matrix* dw = matrix_mult(x_t, dy);
+    matrix* result = matrix_mult(dy, w_t);
+    free_matrix(x_t);
+    free_matrix(w_t);
+    free_matrix(dw);
+    free_matrix(result);
+}
+
+// dW and dX with operands read transposed in place
+static void backward_in_place(matrix* x, matrix* dy, matrix* w) {
+    matrix* dw = matrix_mult_tn(x, dy);
+    matrix* result = matrix_mult_nt(dy, w);
+    free_matrix(dw);
+    free_matrix(result);
+}
+
+static void bench_transpose() {
+    // Dense backward of a 784 -> 128 layer with a batch of 1000
+    matrix* x = allocate_matrix(1000, 784);
+    matrix* dy = allocate_matrix(1000, 128);
+    matrix* w = allocate_matrix(784, 128);
+    fill_random(x);
+    fill_random(dy);
+    fill_random(w);
+
+    gemm_get_kernel();
+    printf("Dense backward 1000x784 -> 128 (ms per step)\n");
+    printf("%-24s %10.3f\n", "transpose + mult", time_backward(backward_transpose_copy, x, dy, w, 0.5));
+    printf("%-24s %10.3f\n", "mult_tn + mult_nt", time_backward(backward_in_place, x, dy, w, 0.5));
+    printf("\n");
+
+    free_matrix(x);
+    free_matrix(dy);
+    free_matrix(w);
+}
+
+static void bench_fused_forward() {
+    // Hidden and output layer of a 784-128-10 network with a batch of 1000
+    int batch = 1000;
+    matrix* x = allocate_matrix(batch, 784);
+    fill_random(x);
+    layer_dense* hidden = init_layer(784, 128);
+    layer_dense* output = init_layer(128, 10);
+    ReluParams* relu = init_relu();
+    SoftMaxParams* softmax = init_softmax();
+    int reps = 200;
+
+    printf("Dense forward, batch 1000, 784 -> 128 -> 10 (ms per step)\n");
+
+    double start = omp_get_wtime();
+    for (int r = 0; r < reps; r++) {
+        dense_forwards(x, hidden);
+        relu_forwards(relu, hidden->outputs);
+        dense_forwards(relu->outputs, output);
+        softmax_forwards(softmax, output->outputs);
+    }
+    printf("%-24s %10.3f\n", "dense + activation", (omp_get_wtime() - start) / reps * 1e3);
+
+    start = omp_get_wtime();
+    for (int r = 0; r < reps; r++) {
+        dense_relu_forwards(x, hidden, relu);
+        dense_softmax_forwards(relu->outputs, output, softmax);
+    }
+    printf("%-24s %10.3f\n", "fused", (omp_get_wtime() - start) / reps * 1e3);
+    printf("\n");
+
+    free_matrix(x);
+    free_layer(hidden);
+    free_layer(output);
+    free_relu(relu);
+    free_softmax(softmax);
+}
+
+static void bench_softmax() {
+    // Row wise softmax and loss of a batch of 256, from the 10 class head up to a wide output layer
+    int batch = 256;
+    int widths[] = {10, 1000, 10000};
+
+    printf("Softmax + catCE loss, batch 256, kernel %s (ms per batch)\n", fastmath_get_kernel()->name);
+    printf("%-8s %10s %10s %10s %10s %12s %12s\n", "classes", "libm", "fast", "loss libm", "loss fast", "max diff", "loss diff");
+    for (int w = 0; w < 3; w++) {
+        int cols = widths[w];
+        matrix* logits = allocate_matrix(batch, cols);
+        matrix* expected = allocate_matrix(batch, cols);
+        matrix* probs = allocate_matrix(batch, cols);
+        matrix* Y = allocate_matrix(batch, cols);
+        for (int i = 0; i < batch * cols; i++) {
+            logits->data[i] = (double) rand() / RAND_MAX * 20.0 - 10.0;
+        }
+        memset(Y->data, 0, batch * cols * sizeof(nn_float));
+        for (int i = 0; i < batch; i++) {
+            Y->data[i * cols + rand() % cols] = 1.0;
+        }
+        Loss* loss = init_loss(CATCROSSENTROPY);
+        int reps = 20000000 / (batch * cols) + 1;
+
+        double start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            reference_softmax(logits, expected);
+        }
+        double libm_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            softmax_inference_forwards(logits, probs);
+        }
+        double fast_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        double expected_loss = 0.0;
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            expected_loss = reference_catCE(expected, Y);
+        }
+        double loss_libm_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            compute_loss(loss, probs, Y);
+        }
+        double loss_fast_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        printf("%-8d %10.4f %10.4f %10.4f %10.4f %12.2e %12.2e\n", cols, libm_ms, fast_ms, loss_libm_ms, loss_fast_ms,
+               max_abs_diff(expected, probs), fabs(expected_loss - loss->loss));
+
+        free(loss);
+        free_matrix(logits);
+        free_matrix(expected);
+        free_matrix(probs);
+        free_matrix(Y);
+    }
+    printf("\n");
+}
+
+static void bench_softmax_loss() {
+    // Softmax, catCE loss and logit gradient of a batch of 256, separate passes on one hot labels against the fused op
+    int batch = 256;
+    int widths[] = {10, 1000, 10000};
+
+    printf("Softmax + catCE forward and backward, batch 256 (ms per batch)\n");
+    printf("%-8s %10s %10s %12s %12s\n", "classes", "separate", "fused", "loss diff", "grad diff");
+    for (int w = 0; w < 3; w++) {
+        int cols = widths[w];
+        matrix* logits = allocate_matrix(batch, cols);
+        matrix* Y = allocate_matrix(batch, cols);
+        int* labels = malloc(batch * sizeof(int));
+        for (int i = 0; i < batch * cols; i++) {
+            logits->data[i] = (double) rand() / RAND_MAX * 20.0 - 10.0;
+        }
+        memset(Y->data, 0, batch * cols * sizeof(nn_float));
+        for (int i = 0; i < batch; i++) {
+            labels[i] = rand() % cols;
+            Y->data[i * cols + labels[i]] = 1.0;
+        }
+        SoftMaxParams* separate = init_softmax();
+        SoftMaxParams* fused = init_softmax();
+        Loss* loss = init_loss(CATCROSSENTROPY);
+        int reps = 20000000 / (batch * cols) + 1;
+
+        double start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            softmax_forwards(separate, logits);
+            compute_loss(loss, separate->outputs, Y);
+            softmax_backwards(separate, Y);
+        }
+        double separate_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        double fused_loss = 0.0;
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            fused_loss = softmax_catCE_forwards_backwards(fused, logits, labels);
+        }
+        double fused_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        printf("%-8d %10.4f %10.4f %12.2e %12.2e\n", cols, separate_ms, fused_ms, fabs(loss->loss - fused_loss),
+               max_abs_diff(separate->dinputs, fused->dinputs));
+
+        free_softmax(separate);
+        free_softmax(fused);
+        free(separate);
+        free(fused);
+        free(loss);
+        free(labels);
+        free_matrix(logits);
+        free_matrix(Y);
+    }
+    printf("\n");
+}
+
+/*
+Naive convolution, every output pixel sums its taps with the padding checked per tap.
+*/
+static void reference_conv(layer_cnn* layer, matrix* X, matrix* Y) {
+    ConvParams* p = &layer->params;
+    int in_per_group = p->in_channels / p->groups;
+    int out_per_group = p->out_channels / p->groups;
+    for (int n = 0; n < X->rows; n++) {
+        for (int oc = 0; oc < p->out_channels; oc++) {
+            int g = oc / out_per_group;
+            for (int oh = 0; oh < layer->out_height; oh++) {
+                for (int ow = 0; ow < layer->out_width; ow++) {
+                    nn_float sum = layer->biases->data[oc];
+                    for (int c = 0; c < in_per_group; c++) {
+                        for (int ki = 0; ki < p->kernel_h; ki++) {
+                            for (int kj = 0; kj < p->kernel_w; kj++) {
+                                int ih = oh * p->stride_h - p->pad_h + ki * p->dilation_h;
+                                int iw = ow * p->stride_w - p->pad_w + kj * p->dilation_w;
+                                if (ih < 0 || iw < 0 || ih >= p->in_height || iw >= p->in_width) {
+                                    continue;
+                                }
+                                sum += layer->weights->data[oc * layer->weights->cols + (c * p->kernel_h + ki) * p->kernel_w + kj]
+                                       * X->data[(size_t) n * X->cols + ((g * in_per_group + c) * p->in_height + ih) * p->in_width + iw];
+                            }
+                        }
+                    }
+                    Y->data[(size_t) n * Y->cols + (oc * layer->out_height + oh) * layer->out_width + ow] = sum;
+                }
+            }
+        }
+    }
+}
+
+static void bench_conv() {
+    // Forward of common conv shapes with every supported algorithm against the naive loops, batch 32,
+    // then forward + backward with the algorithm init picked and the cost of picking it
+    int batch = 32;
+    const char* names[] = {"stem 3->32 3x3 32x32", "3x3 32->64 16x16", "3x3 128->128 8x8", "3x3 64->64 32x32",
+                           "1x1 64->128 16x16", "depthwise 3x3 64 16x16", "3x3 s2 32->64 32x32", "7x7 16->16 32x32",
+                           "11x11 32->32 16x16", "3x3 s2 d2 g4 32->64 32x32"};
+    int num_shapes = 10;
+    ConvParams shapes[10];
+    shapes[0] = conv_params(3, 32, 32, 32, 3);
+    shapes[1] = conv_params(32, 16, 16, 64, 3);
+    shapes[2] = conv_params(128, 8, 8, 128, 3);
+    shapes[3] = conv_params(64, 32, 32, 64, 3);
+    shapes[4] = conv_params(64, 16, 16, 128, 1);
+    shapes[5] = conv_params(64, 16, 16, 64, 3);
+    shapes[5].groups = 64;
+    shapes[6] = conv_params(32, 32, 32, 64, 3);
+    shapes[6].stride_h = shapes[6].stride_w = 2;
+    shapes[7] = conv_params(16, 32, 32, 16, 7);
+    shapes[8] = conv_params(32, 16, 16, 32, 11);
+    shapes[9] = conv_params(32, 32, 32, 64, 3);
+    shapes[9].stride_h = shapes[9].stride_w = 2;
+    shapes[9].dilation_h = shapes[9].dilation_w = 2;
+    shapes[9].groups = 4;
+    for (int i = 0; i < num_shapes; i++) {
+        shapes[i].pad_h = shapes[i].pad_w = shapes[i].kernel_h / 2 * shapes[i].dilation_h; // same padding
+    }
+    ConvAlgorithm algorithms[] = {CONV_IM2COL, CONV_DIRECT, CONV_WINOGRAD_2X2, CONV_WINOGRAD_4X4, CONV_FFT};
+
+    printf("Conv2D, batch 32 (forward ms per batch, - unsupported, grad err over every supported algorithm)\n");
+    printf("%-26s %8s %8s %8s %8s %8s %8s %12s %9s %9s %10s %10s\n", "shape", "naive", "im2col", "direct", "wino2x2", "wino4x4",
+           "fft", "auto", "train ms", "init ms", "max diff", "grad err");
+    for (int s = 0; s < num_shapes; s++) {
+        double start = omp_get_wtime();
+        layer_cnn* layer = init_cnn_layer(shapes[s]);
+        double init_ms = (omp_get_wtime() - start) * 1e3;
+        ConvAlgorithm chosen = layer->algorithm;
+        matrix* X = allocate_matrix(batch, layer->num_inputs);
+        matrix* dY = allocate_matrix(batch, layer->num_outputs);
+        matrix* reference = allocate_matrix(batch, layer->num_outputs);
+        fill_random(X);
+        fill_random(dY);
+        double flops = 2.0 * batch * layer->num_outputs * layer->weights->cols;
+        int reps = 2e9 / flops + 1;
+
+        start = omp_get_wtime();
+        reference_conv(layer, X, reference);
+        double naive_ms = (omp_get_wtime() - start) * 1e3;
+
+        printf("%-26s %8.2f", names[s], naive_ms);
+        double diff = 0.0;
+        for (int a = 0; a < 5; a++) {
+            if (!conv_algorithm_supported(&shapes[s], algorithms[a])) {
+                printf(" %8s", "-");
+                continue;
+            }
+            layer->algorithm = algorithms[a];
+            cnn_forwards(X, layer); // builds the plan
+            start = omp_get_wtime();
+            for (int r = 0; r < reps; r++) {
+                cnn_forwards(X, layer);
+            }
+            printf(" %8.2f", (omp_get_wtime() - start) / reps * 1e3);
+            double d = max_abs_diff(layer->outputs, reference);
+            diff = (d > diff) ? d : diff;
+        }
+
+        // Training pays the weight transform every step
+        layer->algorithm = chosen;
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            cnn_forwards(X, layer);
+            cnn_backwards(dY, layer);
+        }
+        double train_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        // Gradients of every algorithm against central differences, on two samples to keep the probes cheap
+        matrix* check_X = allocate_matrix(2, layer->num_inputs);
+        matrix* check_dY = allocate_matrix(2, layer->num_outputs);
+        fill_random(check_X);
+        fill_random(check_dY);
+        double grad_err = 0.0;
+        for (int a = 0; a < 5; a++) {
+            if (conv_algorithm_supported(&shapes[s], algorithms[a])) {
+                layer->algorithm = algorithms[a];
+                grad_err = fmax(grad_err, conv_gradient_error(layer, check_X, check_dY));
+            }
+        }
+
+        printf(" %12s %9.2f %9.2f %10.2e %10.2e\n", conv_algorithm_name(chosen), train_ms, init_ms, diff, grad_err);
+
+        free_cnn_layer(layer);
+        free(layer);
+        free_matrix(X);
+        free_matrix(dY);
+        free_matrix(reference);
+        free_matrix(check_X);
+        free_matrix(check_dY);
+    }
+    printf("\n");
+}
+
+/*
+Recurrent forward the unfused way: per step, one GEMM per gate for the inputs and one for the state, libm activations.
+gates (total_rows x gate_size) and recurrent (batch x gate_size) are scratch, cells (total_rows x hidden_size) LSTM only.
+*/
+static void reference_rnn_unfused(layer_rnn* layer, SequenceBatch* seq, matrix* X, matrix* Y, matrix* gates,
+                                  matrix* recurrent, matrix* cells) {
+    int H = layer->hidden_size;
+    int G = layer->gate_size;
+    int num_gates = G / H;
+    const nn_float* w_h = layer->weights->data + (size_t) layer->num_inputs * G;
+    const nn_float* b = layer->biases->data;
+    for (int t = 0; t < seq->num_steps; t++) {
+        int rows = seq->batch_sizes[t];
+        nn_float* z = gates->data + (size_t) seq->offsets[t] * G;
+        const nn_float* h_prev = (t > 0) ? Y->data + (size_t) seq->offsets[t - 1] * H : NULL;
+        for (int g = 0; g < num_gates; g++) {
+            gemm(false, false, rows, H, layer->num_inputs, 1.0, X->data + (size_t) seq->offsets[t] * X->cols, X->cols,
+                 layer->weights->data + g * H, G, 0.0, z + g * H, G);
+            if (t > 0) {
+                gemm(false, false, rows, H, H, 1.0, h_prev, H, w_h + g * H, G, 0.0, recurrent->data + g * H, G);
+            }
+        }
+        for (int r = 0; r < rows; r++) {
+            nn_float* zr = z + (size_t) r * G;
+            const nn_float* rec = recurrent->data + (size_t) r * G;
+            nn_float* h = Y->data + (size_t) (seq->offsets[t] + r) * H;
+            for (int k = 0; k < H; k++) {
+                nn_float hp = (t > 0) ? h_prev[(size_t) r * H + k] : 0.0;
+                if (layer->type == RNN_LSTM) {
+                    nn_float pre[4];
+                    for (int g = 0; g < 4; g++) {
+                        pre[g] = zr[g * H + k] + b[g * H + k] + (t > 0 ? rec[g * H + k] : 0.0);
+                    }
+                    nn_float i = 1.0 / (1.0 + exp(-pre[0]));
+                    nn_float f = 1.0 / (1.0 + exp(-pre[1]));
+                    nn_float o = 1.0 / (1.0 + exp(-pre[3]));
+                    nn_float cp = (t > 0) ? cells->data[(size_t) (seq->offsets[t - 1] + r) * H + k] : 0.0;
+                    nn_float c = f * cp + i * tanh(pre[2]);
+                    cells->data[(size_t) (seq->offsets[t] + r) * H + k] = c;
+                    h[k] = o * tanh(c);
+                }
+                else {
+                    nn_float rg = 1.0 / (1.0 + exp(-(zr[k] + b[k] + (t > 0 ? rec[k] : 0.0))));
+                    nn_float zg = 1.0 / (1.0 + exp(-(zr[H + k] + b[H + k] + (t > 0 ? rec[H + k] : 0.0))));
+                    nn_float hn = (t > 0 ? rec[2 * H + k] : 0.0) + b[G + k];
+                    nn_float n = tanh(zr[2 * H + k] + b[2 * H + k] + rg * hn);
+                    h[k] = (1.0 - zg) * n + zg * hp;
+                }
+            }
+        }
+    }
+}
+
+static void bench_recurrent() {
+    // LSTM and GRU over a packed batch of 32 sequences of 16 to 64 steps: the per gate per step GEMMs against
+    // the fused layer (one input GEMM for every step, one recurrent GEMM per step), then forward + backward
+    int batch = 32;
+    int lengths[32];
+    for (int i = 0; i < batch; i++) {
+        lengths[i] = 16 + rand() % 49;
+    }
+    SequenceBatch* seq = init_sequence_batch(lengths, batch);
+    int shapes[][2] = {{64, 128}, {128, 256}};
+    RnnType types[] = {RNN_LSTM, RNN_GRU};
+
+    printf("Recurrent layers, batch %d of 16-64 steps, %d packed rows (ms per batch)\n", batch, seq->total_rows);
+    printf("%-20s %12s %10s %12s %12s %10s %10s\n", "layer", "per gate", "fused", "train", "train bptt16", "max diff",
+           "grad err");
+    for (int s = 0; s < 2; s++) {
+        for (int k = 0; k < 2; k++) {
+            int in = shapes[s][0];
+            int hidden = shapes[s][1];
+            layer_rnn* layer = init_rnn_layer(types[k], in, hidden);
+            matrix* X = allocate_matrix(seq->total_rows, in);
+            matrix* dY = allocate_matrix(seq->total_rows, hidden);
+            matrix* reference = allocate_matrix(seq->total_rows, hidden);
+            matrix* gates = allocate_matrix(seq->total_rows, layer->gate_size);
+            matrix* recurrent = allocate_matrix(batch, layer->gate_size);
+            matrix* cells = allocate_matrix(seq->total_rows, hidden);
+            fill_random(X);
+            fill_random(dY);
+            int reps = 5;
+
+            double start = omp_get_wtime();
+            for (int r = 0; r < reps; r++) {
+                reference_rnn_unfused(layer, seq, X, reference, gates, recurrent, cells);
+            }
+            double unfused_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+            layer->is_training = false;
+            rnn_forwards(X, seq, layer);
+            start = omp_get_wtime();
+            for (int r = 0; r < reps; r++) {
+                rnn_forwards(X, seq, layer);
+            }
+            double fused_ms = (omp_get_wtime() - start) / reps * 1e3;
+            double diff = max_abs_diff(layer->outputs, reference);
+
+            layer->is_training = true;
+            double train_ms[2];
+            for (int b = 0; b < 2; b++) {
+                layer->bptt_steps = b ? 16 : 0;
+                start = omp_get_wtime();
+                for (int r = 0; r < reps; r++) {
+                    rnn_forwards(X, seq, layer);
+                    rnn_backwards(dY, layer);
+                }
+                train_ms[b] = (omp_get_wtime() - start) / reps * 1e3;
+            }
+
+            double grad_err = rnn_gradient_error(layer);
+
+            char name[32];
+            snprintf(name, sizeof(name), "%s %d->%d", types[k] == RNN_LSTM ? "lstm" : "gru", in, hidden);
+            printf("%-20s %12.2f %10.2f %12.2f %12.2f %10.2e %10.2e\n", name, unfused_ms, fused_ms, train_ms[0], train_ms[1],
+                   diff, grad_err);
+
+            free_rnn_layer(layer);
+            free(layer);
+            free_matrix(X);
+            free_matrix(dY);
+            free_matrix(reference);
+            free_matrix(gates);
+            free_matrix(recurrent);
+            free_matrix(cells);
+        }
+    }
+    free_sequence_batch(seq);
+    printf("\n");
+}
+
+/*
+Random BatchNorm statistics and parameters, the same for every layer seeded alike.
+*/
+static void fill_batchnorm(layer_batchnorm* bn) {
+    for (int c = 0; c < bn->channels; c++) {
+        bn->gamma->data[c] = 0.5 + (double) rand() / RAND_MAX;
+        bn->beta->data[c] = (double) rand() / RAND_MAX - 0.5;
+        bn->running_mean->data[c] = (double) rand() / RAND_MAX - 0.5;
+        bn->running_var->data[c] = 0.5 + (double) rand() / RAND_MAX;
+    }
+}
+
+static void bench_normalization() {
+    // Pooling and BatchNorm passes over a conv activation, batch 32 x 64 channels x 32x32, in ms and in GB/s
+    // of the bytes each pass has to move (inputs and gradients read, outputs written)
+    int batch = 32;
+    matrix* X = allocate_matrix(batch, 64 * 32 * 32);
+    matrix* dY = allocate_matrix(batch, 64 * 32 * 32);
+    matrix* pooled_dY = allocate_matrix(batch, 64 * 16 * 16);
+    matrix* outputs = allocate_matrix(batch, 64 * 32 * 32);
+    fill_random(X);
+    fill_random(dY);
+    fill_random(pooled_dY);
+    layer_pool* max_pool = init_pool_layer(pool_params(POOL_MAX, 64, 32, 32, 2));
+    layer_pool* avg_pool = init_pool_layer(pool_params(POOL_AVG, 64, 32, 32, 2));
+    layer_batchnorm* bn = init_batchnorm_layer(64, 32 * 32);
+    double in_bytes = (double) X->rows * X->cols * sizeof(nn_float);
+    double out_bytes = in_bytes / 4;
+    int reps = 50;
+
+    printf("Pooling and BatchNorm, batch %d x 64 x 32x32 (ms per batch, GB/s)\n", batch);
+    const char* names[] = {"maxpool 2x2 forward", "maxpool 2x2 backward", "avgpool 2x2 forward", "avgpool 2x2 backward",
+                           "batchnorm train forward", "batchnorm backward", "batchnorm inference"};
+    double bytes[] = {in_bytes + out_bytes, out_bytes + in_bytes, in_bytes + out_bytes, out_bytes + in_bytes,
+                      2 * in_bytes + 2 * in_bytes, 3 * in_bytes + in_bytes, 2 * in_bytes};
+    for (int k = 0; k < 7; k++) {
+        double start = 0.0;
+        for (int r = -1; r < reps; r++) {
+            if (r == 0) {
+                start = omp_get_wtime();
+            }
+            switch (k) {
+                case 0: pool_forwards(X, max_pool); break;
+                case 1: pool_backwards(pooled_dY, max_pool); break;
+                case 2: pool_forwards(X, avg_pool); break;
+                case 3: pool_backwards(pooled_dY, avg_pool); break;
+                case 4: batchnorm_forwards(X, bn); break;
+                case 5: batchnorm_backwards(dY, bn); break;
+                default: batchnorm_inference_forwards(X, bn, outputs); break;
+            }
+        }
+        double seconds = (omp_get_wtime() - start) / reps;
+        printf("%-24s %10.3f %10.2f\n", names[k], seconds * 1e3, bytes[k] / seconds / 1e9);
+    }
+
+    // Gradients against central differences, 3x3 stride 2 windows with padding so the edges are checked too
+    double grad_err[3];
+    for (int k = 0; k < 2; k++) {
+        PoolParams params = pool_params(k ? POOL_AVG : POOL_MAX, 4, 7, 7, 3);
+        params.stride_h = params.stride_w = 2;
+        params.pad_h = params.pad_w = 1;
+        layer_pool* layer = init_pool_layer(params);
+        grad_err[k] = pool_gradient_error(layer, 2);
+        free_pool_layer(layer);
+        free(layer);
+    }
+    layer_batchnorm* check_bn = init_batchnorm_layer(8, 9);
+    fill_batchnorm(check_bn);
+    grad_err[2] = batchnorm_gradient_error(check_bn, 4);
+    free_batchnorm_layer(check_bn);
+    free(check_bn);
+    printf("grad err maxpool 3x3 s2 p1 %.2e, avgpool 3x3 s2 p1 %.2e, batchnorm %.2e\n", grad_err[0], grad_err[1], grad_err[2]);
+
+    // Dense + BatchNorm + ReLU blocks served as separate steps against the BatchNorms folded into the weights
+    int rows = 256;
+    matrix* inputs = allocate_matrix(rows, 784);
+    fill_random(inputs);
+    network* nets[2];
+    for (int fold = 0; fold < 2; fold++) {
+        srand(7);
+        network* net = init_network();
+        network_add_dense(net, 784, 512);
+        fill_batchnorm(network_add_batchnorm(net, 512));
+        network_add_relu(net);
+        network_add_dense(net, 512, 512);
+        fill_batchnorm(network_add_batchnorm(net, 512));
+        network_add_relu(net);
+        network_add_dense(net, 512, 10);
+        network_add_softmax(net);
+        if (fold) {
+            network_compile_inference(net, rows);
+        }
+        else {
+            network_compile(net, rows);
+        }
+        nets[fold] = net;
+    }
+    matrix* separate = allocate_matrix(rows, 10);
+    reps = 20;
+    printf("\nBatchNorm folding, 784-512-512-10 of dense + batchnorm + relu blocks, batch %d (ms per batch, steps)\n", rows);
+    for (int fold = 0; fold < 2; fold++) {
+        network_predict(nets[fold], inputs);
+        double start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_predict(nets[fold], inputs);
+        }
+        printf("%-24s %10.3f %10d\n", fold ? "folded" : "separate steps", (omp_get_wtime() - start) / reps * 1e3,
+               nets[fold]->num_steps);
+        if (!fold) {
+            memcpy(separate->data, nets[0]->predictions->data, (size_t) rows * 10 * sizeof(nn_float));
+        }
+    }
+    printf("max diff %.2e\n\n", max_abs_diff(separate, nets[1]->predictions));
+
+    free_network(nets[0]);
+    free_network(nets[1]);
+    free_matrix(separate);
+    free_matrix(inputs);
+    free_pool_layer(max_pool);
+    free_pool_layer(avg_pool);
+    free_batchnorm_layer(bn);
+    free(max_pool);
+    free(avg_pool);
+    free(bn);
+    free_matrix(X);
+    free_matrix(dY);
+    free_matrix(pooled_dY);
+    free_matrix(outputs);
+}
+
+static void bench_optimizers() {
+    // One update of a 4096 x 1024 dense layer per optimizer, in ms and in GB/s of the parameters, gradients
+    // and state each step has to read and write, against the previous element at a time Adam update
+    layer_dense* layer = init_layer(4096, 1024);
+    fill_random(layer->dweights);
+    fill_random(layer->dbiases);
+    double tensor_bytes = (double) layer->weights->rows * layer->weights->cols * sizeof(nn_float);
+    int reps = 20;
+
+    printf("Optimizers, one update of a 4096 x 1024 dense layer (ms per step, GB/s)\n");
+    OpParams* opts[] = {init_sgd(1e-4, 0.0), init_sgd_momentum(1e-4, 0.9, 0.0), init_adagrad(1e-4, 1e-7, 0.0),
+                        init_rmsprop(1e-4, 0.9, 1e-7, 0.0), init_adam(0.9, 0.999, 1e-7, 1e-4, 0.0)};
+    int streams[] = {3, 5, 5, 5, 7}; // params read and written, grads read, each state read and written
+    for (int k = 0; k < 5; k++) {
+        double start = 0.0;
+        for (int r = -1; r < reps; r++) {
+            if (r == 0) {
+                start = omp_get_wtime();
+            }
+            PARALLEL_CALL(pre_update_params(opts[k]); update_dense_params(opts[k], layer); post_update_params(opts[k]));
+        }
+        double seconds = (omp_get_wtime() - start) / reps;
+        printf("%-24s %10.3f %10.2f\n", optimizer_name(opts[k]->optimizer), seconds * 1e3,
+               streams[k] * tensor_bytes / seconds / 1e9);
+    }
+
+    OpParams* adam = opts[4];
+    double start = omp_get_wtime();
+    for (int r = 0; r < reps; r++) {
+        reference_adam(adam, layer->weights, layer->dweights, adam->w_momentums, adam->w_cache);
+    }
+    double seconds = (omp_get_wtime() - start) / reps;
+    printf("%-24s %10.3f %10.2f\n\n", "adam per element", seconds * 1e3, 7 * tensor_bytes / seconds / 1e9);
+
+    for (int k = 0; k < 5; k++) {
+        free_optimizer(opts[k]);
+        free(opts[k]);
+    }
+    free_layer(layer);
+    free(layer);
+}
+
+/*
+Two layer classifier on (in x 128) first weights, the first layer sparse or not.
+*/
+static network* make_wide_network(int in, bool sparse) {
+    network* net = init_network();
+    if (sparse) {
+        network_add_sparse_dense(net, in, 128);
+    }
+    else {
+        network_add_dense(net, in, 128);
+    }
+    network_add_relu(net);
+    network_add_dense(net, 128, 10);
+    network_add_softmax(net);
+    network_set_loss(net, CATCROSSENTROPY);
+    network_set_adam(net, 0.9, 0.999, 1e-7, 0.001, 0.0);
+    network_compile(net, 256);
+    return net;
+}
+
+static void bench_sparse() {
+    // Training step and predict on 1% dense inputs, dense batch against CSR batch of the same values
+    int batch = 256;
+    int widths[] = {1000, 20000, 100000};
+
+    printf("Sparse inputs, 1%% nonzeros, batch 256, inputs -> 128 -> 10 (ms per batch)\n");
+    printf("%-8s %12s %12s %12s %12s %12s\n", "inputs", "dense train", "sparse train", "dense pred", "sparse pred", "pred diff");
+    for (int w = 0; w < 3; w++) {
+        int in = widths[w];
+        matrix* X = allocate_matrix(batch, in);
+        int* labels = malloc(batch * sizeof(int));
+        for (int i = 0; i < batch; i++) {
+            for (int k = 0; k < in / 100; k++) {
+                X->data[(size_t) i * in + rand() % in] = (double) rand() / RAND_MAX;
+            }
+            labels[i] = rand() % 10;
+        }
+        sparse_matrix* S = dense_to_sparse(X);
+        network* dense = make_wide_network(in, false);
+        network* sparse = make_wide_network(in, true);
+        int reps = 200000000 / ((size_t) batch * in) + 1;
+
+        double start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_train_step_labels(dense, X, labels);
+        }
+        double dense_train_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_train_step_sparse(sparse, S, labels);
+        }
+        double sparse_train_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        // Same weights for the predict comparison
+        memcpy(sparse->plan[0].dense->weights->data, dense->plan[0].dense->weights->data, (size_t) in * 128 * sizeof(nn_float));
+        memcpy(sparse->plan[0].dense->biases->data, dense->plan[0].dense->biases->data, 128 * sizeof(nn_float));
+        memcpy(sparse->plan[1].dense->weights->data, dense->plan[1].dense->weights->data, 128 * 10 * sizeof(nn_float));
+        memcpy(sparse->plan[1].dense->biases->data, dense->plan[1].dense->biases->data, 10 * sizeof(nn_float));
+
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_predict(dense, X);
+        }
+        double dense_pred_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_predict_sparse(sparse, S);
+        }
+        double sparse_pred_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+        printf("%-8d %12.3f %12.3f %12.3f %12.3f %12.2e\n", in, dense_train_ms, sparse_train_ms, dense_pred_ms,
+               sparse_pred_ms, max_abs_diff(dense->predictions, sparse->predictions));
+
+        free_network(dense);
+        free_network(sparse);
+        free_sparse_matrix(S);
+        free(labels);
+        free_matrix(X);
+    }
+    printf("\n");
+}
+
+/*
+Synthetic MNIST shaped data, 784 features in [0, 1] around one of 10 class prototypes.
+*/
+static void make_synthetic_mnist(matrix* X, matrix* Y, matrix* prototypes) {
+    for (int i = 0; i < X->rows; i++) {
+        int label = rand() % 10;
+        for (int j = 0; j < X->cols; j++) {
+            nn_float noise = (nn_float) rand() / RAND_MAX - 0.5;
+            X->data[i * X->cols + j] = 0.05 * prototypes->data[label * X->cols + j] + noise;
+        }
+        for (int j = 0; j < 10; j++) {
+            Y->data[i * 10 + j] = (j == label) ? 1.0 : 0.0;
+        }
+    }
+}
+
+static double accuracy(matrix* predictions, matrix* Y) {
+    int correct = 0;
+    for (int i = 0; i < predictions->rows; i++) {
+        int best = 0;
+        for (int j = 1; j < predictions->cols; j++) {
+            if (predictions->data[i * predictions->cols + j] > predictions->data[i * predictions->cols + best]) {
+                best = j;
+            }
+        }
+        correct += (Y->data[i * Y->cols + best] == 1.0);
+    }
+    return (double) correct / predictions->rows;
+}
+
+/*
+One training step, every primitive joins the enclosing parallel region when there is one.
+*/
+static void train_step(matrix* x, matrix* y, layer_dense* hidden, layer_dense* output, ReluParams* relu,
+                       SoftMaxParams* softmax, OpParams* adam_hidden, OpParams* adam_output) {
+    dense_relu_forwards(x, hidden, relu);
+    dense_softmax_forwards(relu->outputs, output, softmax);
+    softmax_backwards(softmax, y);
+    dense_backwards(softmax->dinputs, output);
+    relu_backwards(relu, output->dinputs);
+    dense_backwards(relu->dinputs, hidden);
+
+    pre_update_params(adam_hidden);
+    update_dense_params(adam_hidden, hidden);
+    post_update_params(adam_hidden);
+    pre_update_params(adam_output);
+    update_dense_params(adam_output, output);
+    post_update_params(adam_output);
+}
+
+/*
+One training step on the thread pool.
+Gradients of each layer are split into independent dW / dX tasks,
+the output layer's Adam update runs while the hidden layer's backward pass does.
+*/
+static void train_step_pool(ThreadPool* pool, matrix* x, matrix* y, layer_dense* hidden, layer_dense* output, ReluParams* relu,
+                            SoftMaxParams* softmax, OpParams* adam_hidden, OpParams* adam_output) {
+    TaskGroup grads;
+    TaskGroup updates;
+    init_task_group(&grads);
+    init_task_group(&updates);
+
+    dense_relu_forwards(x, hidden, relu);
+    dense_softmax_forwards(relu->outputs, output, softmax);
+    softmax_backwards(softmax, y);
+
+    dense_backwards_async(pool, &grads, softmax->dinputs, output, true);
+    threadpool_wait(pool, &grads);
+    update_dense_params_async(pool, &updates, adam_output, output);
+
+    relu_backwards(relu, output->dinputs);
+    dense_backwards_async(pool, &grads, relu->dinputs, hidden, true);
+    threadpool_wait(pool, &grads);
+    update_dense_params_async(pool, &updates, adam_hidden, hidden);
+    threadpool_wait(pool, &updates);
+}
+
+typedef enum {
+    REGION_PER_PRIMITIVE, // Every primitive forks and joins its own team
+    REGION_PER_STEP, // Each step runs inside one persistent parallel region
+    THREAD_POOL // Backward and optimizer run as work stealing tasks
+} TrainMode;
+
+static void bench_training(TrainMode mode, ThreadPool* pool) {
+    // 784-128-10 MLP, mini batches of 100, Adam
+    int train_size = 5000;
+    int test_size = 1000;
+    int batch = 100;
+    int epochs = 5;
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(train_size, 784);
+    matrix* Y = allocate_matrix(train_size, 10);
+    matrix* X_test = allocate_matrix(test_size, 784);
+    matrix* Y_test = allocate_matrix(test_size, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+    make_synthetic_mnist(X_test, Y_test, prototypes);
+
+    layer_dense* hidden = init_layer(784, 128);
+    layer_dense* output = init_layer(128, 10);
+    ReluParams* relu = init_relu();
+    SoftMaxParams* softmax = init_softmax();
+    OpParams* adam_hidden = init_adam(0.9, 0.999, 1e-7, 1e-3, 0.0);
+    OpParams* adam_output = init_adam(0.9, 0.999, 1e-7, 1e-3, 0.0);
+    Loss* loss = init_loss(CATCROSSENTROPY);
+
+    // Keep double master weights when storage is float
+    adam_hidden->useMasterWeights = (NN_DTYPE == FLOAT32);
+    adam_output->useMasterWeights = (NN_DTYPE == FLOAT32);
+
+    int steps = 0;
+    double start = omp_get_wtime();
+    for (int e = 0; e < epochs; e++) {
+        for (int b = 0; b + batch <= train_size; b += batch) {
+            matrix x_batch;
+            matrix y_batch;
+            shallow_cpy_matrix(X, &x_batch, b, batch);
+            shallow_cpy_matrix(Y, &y_batch, b, batch);
+
+            if (mode == REGION_PER_STEP) {
+                #pragma omp parallel
+                train_step(&x_batch, &y_batch, hidden, output, relu, softmax, adam_hidden, adam_output);
+            }
+            else if (mode == THREAD_POOL) {
+                train_step_pool(pool, &x_batch, &y_batch, hidden, output, relu, softmax, adam_hidden, adam_output);
+            }
+            else {
+                train_step(&x_batch, &y_batch, hidden, output, relu, softmax, adam_hidden, adam_output);
+            }
+            steps++;
+        }
+    }
+    double step_time = (omp_get_wtime() - start) / steps;
+
+    // Evaluate on held out data
+    dense_relu_forwards(X_test, hidden, relu);
+    dense_softmax_forwards(relu->outputs, output, softmax);
+    compute_loss(loss, softmax->outputs, Y_test);
+
+    const char* mode_names[] = {"region per primitive", "one region per step", "thread pool"};
+    printf("Training 784-128-10, batch %d, %d epochs (%s, %s)\n", batch, epochs,
+           (NN_DTYPE == FLOAT32) ? "float32, float64 master weights" : "float64", mode_names[mode]);
+    printf("%-24s %10.3f\n", "ms per step", step_time * 1e3);
+    printf("%-24s %10.4f\n", "test loss", loss->loss);
+    printf("%-24s %10.4f\n", "test accuracy", accuracy(softmax->outputs, Y_test));
+    printf("\n");
+
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+    free_matrix(X_test);
+    free_matrix(Y_test);
+    free_layer(hidden);
+    free_layer(output);
+    free_relu(relu);
+    free_softmax(softmax);
+    free_optimizer(adam_hidden);
+    free_optimizer(adam_output);
+}
+
+/*
+Same model and data as bench_training, driven by a compiled network.
+pool NULL runs each step in one parallel region, otherwise backward and updates run on the pool.
+*/
+static void bench_network(ThreadPool* pool) {
+    int train_size = 5000;
+    int test_size = 1000;
+    int batch = 100;
+    int epochs = 5;
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(train_size, 784);
+    matrix* Y = allocate_matrix(train_size, 10);
+    matrix* X_test = allocate_matrix(test_size, 784);
+    matrix* Y_test = allocate_matrix(test_size, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+    make_synthetic_mnist(X_test, Y_test, prototypes);
+
+    network* net = init_network();
+    network_add_dense(net, 784, 128);
+    network_add_relu(net);
+    network_add_dense(net, 128, 10);
+    network_add_softmax(net);
+    network_set_loss(net, CATCROSSENTROPY);
+    OpParams* adam = network_set_adam(net, 0.9, 0.999, 1e-7, 1e-3, 0.0);
+    adam->useMasterWeights = (NN_DTYPE == FLOAT32);
+    network_set_threadpool(net, pool);
+    network_compile(net, batch);
+
+    int steps = 0;
+    double start = omp_get_wtime();
+    for (int e = 0; e < epochs; e++) {
+        for (int b = 0; b + batch <= train_size; b += batch) {
+            matrix x_batch;
+            matrix y_batch;
+            shallow_cpy_matrix(X, &x_batch, b, batch);
+            shallow_cpy_matrix(Y, &y_batch, b, batch);
+            network_train_step(net, &x_batch, &y_batch);
+            steps++;
+        }
+    }
+    double step_time = (omp_get_wtime() - start) / steps;
+
+    // Evaluate on held out data, predict runs it max_batch rows at a time
+    matrix* predictions = network_predict(net, X_test);
+    Loss* loss = init_loss(CATCROSSENTROPY);
+    compute_loss(loss, predictions, Y_test);
+
+    printf("Network 784-128-10, batch %d, %d epochs (%s)\n", batch, epochs, (pool != NULL) ? "thread pool" : "compiled plan");
+    printf("%-24s %10.3f\n", "ms per step", step_time * 1e3);
+    printf("%-24s %10.4f\n", "test loss", loss->loss);
+    printf("%-24s %10.4f\n", "test accuracy", accuracy(predictions, Y_test));
+    printf("\n");
+
+    free(loss);
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+    free_matrix(X_test);
+    free_matrix(Y_test);
+    free_network(net);
+}
+
+/*
+Shuffled mini batch training, batches gathered in series on the training thread
+against batches prefetched by the data loader.
+*/
+static void bench_data_loader() {
+    int train_size = 10000;
+    int batch = 100;
+    int epochs = 3;
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(train_size, 784);
+    matrix* Y = allocate_matrix(train_size, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+
+    printf("Shuffled training 784-128-10, %d samples, batch %d, %d epochs (ms per step)\n", train_size, batch, epochs);
+    for (int prefetch = 0; prefetch < 2; prefetch++) {
+        network* net = init_network();
+        network_add_dense(net, 784, 128);
+        network_add_relu(net);
+        network_add_dense(net, 128, 10);
+        network_add_softmax(net);
+        network_set_loss(net, CATCROSSENTROPY);
+        network_set_adam(net, 0.9, 0.999, 1e-7, 1e-3, 0.0)->useMasterWeights = (NN_DTYPE == FLOAT32);
+        network_compile(net, batch);
+
+        int steps = 0;
+        double loss = 0.0;
+        double start = omp_get_wtime();
+        if (prefetch) {
+            DataLoader* loader = init_data_loader(X, Y, batch, 2, true, LAST_BATCH_DROP, 7);
+            matrix* x_batch;
+            matrix* y_batch;
+            for (int e = 0; e < epochs; e++) {
+                while (data_loader_next(loader, &x_batch, &y_batch)) {
+                    loss = network_train_step(net, x_batch, y_batch);
+                    steps++;
+                }
+            }
+            printf("%-24s %10.3f (loss %.4f, trainer waited %ld times)\n", "prefetch thread",
+                   (omp_get_wtime() - start) / steps * 1e3, loss, loader->stalls);
+            free_data_loader(loader);
+        }
+        else {
+            // Shuffle and gather by hand between steps
+            int* order = malloc(train_size * sizeof(int));
+            for (int i = 0; i < train_size; i++) {
+                order[i] = i;
+            }
+            unsigned int seed = 7;
+            matrix* x_batch = allocate_matrix(batch, 784);
+            matrix* y_batch = allocate_matrix(batch, 10);
+            for (int e = 0; e < epochs; e++) {
+                for (int i = train_size - 1; i > 0; i--) {
+                    int j = rand_r(&seed) % (i + 1);
+                    int tmp = order[i];
+                    order[i] = order[j];
+                    order[j] = tmp;
+                }
+                for (int b = 0; b + batch <= train_size; b += batch) {
+                    for (int r = 0; r < batch; r++) {
+                        memcpy(x_batch->data + r * 784, X->data + (size_t) order[b + r] * 784, 784 * sizeof(nn_float));
+                        memcpy(y_batch->data + r * 10, Y->data + (size_t) order[b + r] * 10, 10 * sizeof(nn_float));
+                    }
+                    loss = network_train_step(net, x_batch, y_batch);
+                    steps++;
+                }
+            }
+            printf("%-24s %10.3f (loss %.4f)\n", "gather in series", (omp_get_wtime() - start) / steps * 1e3, loss);
+            free(order);
+            free_matrix(x_batch);
+            free_matrix(y_batch);
+        }
+        free_network(net);
+    }
+    printf("\n");
+
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+}
+
+/*
+Startup cost of a dataset: streaming or parsing a CSV file against mapping the converted file.
+*/
+static void bench_dataset() {
+    int train_size = 20000;
+    const char* csv_path = "/tmp/mininet_bench.csv";
+    const char* dataset_path = "/tmp/mininet_bench.mnds";
+
+    // MNIST shaped CSV, label first then 784 pixels
+    FILE* f = fopen(csv_path, "w");
+    if (f == NULL) {
+        printf("Dataset startup skipped, could not write %s\n\n", csv_path);
+        return;
+    }
+    for (int i = 0; i < train_size; i++) {
+        fprintf(f, "%d", rand() % 10);
+        for (int j = 0; j < 784; j++) {
+            fprintf(f, ",%d", rand() % 256);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+
+    printf("Dataset startup, %d x 784 samples (ms)\n", train_size);
+    double start = omp_get_wtime();
+    DataStream* stream = open_csv_stream(csv_path, 0, 10, false, 1.0 / 255, 100, 1024, 7);
+    matrix* x_stream;
+    matrix* y_stream;
+    int streamed = 0;
+    while (data_stream_next(stream, &x_stream, &y_stream)) {
+        streamed += x_stream->rows;
+    }
+    free_data_stream(stream);
+    printf("%-24s %10.3f (%d rows, shuffle buffer 1024)\n", "stream CSV epoch", (omp_get_wtime() - start) * 1e3, streamed);
+
+    start = omp_get_wtime();
+    convert_csv_dataset(csv_path, dataset_path, 0, 10, false, 1.0 / 255, LABELS_ONE_HOT);
+    printf("%-24s %10.3f\n", "parse CSV (convert)", (omp_get_wtime() - start) * 1e3);
+
+    start = omp_get_wtime();
+    Dataset* ds = open_dataset(dataset_path);
+    printf("%-24s %10.3f\n", "open mapped", (omp_get_wtime() - start) * 1e3);
+
+    // First touch of every page, what a training epoch pays on top of the open
+    start = omp_get_wtime();
+    matrix x_batch, y_batch;
+    double sum = 0.0;
+    for (int b = 0; b + 100 <= ds->X.rows; b += 100) {
+        dataset_batch_view(ds, &x_batch, &y_batch, b, 100);
+        sum += x_batch.data[0] + y_batch.data[0];
+        for (size_t k = 0; k < (size_t) 100 * 784; k += 4096 / sizeof(nn_float)) {
+            sum += x_batch.data[k];
+        }
+    }
+    printf("%-24s %10.3f (checksum %.1f)\n\n", "touch every batch view", (omp_get_wtime() - start) * 1e3, sum);
+
+    close_dataset(ds);
+    remove(csv_path);
+    remove(dataset_path);
+}
+
+/*
+Cost of checkpointing to the training loop: a blocking save against the stall of an async snapshot.
+*/
+static void bench_checkpoint() {
+    int batch = 100;
+    const char* path = "/tmp/mininet_bench.ckpt";
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(batch, 784);
+    matrix* Y = allocate_matrix(batch, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+
+    network* net = init_network();
+    network_add_dense(net, 784, 512);
+    network_add_relu(net);
+    network_add_dense(net, 512, 512);
+    network_add_relu(net);
+    network_add_dense(net, 512, 10);
+    network_add_softmax(net);
+    network_set_loss(net, CATCROSSENTROPY);
+    network_set_adam(net, 0.9, 0.999, 1e-7, 1e-3, 0.0)->useMasterWeights = (NN_DTYPE == FLOAT32);
+    network_compile(net, batch);
+    network_train_step(net, X, Y); // Optimizer moments exist from here on
+
+    int reps = 5;
+    double start = omp_get_wtime();
+    for (int i = 0; i < reps; i++) {
+        network_train_step(net, X, Y);
+    }
+    double step_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+    start = omp_get_wtime();
+    for (int i = 0; i < reps; i++) {
+        save_checkpoint(net, path, true);
+    }
+    double save_ms = (omp_get_wtime() - start) / reps * 1e3;
+
+    // Stall is the snapshot copy, the write overlaps the next training steps
+    CheckpointWriter* writer = init_checkpoint_writer();
+    double stall = 0.0;
+    for (int i = 0; i < reps; i++) {
+        start = omp_get_wtime();
+        checkpoint_async(writer, net, path, true);
+        stall += omp_get_wtime() - start;
+        for (int s = 0; s < 3; s++) {
+            network_train_step(net, X, Y);
+        }
+    }
+    free_checkpoint_writer(writer);
+
+    start = omp_get_wtime();
+    network* restored = load_checkpoint(path, false);
+    double load_ms = (omp_get_wtime() - start) * 1e3;
+
+    printf("Checkpoint 784-512-512-10 with Adam state (ms)\n");
+    printf("%-24s %10.3f\n", "train step", step_ms);
+    printf("%-24s %10.3f\n", "blocking save (crc)", save_ms);
+    printf("%-24s %10.3f\n", "async snapshot stall", stall / reps * 1e3);
+    printf("%-24s %10.3f\n\n", "load", load_ms);
+
+    free_network(restored);
+    free_network(net);
+    remove(path);
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+}
+
+/*
+Serving path: a training compiled network run forward through its layers (inputs cached, gradient
+buffers sized) against network_predict on an inference compiled one (ping-pong buffers).
+*/
+static void bench_inference() {
+    int batch = 256;
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(batch, 784);
+    matrix* Y = allocate_matrix(batch, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+
+    network* nets[2];
+    for (int inference = 0; inference < 2; inference++) {
+        network* net = init_network();
+        network_add_dense(net, 784, 512);
+        network_add_relu(net);
+        network_add_dense(net, 512, 512);
+        network_add_relu(net);
+        network_add_dense(net, 512, 10);
+        network_add_softmax(net);
+        if (inference) {
+            network_compile_inference(net, batch);
+        }
+        else {
+            network_compile(net, batch);
+        }
+        nets[inference] = net;
+    }
+
+    int reps = 20;
+    printf("Inference 784-512-512-10, batch %d (ms per batch, batch buffer KB)\n", batch);
+    double start = omp_get_wtime();
+    for (int r = 0; r < reps; r++) {
+        #ifdef ENABLE_PARALLEL
+        #pragma omp parallel
+        #endif
+        {
+            dense_relu_forwards(X, nets[0]->plan[0].dense, nets[0]->plan[0].relu);
+            dense_relu_forwards(nets[0]->plan[0].outputs, nets[0]->plan[1].dense, nets[0]->plan[1].relu);
+            dense_softmax_forwards(nets[0]->plan[1].outputs, nets[0]->plan[2].dense, nets[0]->plan[2].softmax);
+        }
+    }
+    printf("%-24s %10.3f %10.1f\n", "training forward", (omp_get_wtime() - start) / reps * 1e3,
+           nets[0]->workspace->capacity / 1024.0);
+
+    start = omp_get_wtime();
+    for (int r = 0; r < reps; r++) {
+        network_predict(nets[1], X);
+    }
+    printf("%-24s %10.3f %10.1f\n\n", "inference predict", (omp_get_wtime() - start) / reps * 1e3,
+           nets[1]->inference_workspace->capacity / 1024.0);
+
+    free_network(nets[0]);
+    free_network(nets[1]);
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+}
+
+/*
+Trains a small model, quantizes it on a slice of the training data and compares the int8 model against the float one.
+*/
+static void bench_quantization() {
+    int train_size = 5000;
+    int test_size = 2000;
+    int batch = 100;
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(train_size, 784);
+    matrix* Y = allocate_matrix(train_size, 10);
+    matrix* X_test = allocate_matrix(test_size, 784);
+    matrix* Y_test = allocate_matrix(test_size, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+    make_synthetic_mnist(X_test, Y_test, prototypes);
+
+    network* net = init_network();
+    network_add_dense(net, 784, 512);
+    network_add_relu(net);
+    network_add_dense(net, 512, 10);
+    network_add_softmax(net);
+    network_set_loss(net, CATCROSSENTROPY);
+    OpParams* adam = network_set_adam(net, 0.9, 0.999, 1e-7, 1e-3, 0.0);
+    adam->useMasterWeights = (NN_DTYPE == FLOAT32);
+    network_compile(net, batch);
+    for (int e = 0; e < 3; e++) {
+        for (int b = 0; b + batch <= train_size; b += batch) {
+            matrix x_batch;
+            matrix y_batch;
+            shallow_cpy_matrix(X, &x_batch, b, batch);
+            shallow_cpy_matrix(Y, &y_batch, b, batch);
+            network_train_step(net, &x_batch, &y_batch);
+        }
+    }
+
+    matrix calibration;
+    shallow_cpy_matrix(X, &calibration, 0, 500);
+    network_quantize(net, &calibration);
+    print_quantization_report(net, X_test, Y_test);
+
+    int reps = 10;
+    printf("%-24s %10s\n", "predict 784-512-10", "ms per 2000 rows");
+    for (int quantized = 0; quantized < 2; quantized++) {
+        net->quantized = quantized;
+        network_predict(net, X_test);
+        double start = omp_get_wtime();
+        for (int r = 0; r < reps; r++) {
+            network_predict(net, X_test);
+        }
+        printf("%-24s %10.3f\n", quantized ? "int8" : "float", (omp_get_wtime() - start) / reps * 1e3);
+    }
+    printf("\n");
+
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+    free_matrix(X_test);
+    free_matrix(Y_test);
+    free_network(net);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_small_batch() {
+    network* net = init_network();
+    network_add_dense(net, 784, 128);
+    network_add_relu(net);
+    network_add_dense(net, 128, 10);
+    network_add_softmax(net);
+    network_compile_inference(net, 64);
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(GEMM_SMALL_M, 784);
+    matrix* Y = allocate_matrix(GEMM_SMALL_M, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+
+    int requests = 20000;
+    double* latencies = malloc(requests * sizeof(double));
+    int batches[] = {1, 4, 16};
+    printf("Small batch latency 784-128-10 (us per request)\n");
+    printf("%-6s %-10s %10s %10s %12s\n", "batch", "path", "p50", "p99", "max diff");
+    for (int b = 0; b < 3; b++) {
+        matrix request = {batches[b], 784, X->data};
+        for (int path = 0; path < 2; path++) {
+            matrix* out = NULL;
+            for (int r = 0; r < requests / 10; r++) { // Warm up caches and branch predictors
+                out = path ? network_predict_small(net, &request) : network_predict(net, &request);
+            }
+            for (int r = 0; r < requests; r++) {
+                double start = omp_get_wtime();
+                out = path ? network_predict_small(net, &request) : network_predict(net, &request);
+                latencies[r] = (omp_get_wtime() - start) * 1e6;
+            }
+            qsort(latencies, requests, sizeof(double), compare_doubles);
+            double diff = path ? max_abs_diff(out, network_predict(net, &request)) : 0.0;
+            printf("%-6d %-10s %10.2f %10.2f %12.2e\n", batches[b], path ? "small" : "predict",
+                   latencies[requests / 2], latencies[(int) (requests * 0.99)], diff);
+        }
+    }
+    printf("\n");
+
+    free(latencies);
+    free_network(net);
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+}
+
+typedef struct {
+    const char* address;
+    matrix* X;
+    int requests;
+    double* latencies; // us per request
+} ServeClient;
+
+static void* serve_client(void* arg) {
+    ServeClient* client = arg;
+    int fd = serve_connect(client->address);
+    matrix* predictions = NULL;
+    for (int r = 0; r < client->requests; r++) {
+        matrix row;
+        shallow_cpy_matrix(client->X, &row, r % client->X->rows, 1);
+        double start = omp_get_wtime();
+        if (!serve_predict(fd, &row, &predictions)) {
+            fprintf(stderr, "Error: Serve request failed.\n");
+            exit(1);
+        }
+        client->latencies[r] = (omp_get_wtime() - start) * 1e6;
+    }
+    close(fd);
+    free_matrix(predictions);
+    return NULL;
+}
+
+/*
+Concurrent single row clients against the inference server over a unix socket, without and with a batching window.
+*/
+static void bench_serving() {
+    network* net = init_network();
+    network_add_dense(net, 784, 128);
+    network_add_relu(net);
+    network_add_dense(net, 128, 10);
+    network_add_softmax(net);
+    network_compile_inference(net, 64);
+
+    matrix* prototypes = allocate_matrix(10, 784);
+    fill_random(prototypes);
+    matrix* X = allocate_matrix(256, 784);
+    matrix* Y = allocate_matrix(256, 10);
+    make_synthetic_mnist(X, Y, prototypes);
+
+    const char* address = "unix:/tmp/nn_bench_serve.sock";
+    int num_clients = 8;
+    int requests = 2000;
+    long waits[] = {0, 200};
+    ServeClient clients[8];
+    pthread_t threads[8];
+    double* latencies = malloc((size_t) num_clients * requests * sizeof(double));
+
+    printf("Serving 784-128-10, %d clients x %d single row requests\n", num_clients, requests);
+    for (int w = 0; w < 2; w++) {
+        InferenceServer* server = start_server(net, address, 64, waits[w]);
+        double start = omp_get_wtime();
+        for (int c = 0; c < num_clients; c++) {
+            clients[c] = (ServeClient) {address, X, requests, latencies + (size_t) c * requests};
+            pthread_create(&threads[c], NULL, serve_client, &clients[c]);
+        }
+        for (int c = 0; c < num_clients; c++) {
+            pthread_join(threads[c], NULL);
+        }
+        double elapsed = omp_get_wtime() - start;
+
+        int total = num_clients * requests;
+        qsort(latencies, total, sizeof(double), compare_doubles);
+        printf("max wait %ld us: %.0f requests/s, client latency p50 %.1f us, p99 %.1f us\n", waits[w], total / elapsed,
+               latencies[total / 2], latencies[(int) (total * 0.99)]);
+
+        int fd = serve_connect(address);
+        ServerStats stats;
+        serve_stats(fd, &stats);
+        close(fd);
+        print_server_stats(&stats);
+        stop_server(server);
+    }
+    printf("\n");
+
+    free(latencies);
+    free_network(net);
+    free_matrix(prototypes);
+    free_matrix(X);
+    free_matrix(Y);
+}
+
+int main(int argc, char** argv) {
+    int num_threads = 0;
+    bool pin = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-pin") == 0) {
+            pin = true;
+        }
+    }
+
+    srand(42);
+    printf("Precision: %s\n\n", (NN_DTYPE == FLOAT32) ? "float32" : "float64");
+    bench_gemm();
+    bench_transpose();
+    bench_fused_forward();
+    srand(42);
+    bench_softmax();
+    srand(42);
+    bench_softmax_loss();
+    srand(42);
+    bench_sparse();
+    srand(42);
+    bench_conv();
+    srand(42);
+    bench_normalization();
+    srand(42);
+    bench_recurrent();
+    srand(42);
+    bench_optimizers();
+    srand(42);
+    bench_inference();
+    srand(42);
+    bench_small_batch();
+    srand(42);
+    bench_quantization();
+    srand(42);
+    bench_serving();
+    srand(42);
+    bench_training(REGION_PER_PRIMITIVE, NULL);
+#ifdef ENABLE_PARALLEL
+    srand(42);
+    bench_training(REGION_PER_STEP, NULL);
+#endif
+
+    ThreadPool* pool = init_threadpool(num_threads, pin);
+    printf("Thread pool: %d workers%s\n", pool->num_threads, pin ? ", pinned" : "");
+    srand(42);
+    bench_training(THREAD_POOL, pool);
+
+    srand(42);
+    bench_network(NULL);
+    srand(42);
+    bench_network(pool);
+    free_threadpool(pool);
+
+    srand(42);
+    bench_data_loader();
+    srand(42);
+    bench_dataset();
+    srand(42);
+    bench_checkpoint();
+    return 0;
+}
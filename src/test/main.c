@@ -1,22 +1,19 @@
 #include "linalg.h"
-#include "layer_dense.h"
-#include "relu.h"
-#include "softmax.h"
-#include "adam.h"
+#include "network.h"
 
 int main () {
     matrix test1;
     test1.rows = 2;
     test1.cols = 2;
-    test1.data = (double*) malloc(sizeof(double) * test1.rows * test1.cols);
-    double data1[4] = {1, 2, 3, 4};
+    test1.data = (nn_float*) malloc(sizeof(nn_float) * test1.rows * test1.cols);
+    nn_float data1[4] = {1, 2, 3, 4};
     test1.data = data1;
 
     matrix pred1;
     pred1.rows = 2;
     pred1.cols = 5;
-    pred1.data = (double*) malloc(sizeof(double) * pred1.rows * pred1.cols);
-    double pred1data[10] = {0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
+    pred1.data = (nn_float*) malloc(sizeof(nn_float) * pred1.rows * pred1.cols);
+    nn_float pred1data[10] = {0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
     pred1.data = pred1data;
     double beta_1 = 0.9;
     double beta_2 = 0.95;
@@ -24,35 +21,20 @@ int main () {
     double lr = 0.05;
     double decay = 1e-5;
 
-    layer_dense* layer1 = init_layer(2, 10);
-    ReluParams* relu1 = init_relu();
-    OpParams* adam1 = init_adam(beta_1, beta_2, epsilon, lr, decay);
-
-    layer_dense* layer2 = init_layer(10, 5);
-    SoftMaxParams* softmax2 = init_softmax();
-    OpParams* adam2 = init_adam(beta_1, beta_2, epsilon, lr, decay);
-
-    // Forward
-    dense_forwards(&test1, layer1);
-    relu_forwards(relu1, layer1->outputs);
-    dense_forwards(relu1->outputs, layer2);
-    softmax_forwards(softmax2, layer2->outputs);
-
-    // Calculate Loss + Accuracy
-    
-
-    // Backward 
-    softmax_backwards(softmax2, &pred1);
-    dense_backwards(softmax2->dinputs, layer2);
-    relu_backwards(relu1, layer2->dinputs);
-    dense_backwards(relu1->dinputs, layer1);
-
-    // Optimize Params
-    pre_update_params_adam(adam1);
-    update_dense_params_adam(adam1, layer1);
-    post_update_params_adam(adam1);
-
-    pre_update_params_adam(adam2);
-    update_dense_params_adam(adam2, layer2);
-    post_update_params_adam(adam2);
-}
\ No newline at end of file
+    // 2 -> 10 -> 5 classifier, compiled into a fused plan with one workspace
+    network* net = init_network();
+    network_add_dense(net, 2, 10);
+    network_add_relu(net);
+    network_add_dense(net, 10, 5);
+    network_add_softmax(net);
+    network_set_loss(net, CATCROSSENTROPY);
+    network_set_adam(net, beta_1, beta_2, epsilon, lr, decay);
+    network_compile(net, test1.rows);
+    print_network(net);
+
+    // Forward, loss, backward and optimizer in one call
+    double loss = network_train_step(net, &test1, &pred1);
+    printf("loss: %f\n", loss);
+
+    free_network(net);
+}
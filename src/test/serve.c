@@ -0,0 +1,36 @@
+#include "networking.h"
+#include <signal.h>
+
+/*
+Inference daemon, serves a checkpoint until SIGINT or SIGTERM and prints the server stats on the way out.
+Usage: serve <checkpoint> <unix:/path | tcp:port> [max_batch] [max_wait_us]
+*/
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <checkpoint> <unix:/path | tcp:port> [max_batch] [max_wait_us]\n", argv[0]);
+        return 1;
+    }
+    int max_batch = (argc > 3) ? atoi(argv[3]) : 64;
+    long max_wait_us = (argc > 4) ? atol(argv[4]) : 200;
+
+    // Blocked before any thread starts so every thread inherits the mask and only sigwait sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    InferenceServer* server = serve_checkpoint(argv[1], argv[2], max_batch, max_wait_us);
+    print_network(server->net);
+    printf("Serving %s on %s, batches of up to %d rows, max wait %ld us\n", argv[1], argv[2], max_batch, max_wait_us);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&signals, &sig);
+
+    ServerStats stats;
+    server_stats(server, &stats);
+    stop_server(server);
+    print_server_stats(&stats);
+    return 0;
+}
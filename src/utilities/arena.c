@@ -0,0 +1,104 @@
+#include "arena.h"
+
+//////////////////////////////////////////////////// ARENA METHODS ///////////////////////////////////////////////////////////////////////////
+
+Arena* init_arena(size_t capacity) {
+    Arena* arena = malloc(sizeof(Arena));
+    if (arena == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for arena struct.\n");
+        exit(1);
+    }
+
+    capacity = arena_align(capacity);
+    arena->base = NULL;
+    if (capacity > 0 && posix_memalign((void**) &arena->base, ARENA_ALIGNMENT, capacity) != 0) {
+        fprintf(stderr, "Error: Memory allocation failure for arena block (%zu bytes).\n", capacity);
+        exit(1);
+    }
+
+    arena->capacity = capacity;
+    arena->offset = 0;
+    arena->high_water = 0;
+    arena->num_allocs = 0;
+    return arena;
+}
+
+void free_arena(Arena* arena) {
+    free(arena->base);
+    arena->base = NULL;
+    free(arena);
+}
+
+size_t arena_align(size_t bytes) {
+    return (bytes + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+    bytes = arena_align(bytes);
+
+    // Check space
+    if (arena->offset + bytes > arena->capacity) {
+        fprintf(stderr, "Error: Arena out of space, requested %zu bytes with %zu of %zu used.\n",
+                bytes, arena->offset, arena->capacity);
+        exit(1);
+    }
+
+    void* ptr = arena->base + arena->offset;
+    memset(ptr, 0, bytes);
+    arena->offset += bytes;
+    arena->num_allocs++;
+
+    // Track high water mark
+    if (arena->offset > arena->high_water) {
+        arena->high_water = arena->offset;
+    }
+    return ptr;
+}
+
+size_t arena_mark(Arena* arena) {
+    return arena->offset;
+}
+
+void arena_release(Arena* arena, size_t mark) {
+    if (mark > arena->offset) {
+        fprintf(stderr, "Error: Arena release past the current offset.\n");
+        exit(1);
+    }
+    arena->offset = mark;
+}
+
+size_t arena_matrix_bytes(int rows, int cols) {
+    return arena_align(sizeof(matrix)) + arena_align((size_t) rows * cols * sizeof(nn_float));
+}
+
+matrix* arena_alloc_matrix(Arena* arena, int rows, int cols) {
+    matrix* M = arena_alloc(arena, sizeof(matrix));
+    M->rows = rows;
+    M->cols = cols;
+    M->data = arena_alloc(arena, (size_t) rows * cols * sizeof(nn_float));
+    return M;
+}
+
+void print_arena_report(Arena* arena) {
+    printf("Arena: %.2f KB used of %.2f KB (high water %.2f KB, %.1f%%) in %d allocations\n",
+           arena->offset / 1024.0, arena->capacity / 1024.0, arena->high_water / 1024.0,
+           (arena->capacity > 0) ? 100.0 * arena->high_water / arena->capacity : 0.0, arena->num_allocs);
+}
+
+//////////////////////////////////////////////////// LAYER WORKSPACES ///////////////////////////////////////////////////////////////////////////
+
+void fit_buffer(matrix** M, int rows, int cols, int max_batch) {
+    // Heap owned buffer
+    if (max_batch == 0) {
+        resize_matrix(M, rows, cols);
+        return;
+    }
+
+    // Arena slice, only the batch dimension may shrink
+    if (*M == NULL || (*M)->cols != cols || rows > max_batch) {
+        fprintf(stderr, "Error: Batch of (%d x %d) does not fit the planned workspace (max batch %d).\n",
+                rows, cols, max_batch);
+        exit(1);
+    }
+    (*M)->rows = rows;
+}
@@ -0,0 +1,668 @@
+#include "checkpoint.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(CheckpointHeader) == CHECKPOINT_ALIGNMENT, "Checkpoint header must fill the first cache line");
+
+#define MAX_NODE_TENSORS 10
+#define CHECKPOINT_V1_OPTIMIZER_SIZE offsetof(CheckpointOptimizer, momentum) // Adam only optimizer record of version 1
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Linux and macOS limit, only exposed by limits.h with _XOPEN_SOURCE
+#endif
+
+// Source of the zero padding between tensors
+static const char zeros[CHECKPOINT_ALIGNMENT] = {0};
+
+/*
+Tensor of a dense or batchnorm node, in the order it is stored.
+*/
+typedef struct {
+    void* data;
+    size_t bytes;
+} TensorRef;
+
+//////////////////////////////////////////////////// CRC32 ///////////////////////////////////////////////////////////////////////////
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+/*
+Extends a CRC32 (zlib polynomial) over bytes. Start with crc = 0.
+*/
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t bytes) {
+    pthread_once(&crc_once, init_crc_table);
+    const unsigned char* p = (const unsigned char*) data;
+    crc = ~crc;
+    for (size_t i = 0; i < bytes; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//////////////////////////////////////////////////// LAYOUT ///////////////////////////////////////////////////////////////////////////
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + CHECKPOINT_ALIGNMENT - 1) & ~(uint64_t) (CHECKPOINT_ALIGNMENT - 1);
+}
+
+/*
+True for the node types that store tensors.
+*/
+static bool has_tensors(NodeType type) {
+    return type == NODE_DENSE || type == NODE_BATCHNORM;
+}
+
+/*
+Optimizer state of a dense or batchnorm node, NULL without an optimizer.
+*/
+static OpParams* node_state(network* net, NetworkNode* node) {
+    for (int s = 0; s < net->num_steps; s++) {
+        if ((node->dense != NULL && net->plan[s].dense == node->dense) ||
+            (node->batchnorm != NULL && net->plan[s].batchnorm == node->batchnorm)) {
+            return net->plan[s].optimizer;
+        }
+    }
+    return NULL;
+}
+
+/*
+Parameters of a node in the order they are stored, returns their count.
+The first two are the ones the optimizer state follows: weights and biases, or gamma and beta.
+*/
+static int node_params(NetworkNode* node, matrix** params) {
+    if (node->type == NODE_DENSE) {
+        params[0] = node->dense->weights;
+        params[1] = node->dense->biases;
+        return 2;
+    }
+    params[0] = node->batchnorm->gamma;
+    params[1] = node->batchnorm->beta;
+    params[2] = node->batchnorm->running_mean;
+    params[3] = node->batchnorm->running_var;
+    return 4;
+}
+
+/*
+Lists the tensors of a node and sets its flags. Momentums and caches only exist once the layer has been updated
+and only for the optimizers that keep them, master copies only with useMasterWeights.
+*/
+static int node_tensors(network* net, NetworkNode* node, TensorRef* tensors, uint32_t* flags) {
+    matrix* params[4];
+    int num_params = node_params(node, params);
+    size_t w_count = (size_t) params[0]->rows * params[0]->cols;
+    size_t b_count = (size_t) params[1]->rows * params[1]->cols;
+    int count = 0;
+
+    for (int i = 0; i < num_params; i++) {
+        tensors[count++] = (TensorRef) {params[i]->data, (size_t) params[i]->rows * params[i]->cols * sizeof(nn_float)};
+    }
+
+    OpParams* state = node_state(net, node);
+    if (state == NULL) {
+        return count;
+    }
+    if (state->w_momentums != NULL) {
+        *flags |= CHECKPOINT_NODE_MOMENTS;
+        tensors[count++] = (TensorRef) {state->w_momentums->data, w_count * sizeof(nn_float)};
+    }
+    if (state->w_cache != NULL) {
+        *flags |= CHECKPOINT_NODE_CACHE;
+        tensors[count++] = (TensorRef) {state->w_cache->data, w_count * sizeof(nn_float)};
+    }
+    if (state->b_momentums != NULL) {
+        tensors[count++] = (TensorRef) {state->b_momentums->data, b_count * sizeof(nn_float)};
+    }
+    if (state->b_cache != NULL) {
+        tensors[count++] = (TensorRef) {state->b_cache->data, b_count * sizeof(nn_float)};
+    }
+    if (state->w_master != NULL) {
+        *flags |= CHECKPOINT_NODE_MASTER;
+        tensors[count++] = (TensorRef) {state->w_master, w_count * sizeof(double)};
+        tensors[count++] = (TensorRef) {state->b_master, b_count * sizeof(double)};
+    }
+    return count;
+}
+
+/*
+Fills the header, optimizer and node records of a checkpoint of net, nodes has num_nodes entries.
+Returns the file size.
+*/
+static uint64_t layout_checkpoint(network* net, CheckpointHeader* header, CheckpointOptimizer* opt,
+                                  CheckpointNode* nodes) {
+    if (!net->compiled) {
+        fprintf(stderr, "Error: Only compiled networks can be checkpointed.\n");
+        exit(1);
+    }
+
+    memset(header, 0, sizeof(CheckpointHeader));
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->dtype = NN_DTYPE;
+    header->num_nodes = net->num_nodes;
+    header->loss_type = (net->loss != NULL) ? net->loss->lossType : CATCROSSENTROPY;
+    header->max_batch = net->max_batch;
+
+    memset(opt, 0, sizeof(CheckpointOptimizer));
+    if (net->optimizer != NULL) {
+        header->flags |= CHECKPOINT_HAS_OPTIMIZER;
+        opt->type = net->optimizer->optimizer;
+        opt->beta_1 = net->optimizer->beta_1;
+        opt->beta_2 = net->optimizer->beta_2;
+        opt->epsilon = net->optimizer->epsilon;
+        opt->lr = net->optimizer->lr;
+        opt->decay = net->optimizer->decay;
+        opt->correct_bias = net->optimizer->correctBias;
+        opt->use_master_weights = net->optimizer->useMasterWeights;
+        opt->momentum = net->optimizer->momentum;
+        opt->rho = net->optimizer->rho;
+    }
+
+    uint64_t offset = sizeof(CheckpointHeader) + sizeof(CheckpointOptimizer) + net->num_nodes * sizeof(CheckpointNode);
+    for (int i = 0; i < net->num_nodes; i++) {
+        NetworkNode* node = &net->nodes[i];
+        CheckpointNode* rec = &nodes[i];
+        memset(rec, 0, sizeof(CheckpointNode));
+        rec->type = node->type;
+        if (!has_tensors(node->type)) {
+            continue;
+        }
+
+        if (node->type == NODE_DENSE) {
+            layer_dense* layer = node->dense;
+            rec->num_inputs = layer->num_inputs;
+            rec->num_neurons = layer->num_neurons;
+            rec->lambda_l1 = layer->lambda_l1;
+            rec->lambda_l2 = layer->lambda_l2;
+            rec->flags = layer->useRegularization ? CHECKPOINT_NODE_REGULARIZED : 0;
+            if (layer->sparse_inputs) {
+                rec->flags |= CHECKPOINT_NODE_SPARSE;
+            }
+        }
+        else {
+            layer_batchnorm* layer = node->batchnorm;
+            rec->num_inputs = layer->num_features;
+            rec->num_neurons = layer->num_features;
+            rec->lambda_l1 = layer->momentum;
+            rec->lambda_l2 = layer->epsilon;
+            rec->flags = layer->folded ? CHECKPOINT_NODE_FOLDED : 0;
+        }
+        OpParams* state = node_state(net, node);
+        if (state != NULL) {
+            rec->lr = state->lr;
+            rec->iterations = state->iterations;
+        }
+
+        TensorRef tensors[MAX_NODE_TENSORS];
+        int count = node_tensors(net, node, tensors, &rec->flags);
+        offset = align_offset(offset);
+        rec->offset = offset;
+        for (int t = 0; t < count; t++) {
+            offset = align_offset(offset) + tensors[t].bytes;
+        }
+    }
+    header->file_size = offset;
+    return offset;
+}
+
+//////////////////////////////////////////////////// FILE OUTPUT ///////////////////////////////////////////////////////////////////////////
+
+/*
+Writes every iovec, resuming after partial writes. One writev call unless there are more than IOV_MAX.
+*/
+static void writev_all(int fd, struct iovec* iov, int count, const char* path) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Could not write checkpoint %s.\n", path);
+            exit(1);
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+Writes the iovecs to path.tmp, syncs it and renames it over path.
+*/
+static void write_checkpoint_file(const char* path, struct iovec* iov, int count) {
+    size_t len = strlen(path);
+    char* tmp_path = malloc(len + 5);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in write checkpoint file.\n");
+        exit(1);
+    }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create checkpoint %s.\n", tmp_path);
+        exit(1);
+    }
+    writev_all(fd, iov, count, tmp_path);
+    if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error: Could not commit checkpoint %s.\n", path);
+        exit(1);
+    }
+    free(tmp_path);
+}
+
+void save_checkpoint(network* net, const char* path, bool checksum) {
+    CheckpointHeader header;
+    CheckpointOptimizer opt;
+    CheckpointNode* nodes = malloc(net->num_nodes * sizeof(CheckpointNode));
+    struct iovec* iov = malloc((2 + net->num_nodes * 2 * MAX_NODE_TENSORS + 1) * sizeof(struct iovec));
+    if (nodes == NULL || iov == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in save checkpoint.\n");
+        exit(1);
+    }
+    layout_checkpoint(net, &header, &opt, nodes);
+
+    // Header, records, then every tensor straight from the live buffers with padding in between
+    int count = 0;
+    iov[count++] = (struct iovec) {&header, sizeof(header)};
+    iov[count++] = (struct iovec) {&opt, sizeof(opt)};
+    iov[count++] = (struct iovec) {nodes, net->num_nodes * sizeof(CheckpointNode)};
+    uint64_t offset = sizeof(header) + sizeof(opt) + net->num_nodes * sizeof(CheckpointNode);
+    for (int i = 0; i < net->num_nodes; i++) {
+        if (!has_tensors(net->nodes[i].type)) {
+            continue;
+        }
+        TensorRef tensors[MAX_NODE_TENSORS];
+        uint32_t flags = 0;
+        int num_tensors = node_tensors(net, &net->nodes[i], tensors, &flags);
+        for (int t = 0; t < num_tensors; t++) {
+            uint64_t aligned = align_offset(offset);
+            if (aligned > offset) {
+                iov[count++] = (struct iovec) {(void*) zeros, aligned - offset};
+            }
+            iov[count++] = (struct iovec) {tensors[t].data, tensors[t].bytes};
+            offset = aligned + tensors[t].bytes;
+        }
+    }
+
+    if (checksum) {
+        header.flags |= CHECKPOINT_HAS_CRC;
+        uint32_t crc = 0;
+        for (int i = 1; i < count; i++) {
+            crc = crc32_update(crc, iov[i].iov_base, iov[i].iov_len);
+        }
+        header.crc32 = crc;
+    }
+
+    write_checkpoint_file(path, iov, count);
+    free(iov);
+    free(nodes);
+}
+
+//////////////////////////////////////////////////// FILE INPUT ///////////////////////////////////////////////////////////////////////////
+
+/*
+Copies a tensor out of the mapping, checking it lies inside the file.
+*/
+static void read_tensor(const char* base, uint64_t size, uint64_t* offset, void* dest, size_t bytes, const char* path) {
+    uint64_t start = align_offset(*offset);
+    if (start + bytes > size) {
+        fprintf(stderr, "Error: Tensor at offset %llu runs past the end of checkpoint %s.\n",
+                (unsigned long long) start, path);
+        exit(1);
+    }
+    memcpy(dest, base + start, bytes);
+    *offset = start + bytes;
+}
+
+network* load_checkpoint(const char* path, bool inference) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open checkpoint %s.\n", path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CheckpointHeader) + CHECKPOINT_V1_OPTIMIZER_SIZE) {
+        fprintf(stderr, "Error: %s is too short to be a checkpoint.\n", path);
+        exit(1);
+    }
+    uint64_t size = (uint64_t) st.st_size;
+    const char* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map checkpoint %s.\n", path);
+        exit(1);
+    }
+
+    // Validate before trusting any record
+    CheckpointHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != CHECKPOINT_MAGIC || header.version == 0 || header.version > CHECKPOINT_VERSION) {
+        fprintf(stderr, "Error: %s is not a version 1 to %d checkpoint.\n", path, CHECKPOINT_VERSION);
+        exit(1);
+    }
+    size_t opt_size = (header.version == 1) ? CHECKPOINT_V1_OPTIMIZER_SIZE : sizeof(CheckpointOptimizer);
+    if (header.dtype != NN_DTYPE) {
+        fprintf(stderr, "Error: Checkpoint %s is stored as %s but this build uses %s.\n", path,
+                header.dtype == FLOAT32 ? "float32" : "float64", NN_DTYPE == FLOAT32 ? "float32" : "float64");
+        exit(1);
+    }
+    uint64_t records_end = sizeof(header) + opt_size + (uint64_t) header.num_nodes * sizeof(CheckpointNode);
+    if (header.file_size != size || records_end > size || header.num_nodes == 0 || header.max_batch == 0) {
+        fprintf(stderr, "Error: Header of checkpoint %s does not match its size.\n", path);
+        exit(1);
+    }
+    if ((header.flags & CHECKPOINT_HAS_CRC) && crc32_update(0, base + sizeof(header), size - sizeof(header)) != header.crc32) {
+        fprintf(stderr, "Error: Checksum mismatch in checkpoint %s.\n", path);
+        exit(1);
+    }
+
+    // Version 1 records stop before the momentum and only ever hold Adam
+    CheckpointOptimizer opt;
+    memset(&opt, 0, sizeof(opt));
+    memcpy(&opt, base + sizeof(header), opt_size);
+    if (header.version == 1) {
+        opt.type = ADAM;
+    }
+    if ((header.flags & CHECKPOINT_HAS_OPTIMIZER) && opt.type > ADAM) {
+        fprintf(stderr, "Error: Unknown optimizer %u in checkpoint %s.\n", opt.type, path);
+        exit(1);
+    }
+    CheckpointNode* nodes = malloc(header.num_nodes * sizeof(CheckpointNode));
+    if (nodes == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in load checkpoint.\n");
+        exit(1);
+    }
+    memcpy(nodes, base + sizeof(header) + opt_size, header.num_nodes * sizeof(CheckpointNode));
+    if (header.version == 1) {
+        for (uint32_t i = 0; i < header.num_nodes; i++) {
+            if (nodes[i].flags & CHECKPOINT_NODE_MOMENTS) {
+                nodes[i].flags |= CHECKPOINT_NODE_CACHE;
+            }
+        }
+    }
+
+    // Rebuild the architecture, layers start from their stored parameters below
+    network* net = init_network();
+    for (uint32_t i = 0; i < header.num_nodes; i++) {
+        CheckpointNode* rec = &nodes[i];
+        if (rec->type == NODE_DENSE) {
+            if (rec->num_inputs == 0 || rec->num_neurons == 0 || rec->num_inputs > INT_MAX || rec->num_neurons > INT_MAX) {
+                fprintf(stderr, "Error: Dense node %u of checkpoint %s has an invalid shape.\n", i, path);
+                exit(1);
+            }
+            layer_dense* layer = (rec->flags & CHECKPOINT_NODE_SPARSE)
+                                 ? network_add_sparse_dense(net, rec->num_inputs, rec->num_neurons)
+                                 : network_add_dense(net, rec->num_inputs, rec->num_neurons);
+            layer->useRegularization = (rec->flags & CHECKPOINT_NODE_REGULARIZED) != 0;
+            layer->lambda_l1 = rec->lambda_l1;
+            layer->lambda_l2 = rec->lambda_l2;
+        }
+        else if (rec->type == NODE_RELU) {
+            network_add_relu(net);
+        }
+        else if (rec->type == NODE_SOFTMAX) {
+            network_add_softmax(net);
+        }
+        else if (rec->type == NODE_BATCHNORM) {
+            if (rec->num_inputs == 0 || rec->num_inputs > INT_MAX || rec->num_neurons != rec->num_inputs) {
+                fprintf(stderr, "Error: BatchNorm node %u of checkpoint %s has an invalid shape.\n", i, path);
+                exit(1);
+            }
+            layer_batchnorm* layer = network_add_batchnorm(net, rec->num_inputs);
+            layer->momentum = rec->lambda_l1;
+            layer->epsilon = rec->lambda_l2;
+            layer->folded = (rec->flags & CHECKPOINT_NODE_FOLDED) != 0;
+        }
+        else {
+            fprintf(stderr, "Error: Unknown node type %u in checkpoint %s.\n", rec->type, path);
+            exit(1);
+        }
+    }
+    network_set_loss(net, (LossType) header.loss_type);
+
+    // Parameters before compiling, an inference compile folds the batchnorms into the weights
+    uint64_t* state_offsets = malloc(header.num_nodes * sizeof(uint64_t));
+    if (state_offsets == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in load checkpoint.\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < header.num_nodes; i++) {
+        if (!has_tensors((NodeType) nodes[i].type)) {
+            continue;
+        }
+        matrix* params[4];
+        int num_params = node_params(&net->nodes[i], params);
+        uint64_t offset = nodes[i].offset;
+        for (int p = 0; p < num_params; p++) {
+            read_tensor(base, size, &offset, params[p]->data, (size_t) params[p]->rows * params[p]->cols * sizeof(nn_float), path);
+        }
+        state_offsets[i] = offset;
+    }
+
+    if (header.flags & CHECKPOINT_HAS_OPTIMIZER) {
+        OpParams* tmpl = network_set_optimizer(net, init_optimizer((OptimizationType) opt.type, opt.lr, opt.decay));
+        tmpl->beta_1 = opt.beta_1;
+        tmpl->beta_2 = opt.beta_2;
+        tmpl->momentum = opt.momentum;
+        tmpl->rho = opt.rho;
+        tmpl->epsilon = opt.epsilon;
+        tmpl->correctBias = opt.correct_bias;
+        tmpl->useMasterWeights = opt.use_master_weights;
+    }
+    if (inference) {
+        network_compile_inference(net, header.max_batch);
+    }
+    else {
+        network_compile(net, header.max_batch);
+    }
+
+    // Optimizer states, momentums and caches are shaped like the first two parameters
+    for (uint32_t i = 0; i < header.num_nodes; i++) {
+        CheckpointNode* rec = &nodes[i];
+        if (!has_tensors((NodeType) rec->type)) {
+            continue;
+        }
+        OpParams* state = node_state(net, &net->nodes[i]);
+        if (state == NULL) {
+            continue;
+        }
+        matrix* params[4];
+        node_params(&net->nodes[i], params);
+        size_t w_count = (size_t) params[0]->rows * params[0]->cols;
+        size_t b_count = (size_t) params[1]->rows * params[1]->cols;
+        uint64_t offset = state_offsets[i];
+        state->lr = rec->lr;
+        state->iterations = (int) rec->iterations;
+        if (rec->flags & CHECKPOINT_NODE_MOMENTS) {
+            state->w_momentums = allocate_matrix(params[0]->rows, params[0]->cols);
+            read_tensor(base, size, &offset, state->w_momentums->data, w_count * sizeof(nn_float), path);
+        }
+        if (rec->flags & CHECKPOINT_NODE_CACHE) {
+            state->w_cache = allocate_matrix(params[0]->rows, params[0]->cols);
+            read_tensor(base, size, &offset, state->w_cache->data, w_count * sizeof(nn_float), path);
+        }
+        if (rec->flags & CHECKPOINT_NODE_MOMENTS) {
+            state->b_momentums = allocate_matrix(params[1]->rows, params[1]->cols);
+            read_tensor(base, size, &offset, state->b_momentums->data, b_count * sizeof(nn_float), path);
+        }
+        if (rec->flags & CHECKPOINT_NODE_CACHE) {
+            state->b_cache = allocate_matrix(params[1]->rows, params[1]->cols);
+            read_tensor(base, size, &offset, state->b_cache->data, b_count * sizeof(nn_float), path);
+        }
+        if (rec->flags & CHECKPOINT_NODE_MASTER) {
+            state->w_master = malloc(w_count * sizeof(double));
+            state->b_master = malloc(b_count * sizeof(double));
+            if (state->w_master == NULL || state->b_master == NULL) {
+                fprintf(stderr, "Error: Memory allocation failure for master weights in load checkpoint.\n");
+                exit(1);
+            }
+            read_tensor(base, size, &offset, state->w_master, w_count * sizeof(double), path);
+            read_tensor(base, size, &offset, state->b_master, b_count * sizeof(double), path);
+        }
+    }
+
+    free(state_offsets);
+    free(nodes);
+    munmap((void*) base, size);
+    return net;
+}
+
+//////////////////////////////////////////////////// ASYNC SNAPSHOTS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Writer thread, commits one snapshot at a time until stopped.
+*/
+static void* writer_main(void* arg) {
+    CheckpointWriter* writer = (CheckpointWriter*) arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (!writer->pending && !writer->stop) {
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        }
+        if (!writer->pending) {
+            break;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        // The training thread does not touch the staging buffer while pending is set
+        size_t body = writer->header.file_size - sizeof(CheckpointHeader);
+        if (writer->header.flags & CHECKPOINT_HAS_CRC) {
+            writer->header.crc32 = crc32_update(0, writer->staging, body);
+        }
+        struct iovec iov[2] = {{&writer->header, sizeof(CheckpointHeader)}, {writer->staging, body}};
+        write_checkpoint_file(writer->path, iov, 2);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->pending = false;
+        writer->written++;
+        pthread_cond_broadcast(&writer->done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+CheckpointWriter* init_checkpoint_writer() {
+    CheckpointWriter* writer = malloc(sizeof(CheckpointWriter));
+    if (writer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for checkpoint writer struct.\n");
+        exit(1);
+    }
+    writer->staging = NULL;
+    writer->staging_size = 0;
+    writer->path = NULL;
+    writer->pending = false;
+    writer->stop = false;
+    writer->written = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->done, NULL);
+
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        fprintf(stderr, "Error: Could not start the checkpoint writer thread.\n");
+        exit(1);
+    }
+    return writer;
+}
+
+void free_checkpoint_writer(CheckpointWriter* writer) {
+    checkpoint_wait(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->queued);
+    pthread_cond_destroy(&writer->done);
+    free(writer->staging);
+    free(writer->path);
+    free(writer);
+}
+
+void checkpoint_wait(CheckpointWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending) {
+        pthread_cond_wait(&writer->done, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void checkpoint_async(CheckpointWriter* writer, network* net, const char* path, bool checksum) {
+    checkpoint_wait(writer);
+
+    // Stage the file image after the header, the only work done on the training thread
+    CheckpointOptimizer opt;
+    CheckpointNode* nodes = malloc(net->num_nodes * sizeof(CheckpointNode));
+    if (nodes == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in checkpoint async.\n");
+        exit(1);
+    }
+    uint64_t file_size = layout_checkpoint(net, &writer->header, &opt, nodes);
+    size_t body = file_size - sizeof(CheckpointHeader);
+    if (body > writer->staging_size) {
+        free(writer->staging);
+        writer->staging = malloc(body);
+        writer->staging_size = body;
+        if (writer->staging == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure for checkpoint staging buffer.\n");
+            exit(1);
+        }
+    }
+    // Staging holds the file from the end of the header on, so file offset o lands at o - sizeof(header)
+    char* staging = (char*) writer->staging;
+    size_t records = sizeof(opt) + net->num_nodes * sizeof(CheckpointNode);
+    memcpy(staging, &opt, sizeof(opt));
+    memcpy(staging + sizeof(opt), nodes, net->num_nodes * sizeof(CheckpointNode));
+    uint64_t end = sizeof(CheckpointHeader) + records;
+    for (int i = 0; i < net->num_nodes; i++) {
+        if (!has_tensors(net->nodes[i].type)) {
+            continue;
+        }
+        TensorRef tensors[MAX_NODE_TENSORS];
+        uint32_t flags = 0;
+        int num_tensors = node_tensors(net, &net->nodes[i], tensors, &flags);
+        for (int t = 0; t < num_tensors; t++) {
+            uint64_t aligned = align_offset(end);
+            memset(staging + end - sizeof(CheckpointHeader), 0, aligned - end);
+            memcpy(staging + aligned - sizeof(CheckpointHeader), tensors[t].data, tensors[t].bytes);
+            end = aligned + tensors[t].bytes;
+        }
+    }
+    free(nodes);
+    if (checksum) {
+        writer->header.flags |= CHECKPOINT_HAS_CRC;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    free(writer->path);
+    writer->path = strdup(path);
+    writer->pending = true;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+}
@@ -0,0 +1,1015 @@
+#include "data.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(DatasetHeader) == DATASET_ALIGNMENT, "Dataset header must fill the first cache line");
+
+//////////////////////////////////////////////////// DATA LOADER ///////////////////////////////////////////////////////////////////////////
+
+/*
+Fisher-Yates shuffle of the sample order.
+*/
+static void shuffle_order(int* order, int n, unsigned int* seed) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand_r(seed) % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/*
+Copies rows order[start], order[start + 1], ... of src into dest, rows past the epoch wrap to its start (padding).
+*/
+static void gather_rows(matrix* dest, matrix* src, const int* order, int num_samples, int start, int rows) {
+    size_t row_bytes = (size_t) src->cols * sizeof(nn_float);
+    for (int i = 0; i < rows; i++) {
+        int sample = order[(start + i) % num_samples];
+        memcpy(dest->data + (size_t) i * src->cols, src->data + (size_t) sample * src->cols, row_bytes);
+    }
+    dest->rows = rows;
+}
+
+/*
+Gathering thread. Runs epoch after epoch until stopped, at most num_buffers batches ahead of the trainer.
+*/
+static void* loader_main(void* arg) {
+    DataLoader* loader = (DataLoader*) arg;
+    int num_samples = loader->X->rows;
+
+    for (long batch = 0; ; batch++) {
+        int epoch_batch = (int) (batch % loader->batches_per_epoch);
+        if (epoch_batch == 0 && loader->shuffle) {
+            shuffle_order(loader->order, num_samples, &loader->seed);
+        }
+
+        // Wait for a free buffer
+        pthread_mutex_lock(&loader->lock);
+        while (!loader->stop && loader->produced - loader->released >= loader->num_buffers) {
+            pthread_cond_wait(&loader->freed, &loader->lock);
+        }
+        bool stop = loader->stop;
+        pthread_mutex_unlock(&loader->lock);
+        if (stop) {
+            break;
+        }
+
+        // Gather outside the lock, the trainer never touches this buffer until it is published
+        int start = epoch_batch * loader->batch_size;
+        int rows = loader->batch_size;
+        if (start + rows > num_samples && loader->last_batch == LAST_BATCH_KEEP) {
+            rows = num_samples - start;
+        }
+        int slot = (int) (batch % loader->num_buffers);
+        gather_rows(loader->x_batches[slot], loader->X, loader->order, num_samples, start, rows);
+        if (loader->Y != NULL) {
+            gather_rows(loader->y_batches[slot], loader->Y, loader->order, num_samples, start, rows);
+        }
+
+        pthread_mutex_lock(&loader->lock);
+        loader->produced++;
+        pthread_cond_signal(&loader->filled);
+        pthread_mutex_unlock(&loader->lock);
+    }
+    return NULL;
+}
+
+DataLoader* init_data_loader(matrix* X, matrix* Y, int batch_size, int num_buffers, bool shuffle,
+                             LastBatchPolicy last_batch, unsigned int seed) {
+    // Check dimensions
+    if (Y != NULL && Y->rows != X->rows) {
+        fprintf(stderr, "Error: Samples and labels have a different number of rows in init data loader.\n");
+        exit(1);
+    }
+    if (batch_size <= 0 || (last_batch == LAST_BATCH_DROP && batch_size > X->rows) || X->rows == 0) {
+        fprintf(stderr, "Error: Batch size %d does not fit %d samples in init data loader.\n", batch_size, X->rows);
+        exit(1);
+    }
+
+    DataLoader* loader = malloc(sizeof(DataLoader));
+    if (loader == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for data loader struct.\n");
+        exit(1);
+    }
+    loader->X = X;
+    loader->Y = Y;
+    loader->batch_size = batch_size;
+    loader->num_buffers = (num_buffers < 2) ? 2 : num_buffers;
+    loader->shuffle = shuffle;
+    loader->last_batch = last_batch;
+    loader->batches_per_epoch = (last_batch == LAST_BATCH_DROP) ? X->rows / batch_size
+                                                                : (X->rows + batch_size - 1) / batch_size;
+
+    // Identity order, shuffled per epoch by the thread
+    loader->order = malloc(X->rows * sizeof(int));
+    loader->x_batches = malloc(loader->num_buffers * sizeof(matrix*));
+    loader->y_batches = malloc(loader->num_buffers * sizeof(matrix*));
+    if (loader->order == NULL || loader->x_batches == NULL || loader->y_batches == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in init data loader.\n");
+        exit(1);
+    }
+    for (int i = 0; i < X->rows; i++) {
+        loader->order[i] = i;
+    }
+    loader->seed = seed;
+
+    for (int i = 0; i < loader->num_buffers; i++) {
+        loader->x_batches[i] = allocate_matrix(batch_size, X->cols);
+        loader->y_batches[i] = (Y != NULL) ? allocate_matrix(batch_size, Y->cols) : NULL;
+    }
+
+    loader->produced = 0;
+    loader->consumed = 0;
+    loader->released = 0;
+    loader->epoch_batch = 0;
+    loader->stalls = 0;
+    loader->stop = false;
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->filled, NULL);
+    pthread_cond_init(&loader->freed, NULL);
+
+    if (pthread_create(&loader->thread, NULL, loader_main, loader) != 0) {
+        fprintf(stderr, "Error: Could not start the gathering thread in init data loader.\n");
+        exit(1);
+    }
+    return loader;
+}
+
+void free_data_loader(DataLoader* loader) {
+    pthread_mutex_lock(&loader->lock);
+    loader->stop = true;
+    pthread_cond_broadcast(&loader->freed);
+    pthread_mutex_unlock(&loader->lock);
+    pthread_join(loader->thread, NULL);
+
+    for (int i = 0; i < loader->num_buffers; i++) {
+        free_matrix(loader->x_batches[i]);
+        if (loader->y_batches[i] != NULL) {
+            free_matrix(loader->y_batches[i]);
+        }
+    }
+    free(loader->x_batches);
+    free(loader->y_batches);
+    free(loader->order);
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->filled);
+    pthread_cond_destroy(&loader->freed);
+    free(loader);
+}
+
+bool data_loader_next(DataLoader* loader, matrix** X_batch, matrix** Y_batch) {
+    pthread_mutex_lock(&loader->lock);
+
+    // Done with the batch handed out last call, its buffer can be refilled
+    if (loader->released < loader->consumed) {
+        loader->released++;
+        pthread_cond_signal(&loader->freed);
+    }
+
+    // End of epoch, the next call starts the next one
+    if (loader->epoch_batch == loader->batches_per_epoch) {
+        loader->epoch_batch = 0;
+        pthread_mutex_unlock(&loader->lock);
+        return false;
+    }
+
+    if (loader->produced == loader->consumed) {
+        loader->stalls++;
+        while (loader->produced == loader->consumed) {
+            pthread_cond_wait(&loader->filled, &loader->lock);
+        }
+    }
+    int slot = (int) (loader->consumed % loader->num_buffers);
+    loader->consumed++;
+    loader->epoch_batch++;
+    pthread_mutex_unlock(&loader->lock);
+
+    *X_batch = loader->x_batches[slot];
+    if (Y_batch != NULL) {
+        *Y_batch = loader->y_batches[slot];
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////// NUMBER PARSING ///////////////////////////////////////////////////////////////////////////
+
+// Eight digits are combined with one 64 bit load, the digit math assumes little endian byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_DIGITS 1
+#else
+#define SWAR_DIGITS 0
+#endif
+
+// Powers of ten that are exact doubles
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+Loads 8 bytes, parse buffers are padded so this never reads past them.
+*/
+static inline uint64_t load_eight(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+True when all 8 bytes are ASCII digits.
+*/
+static inline bool is_eight_digits(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+           == 0x3333333333333333ULL;
+}
+
+/*
+Value of 8 ASCII digits, first one most significant, in three multiplies.
+*/
+static inline uint64_t parse_eight_digits(uint64_t v) {
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 0x000F424000000064ULL; // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001ULL; // 1 + (10000 << 32)
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    return (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+}
+
+/*
+Parses a decimal number at p, returns its end (p when there is none).
+Up to 19 significant digits are gathered in an integer, eight at a time when they come in runs.
+With a mantissa below 2^53 and a power of ten up to 22 both are exact doubles, one multiply or divide
+rounds correctly. Anything else (long mantissas, big exponents, inf, nan) goes to strtod.
+*/
+static char* parse_number(char* p, double* out) {
+    char* start = p;
+    bool negative = (*p == '-');
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+
+    while (*p == '0') {
+        p++;
+        any = true;
+    }
+    while (SWAR_DIGITS && digits + 8 <= 19 && is_eight_digits(load_eight(p))) {
+        mantissa = mantissa * 100000000 + parse_eight_digits(load_eight(p));
+        digits += 8;
+        p += 8;
+        any = true;
+    }
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (digits == 19) {
+            goto slow;
+        }
+        mantissa = mantissa * 10 + (*p - '0');
+        digits++;
+        any = true;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (digits == 0) {
+            for (; *p == '0'; p++) {
+                exponent--;
+                any = true;
+            }
+        }
+        while (SWAR_DIGITS && digits + 8 <= 19 && is_eight_digits(load_eight(p))) {
+            mantissa = mantissa * 100000000 + parse_eight_digits(load_eight(p));
+            digits += 8;
+            exponent -= 8;
+            p += 8;
+            any = true;
+        }
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (digits == 19) {
+                goto slow;
+            }
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+            exponent--;
+            any = true;
+        }
+    }
+    if (!any) {
+        goto slow;
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        char* e = p + 1;
+        bool negative_exp = (*e == '-');
+        if (*e == '-' || *e == '+') {
+            e++;
+        }
+        if (*e >= '0' && *e <= '9') {
+            int exp_val = 0;
+            for (; *e >= '0' && *e <= '9'; e++) {
+                exp_val = (exp_val < 100000) ? exp_val * 10 + (*e - '0') : exp_val;
+            }
+            exponent += negative_exp ? -exp_val : exp_val;
+            p = e;
+        }
+    }
+
+    if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) {
+        goto slow;
+    }
+    double value = (double) mantissa;
+    value = (exponent < 0) ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+    *out = negative ? -value : value;
+    return p;
+
+slow:
+    *out = strtod(start, &p);
+    return p;
+}
+
+//////////////////////////////////////////////////// STREAMING READER ///////////////////////////////////////////////////////////////////////////
+
+static DataStream* alloc_stream(StreamFormat format, const char* path, double scale) {
+    DataStream* stream = calloc(1, sizeof(DataStream));
+    if (stream == NULL || (stream->path = strdup(path)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for data stream struct.\n");
+        exit(1);
+    }
+    stream->format = format;
+    stream->scale = scale;
+    stream->label_col = -1;
+    return stream;
+}
+
+/*
+Makes sure the whole line at chunk_pos is in the chunk, sliding the partial tail to the front and reading
+behind it (growing the chunk for lines longer than it). Returns the end of the line ('\n' or the end of
+the data), NULL at end of file.
+*/
+static char* next_line(DataStream* stream) {
+    for (;;) {
+        char* line = stream->chunk + stream->chunk_pos;
+        size_t avail = stream->chunk_len - stream->chunk_pos;
+        char* newline = memchr(line, '\n', avail);
+        if (newline != NULL) {
+            return newline;
+        }
+        if (stream->file_done) {
+            return (avail > 0) ? line + avail : NULL;
+        }
+
+        memmove(stream->chunk, line, avail);
+        stream->chunk_len = avail;
+        stream->chunk_pos = 0;
+        if (stream->chunk_len == stream->chunk_cap) {
+            stream->chunk_cap *= 2;
+            stream->chunk = realloc(stream->chunk, stream->chunk_cap + 8);
+            if (stream->chunk == NULL) {
+                fprintf(stderr, "Error: Memory allocation failure for a line of %s.\n", stream->path);
+                exit(1);
+            }
+        }
+        size_t want = stream->chunk_cap - stream->chunk_len;
+        size_t got = fread(stream->chunk + stream->chunk_len, 1, want, stream->file);
+        if (ferror(stream->file)) {
+            fprintf(stderr, "Error: Could not read %s.\n", stream->path);
+            exit(1);
+        }
+        stream->chunk_len += got;
+        stream->chunk[stream->chunk_len] = '\0'; // Stops the parser, the 8 byte pad keeps wide loads in bounds
+        stream->file_done = (got < want);
+    }
+}
+
+static bool is_blank(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p == end;
+}
+
+/*
+Parses the next non blank line into x (cols features) and label. Returns false at end of file.
+*/
+static bool csv_read_sample(DataStream* stream, nn_float* x, int* label) {
+    int fields = stream->cols + (stream->label_col >= 0);
+    for (;;) {
+        char* end = next_line(stream);
+        if (end == NULL) {
+            return false;
+        }
+        char* p = stream->chunk + stream->chunk_pos;
+        stream->chunk_pos = (size_t) (end - stream->chunk) + (*end == '\n');
+        stream->line_num++;
+        if ((stream->skip_header && stream->line_num == 1) || is_blank(p, end)) {
+            continue;
+        }
+
+        *label = -1;
+        int col = 0;
+        for (int field = 0; ; field++) {
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            double val;
+            char* num_end = (field < fields && *p != ',' && p < end && *p != '\r') ? parse_number(p, &val) : p;
+            if (num_end == p) {
+                fprintf(stderr, "Error: Malformed field %d on line %ld of %s.\n", field, stream->line_num, stream->path);
+                exit(1);
+            }
+            if (field == stream->label_col) {
+                *label = (int) val;
+            }
+            else {
+                x[col++] = (nn_float) (val * stream->scale);
+            }
+            p = num_end;
+            while (*p == ' ' || *p == '\t' || *p == '\r') {
+                p++;
+            }
+            if (p >= end) {
+                if (field + 1 != fields) {
+                    fprintf(stderr, "Error: Line %ld of %s has %d fields, expected %d.\n", stream->line_num,
+                            stream->path, field + 1, fields);
+                    exit(1);
+                }
+                return true;
+            }
+            if (*p != ',') {
+                fprintf(stderr, "Error: Malformed field %d on line %ld of %s.\n", field, stream->line_num, stream->path);
+                exit(1);
+            }
+            p++;
+        }
+    }
+}
+
+/*
+Reads the next image (and label) of an IDX stream into x. Returns false after the last one.
+*/
+static bool idx_read_sample(DataStream* stream, nn_float* x, int* label) {
+    if (stream->idx_read == stream->idx_rows) {
+        return false;
+    }
+    if (fread(stream->pixels, 1, stream->cols, stream->file) != (size_t) stream->cols) {
+        fprintf(stderr, "Error: Truncated images in %s.\n", stream->path);
+        exit(1);
+    }
+    for (int j = 0; j < stream->cols; j++) {
+        x[j] = (nn_float) (stream->pixels[j] * stream->scale);
+    }
+    *label = -1;
+    if (stream->label_file != NULL) {
+        int c = fgetc(stream->label_file);
+        if (c == EOF) {
+            fprintf(stderr, "Error: Truncated labels for %s.\n", stream->path);
+            exit(1);
+        }
+        *label = c;
+    }
+    stream->idx_read++;
+    return true;
+}
+
+static bool stream_read_sample(DataStream* stream, nn_float* x, int* label) {
+    return (stream->format == STREAM_CSV) ? csv_read_sample(stream, x, label) : idx_read_sample(stream, x, label);
+}
+
+static bool stream_has_labels(DataStream* stream) {
+    return (stream->format == STREAM_CSV) ? stream->label_col >= 0 : stream->label_file != NULL;
+}
+
+/*
+Back to the first sample for the next epoch.
+*/
+static void rewind_stream(DataStream* stream) {
+    if (stream->format == STREAM_CSV) {
+        rewind(stream->file);
+        stream->chunk_len = 0;
+        stream->chunk_pos = 0;
+        stream->chunk[0] = '\0';
+        stream->file_done = false;
+        stream->line_num = 0;
+    }
+    else {
+        if (fseek(stream->file, stream->data_start, SEEK_SET) != 0
+            || (stream->label_file != NULL && fseek(stream->label_file, stream->label_start, SEEK_SET) != 0)) {
+            fprintf(stderr, "Error: Could not rewind %s.\n", stream->path);
+            exit(1);
+        }
+        stream->idx_read = 0;
+    }
+}
+
+/*
+Opens a CSV file and sizes samples from the first data line, without consuming it.
+*/
+static DataStream* begin_csv_stream(const char* path, int label_col, bool skip_header, double scale) {
+    DataStream* stream = alloc_stream(STREAM_CSV, path, scale);
+    stream->file = fopen(path, "r");
+    stream->chunk_cap = STREAM_CHUNK_SIZE;
+    stream->chunk = malloc(stream->chunk_cap + 8);
+    if (stream->file == NULL || stream->chunk == NULL) {
+        fprintf(stderr, "Error: Could not open CSV file %s.\n", path);
+        exit(1);
+    }
+    stream->chunk[0] = '\0';
+    stream->label_col = label_col;
+    stream->skip_header = skip_header;
+
+    for (;;) {
+        char* end = next_line(stream);
+        if (end == NULL) {
+            fprintf(stderr, "Error: No samples in CSV file %s.\n", path);
+            exit(1);
+        }
+        char* line = stream->chunk + stream->chunk_pos;
+        if ((skip_header && stream->line_num == 0) || is_blank(line, end)) {
+            stream->chunk_pos = (size_t) (end - stream->chunk) + (*end == '\n');
+            stream->line_num++;
+            continue;
+        }
+        int fields = 1;
+        for (char* c = line; c < end; c++) {
+            fields += (*c == ',');
+        }
+        stream->cols = fields - (label_col >= 0);
+        if (stream->cols <= 0 || label_col >= fields) {
+            fprintf(stderr, "Error: Label column %d does not fit %d columns of %s.\n", label_col, fields, path);
+            exit(1);
+        }
+        return stream;
+    }
+}
+
+/*
+Reads the big endian IDX header, checks for unsigned byte data and returns the dim count.
+*/
+static int read_idx_header(FILE* f, const char* path, uint32_t dims[4]) {
+    unsigned char magic[4];
+    if (fread(magic, 1, 4, f) != 4 || magic[0] != 0 || magic[1] != 0 || magic[3] < 1 || magic[3] > 4) {
+        fprintf(stderr, "Error: %s is not an IDX file.\n", path);
+        exit(1);
+    }
+    if (magic[2] != 0x08) {
+        fprintf(stderr, "Error: Only unsigned byte IDX files are supported, %s has type 0x%02x.\n", path, magic[2]);
+        exit(1);
+    }
+    for (int i = 0; i < magic[3]; i++) {
+        unsigned char b[4];
+        if (fread(b, 1, 4, f) != 4) {
+            fprintf(stderr, "Error: Truncated IDX header in %s.\n", path);
+            exit(1);
+        }
+        dims[i] = ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+    }
+    return magic[3];
+}
+
+static DataStream* begin_idx_stream(const char* images_path, const char* labels_path, double scale) {
+    DataStream* stream = alloc_stream(STREAM_IDX, images_path, scale);
+    stream->file = fopen(images_path, "rb");
+    if (stream->file == NULL) {
+        fprintf(stderr, "Error: Could not open IDX file %s.\n", images_path);
+        exit(1);
+    }
+    setvbuf(stream->file, NULL, _IOFBF, STREAM_CHUNK_SIZE);
+
+    uint32_t dims[4];
+    int ndims = read_idx_header(stream->file, images_path, dims);
+    uint64_t cols = 1;
+    for (int i = 1; i < ndims; i++) {
+        cols *= dims[i]; // 28 x 28 images flatten to 784 features
+    }
+    if (dims[0] > INT_MAX || cols > INT_MAX) {
+        fprintf(stderr, "Error: IDX file %s is too large.\n", images_path);
+        exit(1);
+    }
+    stream->idx_rows = (int) dims[0];
+    stream->cols = (int) cols;
+    stream->data_start = ftell(stream->file);
+    stream->pixels = malloc(cols);
+    if (stream->pixels == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in begin idx stream.\n");
+        exit(1);
+    }
+
+    if (labels_path != NULL) {
+        stream->label_file = fopen(labels_path, "rb");
+        if (stream->label_file == NULL) {
+            fprintf(stderr, "Error: Could not open IDX file %s.\n", labels_path);
+            exit(1);
+        }
+        uint32_t label_dims[4];
+        if (read_idx_header(stream->label_file, labels_path, label_dims) != 1 || label_dims[0] != dims[0]) {
+            fprintf(stderr, "Error: %s does not hold one label per image of %s.\n", labels_path, images_path);
+            exit(1);
+        }
+        stream->label_start = ftell(stream->label_file);
+    }
+    return stream;
+}
+
+/*
+Allocates the shuffle buffer and the batch buffers of a stream that feeds training.
+*/
+static DataStream* begin_batches(DataStream* stream, int num_classes, int batch_size, int shuffle_size,
+                                 unsigned int seed) {
+    if (batch_size <= 0 || (stream_has_labels(stream) && num_classes <= 0)) {
+        fprintf(stderr, "Error: Batches of %d rows with %d classes can not be streamed from %s.\n", batch_size,
+                num_classes, stream->path);
+        exit(1);
+    }
+    stream->num_classes = stream_has_labels(stream) ? num_classes : 0;
+    stream->batch_size = batch_size;
+    stream->shuffle_size = (shuffle_size < 1) ? 1 : shuffle_size;
+    stream->seed = seed;
+    stream->buffer_x = allocate_matrix(stream->shuffle_size, stream->cols);
+    stream->buffer_labels = malloc(stream->shuffle_size * sizeof(int));
+    stream->x_batch = allocate_matrix(batch_size, stream->cols);
+    stream->y_batch = (stream->num_classes > 0) ? allocate_matrix(batch_size, stream->num_classes) : NULL;
+    if (stream->buffer_labels == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in begin batches.\n");
+        exit(1);
+    }
+    return stream;
+}
+
+DataStream* open_csv_stream(const char* path, int label_col, int num_classes, bool skip_header, double scale,
+                            int batch_size, int shuffle_size, unsigned int seed) {
+    return begin_batches(begin_csv_stream(path, label_col, skip_header, scale), num_classes, batch_size,
+                         shuffle_size, seed);
+}
+
+DataStream* open_idx_stream(const char* images_path, const char* labels_path, int num_classes, double scale,
+                            int batch_size, int shuffle_size, unsigned int seed) {
+    return begin_batches(begin_idx_stream(images_path, labels_path, scale), num_classes, batch_size,
+                         shuffle_size, seed);
+}
+
+void free_data_stream(DataStream* stream) {
+    fclose(stream->file);
+    if (stream->label_file != NULL) {
+        fclose(stream->label_file);
+    }
+    if (stream->buffer_x != NULL) {
+        free_matrix(stream->buffer_x);
+        free_matrix(stream->x_batch);
+    }
+    if (stream->y_batch != NULL) {
+        free_matrix(stream->y_batch);
+    }
+    free(stream->buffer_labels);
+    free(stream->chunk);
+    free(stream->pixels);
+    free(stream->path);
+    free(stream);
+}
+
+bool data_stream_next(DataStream* stream, matrix** X_batch, matrix** Y_batch) {
+    int cols = stream->cols;
+    size_t row_bytes = (size_t) cols * sizeof(nn_float);
+
+    // Fill the shuffle buffer at the start of an epoch
+    while (!stream->source_done && stream->buffered < stream->shuffle_size) {
+        nn_float* slot = stream->buffer_x->data + (size_t) stream->buffered * cols;
+        if (stream_read_sample(stream, slot, &stream->buffer_labels[stream->buffered])) {
+            stream->buffered++;
+        }
+        else {
+            stream->source_done = true;
+        }
+    }
+
+    // Epoch done, the next call starts over
+    if (stream->buffered == 0) {
+        rewind_stream(stream);
+        stream->source_done = false;
+        return false;
+    }
+
+    if (stream->y_batch != NULL) {
+        memset(stream->y_batch->data, 0, (size_t) stream->batch_size * stream->num_classes * sizeof(nn_float));
+    }
+    int rows = 0;
+    for (; rows < stream->batch_size && stream->buffered > 0; rows++) {
+        // Draw a buffered sample at random, its slot is refilled straight from the file
+        int pick = (stream->buffered > 1) ? rand_r(&stream->seed) % stream->buffered : 0;
+        nn_float* slot = stream->buffer_x->data + (size_t) pick * cols;
+        memcpy(stream->x_batch->data + (size_t) rows * cols, slot, row_bytes);
+
+        if (stream->y_batch != NULL) {
+            int label = stream->buffer_labels[pick];
+            if (label < 0 || label >= stream->num_classes) {
+                fprintf(stderr, "Error: Label %d is outside %d classes in %s.\n", label, stream->num_classes, stream->path);
+                exit(1);
+            }
+            stream->y_batch->data[(size_t) rows * stream->num_classes + label] = 1.0;
+        }
+
+        if (stream->source_done || !stream_read_sample(stream, slot, &stream->buffer_labels[pick])) {
+            // File exhausted, the buffer drains by moving its last sample into the hole
+            stream->source_done = true;
+            stream->buffered--;
+            if (pick != stream->buffered) {
+                memcpy(slot, stream->buffer_x->data + (size_t) stream->buffered * cols, row_bytes);
+                stream->buffer_labels[pick] = stream->buffer_labels[stream->buffered];
+            }
+        }
+    }
+
+    stream->x_batch->rows = rows;
+    *X_batch = stream->x_batch;
+    if (stream->y_batch != NULL) {
+        stream->y_batch->rows = rows;
+    }
+    if (Y_batch != NULL) {
+        *Y_batch = stream->y_batch;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////// DATASET FILES ///////////////////////////////////////////////////////////////////////////
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + DATASET_ALIGNMENT - 1) & ~(uint64_t) (DATASET_ALIGNMENT - 1);
+}
+
+static void write_or_die(FILE* f, const void* data, size_t bytes, const char* path) {
+    if (bytes > 0 && fwrite(data, 1, bytes, f) != bytes) {
+        fprintf(stderr, "Error: Could not write %zu bytes to %s.\n", bytes, path);
+        exit(1);
+    }
+}
+
+/*
+Opens the output file and reserves the header, samples follow at the first aligned offset.
+*/
+static FILE* begin_dataset(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error: Could not create dataset file %s.\n", path);
+        exit(1);
+    }
+    DatasetHeader placeholder = {0};
+    write_or_die(f, &placeholder, sizeof(placeholder), path);
+    return f;
+}
+
+/*
+Writes the label section after rows samples of cols features, then the header, and closes the file.
+labels holds one class per row (NULL for LABELS_NONE), num_classes <= 0 takes the largest label + 1.
+*/
+static void end_dataset(FILE* f, const char* path, int rows, int cols, const int* labels, int num_classes,
+                        LabelLayout layout) {
+    if (labels == NULL) {
+        layout = LABELS_NONE;
+    }
+    if (layout != LABELS_NONE && num_classes <= 0) {
+        for (int i = 0; i < rows; i++) {
+            num_classes = (labels[i] + 1 > num_classes) ? labels[i] + 1 : num_classes;
+        }
+    }
+
+    DatasetHeader header = {0};
+    header.magic = DATASET_MAGIC;
+    header.version = DATASET_VERSION;
+    header.dtype = NN_DTYPE;
+    header.label_layout = layout;
+    header.rows = rows;
+    header.cols = cols;
+    header.label_cols = (layout == LABELS_ONE_HOT) ? num_classes : (layout == LABELS_INDEX) ? 1 : 0;
+    header.data_offset = align_offset(sizeof(DatasetHeader));
+    uint64_t data_end = header.data_offset + (uint64_t) rows * cols * sizeof(nn_float);
+    header.label_offset = (layout == LABELS_NONE) ? data_end : align_offset(data_end);
+
+    if (layout != LABELS_NONE) {
+        // Zero pad up to the label section
+        static const char zeros[DATASET_ALIGNMENT] = {0};
+        write_or_die(f, zeros, header.label_offset - data_end, path);
+
+        nn_float* row = calloc(header.label_cols, sizeof(nn_float));
+        if (row == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure in end dataset.\n");
+            exit(1);
+        }
+        for (int i = 0; i < rows; i++) {
+            if (labels[i] < 0 || labels[i] >= num_classes) {
+                fprintf(stderr, "Error: Label %d of row %d is outside %d classes in %s.\n", labels[i], i, num_classes, path);
+                exit(1);
+            }
+            if (layout == LABELS_INDEX) {
+                row[0] = (nn_float) labels[i];
+            }
+            else {
+                row[labels[i]] = 1.0;
+            }
+            write_or_die(f, row, header.label_cols * sizeof(nn_float), path);
+            if (layout == LABELS_ONE_HOT) {
+                row[labels[i]] = 0.0;
+            }
+        }
+        free(row);
+    }
+
+    // Header goes in last so a file cut short by a crash never passes the magic check
+    if (fseek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Could not seek in dataset file %s.\n", path);
+        exit(1);
+    }
+    write_or_die(f, &header, sizeof(header), path);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: Could not close dataset file %s.\n", path);
+        exit(1);
+    }
+}
+
+/*
+True when rows x cols values from offset end inside a file of size bytes.
+Bounds rows by the space left after offset rather than multiplying, so a corrupt header can not wrap the sum.
+*/
+static bool section_fits(uint64_t offset, uint64_t rows, uint64_t cols, size_t size) {
+    if (offset > size) {
+        return false;
+    }
+    if (cols == 0) {
+        return true; // Nothing stored, no row width to divide by
+    }
+    return rows <= (size - offset) / (cols * sizeof(nn_float));
+}
+
+Dataset* open_dataset(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open dataset file %s.\n", path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(DatasetHeader)) {
+        fprintf(stderr, "Error: %s is too short to be a dataset file.\n", path);
+        exit(1);
+    }
+
+    // Private writable mapping, pages are read from the page cache on first touch and copied only if written
+    size_t size = (size_t) st.st_size;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map dataset file %s.\n", path);
+        exit(1);
+    }
+
+    Dataset* ds = malloc(sizeof(Dataset));
+    if (ds == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for dataset struct.\n");
+        exit(1);
+    }
+    ds->base = base;
+    ds->size = size;
+    memcpy(&ds->header, base, sizeof(DatasetHeader));
+    DatasetHeader* h = &ds->header;
+
+    // Validate everything before pointing views at the mapping
+    if (h->magic != DATASET_MAGIC || h->version != DATASET_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d dataset file.\n", path, DATASET_VERSION);
+        exit(1);
+    }
+    if (h->dtype != NN_DTYPE) {
+        fprintf(stderr, "Error: %s is stored as %s but this build uses %s, convert it again.\n", path,
+                h->dtype == FLOAT32 ? "float32" : "float64", NN_DTYPE == FLOAT32 ? "float32" : "float64");
+        exit(1);
+    }
+    // Label columns follow the layout: none without labels, one class index, or at least one one hot class
+    bool labels_match = (h->label_layout == LABELS_NONE) ? h->label_cols == 0
+                      : (h->label_layout == LABELS_INDEX) ? h->label_cols == 1 : h->label_cols > 0;
+    if (h->rows > INT_MAX || h->cols > INT_MAX || h->label_cols > INT_MAX || h->label_layout > LABELS_ONE_HOT
+        || !labels_match || h->data_offset % DATASET_ALIGNMENT != 0 || h->label_offset % DATASET_ALIGNMENT != 0
+        || !section_fits(h->data_offset, h->rows, h->cols, size)
+        || !section_fits(h->label_offset, h->rows, h->label_cols, size)) {
+        fprintf(stderr, "Error: Header of dataset file %s does not match its size.\n", path);
+        exit(1);
+    }
+
+    ds->X.rows = (int) h->rows;
+    ds->X.cols = (int) h->cols;
+    ds->X.data = (nn_float*) ((char*) base + h->data_offset);
+    ds->Y.rows = (h->label_layout == LABELS_NONE) ? 0 : (int) h->rows;
+    ds->Y.cols = (int) h->label_cols;
+    ds->Y.data = (h->label_layout == LABELS_NONE) ? NULL : (nn_float*) ((char*) base + h->label_offset);
+    return ds;
+}
+
+void close_dataset(Dataset* ds) {
+    munmap(ds->base, ds->size);
+    free(ds);
+}
+
+void dataset_batch_view(Dataset* ds, matrix* X_batch, matrix* Y_batch, int start_row, int num_rows) {
+    if (start_row < 0 || num_rows < 0 || start_row + num_rows > ds->X.rows) {
+        fprintf(stderr, "Error: Rows %d to %d are outside the %d rows of the dataset.\n", start_row,
+                start_row + num_rows, ds->X.rows);
+        exit(1);
+    }
+    shallow_cpy_matrix(&ds->X, X_batch, start_row, num_rows);
+    if (Y_batch != NULL) {
+        if (ds->Y.data == NULL) {
+            fprintf(stderr, "Error: Dataset has no labels in dataset batch view.\n");
+            exit(1);
+        }
+        shallow_cpy_matrix(&ds->Y, Y_batch, start_row, num_rows);
+    }
+}
+
+void write_dataset(const char* path, matrix* X, matrix* Y, LabelLayout layout) {
+    if (Y != NULL && Y->rows != X->rows) {
+        fprintf(stderr, "Error: Samples and labels have a different number of rows in write dataset.\n");
+        exit(1);
+    }
+
+    int* labels = NULL;
+    if (Y != NULL && layout != LABELS_NONE) {
+        labels = malloc(X->rows * sizeof(int));
+        if (labels == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure in write dataset.\n");
+            exit(1);
+        }
+        for (int i = 0; i < X->rows; i++) {
+            const nn_float* row = Y->data + (size_t) i * Y->cols;
+            labels[i] = 0;
+            for (int j = 1; j < Y->cols; j++) {
+                labels[i] = (row[j] > row[labels[i]]) ? j : labels[i];
+            }
+        }
+    }
+
+    FILE* f = begin_dataset(path);
+    write_or_die(f, X->data, (size_t) X->rows * X->cols * sizeof(nn_float), path);
+    end_dataset(f, path, X->rows, X->cols, labels, (Y != NULL) ? Y->cols : 0, layout);
+    free(labels);
+}
+
+/*
+Appends a label to a growing array.
+*/
+static void push_label(int** labels, int* capacity, int count, int label) {
+    if (count == *capacity) {
+        *capacity = (*capacity == 0) ? 1024 : 2 * *capacity;
+        *labels = realloc(*labels, *capacity * sizeof(int));
+        if (*labels == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure for dataset labels.\n");
+            exit(1);
+        }
+    }
+    (*labels)[count] = label;
+}
+
+/*
+Streams every sample of an opened stream into a dataset file, labels are kept until the end.
+*/
+static int convert_stream(DataStream* stream, const char* out_path, int num_classes, LabelLayout layout) {
+    nn_float* row = malloc(stream->cols * sizeof(nn_float));
+    if (row == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in convert stream.\n");
+        exit(1);
+    }
+    bool has_labels = stream_has_labels(stream);
+    int* labels = NULL;
+    int label_cap = 0;
+    int rows = 0;
+    int label;
+
+    FILE* out = begin_dataset(out_path);
+    while (stream_read_sample(stream, row, &label)) {
+        write_or_die(out, row, stream->cols * sizeof(nn_float), out_path);
+        if (has_labels) {
+            push_label(&labels, &label_cap, rows, label);
+        }
+        rows++;
+    }
+    if (rows == 0) {
+        fprintf(stderr, "Error: No samples in %s.\n", stream->path);
+        exit(1);
+    }
+    end_dataset(out, out_path, rows, stream->cols, labels, num_classes, layout);
+
+    free(labels);
+    free(row);
+    free_data_stream(stream);
+    return rows;
+}
+
+int convert_csv_dataset(const char* csv_path, const char* out_path, int label_col, int num_classes,
+                        bool skip_header, double scale, LabelLayout layout) {
+    return convert_stream(begin_csv_stream(csv_path, label_col, skip_header, scale), out_path, num_classes, layout);
+}
+
+int convert_idx_dataset(const char* images_path, const char* labels_path, const char* out_path, int num_classes,
+                        double scale, LabelLayout layout) {
+    return convert_stream(begin_idx_stream(images_path, labels_path, scale), out_path, num_classes, layout);
+}
@@ -0,0 +1,279 @@
+#include "fastmath.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT ON
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FASTMATH_X86
+#endif
+
+/*
+Bit level constants of nn_float.
+exp(x) = 2^n * exp(r) with n = round(x / ln2) and |r| <= ln2 / 2, 2^n is built straight into the exponent bits.
+log(x) = e * ln2 + log(1 + f) with x = (1 + f) * 2^e and 1 + f in [sqrt(1/2), sqrt(2)), log(1 + f) = 2 atanh(s)
+with s = f / (2 + f), evaluated as f - s * (f - R(s^2)) so the leading term f is exact.
+ln2 is split in a high part exact in n * ln2 and a low correction so the reduction loses no bits.
+Both polynomials are truncated Taylor series, the first dropped term is below half an ulp over the reduced range.
+*/
+#ifdef USE_FLOAT32
+typedef uint32_t nn_bits;
+#define MANTISSA_BITS 23
+#define EXPONENT_BIAS 127
+#define EXP_MIN -87.0f // exp(-87) is still a normal float
+#define EXP_MAX 88.0f // n stays below 128
+#define EXP_SHIFTER 0x1.8p23f // Adding it rounds to an integer held in the low mantissa bits
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+#define MIN_NORMAL FLT_MIN
+#define SQRT2 1.41421356237309505f
+static const nn_float exp_coeffs[] = {1.0f / 5040, 1.0f / 720, 1.0f / 120, 1.0f / 24, 1.0f / 6, 0.5f, 1.0f, 1.0f};
+static const nn_float log_coeffs[] = {2.0f / 9, 2.0f / 7, 2.0f / 5, 2.0f / 3};
+#else
+typedef uint64_t nn_bits;
+#define MANTISSA_BITS 52
+#define EXPONENT_BIAS 1023
+#define EXP_MIN -708.0
+#define EXP_MAX 709.0
+#define EXP_SHIFTER 0x1.8p52
+#define LOG2E 1.44269504088896340736
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define MIN_NORMAL DBL_MIN
+#define SQRT2 1.41421356237309504880
+static const nn_float exp_coeffs[] = {1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+                                      1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0,
+                                      1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0};
+static const nn_float log_coeffs[] = {2.0 / 19, 2.0 / 17, 2.0 / 15, 2.0 / 13, 2.0 / 11, 2.0 / 9, 2.0 / 7,
+                                      2.0 / 5, 2.0 / 3};
+#endif
+
+#define EXP_TERMS ((int) (sizeof(exp_coeffs) / sizeof(exp_coeffs[0])))
+#define LOG_TERMS ((int) (sizeof(log_coeffs) / sizeof(log_coeffs[0])))
+#define MANTISSA_MASK ((((nn_bits) 1) << MANTISSA_BITS) - 1)
+#define ONE_BITS (((nn_bits) EXPONENT_BIAS) << MANTISSA_BITS)
+
+// Lanes of mask where the comparison held take a, the rest take b
+#define SELECT(VEC, UVEC, mask, a, b) ((VEC) (((UVEC) (mask) & (UVEC) (a)) | (~(UVEC) (mask) & (UVEC) (b))))
+
+//////////////////////////////////////////////////// KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Every kernel set is the same branch free polynomial code on one vector type, UVEC is its unsigned bit view.
+Rows run whole vectors through the polynomial and pad the tail into one more vector, so every value of a row
+is computed the same way whatever its position.
+*/
+#define DEFINE_FASTMATH_KERNELS(SUFFIX, VEC, UVEC, TARGET)                                          \
+TARGET static inline VEC exp_##SUFFIX(VEC x) {                                                      \
+    VEC underflow = (VEC) ((UVEC) (x < EXP_MIN));                                                   \
+    x = SELECT(VEC, UVEC, x > EXP_MAX, (VEC){0} + EXP_MAX, x);                                      \
+    x = SELECT(VEC, UVEC, underflow, (VEC){0} + EXP_MIN, x);                                        \
+    VEC kd = x * LOG2E + EXP_SHIFTER;                                                               \
+    VEC n = kd - EXP_SHIFTER;                                                                       \
+    VEC r = x - n * LN2_HI;                                                                         \
+    r = r - n * LN2_LO;                                                                             \
+    VEC p = (VEC){0} + exp_coeffs[0];                                                               \
+    _Pragma("GCC unroll 16")                                                                        \
+    for (int k = 1; k < EXP_TERMS; k++) {                                                           \
+        p = p * r + exp_coeffs[k]; /* fma */                                                        \
+    }                                                                                               \
+    VEC scale = (VEC) (((UVEC) kd << MANTISSA_BITS) + ONE_BITS);                                    \
+    return (VEC) (~(UVEC) underflow & (UVEC) (p * scale));                                          \
+}                                                                                                   \
+TARGET static inline VEC log_##SUFFIX(VEC x) {                                                      \
+    x = SELECT(VEC, UVEC, x < MIN_NORMAL, (VEC){0} + MIN_NORMAL, x);                                \
+    UVEC bits = (UVEC) x;                                                                           \
+    UVEC exponent = bits >> MANTISSA_BITS;                                                          \
+    VEC m = (VEC) ((bits & MANTISSA_MASK) | ONE_BITS);                                              \
+    UVEC big = (UVEC) (m > SQRT2);                                                                  \
+    m = (VEC) ((UVEC) m - (big & ((nn_bits) 1 << MANTISSA_BITS))); /* halve m */                    \
+    exponent += big & 1;                                                                            \
+    /* Exponent to float through the mantissa of 2^MANTISSA_BITS */                                 \
+    VEC e = (VEC) (exponent | (UVEC) ((VEC){0} + (nn_float) ((nn_bits) 1 << MANTISSA_BITS)));     \
+    e = e - ((nn_float) ((nn_bits) 1 << MANTISSA_BITS) + EXPONENT_BIAS);                            \
+    VEC f = m - 1;                                                                                  \
+    VEC s = f / (f + 2);                                                                            \
+    VEC z = s * s;                                                                                  \
+    VEC p = (VEC){0} + log_coeffs[0];                                                               \
+    _Pragma("GCC unroll 16")                                                                        \
+    for (int k = 1; k < LOG_TERMS; k++) {                                                           \
+        p = p * z + log_coeffs[k];                                                                  \
+    }                                                                                               \
+    VEC R = z * p;                                                                                  \
+    return e * LN2_HI + ((f - s * (f - R)) + e * LN2_LO);                                           \
+}                                                                                                   \
+TARGET static void exp_row_##SUFFIX(const nn_float* in, nn_float* out, int n) {                     \
+    enum { LANES = sizeof(VEC) / sizeof(nn_float) };                                                \
+    int i = 0;                                                                                      \
+    for (; i + LANES <= n; i += LANES) {                                                            \
+        VEC v;                                                                                      \
+        memcpy(&v, in + i, sizeof(VEC));                                                            \
+        v = exp_##SUFFIX(v);                                                                        \
+        memcpy(out + i, &v, sizeof(VEC));                                                           \
+    }                                                                                               \
+    if (i < n) {                                                                                    \
+        VEC v = (VEC){0};                                                                           \
+        memcpy(&v, in + i, (n - i) * sizeof(nn_float));                                             \
+        v = exp_##SUFFIX(v);                                                                        \
+        memcpy(out + i, &v, (n - i) * sizeof(nn_float));                                            \
+    }                                                                                               \
+}                                                                                                   \
+TARGET static void log_row_##SUFFIX(const nn_float* in, nn_float* out, int n) {                     \
+    enum { LANES = sizeof(VEC) / sizeof(nn_float) };                                                \
+    int i = 0;                                                                                      \
+    for (; i + LANES <= n; i += LANES) {                                                            \
+        VEC v;                                                                                      \
+        memcpy(&v, in + i, sizeof(VEC));                                                            \
+        v = log_##SUFFIX(v);                                                                        \
+        memcpy(out + i, &v, sizeof(VEC));                                                           \
+    }                                                                                               \
+    if (i < n) {                                                                                    \
+        VEC v = (VEC){0} + 1;                                                                       \
+        memcpy(&v, in + i, (n - i) * sizeof(nn_float));                                             \
+        v = log_##SUFFIX(v);                                                                        \
+        memcpy(out + i, &v, (n - i) * sizeof(nn_float));                                            \
+    }                                                                                               \
+}                                                                                                   \
+TARGET static nn_float softmax_row_##SUFFIX(const nn_float* in, nn_float* out, int cols,            \
+                                             nn_float* row_max) {                                   \
+    enum { LANES = sizeof(VEC) / sizeof(nn_float) };                                                \
+    int full = cols - cols % LANES;                                                                 \
+    int rest = cols - full;                                                                         \
+    /* Tail padded with the lowest value so it never wins the max, its pads are left out of the sum */\
+    VEC tail = (VEC){0} - NN_FLOAT_MAX;                                                             \
+    memcpy(&tail, in + full, rest * sizeof(nn_float));                                              \
+                                                                                                    \
+    /* Row max for numerical stability */                                                          \
+    VEC vmax = tail;                                                                                \
+    for (int j = 0; j < full; j += LANES) {                                                         \
+        VEC v;                                                                                      \
+        memcpy(&v, in + j, sizeof(VEC));                                                            \
+        vmax = SELECT(VEC, UVEC, v > vmax, v, vmax);                                                \
+    }                                                                                               \
+    nn_float max = vmax[0];                                                                         \
+    for (int l = 1; l < LANES; l++) {                                                               \
+        max = (vmax[l] > max) ? vmax[l] : max;                                                      \
+    }                                                                                               \
+                                                                                                    \
+    /* Exponentials written straight to the output row and summed */                               \
+    VEC vsum = (VEC){0};                                                                            \
+    for (int j = 0; j < full; j += LANES) {                                                         \
+        VEC v;                                                                                      \
+        memcpy(&v, in + j, sizeof(VEC));                                                            \
+        v = exp_##SUFFIX(v - max);                                                                  \
+        memcpy(out + j, &v, sizeof(VEC));                                                           \
+        vsum += v;                                                                                  \
+    }                                                                                               \
+    tail = exp_##SUFFIX(tail - max);                                                                \
+    memcpy(out + full, &tail, rest * sizeof(nn_float));                                             \
+    nn_float sum = 0.0;                                                                             \
+    for (int l = 0; l < LANES; l++) {                                                               \
+        sum += vsum[l] + ((l < rest) ? tail[l] : 0);                                                \
+    }                                                                                               \
+                                                                                                    \
+    if (row_max != NULL) {                                                                          \
+        *row_max = max;                                                                             \
+    }                                                                                               \
+                                                                                                    \
+    /* Normalize to probabilities */                                                                \
+    nn_float inv = 1 / sum;                                                                         \
+    for (int j = 0; j < full; j += LANES) {                                                         \
+        VEC v;                                                                                      \
+        memcpy(&v, out + j, sizeof(VEC));                                                           \
+        v *= inv;                                                                                   \
+        memcpy(out + j, &v, sizeof(VEC));                                                           \
+    }                                                                                               \
+    for (int j = full; j < cols; j++) {                                                             \
+        out[j] *= inv;                                                                              \
+    }                                                                                               \
+    return sum;                                                                                     \
+}
+
+typedef nn_float fvec128 __attribute__((vector_size(16)));
+typedef nn_bits uvec128 __attribute__((vector_size(16)));
+DEFINE_FASTMATH_KERNELS(generic, fvec128, uvec128, )
+
+#ifdef FASTMATH_X86
+typedef nn_float fvec256 __attribute__((vector_size(32)));
+typedef nn_bits uvec256 __attribute__((vector_size(32)));
+typedef nn_float fvec512 __attribute__((vector_size(64)));
+typedef nn_bits uvec512 __attribute__((vector_size(64)));
+DEFINE_FASTMATH_KERNELS(avx2, fvec256, uvec256, __attribute__((target("avx2,fma"))))
+DEFINE_FASTMATH_KERNELS(avx512, fvec512, uvec512, __attribute__((target("avx512f"))))
+#endif
+
+// Kernel table, best first
+static const FastMathKernel fastmath_kernels[] = {
+#ifdef FASTMATH_X86
+    {"avx512", exp_row_avx512, log_row_avx512, softmax_row_avx512},
+    {"avx2", exp_row_avx2, log_row_avx2, softmax_row_avx2},
+#endif
+    {"generic", exp_row_generic, log_row_generic, softmax_row_generic}
+};
+
+// Published with a release store, read with an acquire load
+static _Atomic(const FastMathKernel*) active_fastmath_kernel = NULL;
+
+//////////////////////////////////////////////////// KERNEL SELECTION ///////////////////////////////////////////////////////////////////////////
+
+static bool fastmath_cpu_supports(const char* name) {
+#ifdef FASTMATH_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+    return strcmp(name, "generic") == 0;
+}
+
+bool fastmath_set_kernel(const char* name) {
+    for (size_t i = 0; i < sizeof(fastmath_kernels) / sizeof(fastmath_kernels[0]); i++) {
+        if (strcmp(fastmath_kernels[i].name, name) == 0 && fastmath_cpu_supports(name)) {
+            atomic_store_explicit(&active_fastmath_kernel, &fastmath_kernels[i], memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+const FastMathKernel* fastmath_get_kernel() {
+    const FastMathKernel* kernel = atomic_load_explicit(&active_fastmath_kernel, memory_order_acquire);
+    if (kernel == NULL) {
+        #pragma omp critical(fastmath_select)
+        {
+            if (atomic_load_explicit(&active_fastmath_kernel, memory_order_relaxed) == NULL) {
+                for (size_t i = 0; i < sizeof(fastmath_kernels) / sizeof(fastmath_kernels[0]); i++) {
+                    if (fastmath_set_kernel(fastmath_kernels[i].name)) {
+                        break;
+                    }
+                }
+            }
+        }
+        kernel = atomic_load_explicit(&active_fastmath_kernel, memory_order_acquire);
+    }
+    return kernel;
+}
+
+//////////////////////////////////////////////////// FAST MATH METHODS ///////////////////////////////////////////////////////////////////////////
+
+void fast_exp(const nn_float* in, nn_float* out, int n) {
+    fastmath_get_kernel()->exp_row(in, out, n);
+}
+
+void fast_log(const nn_float* in, nn_float* out, int n) {
+    fastmath_get_kernel()->log_row(in, out, n);
+}
+
+void fast_softmax_row(const nn_float* in, nn_float* out, int cols) {
+    fastmath_get_kernel()->softmax_row(in, out, cols, NULL);
+}
+
+nn_float fast_softmax_row_sum(const nn_float* in, nn_float* out, int cols, nn_float* max) {
+    return fastmath_get_kernel()->softmax_row(in, out, cols, max);
+}
@@ -0,0 +1,689 @@
+#include "gemm.h"
+#include "fastmath.h"
+#include <unistd.h>
+#include <stdatomic.h>
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT ON
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_X86
+#endif
+
+// Lanes of nn_float in a vector of the given bytes
+#define VEC_LANES(bytes) ((int) ((bytes) / sizeof(nn_float)))
+
+#define GEMM_MAX_MR 8
+#define GEMM_MAX_NR (3 * VEC_LANES(64))
+
+//////////////////////////////////////////////////// MICRO KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Every micro kernel is the same register blocked outer product, MR rows of C by NV vectors of C.
+Accumulators stay in registers for the whole kc loop, C is only touched once at the end.
+The vector width is set by the vector type, the instruction set by the target attribute.
+*/
+#define DEFINE_MICRO_KERNEL(NAME, VEC, MR, NV, TARGET)                                              \
+TARGET static void NAME(int kc, const nn_float* restrict a, const nn_float* restrict b,                 \
+                        nn_float* restrict c, int ldc, nn_float beta) {                                 \
+    enum { LANES = sizeof(VEC) / sizeof(nn_float) };                                                  \
+    VEC acc[MR][NV];                                                                                \
+    _Pragma("GCC unroll 8")                                                                         \
+    for (int i = 0; i < MR; i++) {                                                                  \
+        _Pragma("GCC unroll 4")                                                                     \
+        for (int v = 0; v < NV; v++) {                                                              \
+            acc[i][v] = (VEC){0};                                                                   \
+        }                                                                                           \
+    }                                                                                               \
+    for (int p = 0; p < kc; p++) {                                                                  \
+        VEC bv[NV];                                                                                 \
+        _Pragma("GCC unroll 4")                                                                     \
+        for (int v = 0; v < NV; v++) {                                                              \
+            bv[v] = ((const VEC*) b)[v]; /* packed panels are aligned */                            \
+        }                                                                                           \
+        _Pragma("GCC unroll 8")                                                                     \
+        for (int i = 0; i < MR; i++) {                                                              \
+            VEC av = (VEC){0} + a[i]; /* broadcast */                                               \
+            _Pragma("GCC unroll 4")                                                                 \
+            for (int v = 0; v < NV; v++) {                                                          \
+                acc[i][v] += av * bv[v]; /* fma */                                                  \
+            }                                                                                       \
+        }                                                                                           \
+        a += MR;                                                                                    \
+        b += NV * LANES;                                                                            \
+    }                                                                                               \
+    for (int i = 0; i < MR; i++) {                                                                  \
+        for (int v = 0; v < NV; v++) {                                                              \
+            nn_float* dst = c + i * ldc + v * LANES;                                                  \
+            VEC out = acc[i][v];                                                                    \
+            if (beta != 0.0) {                                                                      \
+                VEC old;                                                                            \
+                memcpy(&old, dst, sizeof(VEC)); /* C is not aligned */                              \
+                out += beta * old;                                                                  \
+            }                                                                                       \
+            memcpy(dst, &out, sizeof(VEC));                                                         \
+        }                                                                                           \
+    }                                                                                               \
+}
+
+/*
+Skinny kernels of gemm_small, MR rows of C by 2 vectors of C over the full depth of a prepacked panel.
+A is broadcast straight from its rows, there are too few of them to be worth packing.
+KU independent sets of accumulators split the depth loop so the 1 row kernel still has enough fma chains
+in flight to hide their latency, they are summed once at the end.
+*/
+#define DEFINE_SMALL_KERNEL(NAME, VEC, MR, KU, TARGET)                                              \
+TARGET static void NAME(int K, const nn_float* restrict a, int lda, const nn_float* restrict b,         \
+                        nn_float* restrict c, int ldc, bool accumulate) {                               \
+    enum { LANES = sizeof(VEC) / sizeof(nn_float) };                                                  \
+    VEC acc[KU][MR][2];                                                                             \
+    _Pragma("GCC unroll 4")                                                                         \
+    for (int u = 0; u < KU; u++) {                                                                  \
+        _Pragma("GCC unroll 4")                                                                     \
+        for (int i = 0; i < MR; i++) {                                                              \
+            acc[u][i][0] = (VEC){0};                                                                \
+            acc[u][i][1] = (VEC){0};                                                                \
+        }                                                                                           \
+    }                                                                                               \
+    int p = 0;                                                                                      \
+    for (; p + KU <= K; p += KU) {                                                                  \
+        _Pragma("GCC unroll 4")                                                                     \
+        for (int u = 0; u < KU; u++) {                                                              \
+            const VEC* bv = (const VEC*) (b + (size_t) (p + u) * 2 * LANES); /* panels are aligned */ \
+            _Pragma("GCC unroll 4")                                                                 \
+            for (int i = 0; i < MR; i++) {                                                          \
+                VEC av = (VEC){0} + a[(size_t) i * lda + p + u]; /* broadcast */                    \
+                acc[u][i][0] += av * bv[0]; /* fma */                                               \
+                acc[u][i][1] += av * bv[1];                                                         \
+            }                                                                                       \
+        }                                                                                           \
+    }                                                                                               \
+    for (; p < K; p++) {                                                                            \
+        const VEC* bv = (const VEC*) (b + (size_t) p * 2 * LANES);                                  \
+        _Pragma("GCC unroll 4")                                                                     \
+        for (int i = 0; i < MR; i++) {                                                              \
+            VEC av = (VEC){0} + a[(size_t) i * lda + p];                                            \
+            acc[0][i][0] += av * bv[0];                                                             \
+            acc[0][i][1] += av * bv[1];                                                             \
+        }                                                                                           \
+    }                                                                                               \
+    for (int i = 0; i < MR; i++) {                                                                  \
+        for (int v = 0; v < 2; v++) {                                                               \
+            nn_float* dst = c + i * ldc + v * LANES;                                                  \
+            VEC out = acc[0][i][v];                                                                 \
+            for (int u = 1; u < KU; u++) {                                                          \
+                out += acc[u][i][v];                                                                \
+            }                                                                                       \
+            if (accumulate) {                                                                       \
+                VEC old;                                                                            \
+                memcpy(&old, dst, sizeof(VEC)); /* C is not aligned */                              \
+                out += old;                                                                         \
+            }                                                                                       \
+            memcpy(dst, &out, sizeof(VEC));                                                         \
+        }                                                                                           \
+    }                                                                                               \
+}
+
+typedef nn_float vec128 __attribute__((vector_size(16)));
+DEFINE_MICRO_KERNEL(micro_kernel_generic, vec128, 4, 2, )
+DEFINE_SMALL_KERNEL(small_kernel_generic_4, vec128, 4, 1, )
+DEFINE_SMALL_KERNEL(small_kernel_generic_1, vec128, 1, 4, )
+
+#ifdef GEMM_X86
+typedef nn_float vec256 __attribute__((vector_size(32)));
+typedef nn_float vec512 __attribute__((vector_size(64)));
+DEFINE_MICRO_KERNEL(micro_kernel_avx2, vec256, 6, 2, __attribute__((target("avx2,fma"))))
+DEFINE_MICRO_KERNEL(micro_kernel_avx512, vec512, 8, 3, __attribute__((target("avx512f"))))
+DEFINE_SMALL_KERNEL(small_kernel_avx2_4, vec256, 4, 1, __attribute__((target("avx2,fma"))))
+DEFINE_SMALL_KERNEL(small_kernel_avx2_1, vec256, 1, 4, __attribute__((target("avx2,fma"))))
+DEFINE_SMALL_KERNEL(small_kernel_avx512_4, vec512, 4, 1, __attribute__((target("avx512f"))))
+DEFINE_SMALL_KERNEL(small_kernel_avx512_1, vec512, 1, 4, __attribute__((target("avx512f"))))
+#endif
+
+// Kernel table, best first. NR is NV vectors wide, so float kernels cover twice the cols.
+// Cache blocks are filled in on selection.
+static GemmKernel kernels[] = {
+#ifdef GEMM_X86
+    {"avx512", 8, 3 * VEC_LANES(64), 0, 0, 0, micro_kernel_avx512,
+     2 * VEC_LANES(64), small_kernel_avx512_4, small_kernel_avx512_1},
+    {"avx2", 6, 2 * VEC_LANES(32), 0, 0, 0, micro_kernel_avx2,
+     2 * VEC_LANES(32), small_kernel_avx2_4, small_kernel_avx2_1},
+#endif
+    {"generic", 4, 2 * VEC_LANES(16), 0, 0, 0, micro_kernel_generic,
+     2 * VEC_LANES(16), small_kernel_generic_4, small_kernel_generic_1}
+};
+
+// Published with a release store after its cache blocks are set, read with an acquire load
+static _Atomic(GemmKernel*) active_kernel = NULL;
+
+//////////////////////////////////////////////////// KERNEL SELECTION ///////////////////////////////////////////////////////////////////////////
+
+static bool cpu_supports(const char* name) {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+    return strcmp(name, "generic") == 0;
+}
+
+static long cache_size(int level, long fallback) {
+    long size = 0;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    if (level == 1) {
+        size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    }
+    else if (level == 2) {
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    else {
+        size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    }
+#endif
+    return (size > 0) ? size : fallback;
+}
+
+static int clamp_block(long val, int multiple, int min, int max) {
+    if (val > max) {
+        val = max;
+    }
+    val = (val / multiple) * multiple;
+    return (val < min) ? min : (int) val;
+}
+
+static void set_cache_blocks(GemmKernel* k) {
+    long l1 = cache_size(1, 32 * 1024);
+    long l2 = cache_size(2, 512 * 1024);
+    long l3 = cache_size(3, 8 * 1024 * 1024);
+
+    // Half of each level holds the packed operand, the rest is left for C and the streaming operand
+    k->kc = clamp_block((l1 / 2) / (k->nr * (long) sizeof(nn_float)), 8, 64, 512);
+    k->mc = clamp_block((l2 / 2) / (k->kc * (long) sizeof(nn_float)), k->mr, k->mr, 1024);
+    k->nc = clamp_block((l3 / 2) / (k->kc * (long) sizeof(nn_float)), k->nr, k->nr, 8192);
+}
+
+bool gemm_set_kernel(const char* name) {
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && cpu_supports(name)) {
+            set_cache_blocks(&kernels[i]);
+            atomic_store_explicit(&active_kernel, &kernels[i], memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+const GemmKernel* gemm_get_kernel() {
+    const GemmKernel* kernel = atomic_load_explicit(&active_kernel, memory_order_acquire);
+    if (kernel == NULL) {
+        #pragma omp critical(gemm_select)
+        {
+            if (atomic_load_explicit(&active_kernel, memory_order_relaxed) == NULL) {
+                for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+                    if (gemm_set_kernel(kernels[i].name)) {
+                        break;
+                    }
+                }
+            }
+        }
+        kernel = atomic_load_explicit(&active_kernel, memory_order_acquire);
+    }
+    return kernel;
+}
+
+//////////////////////////////////////////////////// PACKING ///////////////////////////////////////////////////////////////////////////
+
+// Packed panel buffers, grown on demand and reused across calls.
+// Owned per thread, inside a team the thread that reserves them lends its buffers to the rest of the team.
+static _Thread_local nn_float* pack_a = NULL;
+static _Thread_local nn_float* pack_b = NULL;
+static _Thread_local size_t pack_a_size = 0;
+static _Thread_local size_t pack_b_size = 0;
+
+static void reserve_pack_buffer(nn_float** buf, size_t* size, size_t needed) {
+    if (*size >= needed) {
+        return;
+    }
+    free(*buf);
+    if (posix_memalign((void**) buf, 64, needed * sizeof(nn_float)) != 0) {
+        fprintf(stderr, "Error: Memory allocation failure for packed panels in gemm.\n");
+        exit(1);
+    }
+    *size = needed;
+}
+
+void gemm_free_buffers() {
+    free(pack_a);
+    free(pack_b);
+    pack_a = NULL;
+    pack_b = NULL;
+    pack_a_size = 0;
+    pack_b_size = 0;
+}
+
+/*
+Packs an (mc x kc) block of op(A) into MR row slivers, each sliver stored column by column.
+A points at the first element of the block, trans_a reads it as a (kc x mc) block of the stored matrix.
+alpha is folded in here so the micro kernel never scales. Rows past the edge are zero padded.
+*/
+static void pack_block_a(const GemmKernel* k, int mc, int kc, const nn_float* A, int lda, bool trans_a,
+                         nn_float alpha, nn_float* dest) {
+    int mr = k->mr;
+    int slivers = (mc + mr - 1) / mr;
+
+    #pragma omp for schedule(static)
+    for (int s = 0; s < slivers; s++) {
+        nn_float* out = dest + (size_t) s * mr * kc;
+        int rows = (mc - s * mr < mr) ? mc - s * mr : mr;
+
+        if (trans_a) {
+            // Rows of op(A) are contiguous in memory, copy straight across
+            const nn_float* src = A + s * mr;
+            for (int p = 0; p < kc; p++) {
+                for (int i = 0; i < rows; i++) {
+                    out[p * mr + i] = alpha * src[(size_t) p * lda + i];
+                }
+                for (int i = rows; i < mr; i++) {
+                    out[p * mr + i] = 0.0;
+                }
+            }
+        }
+        else {
+            const nn_float* src = A + (size_t) s * mr * lda;
+            for (int p = 0; p < kc; p++) {
+                for (int i = 0; i < rows; i++) {
+                    out[p * mr + i] = alpha * src[i * lda + p];
+                }
+                for (int i = rows; i < mr; i++) {
+                    out[p * mr + i] = 0.0;
+                }
+            }
+        }
+    }
+}
+
+/*
+Packs a (kc x nc) block of op(B) into nr column slivers, each sliver stored row by row.
+B points at the first element of the block, trans_b reads it as an (nc x kc) block of the stored matrix.
+Cols past the edge are zero padded.
+*/
+static void pack_block_b(int nr, int kc, int nc, const nn_float* B, int ldb, bool trans_b, nn_float* dest) {
+    int slivers = (nc + nr - 1) / nr;
+
+    #pragma omp for schedule(static)
+    for (int s = 0; s < slivers; s++) {
+        nn_float* out = dest + (size_t) s * nr * kc;
+        int cols = (nc - s * nr < nr) ? nc - s * nr : nr;
+
+        if (trans_b) {
+            // Each col of op(B) is a contiguous row of B
+            const nn_float* src = B + (size_t) s * nr * ldb;
+            for (int j = 0; j < cols; j++) {
+                for (int p = 0; p < kc; p++) {
+                    out[p * nr + j] = src[(size_t) j * ldb + p];
+                }
+            }
+            for (int p = 0; p < kc; p++) {
+                for (int j = cols; j < nr; j++) {
+                    out[p * nr + j] = 0.0;
+                }
+            }
+        }
+        else {
+            const nn_float* src = B + s * nr;
+            for (int p = 0; p < kc; p++) {
+                memcpy(out + p * nr, src + (size_t) p * ldb, cols * sizeof(nn_float));
+                for (int j = cols; j < nr; j++) {
+                    out[p * nr + j] = 0.0;
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////// GEMM ///////////////////////////////////////////////////////////////////////////
+
+/*
+Applies the bias / activation epilogue to a (rows x cols) tile of C whose first col is col0 of the full C.
+Called right after the tile's last depth block, while it is still in L1.
+*/
+static void tile_epilogue(const GemmEpilogue* ep, nn_float* c, int ldc, int rows, int cols, int col0) {
+    const nn_float* bias = ep->bias + col0;
+    for (int i = 0; i < rows; i++) {
+        nn_float* row = c + i * ldc;
+        if (ep->type == GEMM_EPILOGUE_BIAS_RELU) {
+            for (int j = 0; j < cols; j++) {
+                nn_float z = row[j] + bias[j];
+                row[j] = (z > 0.0) ? z : 0.0;
+            }
+        }
+        else {
+            for (int j = 0; j < cols; j++) {
+                row[j] += bias[j];
+            }
+        }
+    }
+}
+
+/*
+Row wise softmax over complete rows of C, in place.
+*/
+static void softmax_rows(nn_float* C, int rows, int cols, int ldc) {
+    #pragma omp for schedule(static)
+    for (int i = 0; i < rows; i++) {
+        fast_softmax_row(C + (size_t) i * ldc, C + (size_t) i * ldc, cols);
+    }
+}
+
+/*
+Runs the micro kernel over every register block of an (mc x nc) block of C.
+Edge blocks go through a scratch tile so the kernel never writes outside C.
+ep is applied to each tile when this is the last depth block (NULL otherwise), col0 is the first col of the block.
+*/
+static void macro_kernel(const GemmKernel* k, int mc, int nc, int kc, const nn_float* a, const nn_float* b,
+                         nn_float beta, nn_float* C, int ldc, const GemmEpilogue* ep, int col0) {
+    int mr = k->mr;
+    int nr = k->nr;
+    int m_slivers = (mc + mr - 1) / mr;
+    int n_slivers = (nc + nr - 1) / nr;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int jr = 0; jr < n_slivers; jr++) {
+        for (int ir = 0; ir < m_slivers; ir++) {
+            int rows = (mc - ir * mr < mr) ? mc - ir * mr : mr;
+            int cols = (nc - jr * nr < nr) ? nc - jr * nr : nr;
+            const nn_float* a_sliver = a + (size_t) ir * mr * kc;
+            const nn_float* b_sliver = b + (size_t) jr * nr * kc;
+            nn_float* c_block = C + (size_t) ir * mr * ldc + jr * nr;
+
+            if (rows == mr && cols == nr) {
+                k->kernel(kc, a_sliver, b_sliver, c_block, ldc, beta);
+            }
+            else {
+                nn_float tile[GEMM_MAX_MR * GEMM_MAX_NR];
+                k->kernel(kc, a_sliver, b_sliver, tile, nr, 0.0);
+                for (int i = 0; i < rows; i++) {
+                    for (int j = 0; j < cols; j++) {
+                        nn_float* dst = c_block + i * ldc + j;
+                        *dst = (beta == 0.0) ? tile[i * nr + j] : beta * (*dst) + tile[i * nr + j];
+                    }
+                }
+            }
+
+            if (ep != NULL) {
+                tile_epilogue(ep, c_block, ldc, rows, cols, col0 + jr * nr);
+            }
+        }
+    }
+}
+
+/*
+Blocked loop nest around the macro kernel (jc -> pc -> ic).
+Work shares with orphaned omp for, so every thread of the enclosing team must call it.
+*/
+static void gemm_blocked(const GemmKernel* k, bool trans_a, bool trans_b, int M, int N, int K, nn_float alpha,
+                         const nn_float* A, int lda, const nn_float* B, int ldb, nn_float beta, nn_float* C, int ldc,
+                         const GemmEpilogue* ep, nn_float* pack_a, nn_float* pack_b) {
+    for (int jc = 0; jc < N; jc += k->nc) {
+        int nc = (N - jc < k->nc) ? N - jc : k->nc;
+
+        for (int pc = 0; pc < K; pc += k->kc) {
+            int kc = (K - pc < k->kc) ? K - pc : k->kc;
+            nn_float beta_block = (pc == 0) ? beta : 1.0; // Later depth blocks accumulate
+            bool last_block = (pc + kc == K);
+            const GemmEpilogue* tile_ep = (last_block && ep != NULL && ep->type != GEMM_EPILOGUE_NONE) ? ep : NULL;
+
+            const nn_float* b_block = trans_b ? B + (size_t) jc * ldb + pc : B + (size_t) pc * ldb + jc;
+            pack_block_b(k->nr, kc, nc, b_block, ldb, trans_b, pack_b);
+
+            for (int ic = 0; ic < M; ic += k->mc) {
+                int mc = (M - ic < k->mc) ? M - ic : k->mc;
+                const nn_float* a_block = trans_a ? A + (size_t) pc * lda + ic : A + (size_t) ic * lda + pc;
+                pack_block_a(k, mc, kc, a_block, lda, trans_a, alpha, pack_a);
+                macro_kernel(k, mc, nc, kc, pack_a, pack_b, beta_block, C + (size_t) ic * ldc + jc, ldc, tile_ep, jc);
+
+                // Rows of this block are complete when one col block spans all of C, normalize them while they are in L2
+                if (last_block && nc == N && ep != NULL && ep->type == GEMM_EPILOGUE_BIAS_SOFTMAX) {
+                    softmax_rows(C + (size_t) ic * ldc, mc, N, ldc);
+                }
+            }
+        }
+    }
+
+    // Wide outputs, rows only complete at the end
+    if (ep != NULL && ep->type == GEMM_EPILOGUE_BIAS_SOFTMAX && N > k->nc) {
+        softmax_rows(C, M, N, ldc);
+    }
+}
+
+/*
+C = epilogue(beta * C), used when there is nothing to multiply.
+Work shares like gemm_blocked.
+*/
+static void gemm_scale(int M, int N, nn_float beta, nn_float* C, int ldc, const GemmEpilogue* ep) {
+    #pragma omp for schedule(static)
+    for (int i = 0; i < M; i++) {
+        nn_float* row = C + (size_t) i * ldc;
+        for (int j = 0; j < N; j++) {
+            row[j] = (beta == 0.0) ? 0.0 : beta * row[j];
+        }
+        if (ep != NULL && ep->type != GEMM_EPILOGUE_NONE) {
+            tile_epilogue(ep, row, ldc, 1, N, 0);
+        }
+    }
+    if (ep != NULL && ep->type == GEMM_EPILOGUE_BIAS_SOFTMAX) {
+        softmax_rows(C, M, N, ldc);
+    }
+}
+
+void gemm(bool trans_a, bool trans_b, int M, int N, int K, nn_float alpha, const nn_float* A, int lda,
+          const nn_float* B, int ldb, nn_float beta, nn_float* C, int ldc) {
+    gemm_fused(trans_a, trans_b, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, NULL);
+}
+
+void gemm_fused(bool trans_a, bool trans_b, int M, int N, int K, nn_float alpha, const nn_float* A, int lda,
+                const nn_float* B, int ldb, nn_float beta, nn_float* C, int ldc, const GemmEpilogue* ep) {
+    if (M <= 0 || N <= 0) {
+        return;
+    }
+
+    // Nothing to multiply, C = beta * C
+    if (K <= 0 || alpha == 0.0) {
+        PARALLEL_CALL(gemm_scale(M, N, beta, C, ldc, ep));
+        return;
+    }
+
+    const GemmKernel* k = gemm_get_kernel();
+
+    // Reserve packed buffers rounded up to whole slivers.
+    // Inside a parallel region one thread reserves them and copyprivate hands the pointers to the team.
+    int mc = (M < k->mc) ? M : k->mc;
+    int nc = (N < k->nc) ? N : k->nc;
+    int kc = (K < k->kc) ? K : k->kc;
+    nn_float* a_buf;
+    nn_float* b_buf;
+    #pragma omp single copyprivate(a_buf, b_buf)
+    {
+        reserve_pack_buffer(&pack_a, &pack_a_size, (size_t) ((mc + k->mr - 1) / k->mr) * k->mr * kc);
+        reserve_pack_buffer(&pack_b, &pack_b_size, (size_t) ((nc + k->nr - 1) / k->nr) * k->nr * kc);
+        a_buf = pack_a;
+        b_buf = pack_b;
+    }
+
+    PARALLEL_CALL(gemm_blocked(k, trans_a, trans_b, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, ep, a_buf, b_buf));
+}
+
+//////////////////////////////////////////////////// SMALL BATCH GEMM ///////////////////////////////////////////////////////////////////////////
+
+GemmPackedB* gemm_alloc_packed_b(int K, int N) {
+    const GemmKernel* k = gemm_get_kernel();
+    GemmPackedB* packed = malloc(sizeof(GemmPackedB));
+    if (packed == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for packed matrix struct.\n");
+        exit(1);
+    }
+    size_t panels = (size_t) (N + k->small_nr - 1) / k->small_nr;
+    size_t size = panels * k->small_nr * (K > 0 ? K : 1);
+    if (posix_memalign((void**) &packed->panels, 64, size * sizeof(nn_float)) != 0) {
+        fprintf(stderr, "Error: Memory allocation failure for packed panels in gemm.\n");
+        exit(1);
+    }
+    packed->K = K;
+    packed->N = N;
+    packed->kernel = k;
+    return packed;
+}
+
+GemmPackedB* gemm_pack_b(int K, int N, const nn_float* B, int ldb) {
+    GemmPackedB* packed = gemm_alloc_packed_b(K, N);
+    gemm_repack_b(packed, B, ldb);
+    return packed;
+}
+
+void gemm_repack_b(GemmPackedB* packed, const nn_float* B, int ldb) {
+    // Outside a parallel region the orphaned omp for runs on the calling thread
+    pack_block_b(packed->kernel->small_nr, packed->K, packed->N, B, ldb, false, packed->panels);
+}
+
+void gemm_repack_bt(GemmPackedB* packed, const nn_float* B, int ldb) {
+    pack_block_b(packed->kernel->small_nr, packed->K, packed->N, B, ldb, true, packed->panels);
+}
+
+void free_gemm_packed_b(GemmPackedB* packed) {
+    free(packed->panels);
+    free(packed);
+}
+
+void gemm_small(int M, const nn_float* A, int lda, const GemmPackedB* B, nn_float* C, int ldc, const GemmEpilogue* ep) {
+    const GemmKernel* k = B->kernel;
+    int nr = k->small_nr;
+    bool tile_ep = (ep != NULL && ep->type != GEMM_EPILOGUE_NONE);
+
+    // With more than one row block the depth is split so a chunk of the panel stays in L1 for all of them,
+    // a single row block streams the whole panel once anyway
+    int kc = (M > 4 && B->K > k->kc) ? k->kc : B->K;
+    kc = (kc > 0) ? kc : 1;
+
+    for (int j0 = 0; j0 < B->N; j0 += nr) {
+        const nn_float* panel = B->panels + (size_t) (j0 / nr) * nr * B->K;
+        int cols = (B->N - j0 < nr) ? B->N - j0 : nr;
+
+        for (int pc = 0; pc == 0 || pc < B->K; pc += kc) { // Once for K == 0, C = epilogue(0)
+            int depth = (B->K - pc < kc) ? B->K - pc : kc;
+            bool accumulate = (pc > 0);
+            bool last_block = (pc + depth >= B->K);
+
+            for (int i0 = 0; i0 < M;) {
+                int rows = (M - i0 >= 4) ? 4 : 1;
+                gemm_small_kernel kernel = (rows == 4) ? k->small_rows_4 : k->small_rows_1;
+                const nn_float* a_block = A + (size_t) i0 * lda + pc;
+                nn_float* c_block = C + (size_t) i0 * ldc + j0;
+
+                if (cols == nr) {
+                    kernel(depth, a_block, lda, panel + (size_t) pc * nr, c_block, ldc, accumulate);
+                }
+                else {
+                    nn_float tile[4 * GEMM_MAX_NR];
+                    kernel(depth, a_block, lda, panel + (size_t) pc * nr, tile, nr, false);
+                    for (int i = 0; i < rows; i++) {
+                        for (int j = 0; j < cols; j++) {
+                            nn_float* dst = c_block + i * ldc + j;
+                            *dst = accumulate ? *dst + tile[i * nr + j] : tile[i * nr + j];
+                        }
+                    }
+                }
+
+                if (last_block && tile_ep) {
+                    tile_epilogue(ep, c_block, ldc, rows, cols, j0);
+                }
+                i0 += rows;
+            }
+        }
+    }
+
+    if (ep != NULL && ep->type == GEMM_EPILOGUE_BIAS_SOFTMAX) {
+        for (int i = 0; i < M; i++) {
+            fast_softmax_row(C + (size_t) i * ldc, C + (size_t) i * ldc, B->N);
+        }
+    }
+}
+
+//////////////////////////////////////////////////// SPARSE GEMM ///////////////////////////////////////////////////////////////////////////
+
+/*
+Rows of C = epilogue(A * B) for CSR A, work shared over the rows.
+*/
+static void sparse_rows_kernel(int M, int N, const int* row_ptr, const int* col_idx, const nn_float* values,
+                               const nn_float* B, int ldb, nn_float* C, int ldc, const GemmEpilogue* ep) {
+    bool bias = (ep != NULL && ep->type != GEMM_EPILOGUE_NONE);
+
+    #pragma omp for schedule(static)
+    for (int i = 0; i < M; i++) {
+        nn_float* c = C + (size_t) i * ldc;
+        for (int j = 0; j < N; j++) {
+            c[j] = bias ? ep->bias[j] : 0.0;
+        }
+
+        // One axpy per nonzero, the selected row of B streams through once
+        for (int p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+            const nn_float* b = B + (size_t) col_idx[p] * ldb;
+            nn_float v = values[p];
+            for (int j = 0; j < N; j++) {
+                c[j] += v * b[j];
+            }
+        }
+
+        if (bias && ep->type == GEMM_EPILOGUE_BIAS_RELU) {
+            for (int j = 0; j < N; j++) {
+                c[j] = (c[j] > 0.0) ? c[j] : 0.0;
+            }
+        }
+        else if (bias && ep->type == GEMM_EPILOGUE_BIAS_SOFTMAX) {
+            fast_softmax_row(c, c, N);
+        }
+    }
+}
+
+/*
+Listed rows of C = A * B for CSR A, work shared over the listed rows.
+The row of C is built in place, it stays in L1 while the nonzeros of its row of A are summed into it.
+*/
+static void sparse_listed_rows_kernel(int N, const int* row_ptr, const int* col_idx, const nn_float* values,
+                                      const nn_float* B, int ldb, nn_float* C, int ldc, const int* rows, int num_rows) {
+    #pragma omp for schedule(static)
+    for (int r = 0; r < num_rows; r++) {
+        int i = rows[r];
+        nn_float* c = C + (size_t) i * ldc;
+        for (int j = 0; j < N; j++) {
+            c[j] = 0.0;
+        }
+        for (int p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+            const nn_float* b = B + (size_t) col_idx[p] * ldb;
+            nn_float v = values[p];
+            for (int j = 0; j < N; j++) {
+                c[j] += v * b[j];
+            }
+        }
+    }
+}
+
+void gemm_sparse(int M, int N, const int* row_ptr, const int* col_idx, const nn_float* values, const nn_float* B,
+                 int ldb, nn_float* C, int ldc, const GemmEpilogue* ep) {
+    if (M <= 0 || N <= 0) {
+        return;
+    }
+    PARALLEL_CALL(sparse_rows_kernel(M, N, row_ptr, col_idx, values, B, ldb, C, ldc, ep));
+}
+
+void gemm_sparse_rows(int N, const int* row_ptr, const int* col_idx, const nn_float* values, const nn_float* B, int ldb,
+                      nn_float* C, int ldc, const int* rows, int num_rows) {
+    if (num_rows <= 0 || N <= 0) {
+        return;
+    }
+    PARALLEL_CALL(sparse_listed_rows_kernel(N, row_ptr, col_idx, values, B, ldb, C, ldc, rows, num_rows));
+}
@@ -1,11 +1,12 @@
 #include "linalg.h"
+#include "gemm.h"
 //////////////////////////////////////////////////// HELPER FUNCTIONS //////////////////////////////////////////////////////////////
 
 matrix* allocate_matrix(int rows, int cols) {
     matrix* M = malloc(sizeof(matrix));
     M->rows = rows;
     M->cols = cols;
-    M->data = (double*) calloc(rows * cols, sizeof(double));
+    M->data = (nn_float*) calloc(rows * cols, sizeof(nn_float));
 
     if (M->data == NULL) {
         fprintf(stderr, "Memory Allocation failed in allocate matrix.\n");
@@ -34,7 +35,7 @@ void free_matrix(matrix* M) {
 void shallow_cpy_matrix(matrix* src, matrix* dest, int start_row, int num_rows) {
     dest->rows = num_rows;
     dest->cols = src->cols;
-    dest->data = src->data + start_row * dest->cols; // Point to the starting row
+    dest->data = src->data + (size_t) start_row * dest->cols; // Point to the starting row
 }
 
 void print_matrix(matrix* M) {
@@ -51,7 +52,7 @@ void print_matrix(matrix* M) {
     }
 }
 
-void fill_matrix(matrix* M, double val) {
+void fill_matrix(matrix* M, nn_float val) {
     if (M->data == NULL) {
         fprintf(stderr, "Matrix Data not allocated in fill matrix.\n");
         exit(1);
@@ -64,6 +65,29 @@ void fill_matrix(matrix* M, double val) {
     }
 }
 
+void resize_matrix(matrix** M, int rows, int cols) {
+    // Already the right shape, reuse the buffer
+    if (*M != NULL && (*M)->rows == rows && (*M)->cols == cols) {
+        return;
+    }
+    if (*M != NULL) {
+        free_matrix(*M);
+    }
+    *M = allocate_matrix(rows, cols);
+}
+
+static void check_dest(matrix* dest, int rows, int cols, const char* func) {
+    if (dest->data == NULL) {
+        fprintf(stderr, "Error: Destination matrix has no data (NULL) in %s.\n", func);
+        exit(1);
+    }
+    if (dest->rows != rows || dest->cols != cols) {
+        fprintf(stderr, "Error: Destination dimensionality mismatch in %s, expected (%d x %d) got (%d x %d).\n",
+                func, rows, cols, dest->rows, dest->cols);
+        exit(1);
+    }
+}
+
 //////////////////////////////////////////////////// LIN ALG FUNCTIONS //////////////////////////////////////////////////////////////
 
 matrix* transpose_matrix(matrix* w){
@@ -74,40 +98,58 @@ matrix* transpose_matrix(matrix* w){
         exit(1);
     }
 
-    // Create a new matrix object to hold the transposed matrix
-    matrix* transposed_matrix = (matrix*) malloc(sizeof(matrix));
+    // Transposed matrix rows = original matrix cols
+    matrix* transposed_matrix = allocate_matrix(w->cols, w->rows);
+    transpose_matrix_into(transposed_matrix, w);
 
-    // Check memory allocation for the matrix struct
-    if (transposed_matrix == NULL) {
-        fprintf(stderr, "Error: Memory allocation failure for transposed_matrix struct.\n");
-        exit(1);
-    }
-
-    // Allocate memory for the transposed data
-    transposed_matrix->rows = w->cols;  // Transposed matrix rows = original matrix cols
-    transposed_matrix->cols = w->rows;  // Transposed matrix cols = original matrix rows
-    transposed_matrix->data = (double*) calloc(transposed_matrix->rows * transposed_matrix->cols, sizeof(double));
+    // Return the pointer to the transposed matrix
+    return transposed_matrix;
+}
 
-    // Check memory allocation for the transposed data
-    if (transposed_matrix->data == NULL) {
-        fprintf(stderr, "Error: Memory allocation failure for transposed matrix data.\n");
-        exit(1);
-    }
+static void transpose_kernel(matrix* dest, matrix* w) {
 
-    // Iterate through the original matrix and fill the transposed matrix
+    // Iterate through the original matrix and fill the transposed matrix, each thread gets its own rows
+    #pragma omp for schedule(static)
     for (int i = 0; i < w->rows; i++) {
         for (int j = 0; j < w->cols; j++) {
             // Swap row and column indices to transpose the matrix
-            transposed_matrix->data[j * w->rows + i] = w->data[i * w->cols + j];
+            dest->data[j * w->rows + i] = w->data[i * w->cols + j];
         }
     }
+}
 
-    // Return the pointer to the transposed matrix
-    return transposed_matrix;
+void transpose_matrix_into(matrix* dest, matrix* w) {
+
+    // Check w memory
+    if (w->data == NULL) {
+        fprintf(stderr, "Error: Input Matrix has no data (NULL).\n");
+        exit(1);
+    }
+    if (dest->data == w->data) {
+        fprintf(stderr, "Error: transpose matrix into can not be done in place.\n");
+        exit(1);
+    }
+    check_dest(dest, w->cols, w->rows, "transpose matrix into");
+
+    PARALLEL_CALL(transpose_kernel(dest, w));
 }
 
 matrix* matrix_mult(matrix* w, matrix* v) {
 
+    // Check dimensions
+    if (w->cols != v->rows) {
+        fprintf(stderr, "Error in matrix mult, dimensionality mismatch.\n");
+        exit(1);
+    }
+
+    // Allocate result matrix with dimensions rows_w x cols_v
+    matrix* result = allocate_matrix(w->rows, v->cols);
+    matrix_mult_into(result, w, v);
+    return result;
+}
+
+void matrix_mult_into(matrix* dest, matrix* w, matrix* v) {
+
     // Get dimensionality info
     int rows_w = w->rows;
     int cols_w = w->cols;
@@ -118,144 +160,110 @@ matrix* matrix_mult(matrix* w, matrix* v) {
         fprintf(stderr, "Error in matrix mult, dimensionality mismatch.\n");
         exit(1);
     }
+    check_dest(dest, rows_w, cols_v, "matrix mult into");
 
-    // Allocate result matrix with dimensions rows_w x cols_v
-    matrix* result = malloc(sizeof(matrix));
-    result->rows = rows_w;
-    result->cols = cols_v;
-    result->data = (double*) calloc(rows_w * cols_v, sizeof(double));
-    
-    // Check memory allocation
-    if (result->data == NULL) {
-        fprintf(stderr, "Error: Memory allocation failure in matrix_mult.\n");
-        exit(1);
-    }
-
-#ifdef ENABLE_PARALLEL
-    int block_size = 32;
-    #pragma omp parallel for collapse(2) schedule(dynamic)
-    for (int i = 0; i < rows_w; i += block_size) {
-        for (int j = 0; j < cols_v; j += block_size) {
-            // Tile multiplication
-            for (int k = 0; k < cols_w; k += block_size) {
-                // Iterate over blocks of w, v, and result
-                for (int ii = i; ii < i + block_size && ii < rows_w; ++ii) {
-                    for (int jj = j; jj < j + block_size && jj < cols_v; ++jj) {
-                        double sum = 0.0;
-                        for (int kk = k; kk < k + block_size && kk < cols_w; ++kk) {
-                            sum += w->data[ii * cols_w + kk] * v->data[kk * cols_v + jj];
-                        }
-                        result->data[ii * cols_v + jj] += sum;
-                    }
-                }
-            }
-        }
-    }
-#else 
-        for (int i = 0; i < rows_w; i++) {
-            for (int j = 0; j < cols_v; j++) {
-                for (int k = 0; k < cols_w; k++) {
-                    result->data[i * cols_v + j] += w->data[i * cols_w + k] * v->data[k * cols_v + j];
-                }
-            }
-        }
+    // Packed, register blocked kernel (supports parallel), overwrites dest (beta = 0)
+    gemm(false, false, rows_w, cols_v, cols_w, 1.0, w->data, cols_w, v->data, cols_v, 0.0, dest->data, cols_v);
+}
 
+matrix* matrix_mult_tn(matrix* w, matrix* v) {
 
-#endif
+    // Check dimensions, w^T is (w->cols x w->rows)
+    if (w->rows != v->rows) {
+        fprintf(stderr, "Error in matrix mult tn, dimensionality mismatch.\n");
+        exit(1);
+    }
 
+    // Allocate result matrix with dimensions cols_w x cols_v
+    matrix* result = allocate_matrix(w->cols, v->cols);
+    matrix_mult_tn_into(result, w, v);
     return result;
-
 }
 
-matrix* element_matrix_mult(matrix* w, matrix* v){
-    // Check dimensions
-    if(w->rows != v->rows || w->cols != v->cols) {
-        fprintf(stderr, "Error, mismatching dimensions in element matrix mult.\n");
-    }
-    int row_w = w->rows;
-    int col_w = w->cols;
-
-    // Allocate and check memory for result
-    matrix* result = malloc(sizeof(matrix));
-    result->rows = row_w;
-    result->cols = col_w;
-    result->data = (double*) calloc(row_w * col_w, sizeof(double));
+void matrix_mult_tn_into(matrix* dest, matrix* w, matrix* v) {
 
-    if (result->data == NULL) {
-        fprintf(stderr, "Memory allocation failure for result in element matrix mult.\n");
+    // Check dimensions, w^T is (w->cols x w->rows)
+    if (w->rows != v->rows) {
+        fprintf(stderr, "Error in matrix mult tn, dimensionality mismatch.\n");
         exit(1);
     }
+    check_dest(dest, w->cols, v->cols, "matrix mult tn into");
 
+    // w is read transposed in place
+    gemm(true, false, w->cols, v->cols, w->rows, 1.0, w->data, w->cols, v->data, v->cols, 0.0, dest->data, dest->cols);
+}
 
+matrix* matrix_mult_nt(matrix* w, matrix* v) {
 
-#ifdef ENABLE_PARALLEL 
-    // Parallel Code
-    #pragma omp parallel 
-    {
-        int thread_id = omp_get_thread_num(); // Get current thread id
-        int total_threads = omp_get_num_threads(); // Get total num threads
-        int rows_per_thread = (row_w + total_threads - 1) / total_threads; // Get num rows to calc per each thread
-        int start_row = rows_per_thread * thread_id; // Get start row for unique thread
-        int end_row = rows_per_thread * thread_id + rows_per_thread; // Get end row for unique thread
+    // Check dimensions, v^T is (v->cols x v->rows)
+    if (w->cols != v->cols) {
+        fprintf(stderr, "Error in matrix mult nt, dimensionality mismatch.\n");
+        exit(1);
+    }
 
-        if (end_row > row_w) {
-            end_row = row_w;
-        }
+    // Allocate result matrix with dimensions rows_w x rows_v
+    matrix* result = allocate_matrix(w->rows, v->rows);
+    matrix_mult_nt_into(result, w, v);
+    return result;
+}
 
-        for (int i = start_row; i < end_row; i++) {
-            for (int j = 0; j < col_w; j++) {
-                result->data[i * col_w + j] = w->data[i * col_w + j] * v->data[i * col_w + j];
-            }
-        }
+void matrix_mult_nt_into(matrix* dest, matrix* w, matrix* v) {
+
+    // Check dimensions, v^T is (v->cols x v->rows)
+    if (w->cols != v->cols) {
+        fprintf(stderr, "Error in matrix mult nt, dimensionality mismatch.\n");
+        exit(1);
     }
+    check_dest(dest, w->rows, v->rows, "matrix mult nt into");
 
-#else
+    // v is read transposed in place
+    gemm(false, true, w->rows, v->rows, w->cols, 1.0, w->data, w->cols, v->data, v->cols, 0.0, dest->data, dest->cols);
+}
 
-    // Sequential Code
-    for (int i = 0; i < row_w; i++) {
-        for (int j = 0; j < col_w; j++) {
-            result->data[i * col_w + j] = w->data[i * col_w + j] * v->data[i * col_w + j];
-        }
+matrix* element_matrix_mult(matrix* w, matrix* v){
+    // Check dimensions
+    if(w->rows != v->rows || w->cols != v->cols) {
+        fprintf(stderr, "Error, mismatching dimensions in element matrix mult.\n");
+        exit(1);
     }
 
-#endif
+    // Allocate memory for result
+    matrix* result = allocate_matrix(w->rows, w->cols);
+    element_matrix_mult_into(result, w, v);
     return result;
 }
 
-void matrix_scalar_mult(matrix* w, double s) {
+static void element_mult_kernel(matrix* dest, matrix* w, matrix* v) {
+    int n = w->rows * w->cols;
 
-    int rows = w->rows;
-    int cols = w->cols;
-    
-#ifdef ENABLE_PARALLEL
-#pragma omp parallel
-{
-    int thread_id = omp_get_thread_num(); // Get current thread id
-    int total_threads = omp_get_num_threads(); // Get total num threads
-    int rows_per_thread = (rows + total_threads - 1) / total_threads; // Get num rows to calc per each thread
-    int start_row = rows_per_thread * thread_id; // Get start row for unique thread
-    int end_row = rows_per_thread * thread_id + rows_per_thread; // Get end row for unique thread
-    
-    // check bounds
-    if(end_row > rows) {
-        end_row = rows;
+    #pragma omp for schedule(static) // Each thread gets its own range of i
+    for (int i = 0; i < n; i++) {
+        dest->data[i] = w->data[i] * v->data[i];
     }
+}
 
-    for (int i = start_row; i < end_row; i++) {
-        for (int j = 0; j < cols; j++) {
-            w->data[i * cols + j] = s * w->data[i * cols + j];
-        }
+void element_matrix_mult_into(matrix* dest, matrix* w, matrix* v) {
+    // Check dimensions
+    if(w->rows != v->rows || w->cols != v->cols) {
+        fprintf(stderr, "Error, mismatching dimensions in element matrix mult.\n");
+        exit(1);
     }
+    check_dest(dest, w->rows, w->cols, "element matrix mult into");
 
+    PARALLEL_CALL(element_mult_kernel(dest, w, v));
 }
 
-#else
-    for (int i = 0; i < rows * cols; i++) {
+static void scalar_mult_kernel(matrix* w, nn_float s) {
+    int n = w->rows * w->cols;
+
+    #pragma omp for schedule(static)
+    for (int i = 0; i < n; i++) {
         w->data[i] = s * w->data[i];
     }
+}
 
-#endif
-
+void matrix_scalar_mult(matrix* w, nn_float s) {
+    PARALLEL_CALL(scalar_mult_kernel(w, s));
 }
 
 matrix* matrix_sum(matrix* w, matrix* v) {
@@ -267,124 +275,242 @@ matrix* matrix_sum(matrix* w, matrix* v) {
     }
 
     // Allocate memory for the return object
-    matrix* result = malloc(sizeof(matrix));
-    result->rows = w->rows;
-    result->cols = w->cols;
-    result->data = (double*) calloc(result->rows * result->cols, sizeof(double));
-    
-    // Check memory allocation
-    if (result->data == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed in matrix sum.\n");
+    matrix* result = allocate_matrix(w->rows, w->cols);
+    matrix_sum_into(result, w, v);
+    return result;
+}
+
+static void sum_kernel(matrix* dest, matrix* w, matrix* v) {
+    int n = w->rows * w->cols;
+
+    #pragma omp for schedule(static) // Row major, each thread gets its own range of i
+    for (int i = 0; i < n; i++) {
+        dest->data[i] = w->data[i] + v->data[i];
+    }
+}
+
+void matrix_sum_into(matrix* dest, matrix* w, matrix* v) {
+
+    // Check dimensions
+    if (w->rows != v->rows || w->cols != v->cols) {
+        fprintf(stderr, "Error, Dimensionality Mismatch in Matrix Sum.\n");
         exit(1);
     }
+    check_dest(dest, w->rows, w->cols, "matrix sum into");
 
-    // Get dimensions
-    int row_w = w->rows;
-    int col_w = w->cols;
+    PARALLEL_CALL(sum_kernel(dest, w, v));
+}
 
-// Parallel Code
-#ifdef ENABLE_PARALLEL
-    #pragma omp parallel
-    {   
-        // Init parallel constraints
-        int thread_id = omp_get_thread_num(); // Get current thread id
-        int total_threads = omp_get_num_threads(); // Get total num threads
-        int rows_per_thread = (row_w + total_threads - 1) / total_threads; // Get num rows to calc per each thread
-        int start_row = rows_per_thread * thread_id; // Get start row for unique thread
-        int end_row = rows_per_thread * thread_id + rows_per_thread; // Get end row for unique thread
-
-        // Check bounds
-        if (end_row > row_w) {
-            end_row = row_w;
-        }
+matrix* matrix_scalar_sum(matrix* w, nn_float s, bool useAbs) {
 
-        // Parallel, each thread gets range from start to end row.
-        for (int i = start_row; i < end_row; i++) {
-            for (int j = 0; j < col_w; j++) {
-                result->data[i * col_w + j] = w->data[i * col_w + j] + v->data[i * col_w + j]; // Row major order
-            }
+    // Allocate memory for the result
+    matrix* result = allocate_matrix(w->rows, w->cols);
+    matrix_scalar_sum_into(result, w, s, useAbs);
+    return result; // return pointer to matrix
+}
+
+static void scalar_sum_kernel(matrix* dest, matrix* w, nn_float s, bool useAbs) {
+    int n = w->rows * w->cols;
+
+    #pragma omp for schedule(static) // No race conditions, each thread gets its own i
+    for (int i = 0; i < n; i++) {
+        if (useAbs){
+            dest->data[i] = fabs(w->data[i] + s); // useAbs allows for more control.
+        }
+        else {
+            dest->data[i] = w->data[i] + s;
         }
     }
+}
 
+void matrix_scalar_sum_into(matrix* dest, matrix* w, nn_float s, bool useAbs) {
 
-// Sequential Code
-#else
+    check_dest(dest, w->rows, w->cols, "matrix scalar sum into");
+
+    PARALLEL_CALL(scalar_sum_kernel(dest, w, s, useAbs));
+}
+
+double matrix_mean(matrix* w) {
+    int n = w->rows * w->cols;
+    double sum = 0.0;
 
-    for (int i = 0; i < row_w; i++) {
-        for (int j = 0; j < col_w; j++) {
-            result->data[i * col_w + j] = w->data[i * col_w + j] + v->data[i * col_w + j]; // Row major order
+#ifdef ENABLE_PARALLEL
+    if (omp_in_parallel()) {
+        // Joined from an enclosing region with no team storage to reduce into, one thread sums for the team
+        #pragma omp single copyprivate(sum)
+        for (int i = 0; i < n; i++) {
+            sum += w->data[i];
         }
+        return sum / n;
     }
 
+    #pragma omp parallel for reduction(+:sum) schedule(static)
 #endif
-
-    return result;
+    for (int i = 0; i < n; i++) {
+        sum += w->data[i];
+    }
+    return sum / n;
 }
 
-matrix* matrix_scalar_sum(matrix* w, double s, bool useAbs) {
+double matrix_mean_shared(matrix* w, double* total) {
+    int n = w->rows * w->cols;
 
-    // Allocate memory for the result
-    matrix* result = malloc(sizeof(matrix));
-    result->rows = w->rows;
-    result->cols = w->cols;
+    #pragma omp single
+    *total = 0.0;
 
-    // Check memory
-    if (result->data == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed in matrix scalar sum\n");
-        exit(1);
+    double sum = 0.0;
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; i++) {
+        sum += w->data[i];
     }
 
+    // Each thread adds its part to the caller's total, the barrier publishes it to the team
+    #pragma omp atomic
+    *total += sum;
+    #pragma omp barrier
+    double mean = *total / n;
 
-#ifdef ENABLE_PARALLEL // Parallel approach
+    // Every thread has read the total before the next call resets it
+    #pragma omp barrier
+    return mean;
+}
 
-    #pragma omp for schedule(static) // No race conditions, each thread gets its own i
-    for (int i = 0; i < result->rows * result->cols; i++) {
-        if (useAbs){
-            result->data[i] = fabs(w->data[i] + s); // useAbs allows for more control.
-        }
-        else {
-            result->data[i] = w->data[i] + s;
-        }
+//////////////////////////////////////////////////// SPARSE FUNCTIONS //////////////////////////////////////////////////////////////
+
+sparse_matrix* allocate_sparse_matrix(int rows, int cols, int nnz) {
+    sparse_matrix* S = malloc(sizeof(sparse_matrix));
+    if (S == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in allocate sparse matrix.\n");
+        exit(1);
+    }
+    S->rows = rows;
+    S->cols = cols;
+    S->nnz = nnz;
+    S->capacity = nnz;
+    S->row_ptr = calloc(rows + 1, sizeof(int));
+    S->col_idx = malloc((nnz > 0 ? nnz : 1) * sizeof(int));
+    S->values = malloc((nnz > 0 ? nnz : 1) * sizeof(nn_float));
+    if (S->row_ptr == NULL || S->col_idx == NULL || S->values == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure in allocate sparse matrix (%d x %d, %d nonzeros).\n", rows, cols, nnz);
+        exit(1);
     }
+    return S;
+}
 
+void free_sparse_matrix(sparse_matrix* S) {
+    free(S->row_ptr);
+    free(S->col_idx);
+    free(S->values);
+    free(S);
+}
 
-#else // Sequential Approach
-    for (int i = 0; i < result->rows * result->cols; i++) {
-        if (useAbs){
-            result->data[i] = fabs(w->data[i] + s);
+sparse_matrix* dense_to_sparse(matrix* M) {
+    int nnz = 0;
+    for (int i = 0; i < M->rows * M->cols; i++) {
+        nnz += (M->data[i] != 0.0);
+    }
+
+    sparse_matrix* S = allocate_sparse_matrix(M->rows, M->cols, nnz);
+    int p = 0;
+    for (int i = 0; i < M->rows; i++) {
+        S->row_ptr[i] = p;
+        for (int j = 0; j < M->cols; j++) {
+            nn_float v = M->data[i * M->cols + j];
+            if (v != 0.0) {
+                S->col_idx[p] = j;
+                S->values[p] = v;
+                p++;
+            }
         }
-        else {
-            result->data[i] = w->data[i] + s;
+    }
+    S->row_ptr[M->rows] = p;
+    return S;
+}
+
+matrix* sparse_to_dense(sparse_matrix* S) {
+    matrix* M = allocate_matrix(S->rows, S->cols);
+    for (int i = 0; i < S->rows; i++) {
+        for (int p = S->row_ptr[i]; p < S->row_ptr[i + 1]; p++) {
+            M->data[i * S->cols + S->col_idx[p]] = S->values[p];
         }
     }
+    return M;
+}
 
-#endif
+void sparse_rows_view(sparse_matrix* src, sparse_matrix* dest, int start_row, int num_rows) {
+    dest->rows = num_rows;
+    dest->cols = src->cols;
+    dest->row_ptr = src->row_ptr + start_row; // Offsets stay absolute
+    dest->col_idx = src->col_idx;
+    dest->values = src->values;
+    dest->nnz = dest->row_ptr[num_rows] - dest->row_ptr[0];
+    dest->capacity = 0;
+}
 
-    return result; // return pointer to matrix
+void sparse_matrix_mult_into(matrix* dest, sparse_matrix* S, matrix* W) {
+    if (S->cols != W->rows) {
+        fprintf(stderr, "Error: Dimensionality mismatch in sparse matrix mult, (%d x %d) * (%d x %d).\n",
+                S->rows, S->cols, W->rows, W->cols);
+        exit(1);
+    }
+    check_dest(dest, S->rows, W->cols, "sparse matrix mult into");
+
+    gemm_sparse(S->rows, W->cols, S->row_ptr, S->col_idx, S->values, W->data, W->cols, dest->data, dest->cols, NULL);
 }
 
-double matrix_mean(matrix* w) {
-    int rows = w->rows;
-    int cols = w->cols;
-    double sum = 0.0;
+void sparse_matrix_mult_rows_into(matrix* dest, sparse_matrix* S, matrix* W, const int* rows, int num_rows) {
+    if (S->cols != W->rows) {
+        fprintf(stderr, "Error: Dimensionality mismatch in sparse matrix mult rows, (%d x %d) * (%d x %d).\n",
+                S->rows, S->cols, W->rows, W->cols);
+        exit(1);
+    }
+    check_dest(dest, S->rows, W->cols, "sparse matrix mult rows into");
 
-#ifdef ENABLE_PARALLEL
-    #pragma omp for collapse(2) schedule(static)
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            sum += w->data[i * cols + j];
+    gemm_sparse_rows(W->cols, S->row_ptr, S->col_idx, S->values, W->data, W->cols, dest->data, dest->cols, rows, num_rows);
+}
+
+void sparse_transpose_into(sparse_matrix** dest, sparse_matrix* S) {
+    sparse_matrix* T = *dest;
+    if (T == NULL || T->rows != S->cols || T->capacity < S->nnz) {
+        if (T != NULL) {
+            free_sparse_matrix(T);
         }
+        T = allocate_sparse_matrix(S->cols, S->rows, S->nnz);
+        *dest = T;
     }
-    sum = sum / (rows * cols);
-
-#else
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            sum += w->data[i * cols + j];
+    T->cols = S->rows;
+    T->nnz = S->nnz;
+
+    // Counting sort on the cols of S, rows of S are visited in order so each row of T comes out sorted
+    memset(T->row_ptr, 0, (T->rows + 1) * sizeof(int));
+    int base = S->row_ptr[0];
+    for (int p = base; p < S->row_ptr[S->rows]; p++) {
+        T->row_ptr[S->col_idx[p] + 1]++;
+    }
+    for (int k = 0; k < T->rows; k++) {
+        T->row_ptr[k + 1] += T->row_ptr[k];
+    }
+    for (int i = 0; i < S->rows; i++) {
+        for (int p = S->row_ptr[i]; p < S->row_ptr[i + 1]; p++) {
+            int q = T->row_ptr[S->col_idx[p]]++;
+            T->col_idx[q] = i;
+            T->values[q] = S->values[p];
         }
     }
-    sum = sum / (rows * cols);
 
-#endif
-    return sum;
-}
\ No newline at end of file
+    // The fill advanced every offset to the start of the next row, shift them back
+    for (int k = T->rows; k > 0; k--) {
+        T->row_ptr[k] = T->row_ptr[k - 1];
+    }
+    T->row_ptr[0] = 0;
+}
+
+int sparse_nonempty_rows(sparse_matrix* S, int* rows) {
+    int count = 0;
+    for (int i = 0; i < S->rows; i++) {
+        if (S->row_ptr[i + 1] > S->row_ptr[i]) {
+            rows[count++] = i;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,590 @@
+#include "networking.h"
+#include "checkpoint.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(ServeHeader) == 24, "Serve header layout is part of the wire protocol");
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS, SIGPIPE is left to the process
+#endif
+
+#define ACCEPT_POLL_MS 100 // How often the accept thread checks for stop
+
+//////////////////////////////////////////////////// SOCKETS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Reads exactly len bytes, false on end of stream or error.
+*/
+static bool read_full(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+Writes a header and its payload (may be empty) with one sendmsg per attempt, false on error.
+One write keeps small responses in one segment instead of waiting on the peer's delayed ack.
+*/
+static bool write_message(int fd, const ServeHeader* header, const void* payload, size_t payload_len) {
+    struct iovec iov[2] = {{(void*) header, sizeof(ServeHeader)}, {(void*) payload, payload_len}};
+    struct iovec* cur = iov;
+    int count = (payload_len > 0) ? 2 : 1;
+    while (count > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = cur;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        // Skip what was sent
+        while (count > 0 && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            count--;
+        }
+        if (count > 0) {
+            cur->iov_base = (char*) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/*
+Opens a socket for address ("unix:/path" or "tcp:port" on 127.0.0.1), listening or connected.
+A listening unix socket replaces a stale socket file and its path is returned in unix_path (NULL for TCP).
+Returns -1 and prints why on failure.
+*/
+static int open_socket(const char* address, bool listening, char** unix_path) {
+    int fd = -1;
+    if (unix_path != NULL) {
+        *unix_path = NULL;
+    }
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char* path = address + 5;
+        struct sockaddr_un addr = {0};
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Socket path %s is too long.\n", path);
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Error: socket");
+            return -1;
+        }
+        if (listening) {
+            unlink(path);
+            if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+                fprintf(stderr, "Error: Can not listen on %s: %s.\n", path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            if (unix_path != NULL) {
+                *unix_path = strdup(path);
+            }
+        }
+        else if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "Error: Can not connect to %s: %s.\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (strncmp(address, "tcp:", 4) == 0) {
+        int port = atoi(address + 4);
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Error: Invalid port in address %s.\n", address);
+            return -1;
+        }
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local clients only
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Error: socket");
+            return -1;
+        }
+        int one = 1;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+                fprintf(stderr, "Error: Can not listen on port %d: %s.\n", port, strerror(errno));
+                close(fd);
+                return -1;
+            }
+        }
+        else {
+            if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+                fprintf(stderr, "Error: Can not connect to port %d: %s.\n", port, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    fprintf(stderr, "Error: Unknown address %s, expected unix:/path or tcp:port.\n", address);
+    return -1;
+}
+
+//////////////////////////////////////////////////// STATS ///////////////////////////////////////////////////////////////////////////
+
+static void histogram_add(Histogram* h, uint64_t value) {
+    int b = 0;
+    while (b < SERVE_HISTOGRAM_BUCKETS - 1 && (value >> b) != 0) {
+        b++;
+    }
+    h->counts[b]++;
+    h->total++;
+    h->sum += value;
+    h->max = (value > h->max) ? value : h->max;
+}
+
+/*
+Upper bound of the bucket holding quantile q, exact to a power of two.
+*/
+static uint64_t histogram_quantile(Histogram* h, double q) {
+    uint64_t target = (uint64_t) (q * h->total);
+    uint64_t seen = 0;
+    for (int b = 0; b < SERVE_HISTOGRAM_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > target) {
+            uint64_t hi = (b == 0) ? 0 : ((uint64_t) 1 << b) - 1;
+            return (hi < h->max) ? hi : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void print_histogram(const char* name, Histogram* h) {
+    printf("  %s: %" PRIu64 " values, mean %.1f, p50 <= %" PRIu64 ", p99 <= %" PRIu64 ", max %" PRIu64 "\n", name,
+           h->total, (h->total > 0) ? (double) h->sum / h->total : 0.0, histogram_quantile(h, 0.5),
+           histogram_quantile(h, 0.99), h->max);
+    for (int b = 0; b < SERVE_HISTOGRAM_BUCKETS; b++) {
+        if (h->counts[b] == 0) {
+            continue;
+        }
+        uint64_t lo = (b == 0) ? 0 : (uint64_t) 1 << (b - 1);
+        uint64_t hi = (b == 0) ? 0 : ((uint64_t) 1 << b) - 1;
+        printf("    [%8" PRIu64 ", %8" PRIu64 "] %10" PRIu64 " %6.2f%%\n", lo, hi, h->counts[b],
+               100.0 * h->counts[b] / h->total);
+    }
+}
+
+void server_stats(InferenceServer* server, ServerStats* stats) {
+    pthread_mutex_lock(&server->lock);
+    *stats = server->stats;
+    pthread_mutex_unlock(&server->lock);
+}
+
+void print_server_stats(ServerStats* stats) {
+    printf("Server: %" PRIu64 " requests, %" PRIu64 " rows in %" PRIu64 " batches (%.2f requests per batch), %" PRIu64
+           " errors\n", stats->requests, stats->rows, stats->batches,
+           (stats->batches > 0) ? (double) stats->requests / stats->batches : 0.0, stats->errors);
+    print_histogram("queue depth", &stats->queue_depth);
+    print_histogram("batch rows", &stats->batch_rows);
+    print_histogram("latency us", &stats->latency_us);
+}
+
+//////////////////////////////////////////////////// SERVER ///////////////////////////////////////////////////////////////////////////
+
+static long elapsed_us(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+Runs one forward pass over the listed requests (rows in total) and scatters the predictions back.
+Called without the lock, the requests are off the queue and nothing else touches them.
+*/
+static void run_batch(InferenceServer* server, ServeRequest* first, int rows) {
+    network* net = server->net;
+
+    // A lone request is predicted in place, several are gathered into the batch buffer
+    matrix batch = {rows, net->plan[0].in_features, first->inputs->data};
+    if (first->next != NULL) {
+        batch.data = server->batch->data;
+        size_t offset = 0;
+        for (ServeRequest* r = first; r != NULL; r = r->next) {
+            size_t count = (size_t) r->inputs->rows * r->inputs->cols;
+            memcpy(batch.data + offset, r->inputs->data, count * sizeof(nn_float));
+            offset += count;
+        }
+    }
+
+    // Small batches take the prepacked single threaded path when the network has one
+    matrix* predictions;
+    if (rows <= GEMM_SMALL_M && net->packed_weights != NULL && !net->quantized) {
+        predictions = network_predict_small(net, &batch);
+    }
+    else {
+        predictions = network_predict(net, &batch);
+    }
+
+    size_t offset = 0;
+    for (ServeRequest* r = first; r != NULL; r = r->next) {
+        size_t count = (size_t) r->outputs->rows * r->outputs->cols;
+        memcpy(r->outputs->data, predictions->data + offset, count * sizeof(nn_float));
+        offset += count;
+    }
+}
+
+/*
+Dynamic batching loop. Waits for a request, then for the batch to fill up or the oldest request's
+max wait to run out, takes the oldest requests that fit and runs them as one forward pass.
+Exits once stopping, every connection is closed and the queue is drained.
+*/
+static void* batch_thread(void* arg) {
+    InferenceServer* server = arg;
+    pthread_mutex_lock(&server->lock);
+    while (true) {
+        while (server->head == NULL && !(server->stop && server->active_connections == 0)) {
+            pthread_cond_wait(&server->queued, &server->lock);
+        }
+        if (server->head == NULL) {
+            break;
+        }
+
+        struct timespec deadline = server->head->arrival;
+        deadline.tv_sec += server->max_wait_us / 1000000;
+        deadline.tv_nsec += (server->max_wait_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!server->stop && server->queued_rows < server->max_batch) {
+            if (pthread_cond_timedwait(&server->queued, &server->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        // Oldest requests that fit, a request larger than max_batch runs alone
+        ServeRequest* first = server->head;
+        ServeRequest* last = first;
+        int rows = first->inputs->rows;
+        int count = 1;
+        while (last->next != NULL && rows + last->next->inputs->rows <= server->max_batch) {
+            last = last->next;
+            rows += last->inputs->rows;
+            count++;
+        }
+        server->head = last->next;
+        if (server->head == NULL) {
+            server->tail = NULL;
+        }
+        last->next = NULL;
+        server->queued_requests -= count;
+        server->queued_rows -= rows;
+        pthread_mutex_unlock(&server->lock);
+
+        run_batch(server, first, rows);
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_mutex_lock(&server->lock);
+        for (ServeRequest* r = first; r != NULL;) {
+            ServeRequest* next = r->next; // r belongs to its connection once done
+            histogram_add(&server->stats.latency_us, elapsed_us(&r->arrival, &end));
+            server->stats.requests++;
+            r->done = true;
+            r = next;
+        }
+        server->stats.rows += rows;
+        server->stats.batches++;
+        histogram_add(&server->stats.batch_rows, rows);
+        pthread_cond_broadcast(&server->done);
+    }
+    pthread_mutex_unlock(&server->lock);
+    gemm_free_buffers();
+    return NULL;
+}
+
+/*
+Serves one client: reads requests, queues predict requests and writes the predictions back in order.
+*/
+static void* connection_thread(void* arg) {
+    ServeConnection* conn = arg;
+    InferenceServer* server = conn->server;
+    int in_cols = server->net->plan[0].in_features;
+    int out_cols = server->net->plan[server->net->num_steps - 1].out_features;
+    matrix* inputs = NULL;
+    matrix* outputs = NULL;
+
+    ServeHeader header;
+    while (read_full(conn->fd, &header, sizeof(header))) {
+        ServeHeader reply = {SERVE_MAGIC, header.type, SERVE_OK, NN_DTYPE, 0, 0};
+
+        if (header.magic == SERVE_MAGIC && header.type == SERVE_STATS) {
+            ServerStats stats;
+            server_stats(server, &stats);
+            if (!write_message(conn->fd, &reply, &stats, sizeof(stats))) {
+                break;
+            }
+            continue;
+        }
+
+        // The payload size of a bad header can not be trusted, refuse and drop the connection
+        if (header.magic != SERVE_MAGIC || header.type != SERVE_PREDICT || header.dtype != NN_DTYPE ||
+            header.cols != (uint32_t) in_cols || header.rows == 0 || header.rows > SERVE_MAX_REQUEST_ROWS) {
+            reply.status = SERVE_BAD_REQUEST;
+            reply.rows = header.rows;
+            reply.cols = in_cols;
+            write_message(conn->fd, &reply, NULL, 0);
+            pthread_mutex_lock(&server->lock);
+            server->stats.errors++;
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        int rows = header.rows;
+        resize_matrix(&inputs, rows, in_cols);
+        resize_matrix(&outputs, rows, out_cols);
+        if (!read_full(conn->fd, inputs->data, (size_t) rows * in_cols * sizeof(nn_float))) {
+            break;
+        }
+
+        ServeRequest request = {inputs, outputs, {0, 0}, false, NULL};
+        clock_gettime(CLOCK_MONOTONIC, &request.arrival);
+        pthread_mutex_lock(&server->lock);
+        if (server->tail != NULL) {
+            server->tail->next = &request;
+        }
+        else {
+            server->head = &request;
+        }
+        server->tail = &request;
+        server->queued_requests++;
+        server->queued_rows += rows;
+        histogram_add(&server->stats.queue_depth, server->queued_requests);
+        pthread_cond_signal(&server->queued);
+        while (!request.done) {
+            pthread_cond_wait(&server->done, &server->lock);
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        reply.rows = rows;
+        reply.cols = out_cols;
+        if (!write_message(conn->fd, &reply, outputs->data, (size_t) rows * out_cols * sizeof(nn_float))) {
+            break;
+        }
+    }
+
+    // Off the list before the fd is closed, so a stopping server never shuts down a reused fd
+    pthread_mutex_lock(&server->lock);
+    for (ServeConnection** c = &server->connections; *c != NULL; c = &(*c)->next) {
+        if (*c == conn) {
+            *c = conn->next;
+            break;
+        }
+    }
+    server->active_connections--;
+    pthread_cond_signal(&server->queued); // The batch thread may be waiting for the last connection
+    pthread_mutex_unlock(&server->lock);
+
+    close(conn->fd);
+    free(conn);
+    if (inputs != NULL) {
+        free_matrix(inputs);
+    }
+    if (outputs != NULL) {
+        free_matrix(outputs);
+    }
+    return NULL;
+}
+
+/*
+Accepts clients until stop, one detached thread each.
+*/
+static void* accept_thread(void* arg) {
+    InferenceServer* server = arg;
+    struct pollfd pfd = {server->listen_fd, POLLIN, 0};
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        bool stop = server->stop;
+        pthread_mutex_unlock(&server->lock);
+        if (stop) {
+            break;
+        }
+
+        // Poll with a timeout, a blocked accept is not reliably woken by closing the socket
+        if (poll(&pfd, 1, ACCEPT_POLL_MS) <= 0) {
+            continue;
+        }
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on unix sockets
+
+        ServeConnection* conn = malloc(sizeof(ServeConnection));
+        if (conn == NULL) {
+            fprintf(stderr, "Error: Memory allocation failure for server connection.\n");
+            exit(1);
+        }
+        conn->server = server;
+        conn->fd = fd;
+
+        pthread_mutex_lock(&server->lock);
+        if (server->stop) {
+            pthread_mutex_unlock(&server->lock);
+            close(fd);
+            free(conn);
+            break;
+        }
+        conn->next = server->connections;
+        server->connections = conn;
+        server->active_connections++;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, connection_thread, conn) != 0) {
+            fprintf(stderr, "Error: Failed to start server connection thread.\n");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+InferenceServer* start_server(network* net, const char* address, int max_batch, long max_wait_us) {
+    if (!net->compiled) {
+        fprintf(stderr, "Error: Network must be compiled before serving.\n");
+        exit(1);
+    }
+    if (max_batch <= 0 || max_wait_us < 0) {
+        fprintf(stderr, "Error: Server needs max_batch > 0 and max_wait_us >= 0.\n");
+        exit(1);
+    }
+
+    InferenceServer* server = calloc(1, sizeof(InferenceServer));
+    if (server == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for inference server.\n");
+        exit(1);
+    }
+    server->net = net;
+    server->max_batch = max_batch;
+    server->max_wait_us = max_wait_us;
+    server->batch = allocate_matrix(max_batch, net->plan[0].in_features);
+    server->listen_fd = open_socket(address, true, &server->socket_path);
+    if (server->listen_fd < 0) {
+        exit(1);
+    }
+
+    // Batch deadlines are monotonic, wall clock jumps must not stall or flush a batch
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->queued, &attr);
+    pthread_cond_init(&server->done, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&server->batch_thread, NULL, batch_thread, server) != 0 ||
+        pthread_create(&server->accept_thread, NULL, accept_thread, server) != 0) {
+        fprintf(stderr, "Error: Failed to start server threads.\n");
+        exit(1);
+    }
+    return server;
+}
+
+InferenceServer* serve_checkpoint(const char* model_path, const char* address, int max_batch, long max_wait_us) {
+    network* net = load_checkpoint(model_path, true);
+    InferenceServer* server = start_server(net, address, max_batch, max_wait_us);
+    server->owns_net = true;
+    return server;
+}
+
+void stop_server(InferenceServer* server) {
+    // Connection threads see end of stream, requests already queued are still answered
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    for (ServeConnection* c = server->connections; c != NULL; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&server->queued);
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_join(server->accept_thread, NULL);
+    pthread_join(server->batch_thread, NULL); // Returns once every connection thread is gone
+
+    close(server->listen_fd);
+    if (server->socket_path != NULL) {
+        unlink(server->socket_path);
+        free(server->socket_path);
+    }
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->queued);
+    pthread_cond_destroy(&server->done);
+    free_matrix(server->batch);
+    if (server->owns_net) {
+        free_network(server->net);
+    }
+    free(server);
+}
+
+//////////////////////////////////////////////////// CLIENT ///////////////////////////////////////////////////////////////////////////
+
+int serve_connect(const char* address) {
+    int fd = open_socket(address, false, NULL);
+    if (fd < 0) {
+        exit(1);
+    }
+    return fd;
+}
+
+bool serve_predict(int fd, matrix* X, matrix** predictions) {
+    ServeHeader header = {SERVE_MAGIC, SERVE_PREDICT, SERVE_OK, NN_DTYPE, X->rows, X->cols};
+    if (!write_message(fd, &header, X->data, (size_t) X->rows * X->cols * sizeof(nn_float))) {
+        return false;
+    }
+    ServeHeader reply;
+    if (!read_full(fd, &reply, sizeof(reply)) || reply.magic != SERVE_MAGIC || reply.status != SERVE_OK) {
+        return false;
+    }
+    resize_matrix(predictions, reply.rows, reply.cols);
+    return read_full(fd, (*predictions)->data, (size_t) reply.rows * reply.cols * sizeof(nn_float));
+}
+
+bool serve_stats(int fd, ServerStats* stats) {
+    ServeHeader header = {SERVE_MAGIC, SERVE_STATS, SERVE_OK, NN_DTYPE, 0, 0};
+    if (!write_message(fd, &header, NULL, 0)) {
+        return false;
+    }
+    ServeHeader reply;
+    if (!read_full(fd, &reply, sizeof(reply)) || reply.magic != SERVE_MAGIC || reply.status != SERVE_OK) {
+        return false;
+    }
+    return read_full(fd, stats, sizeof(ServerStats));
+}
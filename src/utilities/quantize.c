@@ -0,0 +1,299 @@
+#include "quantize.h"
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUANT_X86
+#include <immintrin.h>
+#endif
+
+// Bytes of one group row of a panel, QUANT_PANEL channels of QUANT_GROUP inputs
+#define QUANT_PANEL_ROW (QUANT_PANEL * QUANT_GROUP)
+
+//////////////////////////////////////////////////// INT8 KERNELS ///////////////////////////////////////////////////////////////////////////
+
+/*
+Each panel group row holds the QUANT_GROUP weights of a channel next to each other, channel after channel.
+Broadcasting QUANT_GROUP input bytes to every int32 lane then lines up input t with weight t of every channel,
+which is exactly what vpdpbusd, and maddubs followed by madd with ones, sum into one int32 lane.
+*/
+static void quant_kernel_generic(int groups, const uint8_t* const* a, const int8_t* panel, int32_t* c) {
+    for (int i = 0; i < 4; i++) {
+        int32_t acc[QUANT_PANEL] = {0};
+        for (int g = 0; g < groups; g++) {
+            const uint8_t* x = a[i] + g * QUANT_GROUP;
+            const int8_t* w = panel + (size_t) g * QUANT_PANEL_ROW;
+            for (int j = 0; j < QUANT_PANEL; j++) {
+                for (int t = 0; t < QUANT_GROUP; t++) {
+                    acc[j] += x[t] * w[j * QUANT_GROUP + t];
+                }
+            }
+        }
+        memcpy(c + i * QUANT_PANEL, acc, sizeof(acc));
+    }
+}
+
+#ifdef QUANT_X86
+/*
+maddubs multiplies unsigned inputs with signed weights and adds pairs into int16 with saturation.
+Inputs stop at 127 so a pair is at most 2 * 127 * 127 and never saturates, madd with ones adds the pairs into int32.
+*/
+__attribute__((target("avx2")))
+static void quant_kernel_avx2(int groups, const uint8_t* const* a, const int8_t* panel, int32_t* c) {
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc[4][2];
+    for (int i = 0; i < 4; i++) {
+        acc[i][0] = _mm256_setzero_si256();
+        acc[i][1] = _mm256_setzero_si256();
+    }
+    for (int g = 0; g < groups; g++) {
+        const int8_t* w = panel + (size_t) g * QUANT_PANEL_ROW;
+        __m256i w0 = _mm256_load_si256((const __m256i*) w); // panels are aligned
+        __m256i w1 = _mm256_load_si256((const __m256i*) (w + 32));
+        for (int i = 0; i < 4; i++) {
+            int32_t x;
+            memcpy(&x, a[i] + g * QUANT_GROUP, sizeof(x));
+            __m256i av = _mm256_set1_epi32(x);
+            acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(av, w0), ones));
+            acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(av, w1), ones));
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm256_storeu_si256((__m256i*) (c + i * QUANT_PANEL), acc[i][0]);
+        _mm256_storeu_si256((__m256i*) (c + i * QUANT_PANEL + 8), acc[i][1]);
+    }
+}
+
+/*
+vpdpbusd does the multiply, pair and quad sums in one instruction straight into int32, no saturation.
+*/
+__attribute__((target("avx512f,avx512vnni")))
+static void quant_kernel_avx512vnni(int groups, const uint8_t* const* a, const int8_t* panel, int32_t* c) {
+    __m512i acc[4];
+    for (int i = 0; i < 4; i++) {
+        acc[i] = _mm512_setzero_si512();
+    }
+    for (int g = 0; g < groups; g++) {
+        __m512i w = _mm512_load_si512((const void*) (panel + (size_t) g * QUANT_PANEL_ROW));
+        for (int i = 0; i < 4; i++) {
+            int32_t x;
+            memcpy(&x, a[i] + g * QUANT_GROUP, sizeof(x));
+            acc[i] = _mm512_dpbusd_epi32(acc[i], _mm512_set1_epi32(x), w);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm512_storeu_si512((void*) (c + i * QUANT_PANEL), acc[i]);
+    }
+}
+#endif
+
+// Kernel table, best first
+static QuantKernel quant_kernels[] = {
+#ifdef QUANT_X86
+    {"avx512vnni", quant_kernel_avx512vnni},
+    {"avx2", quant_kernel_avx2},
+#endif
+    {"generic", quant_kernel_generic}
+};
+
+// Published with a release store, read with an acquire load
+static _Atomic(QuantKernel*) active_quant_kernel = NULL;
+
+//////////////////////////////////////////////////// KERNEL SELECTION ///////////////////////////////////////////////////////////////////////////
+
+static bool quant_cpu_supports(const char* name) {
+#ifdef QUANT_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512vnni") == 0) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return strcmp(name, "generic") == 0;
+}
+
+bool quantize_set_kernel(const char* name) {
+    for (size_t i = 0; i < sizeof(quant_kernels) / sizeof(quant_kernels[0]); i++) {
+        if (strcmp(quant_kernels[i].name, name) == 0 && quant_cpu_supports(name)) {
+            atomic_store_explicit(&active_quant_kernel, &quant_kernels[i], memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+const QuantKernel* quantize_get_kernel() {
+    const QuantKernel* kernel = atomic_load_explicit(&active_quant_kernel, memory_order_acquire);
+    if (kernel == NULL) {
+        #pragma omp critical(quantize_select)
+        {
+            if (atomic_load_explicit(&active_quant_kernel, memory_order_relaxed) == NULL) {
+                for (size_t i = 0; i < sizeof(quant_kernels) / sizeof(quant_kernels[0]); i++) {
+                    if (quantize_set_kernel(quant_kernels[i].name)) {
+                        break;
+                    }
+                }
+            }
+        }
+        kernel = atomic_load_explicit(&active_quant_kernel, memory_order_acquire);
+    }
+    return kernel;
+}
+
+//////////////////////////////////////////////////// QUANTIZATION ///////////////////////////////////////////////////////////////////////////
+
+QuantizedDense* quantize_weights(matrix* weights, nn_float input_min, nn_float input_max) {
+    int K = weights->rows;
+    int N = weights->cols;
+    QuantizedDense* q = malloc(sizeof(QuantizedDense));
+    if (q == NULL) {
+        fprintf(stderr, "Error: Memory allocation failure for quantized dense struct.\n");
+        exit(1);
+    }
+    q->K = K;
+    q->N = N;
+    q->k_padded = (K + QUANT_GROUP - 1) / QUANT_GROUP * QUANT_GROUP;
+    int panels = (N + QUANT_PANEL - 1) / QUANT_PANEL;
+    size_t weight_bytes = (size_t) panels * q->k_padded * QUANT_PANEL;
+    q->scales = malloc(N * sizeof(nn_float));
+    q->offsets = malloc(N * sizeof(int32_t));
+    if (q->scales == NULL || q->offsets == NULL ||
+        posix_memalign((void**) &q->weights, 64, (weight_bytes > 0) ? weight_bytes : 64) != 0) {
+        fprintf(stderr, "Error: Memory allocation failure for quantized weights.\n");
+        exit(1);
+    }
+    memset(q->weights, 0, weight_bytes); // Padded inputs and channels multiply by zero
+
+    // Asymmetric input range, widened to hold 0 exactly
+    nn_float lo = (input_min < 0.0) ? input_min : 0.0;
+    nn_float hi = (input_max > 0.0) ? input_max : 0.0;
+    q->input_min = input_min;
+    q->input_max = input_max;
+    q->input_scale = (hi > lo) ? (hi - lo) / QUANT_INPUT_MAX : 1.0;
+    q->zero_point = (int) round(-lo / q->input_scale);
+    q->zero_point = (q->zero_point > QUANT_INPUT_MAX) ? QUANT_INPUT_MAX : q->zero_point;
+
+    // Symmetric weights per output channel
+    int groups = q->k_padded / QUANT_GROUP;
+    for (int n = 0; n < N; n++) {
+        nn_float max_abs = 0.0;
+        for (int k = 0; k < K; k++) {
+            nn_float w = fabs(weights->data[(size_t) k * N + n]);
+            max_abs = (w > max_abs) ? w : max_abs;
+        }
+        nn_float weight_scale = (max_abs > 0.0) ? max_abs / QUANT_WEIGHT_MAX : 1.0;
+
+        int8_t* panel = q->weights + (size_t) (n / QUANT_PANEL) * groups * QUANT_PANEL_ROW;
+        int lane = n % QUANT_PANEL;
+        int32_t sum = 0;
+        for (int k = 0; k < K; k++) {
+            long wq = lround(weights->data[(size_t) k * N + n] / weight_scale);
+            wq = (wq > QUANT_WEIGHT_MAX) ? QUANT_WEIGHT_MAX : (wq < -QUANT_WEIGHT_MAX) ? -QUANT_WEIGHT_MAX : wq;
+            panel[(size_t) (k / QUANT_GROUP) * QUANT_PANEL_ROW + lane * QUANT_GROUP + k % QUANT_GROUP] = (int8_t) wq;
+            sum += (int32_t) wq;
+        }
+        q->scales[n] = q->input_scale * weight_scale;
+        q->offsets[n] = q->zero_point * sum;
+    }
+    return q;
+}
+
+void free_quantized_dense(QuantizedDense* q) {
+    free(q->weights);
+    free(q->scales);
+    free(q->offsets);
+    free(q);
+}
+
+size_t quantized_dense_bytes(QuantizedDense* q) {
+    size_t panels = (q->N + QUANT_PANEL - 1) / QUANT_PANEL;
+    return panels * q->k_padded * QUANT_PANEL + q->N * (sizeof(nn_float) + sizeof(int32_t));
+}
+
+static void quantize_inputs_kernel(QuantizedDense* q, matrix* inputs, uint8_t* dest) {
+    nn_float inv_scale = 1.0 / q->input_scale;
+    nn_float zero_point = q->zero_point + 0.5; // Rounds half up once truncated
+
+    #pragma omp for schedule(static)
+    for (int i = 0; i < inputs->rows; i++) {
+        const nn_float* row = inputs->data + (size_t) i * inputs->cols;
+        uint8_t* out = dest + (size_t) i * q->k_padded;
+        for (int k = 0; k < q->K; k++) {
+            nn_float v = row[k] * inv_scale + zero_point;
+            v = (v < 0.0) ? 0.0 : (v > QUANT_INPUT_MAX) ? QUANT_INPUT_MAX : v;
+            out[k] = (uint8_t) v;
+        }
+        for (int k = q->K; k < q->k_padded; k++) {
+            out[k] = 0;
+        }
+    }
+}
+
+void quantize_inputs(QuantizedDense* q, matrix* inputs, uint8_t* dest) {
+    if (inputs->cols != q->K) {
+        fprintf(stderr, "Error: Dimensionality mismatch in quantize inputs, expected %d features got %d.\n",
+                q->K, inputs->cols);
+        exit(1);
+    }
+    PARALLEL_CALL(quantize_inputs_kernel(q, inputs, dest));
+}
+
+/*
+Runs the kernel over every (4 row x panel) tile, dequantizing each int32 tile straight into C.
+Work shares with orphaned omp for.
+*/
+static void quantized_gemm_tiles(const QuantKernel* k, QuantizedDense* q, int M, const uint8_t* A, const nn_float* bias,
+                                 nn_float* C, int ldc, GemmEpilogueType epilogue) {
+    int groups = q->k_padded / QUANT_GROUP;
+    int panels = (q->N + QUANT_PANEL - 1) / QUANT_PANEL;
+    int row_blocks = (M + 3) / 4;
+
+    #pragma omp for collapse(2) schedule(static)
+    for (int p = 0; p < panels; p++) {
+        for (int r = 0; r < row_blocks; r++) {
+            int i0 = r * 4;
+            int rows = (M - i0 < 4) ? M - i0 : 4;
+            int j0 = p * QUANT_PANEL;
+            int cols = (q->N - j0 < QUANT_PANEL) ? q->N - j0 : QUANT_PANEL;
+
+            // Short row blocks repeat their last row, the copies are dropped below
+            const uint8_t* a[4];
+            for (int i = 0; i < 4; i++) {
+                a[i] = A + (size_t) (i0 + ((i < rows) ? i : rows - 1)) * q->k_padded;
+            }
+            int32_t acc[4 * QUANT_PANEL];
+            k->kernel(groups, a, q->weights + (size_t) p * groups * QUANT_PANEL_ROW, acc);
+
+            const nn_float* scales = q->scales + j0;
+            const int32_t* offsets = q->offsets + j0;
+            for (int i = 0; i < rows; i++) {
+                nn_float* row = C + (size_t) (i0 + i) * ldc + j0;
+                const int32_t* tile = acc + i * QUANT_PANEL;
+                for (int j = 0; j < cols; j++) {
+                    nn_float z = (nn_float) (tile[j] - offsets[j]) * scales[j];
+                    if (epilogue != GEMM_EPILOGUE_NONE) {
+                        z += bias[j0 + j];
+                    }
+                    if (epilogue == GEMM_EPILOGUE_BIAS_RELU) {
+                        z = (z > 0.0) ? z : 0.0;
+                    }
+                    row[j] = z;
+                }
+            }
+        }
+    }
+}
+
+void quantized_gemm(QuantizedDense* q, int M, const uint8_t* A, const nn_float* bias, nn_float* C, int ldc,
+                    GemmEpilogueType epilogue) {
+    if (epilogue == GEMM_EPILOGUE_BIAS_SOFTMAX) {
+        fprintf(stderr, "Error: Quantized gemm does not fuse softmax.\n");
+        exit(1);
+    }
+    if (M <= 0 || q->N <= 0) {
+        return;
+    }
+    const QuantKernel* k = quantize_get_kernel();
+    PARALLEL_CALL(quantized_gemm_tiles(k, q, M, A, bias, C, ldc, epilogue));
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
+#include "threadpool.h"
+#include "gemm.h"
+#include <sched.h>
+#include <unistd.h>
+
+// Worker the current thread runs as, NULL for threads outside any pool
+static _Thread_local Worker* current_worker = NULL;
+
+//////////////////////////////////////////////////// WORK STEALING DEQUE ///////////////////////////////////////////////////////////////////////////
+
+/*
+Pushes a task at bottom, owner only. Returns false when the deque is full.
+top only grows, so a stale top can only make the deque look fuller than it is.
+*/
+static bool deque_push(TaskDeque* dq, const Task* task) {
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    if (b - t >= TASK_DEQUE_SIZE) {
+        return false;
+    }
+    dq->tasks[b & (TASK_DEQUE_SIZE - 1)] = *task;
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_release); // Publishes the task to thieves
+    return true;
+}
+
+/*
+Pops the newest task from bottom, owner only.
+Races thieves with a CAS on top only when one task is left.
+*/
+static bool deque_pop(TaskDeque* dq, Task* task) {
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+    // Empty, restore bottom
+    if (t > b) {
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *task = dq->tasks[b & (TASK_DEQUE_SIZE - 1)];
+    if (t == b) {
+        // Last task, whoever moves top first gets it
+        bool won = atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                                           memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+/*
+Steals the oldest task from top, any thread.
+The slot is copied before the CAS, the copy is only used if the CAS wins
+(the owner can only reuse the slot after top has moved past it).
+*/
+static bool deque_steal(TaskDeque* dq, Task* task) {
+    long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+    *task = dq->tasks[t & (TASK_DEQUE_SIZE - 1)];
+    return atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////// WORKERS ///////////////////////////////////////////////////////////////////////////
+
+static void run_task(const Task* task) {
+    task->func(task->ctx, task->data, task->begin, task->end);
+    atomic_fetch_sub_explicit(&task->group->pending, 1, memory_order_release);
+}
+
+/*
+Takes a task from the worker's own deque, else steals from the others starting at a random victim.
+*/
+static bool find_task(Worker* w, Task* task) {
+    ThreadPool* pool = w->pool;
+    bool found = deque_pop(&w->deque, task);
+
+    if (!found && pool->num_threads > 1) {
+        int start = rand_r(&w->seed) % pool->num_threads;
+        for (int i = 0; i < pool->num_threads && !found; i++) {
+            int victim = (start + i) % pool->num_threads;
+            if (victim != w->id) {
+                found = deque_steal(&pool->workers[victim].deque, task);
+            }
+        }
+    }
+
+    if (found) {
+        atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    }
+    return found;
+}
+
+static void pin_thread(int core) {
+#ifdef __linux__
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % (num_cores > 0 ? num_cores : 1), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Warning: Could not pin worker %d in thread pool.\n", core);
+    }
+#else
+    (void) core; // No core affinity API, workers float
+#endif
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = (Worker*) arg;
+    ThreadPool* pool = w->pool;
+    current_worker = w;
+
+    // Tasks are the unit of parallelism, keep OpenMP inside them on this thread
+    omp_set_num_threads(1);
+    if (pool->pinned) {
+        pin_thread(w->id);
+    }
+
+    Task task;
+    while (!atomic_load(&pool->shutdown)) {
+        // Spin briefly, tasks usually arrive in bursts
+        bool found = false;
+        for (int spin = 0; spin < 64 && !found; spin++) {
+            found = find_task(w, &task);
+        }
+        if (found) {
+            run_task(&task);
+            continue;
+        }
+
+        // Sleep until something is queued. sleeping is raised before queued is checked,
+        // and submit raises queued before it checks sleeping, so a wake up can not be lost.
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleeping, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->shutdown)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleeping, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    // Tasks that ran gemm reserved this worker's packed panels
+    gemm_free_buffers();
+    return NULL;
+}
+
+//////////////////////////////////////////////////// THREAD POOL METHODS ///////////////////////////////////////////////////////////////////////////
+
+ThreadPool* init_threadpool(int num_threads, bool pin) {
+    if (current_worker != NULL) {
+        fprintf(stderr, "Error: Thread already belongs to a thread pool in init threadpool.\n");
+        exit(1);
+    }
+    if (num_threads <= 0) {
+        long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_cores > 0) ? (int) num_cores : 1;
+    }
+
+    ThreadPool* pool = malloc(sizeof(ThreadPool));
+    if (pool == NULL || posix_memalign((void**) &pool->workers, 64, num_threads * sizeof(Worker)) != 0) {
+        fprintf(stderr, "Error: Memory allocation failure in init threadpool.\n");
+        exit(1);
+    }
+    pool->num_threads = num_threads;
+    pool->pinned = pin;
+    atomic_init(&pool->shutdown, false);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleeping, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        Worker* w = &pool->workers[i];
+        atomic_init(&w->deque.top, 0);
+        atomic_init(&w->deque.bottom, 0);
+        w->pool = pool;
+        w->id = i;
+        w->seed = 0x9e3779b9u * (i + 1);
+    }
+
+    // Calling thread is worker 0
+    current_worker = &pool->workers[0];
+    pool->workers[0].thread = pthread_self();
+    if (pin) {
+        pin_thread(0);
+    }
+
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            fprintf(stderr, "Error: Could not start worker %d in init threadpool.\n", i);
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void free_threadpool(ThreadPool* pool) {
+    if (current_worker != &pool->workers[0]) {
+        fprintf(stderr, "Error: free threadpool called from a thread other than the one that created the pool.\n");
+        exit(1);
+    }
+
+    // Wake everyone up to see the shutdown
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->shutdown, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    current_worker = NULL;
+    free(pool->workers);
+    free(pool);
+}
+
+void init_task_group(TaskGroup* group) {
+    atomic_init(&group->pending, 0);
+}
+
+void threadpool_submit(ThreadPool* pool, TaskGroup* group, task_func func, void* ctx, void* data, int begin, int end) {
+    Worker* w = current_worker;
+    if (w == NULL || w->pool != pool) {
+        fprintf(stderr, "Error: Tasks can only be submitted from threads of the pool in threadpool submit.\n");
+        exit(1);
+    }
+
+    Task task = {func, ctx, data, begin, end, group};
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+
+    // Counted before the push so a thief never takes it below zero
+    atomic_fetch_add(&pool->queued, 1);
+
+    // Deque full, the submitter does the work itself
+    if (!deque_push(&w->deque, &task)) {
+        atomic_fetch_sub(&pool->queued, 1);
+        run_task(&task);
+        return;
+    }
+
+    // Wake a sleeping worker if there is one
+    if (atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void threadpool_submit_range(ThreadPool* pool, TaskGroup* group, task_func func, void* ctx, void* data,
+                             int begin, int end, int grain) {
+    int n = end - begin;
+    if (n <= 0) {
+        return;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+
+    // A few chunks per worker so stealing can even out uneven tasks
+    int chunks = (n + grain - 1) / grain;
+    if (chunks > 4 * pool->num_threads) {
+        chunks = 4 * pool->num_threads;
+    }
+
+    for (int c = 0; c < chunks; c++) {
+        int chunk_begin = begin + (int) ((long) n * c / chunks);
+        int chunk_end = begin + (int) ((long) n * (c + 1) / chunks);
+        threadpool_submit(pool, group, func, ctx, data, chunk_begin, chunk_end);
+    }
+}
+
+void threadpool_wait(ThreadPool* pool, TaskGroup* group) {
+    Worker* w = current_worker;
+    if (w == NULL || w->pool != pool) {
+        fprintf(stderr, "Error: Only threads of the pool can wait in threadpool wait.\n");
+        exit(1);
+    }
+
+    // Tasks run single threaded on the waiting thread too
+    int omp_threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+
+    Task task;
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) > 0) {
+        if (find_task(w, &task)) {
+            run_task(&task);
+        }
+        else {
+            sched_yield();
+        }
+    }
+
+    omp_set_num_threads(omp_threads);
+}